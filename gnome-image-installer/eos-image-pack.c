@@ -0,0 +1,393 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*- */
+/*
+ * Copyright © 2018 Endless Mobile, Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * eos-image-pack: compresses a raw Endless OS image into the form which the
+ * installer handles best. The output is an xz file made of many independently
+ * compressed blocks, listed in the xz index at the end of the file, so that it
+ * can be compressed (and decompressed) on several cores and read from any
+ * block boundary. Alongside it are written a chunk manifest, so that the
+ * installer can verify the image in parallel, and detached signatures for
+ * both, made with the same GPG keys used for any other image.
+ */
+
+#include "config.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <locale.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <lzma.h>
+#include <gio/gio.h>
+
+#include "glnx-errors.h"
+#include "util/gis-chunk-manifest.h"
+#include "util/gpt_probe.h"
+
+#define BUFFER_SIZE (1024 * 1024)
+
+/* Each block is compressed independently, at some cost in compression ratio.
+ * 16 MiB costs very little, and still gives several blocks per core on even
+ * the smallest Endless OS image.
+ */
+#define DEFAULT_BLOCK_SIZE (16 * 1024 * 1024)
+#define DEFAULT_CHUNK_SIZE (4 * 1024 * 1024)
+
+static gint64 block_size = DEFAULT_BLOCK_SIZE;
+static gint chunk_size = DEFAULT_CHUNK_SIZE;
+static gint n_threads = 0;
+static gint preset = 6;
+static gboolean no_sign = FALSE;
+static gchar *gpg_path = NULL;
+static gchar *gpg_homedir = NULL;
+static gchar *local_user = NULL;
+
+static const GOptionEntry entries[] = {
+  { "block-size", 0, 0, G_OPTION_ARG_INT64, &block_size,
+    "Size of each independently-compressed block, in bytes", "BYTES" },
+  { "chunk-size", 0, 0, G_OPTION_ARG_INT, &chunk_size,
+    "Size of each chunk in the manifest, in bytes", "BYTES" },
+  { "threads", 0, 0, G_OPTION_ARG_INT, &n_threads,
+    "Number of threads to compress with (default: one per core)", "N" },
+  { "preset", 0, 0, G_OPTION_ARG_INT, &preset,
+    "xz compression preset, from 0 to 9 (default: 6)", "N" },
+  { "no-sign", 0, 0, G_OPTION_ARG_NONE, &no_sign,
+    "Don't sign the image and manifest", NULL },
+  { "gpg-path", 0, 0, G_OPTION_ARG_FILENAME, &gpg_path,
+    "GPG executable", "PATH" },
+  { "gpg-homedir", 0, 0, G_OPTION_ARG_FILENAME, &gpg_homedir,
+    "GPG home directory holding the signing key", "DIR" },
+  { "local-user", 'u', 0, G_OPTION_ARG_STRING, &local_user,
+    "Key to sign with", "KEY" },
+  { NULL }
+};
+
+/* Checks @fd holds an image which the installer would accept, by the same
+ * rules as the image page, and returns the disk size its GPT describes.
+ */
+static gboolean
+check_image (gint          fd,
+             const gchar  *path,
+             guint64      *size_out,
+             GError      **error)
+{
+  g_auto(GptTable) table = { 0 };
+  struct stat st;
+  uint64_t size = 0;
+
+  if (!gpt_probe_fd (fd, GPT_PROBE_COMPRESSION_NONE, &table, NULL, error))
+    {
+      g_prefix_error (error, "%s: ", path);
+      return FALSE;
+    }
+
+  if (!is_eos_gpt_table_valid (&table, &size))
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+                   "%s does not have a valid Endless OS partition table",
+                   path);
+      return FALSE;
+    }
+
+  if (fstat (fd, &st) < 0)
+    return glnx_throw_errno_prefix (error, "Can't stat %s", path);
+
+  if ((guint64) st.st_size != size)
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+                   "%s is %" G_GUINT64_FORMAT " bytes, but its partition "
+                   "table says %" G_GUINT64_FORMAT,
+                   path, (guint64) st.st_size, (guint64) size);
+      return FALSE;
+    }
+
+  *size_out = size;
+  return TRUE;
+}
+
+/* Writes what the encoder has produced so far, and feeds it into @manifest */
+static gboolean
+flush_output (lzma_stream             *strm,
+              guint8                  *out,
+              GOutputStream           *output,
+              GisChunkManifestBuilder *manifest,
+              GError                 **error)
+{
+  gsize len = BUFFER_SIZE - strm->avail_out;
+
+  if (!g_output_stream_write_all (output, out, len, NULL, NULL, error))
+    return FALSE;
+
+  gis_chunk_manifest_builder_update (manifest, out, len);
+  strm->next_out = out;
+  strm->avail_out = BUFFER_SIZE;
+  return TRUE;
+}
+
+static gboolean
+compress_image (gint                     fd,
+                const gchar             *path,
+                GOutputStream           *output,
+                GisChunkManifestBuilder *manifest,
+                GError                 **error)
+{
+  lzma_stream strm = LZMA_STREAM_INIT;
+  lzma_mt mt = {
+      .block_size = block_size,
+      .preset = preset,
+      .check = LZMA_CHECK_CRC64,
+      .threads = n_threads > 0 ? n_threads : lzma_cputhreads (),
+  };
+  g_autofree guint8 *in = g_malloc (BUFFER_SIZE);
+  g_autofree guint8 *out = g_malloc (BUFFER_SIZE);
+  guint64 offset = 0;
+  lzma_action action = LZMA_RUN;
+  lzma_ret ret;
+  gboolean ok = FALSE;
+
+  if (mt.threads == 0)
+    mt.threads = 1;
+
+  ret = lzma_stream_encoder_mt (&strm, &mt);
+  if (ret != LZMA_OK)
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                   "Can't create xz encoder (error %d)", ret);
+      return FALSE;
+    }
+
+  strm.next_out = out;
+  strm.avail_out = BUFFER_SIZE;
+
+  while (TRUE)
+    {
+      if (strm.avail_in == 0 && action == LZMA_RUN)
+        {
+          ssize_t r = pread (fd, in, BUFFER_SIZE, offset);
+
+          if (r < 0)
+            {
+              if (errno == EINTR)
+                continue;
+
+              glnx_throw_errno_prefix (error, "Can't read %s", path);
+              goto out;
+            }
+
+          strm.next_in = in;
+          strm.avail_in = r;
+          offset += r;
+
+          if (r == 0)
+            action = LZMA_FINISH;
+        }
+
+      ret = lzma_code (&strm, action);
+
+      if (strm.avail_out == 0 || ret == LZMA_STREAM_END)
+        {
+          if (!flush_output (&strm, out, output, manifest, error))
+            goto out;
+        }
+
+      if (ret == LZMA_STREAM_END)
+        break;
+
+      if (ret != LZMA_OK)
+        {
+          g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                       "Error compressing %s (error %d)", path, ret);
+          goto out;
+        }
+    }
+
+  ok = TRUE;
+
+out:
+  lzma_end (&strm);
+  return ok;
+}
+
+/* Writes @path.asc, which is where the installer looks for the signature of
+ * any file, be it an image or a manifest.
+ */
+static gboolean
+sign_file (const gchar  *path,
+           GError      **error)
+{
+  g_autoptr(GPtrArray) args = g_ptr_array_new ();
+  g_autoptr(GSubprocess) subprocess = NULL;
+
+  g_ptr_array_add (args, gpg_path != NULL ? gpg_path : (gchar *) GPG_PATH);
+  g_ptr_array_add (args, "--batch");
+  g_ptr_array_add (args, "--yes");
+  if (gpg_homedir != NULL)
+    {
+      g_ptr_array_add (args, "--homedir");
+      g_ptr_array_add (args, gpg_homedir);
+    }
+  if (local_user != NULL)
+    {
+      g_ptr_array_add (args, "--local-user");
+      g_ptr_array_add (args, local_user);
+    }
+  g_ptr_array_add (args, "--detach-sign");
+  g_ptr_array_add (args, "--armor");
+  g_ptr_array_add (args, (gchar *) path);
+  g_ptr_array_add (args, NULL);
+
+  subprocess = g_subprocess_newv ((const gchar * const *) args->pdata,
+                                  G_SUBPROCESS_FLAGS_NONE, error);
+  if (subprocess == NULL)
+    return FALSE;
+
+  if (!g_subprocess_wait_check (subprocess, NULL, error))
+    {
+      g_prefix_error (error, "Can't sign %s: ", path);
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
+static gboolean
+pack_image (gint          fd,
+            const gchar  *input_path,
+            const gchar  *output_path,
+            GError      **error)
+{
+  guint64 image_size = 0;
+  g_autoptr(GFile) output_file = g_file_new_for_path (output_path);
+  g_autoptr(GFileOutputStream) output = NULL;
+  g_autoptr(GisChunkManifestBuilder) builder = NULL;
+  g_autofree gchar *manifest = NULL;
+  g_autofree gchar *manifest_path = NULL;
+  g_autofree gchar *image_size_str = NULL;
+  g_autofree gchar *output_size_str = NULL;
+  guint64 n_blocks;
+
+  if (!check_image (fd, input_path, &image_size, error))
+    return FALSE;
+
+  /* Replaced atomically when closed, so a failure leaves no partial image
+   * behind to be mistaken for a good one.
+   */
+  output = g_file_replace (output_file, NULL, FALSE, G_FILE_CREATE_NONE, NULL,
+                           error);
+  if (output == NULL)
+    return FALSE;
+
+  builder = gis_chunk_manifest_builder_new (chunk_size);
+  if (!compress_image (fd, input_path, G_OUTPUT_STREAM (output), builder,
+                       error) ||
+      !g_output_stream_close (G_OUTPUT_STREAM (output), NULL, error))
+    return FALSE;
+
+  manifest = gis_chunk_manifest_builder_end (builder);
+  manifest_path = g_strconcat (output_path, GIS_CHUNK_MANIFEST_SUFFIX, NULL);
+  if (!g_file_set_contents (manifest_path, manifest, -1, error))
+    return FALSE;
+
+  if (!no_sign &&
+      (!sign_file (output_path, error) || !sign_file (manifest_path, error)))
+    return FALSE;
+
+  n_blocks = image_size / block_size + (image_size % block_size != 0);
+  image_size_str = g_format_size_full (image_size, G_FORMAT_SIZE_IEC_UNITS);
+  output_size_str = g_format_size_full (
+      g_output_stream_get_bytes_written (G_OUTPUT_STREAM (output)),
+      G_FORMAT_SIZE_IEC_UNITS);
+  g_print ("Packed %s (%s) into %s (%s) in %" G_GUINT64_FORMAT " blocks\n",
+           input_path, image_size_str, output_path, output_size_str, n_blocks);
+
+  return TRUE;
+}
+
+int
+main (int    argc,
+      char **argv)
+{
+  g_autoptr(GOptionContext) context = NULL;
+  g_autoptr(GError) error = NULL;
+  gint fd;
+  gboolean ok;
+
+  setlocale (LC_ALL, "");
+
+  context = g_option_context_new ("INPUT.img OUTPUT.img.xz");
+  g_option_context_set_summary (context,
+      "Compress an Endless OS image into independently-compressed xz blocks,\n"
+      "and write its chunk manifest and signatures alongside it.");
+  g_option_context_add_main_entries (context, entries, NULL);
+
+  if (!g_option_context_parse (context, &argc, &argv, &error))
+    {
+      g_printerr ("%s\n", error->message);
+      return 2;
+    }
+
+  if (argc != 3)
+    {
+      g_autofree gchar *help = g_option_context_get_help (context, TRUE, NULL);
+
+      g_printerr ("%s", help);
+      return 2;
+    }
+
+  if (block_size < BUFFER_SIZE)
+    {
+      g_printerr ("--block-size must be at least %d\n", BUFFER_SIZE);
+      return 2;
+    }
+
+  if (chunk_size < GIS_CHUNK_MANIFEST_MIN_CHUNK_SIZE ||
+      chunk_size > GIS_CHUNK_MANIFEST_MAX_CHUNK_SIZE)
+    {
+      g_printerr ("--chunk-size must be between %d and %d\n",
+                  GIS_CHUNK_MANIFEST_MIN_CHUNK_SIZE,
+                  GIS_CHUNK_MANIFEST_MAX_CHUNK_SIZE);
+      return 2;
+    }
+
+  if (preset < 0 || preset > 9 || n_threads < 0)
+    {
+      g_printerr ("--preset must be between 0 and 9, and --threads must not "
+                  "be negative\n");
+      return 2;
+    }
+
+  fd = open (argv[1], O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    {
+      glnx_throw_errno_prefix (&error, "Can't open %s", argv[1]);
+      g_printerr ("%s\n", error->message);
+      return 1;
+    }
+
+  ok = pack_image (fd, argv[1], argv[2], &error);
+  close (fd);
+
+  if (!ok)
+    {
+      g_printerr ("%s\n", error->message);
+      return 1;
+    }
+
+  return 0;
+}
@@ -42,6 +42,18 @@
 
 static gboolean force_new_user_mode;
 
+/* When main() began, for the startup timing trace */
+static gint64 startup_time_usec;
+
+/* TRUE while the eosimages partition is being mounted to look for
+ * unattended.ini; pages are not built until it has been read.
+ */
+static gboolean unattended_ini_pending;
+/* Set if the driver asked for pages to be built while unattended_ini_pending */
+static GisDriver *pending_rebuild_driver;
+/* Idle source which builds the pages after the first at startup */
+static guint prepare_remaining_pages_id;
+
 typedef void (*PreparePage) (GisDriver *driver);
 
 typedef struct {
@@ -65,6 +77,20 @@ static PageData page_table[] = {
 #define EOS_GROUP "EndlessOS"
 #define LOCALE_KEY "locale"
 
+static void rebuild_pages_cb (GisDriver *driver);
+
+/* Logs how long after startup @event happened, so that the time to the first
+ * interactive frame can be measured on slow live media.
+ */
+static void
+startup_trace (const gchar *event)
+{
+  gint64 elapsed_usec = g_get_monotonic_time () - startup_time_usec;
+
+  g_message ("startup: %s after %" G_GINT64_FORMAT " ms",
+             event, elapsed_usec / G_TIME_SPAN_MILLISECOND);
+}
+
 static void
 destroy_pages_after (GisAssistant *assistant,
                      GisPage      *page)
@@ -114,6 +140,42 @@ read_unattended_ini (const gchar *path)
     }
 }
 
+static void
+unattended_ini_ready (void)
+{
+  unattended_ini_pending = FALSE;
+  startup_trace ("unattended.ini read");
+
+  if (pending_rebuild_driver != NULL)
+    {
+      GisDriver *driver = g_steal_pointer (&pending_rebuild_driver);
+
+      rebuild_pages_cb (driver);
+      g_object_unref (driver);
+    }
+}
+
+static void
+mount_cb (GObject      *source,
+          GAsyncResult *result,
+          gpointer      user_data)
+{
+  UDisksFilesystem *fs = UDISKS_FILESYSTEM (source);
+  g_autofree gchar *path = NULL;
+  g_autoptr(GError) error = NULL;
+
+  if (udisks_filesystem_call_mount_finish (fs, &path, result, &error))
+    read_unattended_ini (path);
+  else
+    g_message ("Failed to mount eosimages partition: %s", error->message);
+
+  unattended_ini_ready ();
+}
+
+/* Reads unattended.ini from the eosimages partition if it is already mounted;
+ * otherwise, starts mounting it in the background, and pages are built once
+ * that finishes.
+ */
 static void
 mount_and_read_unattended_ini (void)
 {
@@ -128,8 +190,6 @@ mount_and_read_unattended_ini (void)
       UDisksBlock *block = udisks_object_peek_block (object);
       UDisksFilesystem *fs = NULL;
       const gchar *const*mounts = NULL;
-      g_autofree gchar *path_to_free = NULL;
-      const gchar *path = NULL;
 
       if (block == NULL)
         continue;
@@ -147,18 +207,23 @@ mount_and_read_unattended_ini (void)
       mounts = udisks_filesystem_get_mount_points (fs);
 
       if (mounts != NULL && mounts[0] != NULL)
-        path = mounts[0];
-      else if (udisks_filesystem_call_mount_sync (fs, g_variant_new ("a{sv}", NULL),
-                                                  &path_to_free, NULL, NULL))
-        path = path_to_free;
-
-      if (path != NULL)
         {
-          read_unattended_ini (path);
+          read_unattended_ini (mounts[0]);
+        }
+      else
+        {
+          unattended_ini_pending = TRUE;
+          udisks_filesystem_call_mount (fs, g_variant_new ("a{sv}", NULL),
+                                        NULL, mount_cb, NULL);
         }
 
       break;
     }
+
+  g_list_free_full (objects, g_object_unref);
+
+  if (!unattended_ini_pending)
+    unattended_ini_ready ();
 }
 
 /* Should be kept in sync with gnome-initial-setup gis-driver.c */
@@ -203,17 +268,80 @@ check_for_live_boot (gchar **uuid)
   return live_boot;
 }
 
+static void
+prepare_pages_from (GisDriver *driver,
+                    PageData  *page_data)
+{
+  for (; page_data->page_id != NULL; ++page_data)
+      page_data->prepare_page_func (driver);
+
+  gis_assistant_locale_changed (gis_driver_get_assistant (driver));
+}
+
+typedef struct {
+  GisDriver *driver;
+  PageData *page_data;
+} PreparePagesData;
+
+static void
+prepare_pages_data_free (PreparePagesData *data)
+{
+  g_object_unref (data->driver);
+  g_free (data);
+}
+
+static gboolean
+prepare_remaining_pages_cb (gpointer user_data)
+{
+  PreparePagesData *data = user_data;
+
+  prepare_remaining_pages_id = 0;
+  prepare_pages_from (data->driver, data->page_data);
+  startup_trace ("all pages built");
+
+  return G_SOURCE_REMOVE;
+}
+
+static gboolean
+first_frame_cb (GtkWidget *window,
+                cairo_t   *cr,
+                gpointer   user_data)
+{
+  startup_trace ("first frame drawn");
+  g_signal_handlers_disconnect_by_func (window, first_frame_cb, user_data);
+
+  return GDK_EVENT_PROPAGATE;
+}
+
 static void
 rebuild_pages_cb (GisDriver *driver)
 {
   PageData *page_data = page_table;
   GisAssistant *assistant;
   GisPage *current_page;
+  PreparePagesData *data;
+  GList *pages;
+
+  /* Which pages are added depends on unattended.ini; it will call back here
+   * once it has been read.
+   */
+  if (unattended_ini_pending)
+    {
+      g_set_object (&pending_rebuild_driver, driver);
+      return;
+    }
 
   assistant = gis_driver_get_assistant (driver);
   current_page = gis_assistant_get_current_page (assistant);
 
   if (current_page != NULL) {
+    /* The pages after the current one are about to be built anyway */
+    if (prepare_remaining_pages_id != 0)
+      {
+        g_source_remove (prepare_remaining_pages_id);
+        prepare_remaining_pages_id = 0;
+      }
+
     destroy_pages_after (assistant, current_page);
 
     for (page_data = page_table; page_data->page_id != NULL; ++page_data)
@@ -221,12 +349,40 @@ rebuild_pages_cb (GisDriver *driver)
         break;
 
     ++page_data;
+
+    prepare_pages_from (driver, page_data);
+    return;
   }
 
+  /* At startup, build just the first page before the window is first drawn,
+   * and the rest once the main loop is idle. This is queued before the first
+   * page is built, so that it runs before any idle callbacks which that page
+   * queues at the same priority when it is shown.
+   */
+  data = g_new0 (PreparePagesData, 1);
+  data->driver = g_object_ref (driver);
+  prepare_remaining_pages_id =
+    g_idle_add_full (G_PRIORITY_DEFAULT_IDLE, prepare_remaining_pages_cb,
+                     data, (GDestroyNotify) prepare_pages_data_free);
+
+  g_signal_connect_after (gtk_widget_get_toplevel (GTK_WIDGET (assistant)),
+                          "draw", G_CALLBACK (first_frame_cb), NULL);
+
+  pages = gis_assistant_get_all_pages (assistant);
   for (; page_data->page_id != NULL; ++page_data)
+    {
       page_data->prepare_page_func (driver);
 
+      if (gis_assistant_get_all_pages (assistant) != pages)
+        {
+          ++page_data;
+          break;
+        }
+    }
+
+  data->page_data = page_data;
   gis_assistant_locale_changed (assistant);
+  startup_trace ("first page built");
 }
 
 static gboolean
@@ -253,6 +409,16 @@ get_mode (void)
     return GIS_DRIVER_MODE_EXISTING_USER;
 }
 
+static void
+udisks_client_new_cb (GObject      *source,
+                      GAsyncResult *result,
+                      gpointer      user_data)
+{
+  GAsyncResult **result_out = user_data;
+
+  *result_out = g_object_ref (result);
+}
+
 int
 main (int argc, char *argv[])
 {
@@ -261,8 +427,16 @@ main (int argc, char *argv[])
   GOptionContext *context;
   gchar *uuid = NULL;
   UDisksClient *udisks_client = NULL;
+  GAsyncResult *udisks_result = NULL;
   GError *error = NULL;
 
+  startup_time_usec = g_get_monotonic_time ();
+
+  /* Connecting to UDisks means waiting for it to enumerate every object, which
+   * can be slow; do that while GTK starts up.
+   */
+  udisks_client_new (NULL, udisks_client_new_cb, &udisks_result);
+
   GOptionEntry entries[] = {
     { "force-new-user", 0, 0, G_OPTION_ARG_NONE, &force_new_user_mode,
       _("Force new user mode"), NULL },
@@ -286,9 +460,14 @@ main (int argc, char *argv[])
       gis_store_set_image_uuid (uuid);
     }
 
-  udisks_client = udisks_client_new_sync (NULL, &error);
+  while (udisks_result == NULL)
+    g_main_context_iteration (NULL, TRUE);
+
+  udisks_client = udisks_client_new_finish (udisks_result, &error);
+  g_object_unref (udisks_result);
   if (udisks_client == NULL)
     g_error ("Failed to connect to UDisks: %s", error->message);
+  startup_trace ("connected to UDisks");
   gis_store_set_object (GIS_STORE_UDISKS_CLIENT, G_OBJECT (udisks_client));
   g_object_unref (udisks_client);
   mount_and_read_unattended_ini ();
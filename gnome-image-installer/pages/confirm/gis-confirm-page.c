@@ -24,6 +24,7 @@
 #include "config.h"
 #include "confirm-resources.h"
 #include "gis-confirm-page.h"
+#include "gis-calibration.h"
 #include "gis-dmi.h"
 #include "gis-errors.h"
 #include "gis-store.h"
@@ -32,6 +33,7 @@
 #include <glib/gstdio.h>
 #include <glib/gi18n.h>
 #include <gio/gio.h>
+#include <gio/gunixfdlist.h>
 #include <stdlib.h>
 #include <errno.h>
 
@@ -43,6 +45,7 @@ struct _GisConfirmPagePrivate {
     GtkLabel *model1_label;
     GtkLabel *device1_label;
     GtkLabel *size1_label;
+    GtkLabel *estimate1_label;
 
     GtkBox *warning_box;
     GtkLabel *warning_label;
@@ -55,6 +58,8 @@ struct _GisConfirmPagePrivate {
 
     guint countdown_source;
     guint countdown_remaining_seconds;
+
+    GCancellable *calibration_cancellable;
 };
 typedef struct _GisConfirmPagePrivate GisConfirmPagePrivate;
 
@@ -72,6 +77,12 @@ gis_confirm_page_advance (GisConfirmPage *self)
       priv->countdown_source = 0;
     }
 
+  /* The calibration reads from the target, so make sure it has stopped
+   * before we start writing to it.
+   */
+  if (priv->calibration_cancellable != NULL)
+    g_cancellable_cancel (priv->calibration_cancellable);
+
   gis_assistant_next_page (gis_driver_get_assistant (page->driver));
 }
 
@@ -126,6 +137,120 @@ gis_confirm_page_start_countdown (GisConfirmPage *self)
                                                   self);
 }
 
+static void
+gis_confirm_page_calibration_cb (GObject      *source,
+                                 GAsyncResult *result,
+                                 gpointer      data)
+{
+  g_autoptr(GisConfirmPage) self = GIS_CONFIRM_PAGE (data);
+  GisConfirmPagePrivate *priv = gis_confirm_page_get_instance_private (self);
+  g_autoptr(GisCalibration) calibration = NULL;
+  g_autoptr(GError) error = NULL;
+  guint64 seconds = 0;
+  g_autofree gchar *estimate = NULL;
+
+  calibration = gis_calibration_finish (result, &error);
+  if (calibration == NULL)
+    {
+      if (!g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+        g_warning ("Failed to estimate reformatting time: %s", error->message);
+    }
+  else
+    {
+      seconds = gis_calibration_estimate_seconds (calibration,
+                                                  gis_store_get_image_size (),
+                                                  gis_store_get_required_size ());
+      g_message ("Estimated reformatting time: %" G_GUINT64_FORMAT " seconds",
+                 seconds);
+    }
+
+  if (seconds == 0)
+    {
+      g_autofree gchar *unknown_markup =
+        g_markup_printf_escaped ("<i>%s</i>", _("Unknown"));
+
+      gtk_label_set_markup (priv->estimate1_label, unknown_markup);
+      return;
+    }
+
+  estimate = gis_calibration_format_estimate (seconds);
+  gtk_label_set_text (priv->estimate1_label, estimate);
+}
+
+static void
+gis_confirm_page_open_for_benchmark_cb (GObject      *source,
+                                        GAsyncResult *result,
+                                        gpointer      data)
+{
+  g_autoptr(GisConfirmPage) self = GIS_CONFIRM_PAGE (data);
+  GisConfirmPagePrivate *priv = gis_confirm_page_get_instance_private (self);
+  UDisksBlock *block = UDISKS_BLOCK (source);
+  UDisksClient *client = UDISKS_CLIENT (gis_store_get_object (GIS_STORE_UDISKS_CLIENT));
+  g_autoptr(GUnixFDList) fd_list = NULL;
+  g_autoptr(GVariant) fd_index = NULL;
+  UDisksDrive *drive = NULL;
+  g_autoptr(GError) error = NULL;
+  gint fd = -1;
+
+  if (!udisks_block_call_open_for_benchmark_finish (block, &fd_index, &fd_list,
+                                                    result, &error))
+    {
+      if (g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+        return;
+
+      /* We can still estimate based on the image alone. */
+      g_warning ("Failed to open %s for benchmarking: %s",
+                 udisks_block_get_device (block), error->message);
+      g_clear_error (&error);
+    }
+  else
+    {
+      fd = g_unix_fd_list_get (fd_list, g_variant_get_handle (fd_index), &error);
+      if (fd < 0)
+        {
+          g_warning ("Error extracting fd with handle %d from D-Bus message: %s",
+                     g_variant_get_handle (fd_index), error->message);
+          g_clear_error (&error);
+        }
+    }
+
+  drive = udisks_client_get_drive_for_block (client, block);
+  gis_calibration_async (G_FILE (gis_store_get_object (GIS_STORE_IMAGE)),
+                         fd,
+                         udisks_block_get_device (block),
+                         drive != NULL ? udisks_drive_get_connection_bus (drive) : NULL,
+                         priv->calibration_cancellable,
+                         gis_confirm_page_calibration_cb,
+                         g_object_ref (self));
+  g_clear_object (&drive);
+}
+
+/* Samples each stage of the reformatting process to show roughly how long it
+ * will take. Nothing is written to the target.
+ */
+static void
+gis_confirm_page_start_calibration (GisConfirmPage *self,
+                                    UDisksBlock    *target_block)
+{
+  GisConfirmPagePrivate *priv = gis_confirm_page_get_instance_private (self);
+  g_autofree gchar *calculating_markup =
+    g_markup_printf_escaped ("<i>%s</i>", _("Calculating…"));
+
+  gtk_label_set_markup (priv->estimate1_label, calculating_markup);
+
+  if (priv->calibration_cancellable != NULL)
+    g_cancellable_cancel (priv->calibration_cancellable);
+  g_clear_object (&priv->calibration_cancellable);
+  priv->calibration_cancellable = g_cancellable_new ();
+
+  udisks_block_call_open_for_benchmark (target_block,
+                                        g_variant_new ("a{sv}", NULL), /* options */
+                                        NULL, /* fd_list */
+                                        priv->calibration_cancellable,
+                                        gis_confirm_page_open_for_benchmark_cb,
+                                        g_object_ref (self));
+}
+
 static void
 gis_confirm_page_shown (GisPage *page)
 {
@@ -191,6 +316,8 @@ gis_confirm_page_shown (GisPage *page)
 
   g_clear_object (&target_drive);
 
+  gis_confirm_page_start_calibration (self, target_block);
+
   config = gis_store_get_unattended_config ();
   g_assert (config != NULL);
   match = gis_unattended_config_match_computer (config, vendor, product);
@@ -257,6 +384,19 @@ gis_confirm_page_constructed (GObject *object)
   gtk_widget_show (GTK_WIDGET (self));
 }
 
+static void
+gis_confirm_page_dispose (GObject *object)
+{
+  GisConfirmPage *self = GIS_CONFIRM_PAGE (object);
+  GisConfirmPagePrivate *priv = gis_confirm_page_get_instance_private (self);
+
+  if (priv->calibration_cancellable != NULL)
+    g_cancellable_cancel (priv->calibration_cancellable);
+  g_clear_object (&priv->calibration_cancellable);
+
+  G_OBJECT_CLASS (gis_confirm_page_parent_class)->dispose (object);
+}
+
 static void
 gis_confirm_page_locale_changed (GisPage *page)
 {
@@ -278,6 +418,7 @@ gis_confirm_page_class_init (GisConfirmPageClass *klass)
   gtk_widget_class_bind_template_child_private (GTK_WIDGET_CLASS (klass), GisConfirmPage, model1_label);
   gtk_widget_class_bind_template_child_private (GTK_WIDGET_CLASS (klass), GisConfirmPage, device1_label);
   gtk_widget_class_bind_template_child_private (GTK_WIDGET_CLASS (klass), GisConfirmPage, size1_label);
+  gtk_widget_class_bind_template_child_private (GTK_WIDGET_CLASS (klass), GisConfirmPage, estimate1_label);
 
   gtk_widget_class_bind_template_child_private (GTK_WIDGET_CLASS (klass), GisConfirmPage, warning_box);
   gtk_widget_class_bind_template_child_private (GTK_WIDGET_CLASS (klass), GisConfirmPage, warning_label);
@@ -294,6 +435,7 @@ gis_confirm_page_class_init (GisConfirmPageClass *klass)
   page_class->locale_changed = gis_confirm_page_locale_changed;
   page_class->shown = gis_confirm_page_shown;
   object_class->constructed = gis_confirm_page_constructed;
+  object_class->dispose = gis_confirm_page_dispose;
 }
 
 static void
@@ -307,7 +449,7 @@ gis_confirm_page_init (GisConfirmPage *self)
 void
 gis_prepare_confirm_page (GisDriver *driver)
 {
-  if (gis_store_is_unattended ())
+  if (gis_store_is_unattended () && !gis_store_is_station ())
     gis_driver_add_page (driver,
                          g_object_new (GIS_TYPE_CONFIRM_PAGE,
                                        "driver", driver,
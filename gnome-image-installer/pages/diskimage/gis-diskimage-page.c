@@ -28,10 +28,13 @@
 #include "diskimage-resources.h"
 #include "gis-diskimage-page.h"
 #include "gis-errors.h"
+#include "gis-http-source.h"
+#include "gis-image-format.h"
+#include "gis-image-prewarm.h"
+#include "gis-split-image.h"
+#include "gis-squashfs.h"
 #include "gis-store.h"
-#include "gpt.h"
-#include "gpt_gz.h"
-#include "gpt_lzma.h"
+#include "gpt_probe.h"
 
 #define GNOME_DESKTOP_USE_UNSTABLE_API
 #include <libgnome-desktop/gnome-languages.h>
@@ -46,6 +49,9 @@
 struct _GisDiskImagePagePrivate {
     GtkListStore *image_store;
     GtkComboBox *image_combo;
+
+    /* Cancelled when the page is destroyed */
+    GCancellable *cancellable;
 };
 typedef struct _GisDiskImagePagePrivate GisDiskImagePagePrivate;
 
@@ -59,6 +65,14 @@ G_DEFINE_TYPE_WITH_PRIVATE (GisDiskImagePage, gis_diskimage_page, GIS_TYPE_PAGE)
  */
 static const gchar * const live_device_path = "/dev/mapper/endless-image";
 
+/* Signatures and checksums of images on a server are downloaded to the cache
+ * directory; anything larger than this is not one.
+ */
+#define REMOTE_SIGNATURE_MAX_SIZE (64 * 1024)
+
+/* Only the partition table is needed from a remote image while listing it */
+#define REMOTE_PROBE_SEGMENT_SIZE (1024 * 1024)
+
 /* Deliberately out-of-order so that sorting is exercised in English */
 static const gchar * const sea_locales[] = {
   "th",
@@ -76,7 +90,9 @@ enum {
     IMAGE_SIGNATURE,
     IMAGE_CHECKSUM,
     ALIGN,
-    IMAGE_REQUIRED_SIZE
+    IMAGE_REQUIRED_SIZE,
+    /* GPtrArray of GisSplitDisk, or NULL if the image is not split */
+    IMAGE_SPLIT_DISKS
 };
 
 static void
@@ -86,7 +102,10 @@ gis_diskimage_page_selection_changed(GtkWidget *combo, GisPage *page)
   gchar *image, *name, *signature = NULL;
   g_autofree gchar *checksum = NULL;
   GtkTreeModel *model = gtk_combo_box_get_model (GTK_COMBO_BOX (combo));
-  GFile *file = NULL;
+  g_autoptr(GFile) file = NULL;
+  g_autoptr(GFile) signature_file = NULL;
+  g_autoptr(GFile) checksum_file = NULL;
+  g_autoptr(GPtrArray) split_disks = NULL;
   guint64 size_bytes;
   guint64 required_size;
 
@@ -103,27 +122,42 @@ gis_diskimage_page_selection_changed(GtkWidget *combo, GisPage *page)
       IMAGE_CHECKSUM, &checksum,
       IMAGE_SIZE_BYTES, &size_bytes,
       IMAGE_REQUIRED_SIZE, &required_size,
+      IMAGE_SPLIT_DISKS, &split_disks,
       -1);
 
   gis_store_set_image_name (name);
   gis_store_set_image_size (size_bytes);
   gis_store_set_required_size (required_size);
+  gis_store_set_split_disks (split_disks);
   g_free (name);
 
-  file = g_file_new_for_path (image);
+  if (gis_http_source_is_uri (image))
+    file = g_file_new_for_uri (image);
+  else
+    file = g_file_new_for_path (image);
   gis_store_set_object (GIS_STORE_IMAGE, G_OBJECT (file));
-  g_object_unref(file);
 
   if (signature == NULL)
     signature = g_strjoin (NULL, image, ".asc", NULL);
 
   gis_store_set_image_signature (signature);
+  signature_file = g_file_new_for_path (signature);
   g_free (signature);
 
   if (checksum == NULL)
     checksum = g_strjoin (NULL, image, ".sha256", NULL);
 
   gis_store_set_image_checksum (checksum);
+  checksum_file = g_file_new_for_path (checksum);
+
+  /* Get a head start on reading and verifying the image while the user picks
+   * a disk; the install page cancels this if it has not finished by then.
+   * Images on a server are only fetched once, so are verified as they are
+   * written instead.
+   */
+  if (!gis_http_source_is_uri (image))
+    gis_image_prewarm_start (file, signature_file, checksum_file,
+                             gis_store_is_verify_first ());
 
   gis_page_set_complete (page, TRUE);
 
@@ -217,16 +251,9 @@ static gchar *get_display_name(const gchar *fullname)
       g_autofree gchar *product = g_match_info_fetch (info, 1);
       g_autofree gchar *version = g_match_info_fetch (info, 2);
       g_autofree gchar *personality = g_match_info_fetch (info, 3);
-      g_autofree gchar *type = g_match_info_fetch (info, 4);
       g_autofree gchar *language = NULL;
       const gchar *known_personality = NULL;
 
-      /* Split images not supported yet */
-      if (strlen (type) > 0)
-        {
-          return NULL;
-        }
-
       if (g_str_equal (product, "eos"))
         {
           g_free (product);
@@ -298,95 +325,248 @@ static gchar *get_display_name(const gchar *fullname)
   return name;
 }
 
-static void
-add_image (
-    GtkListStore *store,
+/* Reads the partition table from the start of @input, which holds @image in
+ * @format, and checks that it is valid as described for probe_image().
+ */
+static gboolean
+probe_partition_table (
+    const gchar          *image,
+    GInputStream         *input,
+    const GisImageFormat *format,
+    gboolean              bootable,
+    guint64              *required_size,
+    GCancellable         *cancellable)
+{
+  g_autoptr(GError) error = NULL;
+  g_auto(GptTable) table = { 0 };
+  gint valid;
+
+  if (!gpt_probe_stream (input, format->probe_compression, &table,
+                         cancellable, &error))
+    {
+      g_warning ("%s is not a valid image file: %s", image, error->message);
+      return FALSE;
+    }
+
+  if (bootable)
+    valid = is_eos_gpt_table_valid (&table, required_size);
+  else
+    valid = is_gpt_table_valid (&table, required_size);
+
+  if (!valid || *required_size == 0)
+    {
+      g_warning ("%s is not a valid image file", image);
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
+/* Checks that @image is a disk image with a valid partition table, which must
+ * be that of a bootable Endless OS image if @bootable is set, and finds its
+ * size and that of the disk within it. In the live case, @image_device is the
+ * mapped copy of @image which is actually read.
+ */
+static gboolean
+probe_image (
     const gchar  *image,
     const gchar  *image_device,
-    const gchar  *signature,
-    const gchar  *checksum)
+    gboolean      bootable,
+    guint64      *size_bytes,
+    guint64      *required_size)
 {
-  GtkTreeIter i;
   GError *error = NULL;
   g_autoptr(GFile) f = g_file_new_for_path (image);
-  g_autoptr(GFileInfo) fi = g_file_query_info (f, G_FILE_ATTRIBUTE_STANDARD_SIZE,
-                                     G_FILE_QUERY_INFO_NONE, NULL,
-                                     &error);
-  if (fi != NULL)
+  g_autoptr(GFile) probe_file = NULL;
+  g_autoptr(GInputStream) input = NULL;
+  g_autoptr(GFileInfo) fi = NULL;
+  const GisImageFormat *format;
+  guint64 image_size;
+
+  /* Images are told apart by their contents, so that renamed images work.
+   * In the live case, the size is that of the file on disk but the partition
+   * table is read from the mapped device. Likewise for squashfs images, whose
+   * partition table is read from the disk image within them.
+   */
+  probe_file = image_device != NULL ? g_file_new_for_path (image_device)
+                                    : g_object_ref (f);
+  format = gis_image_format_detect_file (probe_file, NULL, &error);
+  if (format != NULL)
+    input = format->open (probe_file, 1, NULL, NULL, &error);
+
+  /* Where possible, use the same handle both to find the image's size and to
+   * read its partition table.
+   */
+  if (input != NULL)
     {
-      gchar *size = NULL;
-      gchar *displayname = NULL;
-      gboolean valid = FALSE;
-      guint64 required_size = 0;
+      if (image_device != NULL || !G_IS_FILE_INPUT_STREAM (input))
+        fi = g_file_query_info (f, G_FILE_ATTRIBUTE_STANDARD_SIZE,
+                                G_FILE_QUERY_INFO_NONE, NULL, &error);
+      else
+        fi = g_file_input_stream_query_info (G_FILE_INPUT_STREAM (input),
+                                             G_FILE_ATTRIBUTE_STANDARD_SIZE,
+                                             NULL, &error);
+    }
 
-      if (g_str_has_suffix (image, ".img.gz"))
-        {
-          valid = get_gzip_is_valid_eos_gpt (image, &required_size);
-        }
-      else if (g_str_has_suffix (image, ".img.xz"))
-        {
-          valid = get_xz_is_valid_eos_gpt (image, &required_size);
-        }
-      else if (image_device != NULL)
-        {
-          valid = get_is_valid_eos_gpt (image_device, &required_size);
-        }
-      else if (g_str_has_suffix (image, ".img"))
-        {
-          valid = get_is_valid_eos_gpt (image, &required_size);
-        }
+  if (fi == NULL)
+    {
+      g_warning ("Could not get file info: %s", error->message);
+      g_clear_error (&error);
+      return FALSE;
+    }
 
-      if (!valid || required_size == 0)
-        {
-          g_warning ("%s is not a valid image file", image);
-          return;
-        }
+  if (!probe_partition_table (image, input, format, bootable, required_size,
+                              NULL))
+    return FALSE;
 
-      displayname = get_display_name (image);
+  /* A disk image smaller than its partition table says has been truncated.
+   * (The mapped device in the live case is known to be complete.)
+   */
+  if (image_device == NULL && format->get_image_size != NULL &&
+      format->get_image_size (probe_file, &image_size, NULL) &&
+      image_size < *required_size)
+    {
+      g_warning ("%s is a truncated %s image: %" G_GUINT64_FORMAT " bytes, "
+                 "but its partition table needs %" G_GUINT64_FORMAT,
+                 image, format->name, image_size, *required_size);
+      return FALSE;
+    }
+
+  g_warn_if_fail (g_file_info_get_size (fi) >= 0);
+  *size_bytes = g_file_info_get_size (fi);
+  return TRUE;
+}
 
-      /* if we have a signature file or checksum file passed in,
-       * attempt to get the name from that too */
-      if (displayname == NULL)
+/* Finds the display name for @image, or failing that for its signature or
+ * checksum file.
+ */
+static gchar *
+get_image_display_name (
+    const gchar  *image,
+    const gchar  *signature,
+    const gchar  *checksum)
+{
+  gchar *displayname = get_display_name (image);
+
+  /* if we have a signature file or checksum file passed in,
+   * attempt to get the name from that too */
+  if (displayname == NULL)
+    {
+      if (signature != NULL)
         {
-          if (signature != NULL)
-            {
-              displayname = get_display_name (signature);
-            }
-          if (displayname == NULL && checksum != NULL)
-            {
-              displayname = get_display_name (checksum);
-            }
+          displayname = get_display_name (signature);
         }
-
-      if (displayname == NULL)
+      if (displayname == NULL && checksum != NULL)
         {
-          g_warning ("Could not determine display name for %s", image);
-          return;
+          displayname = get_display_name (checksum);
         }
+    }
+
+  if (displayname == NULL)
+    g_warning ("Could not determine display name for %s", image);
 
-      goffset size_bytes = g_file_info_get_size (fi);
-      g_warn_if_fail (size_bytes >= 0);
-      size = g_format_size_full (size_bytes, G_FORMAT_SIZE_DEFAULT);
-
-      gtk_list_store_append (store, &i);
-      g_message ("storing image %s", image);
-      gtk_list_store_set (store, &i,
-                          IMAGE_NAME, displayname,
-                          IMAGE_SIZE, size,
-                          IMAGE_SIZE_BYTES, (guint64) size_bytes,
-                          IMAGE_FILE, image_device != NULL ? image_device : image,
-                          IMAGE_SIGNATURE, signature,
-                          IMAGE_CHECKSUM, checksum,
-                          IMAGE_REQUIRED_SIZE, required_size,
-                          -1);
-      g_free (size);
-      g_free (displayname);
+  return displayname;
+}
+
+static void
+add_image (
+    GtkListStore *store,
+    const gchar  *image,
+    const gchar  *image_device,
+    const gchar  *signature,
+    const gchar  *checksum)
+{
+  GtkTreeIter i;
+  g_autofree gchar *size = NULL;
+  g_autofree gchar *displayname = NULL;
+  guint64 size_bytes = 0;
+  guint64 required_size = 0;
+
+  if (!probe_image (image, image_device, TRUE, &size_bytes, &required_size))
+    return;
+
+  displayname = get_image_display_name (image, signature, checksum);
+  if (displayname == NULL)
+    return;
+
+  size = g_format_size_full (size_bytes, G_FORMAT_SIZE_DEFAULT);
+
+  gtk_list_store_append (store, &i);
+  g_message ("storing image %s", image);
+  gtk_list_store_set (store, &i,
+                      IMAGE_NAME, displayname,
+                      IMAGE_SIZE, size,
+                      IMAGE_SIZE_BYTES, size_bytes,
+                      IMAGE_FILE, image_device != NULL ? image_device : image,
+                      IMAGE_SIGNATURE, signature,
+                      IMAGE_CHECKSUM, checksum,
+                      IMAGE_REQUIRED_SIZE, required_size,
+                      -1);
+}
+
+/* Split images are listed once, as their first disk, if every disk is
+ * present and valid. The first disk must be a bootable Endless OS image; the
+ * others need only have a partition table.
+ */
+static void
+add_split_image (
+    GtkListStore *store,
+    const gchar  *image)
+{
+  GtkTreeIter i;
+  g_autoptr(GError) error = NULL;
+  g_autoptr(GPtrArray) disks = gis_split_image_find_disks (image, &error);
+  g_autofree gchar *size = NULL;
+  g_autofree gchar *basename = NULL;
+  g_autofree gchar *displayname = NULL;
+  GisSplitDisk *first;
+  guint64 total_size = 0;
+  guint j;
+
+  if (disks == NULL)
+    {
+      g_warning ("%s is not a valid split image: %s", image, error->message);
+      return;
     }
-  else
+
+  for (j = 0; j < disks->len; j++)
     {
-      g_warning ("Could not get file info: %s", error->message);
-      g_clear_error (&error);
+      GisSplitDisk *disk = g_ptr_array_index (disks, j);
+
+      if (!probe_image (disk->image, NULL, j == 0, &disk->image_size,
+                        &disk->required_size))
+        return;
+
+      total_size += disk->image_size;
     }
+
+  first = g_ptr_array_index (disks, 0);
+  basename = get_image_display_name (first->image, NULL, NULL);
+  if (basename == NULL)
+    return;
+
+  displayname = g_strdup_printf (g_dngettext (GETTEXT_PACKAGE,
+                                              /* Translators: the placeholder
+                                               * is an image name such as
+                                               * "Endless OS 3.4 Base" */
+                                              "%s (%u disk)",
+                                              "%s (%u disks)",
+                                              disks->len),
+                                 basename, disks->len);
+  size = g_format_size_full (total_size, G_FORMAT_SIZE_DEFAULT);
+
+  gtk_list_store_append (store, &i);
+  g_message ("storing split image %s with %u disks", image, disks->len);
+  gtk_list_store_set (store, &i,
+                      IMAGE_NAME, displayname,
+                      IMAGE_SIZE, size,
+                      IMAGE_SIZE_BYTES, first->image_size,
+                      IMAGE_FILE, first->image,
+                      IMAGE_SIGNATURE, first->signature,
+                      IMAGE_CHECKSUM, first->checksum,
+                      IMAGE_REQUIRED_SIZE, first->required_size,
+                      IMAGE_SPLIT_DISKS, disks,
+                      -1);
 }
 
 static gboolean
@@ -498,16 +678,287 @@ gis_diskimage_page_add_live_image (
     }
   else
     {
-      // TODO: mount the squashfs image and read endless.img from within it?
-      g_set_error (error, GIS_IMAGE_ERROR, GIS_IMAGE_ERROR_NOT_SUPPORTED,
-                   _("Cannot find image device ‘%s’ and cannot use ‘%s’ directly."),
-                   live_device_path, endless_path);
-      return FALSE;
+      g_message ("can't find image device %s; will read %s from %s",
+                 live_device_path, GIS_SQUASHFS_IMAGE_PATH,
+                 endless_squash_path);
+      add_image (store, endless_squash_path, NULL, live_sig, live_csum);
     }
 
   return TRUE;
 }
 
+/* Downloads the small file at @uri, such as a signature, to @path */
+static gboolean
+fetch_remote_file (
+    const gchar  *uri,
+    const gchar  *path,
+    GCancellable *cancellable,
+    GError      **error)
+{
+  g_autoptr(GBytes) bytes = NULL;
+
+  bytes = gis_http_source_fetch (uri, REMOTE_SIGNATURE_MAX_SIZE, cancellable,
+                                 error);
+  if (bytes == NULL)
+    return FALSE;
+
+  return g_file_set_contents (path, g_bytes_get_data (bytes, NULL),
+                              g_bytes_get_size (bytes), error);
+}
+
+/* What probing an image on a server found, to be added to the list */
+typedef struct {
+  gchar *url;
+  gchar *signature;
+  gchar *checksum;
+  guint64 size_bytes;
+  guint64 required_size;
+} RemoteImage;
+
+static void
+remote_image_free (RemoteImage *image)
+{
+  g_free (image->url);
+  g_free (image->signature);
+  g_free (image->checksum);
+  g_free (image);
+}
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (RemoteImage, remote_image_free)
+
+/**
+ * Probes the image at @url, on an HTTP(S) server. Its signature or checksum
+ * is downloaded to the cache directory alongside, and only its partition
+ * table is read for now; the image itself is read from the server as it is
+ * written. This blocks on the network, so is called in a thread.
+ */
+static RemoteImage *
+probe_remote_image (
+    const gchar         *url,
+    GCancellable        *cancellable,
+    GError             **error)
+{
+  g_autoptr(GFile) file = g_file_new_for_uri (url);
+  g_autofree gchar *basename = g_file_get_basename (file);
+  g_autofree gchar *cache_dir = g_build_filename (g_get_user_cache_dir (),
+                                                  "eos-installer", NULL);
+  g_autofree gchar *signature_url = g_strconcat (url, ".asc", NULL);
+  g_autofree gchar *checksum_url = g_strconcat (url, ".sha256", NULL);
+  g_autoptr(RemoteImage) image = g_new0 (RemoteImage, 1);
+  g_autoptr(GError) signature_error = NULL;
+  g_autoptr(GInputStream) remote = NULL;
+  g_autoptr(GInputStream) input = NULL;
+  const GisImageFormat *format;
+  const GisImageFormat *detected;
+
+  image->url = g_strdup (url);
+
+  /* The image is only read from the server as it is written, when its format
+   * is known only by its name (see gis_scribe_write_async()); so the name
+   * must agree with the contents, which are checked below. Only compressed
+   * and raw images can be streamed.
+   */
+  format = gis_image_format_guess (basename);
+  if (format->id == GIS_IMAGE_FORMAT_SQUASHFS)
+    {
+      g_set_error (error, GIS_IMAGE_ERROR, GIS_IMAGE_ERROR_NOT_SUPPORTED,
+                   _("‘%s’ is not an image which can be read from a server."),
+                   url);
+      return NULL;
+    }
+
+  if (g_mkdir_with_parents (cache_dir, 0755) < 0)
+    {
+      int saved_errno = errno;
+
+      g_set_error (error, G_IO_ERROR, g_io_error_from_errno (saved_errno),
+                   "Failed to create %s: %s", cache_dir,
+                   g_strerror (saved_errno));
+      return NULL;
+    }
+
+  /* Remove copies left over from a previous image, lest the image be
+   * verified against the wrong one.
+   */
+  image->signature = g_strconcat (cache_dir, "/", basename, ".asc", NULL);
+  image->checksum = g_strconcat (cache_dir, "/", basename, ".sha256", NULL);
+  g_unlink (image->signature);
+  g_unlink (image->checksum);
+
+  if (!fetch_remote_file (signature_url, image->signature, cancellable,
+                          &signature_error))
+    {
+      if (g_error_matches (signature_error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+        {
+          g_propagate_error (error, g_steal_pointer (&signature_error));
+          return NULL;
+        }
+
+      if (!fetch_remote_file (checksum_url, image->checksum, cancellable,
+                              error))
+        {
+          g_prefix_error (error, "%s ", signature_error->message);
+          return NULL;
+        }
+    }
+
+  if (!gis_http_source_query_size (url, &image->size_bytes, cancellable,
+                                   error))
+    return NULL;
+
+  remote = gis_http_source_open (url, image->size_bytes, 1,
+                                 REMOTE_PROBE_SEGMENT_SIZE, NULL);
+  input = g_buffered_input_stream_new (remote);
+  detected = gis_image_format_peek (G_BUFFERED_INPUT_STREAM (input),
+                                    cancellable, error);
+  if (detected == NULL)
+    return NULL;
+
+  if (detected != format)
+    {
+      g_set_error (error, GIS_IMAGE_ERROR, GIS_IMAGE_ERROR_NOT_SUPPORTED,
+                   _("‘%s’ is named like a %s image, but is a %s image."),
+                   url, format->name, detected->name);
+      return NULL;
+    }
+
+  if (!probe_partition_table (url, input, format, TRUE, &image->required_size,
+                              cancellable))
+    {
+      if (!g_cancellable_set_error_if_cancelled (cancellable, error))
+        g_set_error (error, GIS_IMAGE_ERROR, GIS_IMAGE_ERROR_NOT_SUPPORTED,
+                     _("‘%s’ is not a valid image."), url);
+      return NULL;
+    }
+
+  return g_steal_pointer (&image);
+}
+
+static void
+probe_remote_image_thread (
+    GTask        *task,
+    gpointer      source_object,
+    gpointer      task_data,
+    GCancellable *cancellable)
+{
+  const gchar *url = task_data;
+  GError *error = NULL;
+  RemoteImage *image;
+
+  image = probe_remote_image (url, cancellable, &error);
+  if (image == NULL)
+    g_task_return_error (task, error);
+  else
+    g_task_return_pointer (task, image, (GDestroyNotify) remote_image_free);
+}
+
+/* Selects the first image in the list; or, if there are none, reports @error
+ * or that none were found, and moves on so that it is shown.
+ */
+static void
+gis_diskimage_page_select_first_image (
+    GisDiskImagePage    *self,
+    const gchar         *ufile,
+    GError              *error)
+{
+  GisDiskImagePagePrivate *priv = gis_diskimage_page_get_instance_private (self);
+  GisPage *page = GIS_PAGE (self);
+  g_autoptr(GError) not_found = NULL;
+  GtkTreeIter iter;
+
+  if (gtk_tree_model_get_iter_first (GTK_TREE_MODEL (priv->image_store), &iter))
+    {
+      gtk_combo_box_set_active_iter (priv->image_combo, &iter);
+      return;
+    }
+
+  if (error == NULL)
+    {
+      if (ufile != NULL)
+        g_set_error (&not_found, GIS_UNATTENDED_ERROR,
+                     GIS_UNATTENDED_ERROR_IMAGE_NOT_FOUND,
+                     /* Translators: the placeholder is a filename. */
+                     _("Configured image ‘%s’ was not found."),
+                     ufile);
+      else
+        g_set_error_literal (&not_found, GIS_IMAGE_ERROR,
+                             GIS_IMAGE_ERROR_NOT_FOUND,
+                             _("No suitable images were found."));
+      error = not_found;
+    }
+
+  gis_store_set_error (error);
+  gis_assistant_next_page (gis_driver_get_assistant (page->driver));
+}
+
+static void
+gis_diskimage_page_add_remote_image_cb (
+    GObject      *source,
+    GAsyncResult *result,
+    gpointer      user_data)
+{
+  GisDiskImagePage *self = GIS_DISK_IMAGE_PAGE (source);
+  GisDiskImagePagePrivate *priv = gis_diskimage_page_get_instance_private (self);
+  g_autoptr(RemoteImage) image = NULL;
+  g_autoptr(GError) error = NULL;
+  g_autoptr(GFile) file = NULL;
+  g_autofree gchar *displayname = NULL;
+  g_autofree gchar *size = NULL;
+  GtkTreeIter i;
+
+  image = g_task_propagate_pointer (G_TASK (result), &error);
+  if (image == NULL)
+    {
+      /* The page is being destroyed */
+      if (g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+        return;
+
+      g_warning ("finding remote image failed: %s", error->message);
+      gis_diskimage_page_select_first_image (self, NULL, error);
+      return;
+    }
+
+  file = g_file_new_for_uri (image->url);
+  displayname = get_image_display_name (image->url, NULL, NULL);
+  if (displayname == NULL)
+    displayname = g_file_get_basename (file);
+
+  size = g_format_size_full (image->size_bytes, G_FORMAT_SIZE_DEFAULT);
+
+  gtk_list_store_append (priv->image_store, &i);
+  g_message ("storing remote image %s", image->url);
+  gtk_list_store_set (priv->image_store, &i,
+                      IMAGE_NAME, displayname,
+                      IMAGE_SIZE, size,
+                      IMAGE_SIZE_BYTES, image->size_bytes,
+                      IMAGE_FILE, image->url,
+                      IMAGE_SIGNATURE, image->signature,
+                      IMAGE_CHECKSUM, image->checksum,
+                      IMAGE_REQUIRED_SIZE, image->required_size,
+                      -1);
+
+  gis_diskimage_page_select_first_image (self, NULL, NULL);
+}
+
+/**
+ * Adds the image at @url, on an HTTP(S) server, to the list once it has been
+ * probed in a thread, and then selects it.
+ */
+static void
+gis_diskimage_page_add_remote_image (
+    GisDiskImagePage    *self,
+    const gchar         *url)
+{
+  GisDiskImagePagePrivate *priv = gis_diskimage_page_get_instance_private (self);
+  g_autoptr(GTask) task = NULL;
+
+  task = g_task_new (self, priv->cancellable,
+                     gis_diskimage_page_add_remote_image_cb, NULL);
+  g_task_set_source_tag (task, gis_diskimage_page_add_remote_image);
+  g_task_set_task_data (task, g_strdup (url), g_free);
+  g_task_run_in_thread (task, probe_remote_image_thread);
+}
+
 static void
 gis_diskimage_page_populate_model (GisPage     *page,
                                    const gchar *path)
@@ -520,8 +971,9 @@ gis_diskimage_page_populate_model (GisPage     *page,
   GisUnattendedConfig *config = gis_store_get_unattended_config ();
   const gchar *ufile =
     (config != NULL) ? gis_unattended_config_get_image (config) : NULL;
+  const gchar *url =
+    (config != NULL) ? gis_unattended_config_get_url (config) : NULL;
   g_autoptr(GDir) dir = NULL;
-  GtkTreeIter iter;
   gboolean is_live = gis_store_is_live_install ();
 
   dir = g_dir_open (path, 0, &error);
@@ -535,13 +987,26 @@ gis_diskimage_page_populate_model (GisPage     *page,
   gis_store_set_object (GIS_STORE_IMAGE_DIR, G_OBJECT (path_file));
   gtk_list_store_clear (priv->image_store);
 
+  /* If an image server is configured, images on this partition are ignored */
+  if (url != NULL)
+    {
+      gis_diskimage_page_add_remote_image (self, url);
+      return;
+    }
+
   while ((file = g_dir_read_name (dir)))
     {
       /* ufile is only set in the unattended case */
       if (ufile == NULL || g_strcmp0 (ufile, file) == 0)
         {
           g_autofree gchar *fullpath = g_build_path ("/", path, file, NULL);
-          add_image (priv->image_store, fullpath, NULL, NULL, NULL);
+          guint disk = gis_split_image_get_disk (fullpath);
+
+          /* Later disks of split images are listed along with the first */
+          if (disk == 1)
+            add_split_image (priv->image_store, fullpath);
+          else if (disk == 0)
+            add_image (priv->image_store, fullpath, NULL, NULL, NULL);
         }
     }
 
@@ -551,28 +1016,7 @@ gis_diskimage_page_populate_model (GisPage     *page,
       g_warning ("finding live image failed: %s", error->message);
     }
 
-  if (gtk_tree_model_get_iter_first (GTK_TREE_MODEL (priv->image_store), &iter))
-    {
-      gtk_combo_box_set_active_iter (priv->image_combo, &iter);
-    }
-  else
-    {
-      if (error == NULL)
-        {
-          if (ufile != NULL)
-            g_set_error (&error, GIS_UNATTENDED_ERROR,
-                         GIS_UNATTENDED_ERROR_IMAGE_NOT_FOUND,
-                         /* Translators: the placeholder is a filename. */
-                         _("Configured image ‘%s’ was not found."),
-                         ufile);
-          else
-            g_set_error_literal (&error, GIS_IMAGE_ERROR,
-                                 GIS_IMAGE_ERROR_NOT_FOUND,
-                                 _("No suitable images were found."));
-        }
-      gis_store_set_error (error);
-      gis_assistant_next_page (gis_driver_get_assistant (page->driver));
-    }
+  gis_diskimage_page_select_first_image (self, ufile, error);
 }
 
 static void
@@ -694,11 +1138,13 @@ gis_diskimage_page_shown (GisPage *page)
   /* In most cases, this page is the first page shown.
    * gis_diskimage_page_mount() can, in several situations, call
    * gis_assistant_next_page() synchronously. But when the page is first shown,
-   * the list of pages is not fully initialized in the driver.
+   * the list of pages is not fully initialized in the driver: the remaining
+   * pages are added from an idle callback at G_PRIORITY_DEFAULT_IDLE, after
+   * the window is first drawn.
    *
-   * So, defer initializing the page.
+   * So, defer initializing the page until after that callback.
    */
-  g_idle_add_full (G_PRIORITY_DEFAULT, gis_diskimage_page_shown_idle_cb,
+  g_idle_add_full (G_PRIORITY_DEFAULT_IDLE, gis_diskimage_page_shown_idle_cb,
                    g_object_ref (page), g_object_unref);
 }
 
@@ -719,6 +1165,19 @@ gis_diskimage_page_constructed (GObject *object)
   gtk_widget_show (GTK_WIDGET (page));
 }
 
+static void
+gis_diskimage_page_dispose (GObject *object)
+{
+  GisDiskImagePage *page = GIS_DISK_IMAGE_PAGE (object);
+  GisDiskImagePagePrivate *priv = gis_diskimage_page_get_instance_private (page);
+
+  if (priv->cancellable != NULL)
+    g_cancellable_cancel (priv->cancellable);
+  g_clear_object (&priv->cancellable);
+
+  G_OBJECT_CLASS (gis_diskimage_page_parent_class)->dispose (object);
+}
+
 static void
 gis_diskimage_page_locale_changed (GisPage *page)
 {
@@ -731,6 +1190,8 @@ gis_diskimage_page_class_init (GisDiskImagePageClass *klass)
   GisPageClass *page_class = GIS_PAGE_CLASS (klass);
   GObjectClass *object_class = G_OBJECT_CLASS (klass);
 
+  /* Used by the template's list store, by name */
+  g_type_ensure (G_TYPE_PTR_ARRAY);
   gtk_widget_class_set_template_from_resource (GTK_WIDGET_CLASS (klass), "/org/gnome/initial-setup/gis-diskimage-page.ui");
 
   gtk_widget_class_bind_template_child_private (GTK_WIDGET_CLASS (klass), GisDiskImagePage, image_store);
@@ -740,11 +1201,16 @@ gis_diskimage_page_class_init (GisDiskImagePageClass *klass)
   page_class->locale_changed = gis_diskimage_page_locale_changed;
   page_class->shown = gis_diskimage_page_shown;
   object_class->constructed = gis_diskimage_page_constructed;
+  object_class->dispose = gis_diskimage_page_dispose;
 }
 
 static void
 gis_diskimage_page_init (GisDiskImagePage *page)
 {
+  GisDiskImagePagePrivate *priv = gis_diskimage_page_get_instance_private (page);
+
+  priv->cancellable = g_cancellable_new ();
+
   g_resources_register (diskimage_get_resource ());
 
   gtk_widget_init_template (GTK_WIDGET (page));
@@ -27,13 +27,17 @@
 #include "config.h"
 #include "disktarget-resources.h"
 #include "gis-disktarget-page.h"
+#include "gis-calibration.h"
+#include "gis-drive-benchmark.h"
 #include "gis-errors.h"
+#include "gis-split-image.h"
 #include "gis-store.h"
 
 #include <udisks/udisks.h>
 #include <glib/gstdio.h>
 #include <glib/gi18n.h>
 #include <gio/gio.h>
+#include <gio/gunixfdlist.h>
 #include <stdlib.h>
 #include <errno.h>
 
@@ -46,6 +50,7 @@ struct _GisDiskTargetPagePrivate {
 
   GtkBox *confirm_box;
   GtkToggleButton *confirm_button;
+  GtkLabel *confirm_label;
   GtkToggleButton *partition_button;
 
   GtkBox *error_box;
@@ -53,11 +58,52 @@ struct _GisDiskTargetPagePrivate {
   GtkLabel *too_small_label;
   GtkBox *suitable_disks_box;
   GtkLabel *suitable_disks_label;
+
+  /* Drives are benchmarked one at a time, so they don't compete for the bus
+   * or the CPU. benchmark_queue holds (owned) GtkTreeRowReference * for the
+   * targets still to be benchmarked; benchmark_row is the one in progress.
+   */
+  GCancellable *benchmark_cancellable;
+  GQueue benchmark_queue;
+  GtkTreeRowReference *benchmark_row;
+  gboolean select_fastest;
 };
 typedef struct _GisDiskTargetPagePrivate GisDiskTargetPagePrivate;
 
 G_DEFINE_TYPE_WITH_PRIVATE (GisDiskTargetPage, gis_disktarget_page, GIS_TYPE_PAGE);
 
+enum {
+  TARGET_NAME,
+  TARGET_SIZE,
+  TARGET_BLOCK,
+  TARGET_HAS_DATA_PARTITIONS,
+  TARGET_ESTIMATE,
+  TARGET_WRITE_RATE,
+};
+
+static gboolean gis_disktarget_page_assign_split_disks (GisDiskTargetPage *page,
+                                                        UDisksBlock       *block);
+
+/* Whether every disk of a split image has a target; TRUE if the image is not
+ * split.
+ */
+static gboolean
+split_disks_have_targets (void)
+{
+  GPtrArray *disks = gis_store_get_split_disks ();
+  guint j;
+
+  for (j = 0; disks != NULL && j < disks->len; j++)
+    {
+      GisSplitDisk *disk = g_ptr_array_index (disks, j);
+
+      if (disk->target == NULL)
+        return FALSE;
+    }
+
+  return TRUE;
+}
+
 static void
 check_can_continue(GisDiskTargetPage *page)
 {
@@ -79,6 +125,9 @@ check_can_continue(GisDiskTargetPage *page)
   if (available < gis_store_get_required_size())
     return;
 
+  if (!split_disks_have_targets ())
+    return;
+
   if (!gtk_toggle_button_get_active (priv->confirm_button))
     return;
 
@@ -115,7 +164,10 @@ gis_disktarget_page_selection_changed(GtkWidget *combo, GisPage *page)
       return;
     }
 
-  gtk_tree_model_get(model, &i, 2, &block, 3, &has_data_partitions, -1);
+  gtk_tree_model_get(model, &i,
+                     TARGET_BLOCK, &block,
+                     TARGET_HAS_DATA_PARTITIONS, &has_data_partitions,
+                     -1);
 
   if (block != NULL)
     {
@@ -138,11 +190,32 @@ gis_disktarget_page_selection_changed(GtkWidget *combo, GisPage *page)
           check_can_continue (disktarget);
           return;
         }
+
+      if (!gis_disktarget_page_assign_split_disks (disktarget,
+                                                   UDISKS_BLOCK (block)))
+        {
+          g_autofree gchar *msg = g_strdup_printf (
+              g_dngettext (GETTEXT_PACKAGE,
+                           "%s must be written to %u disks, but there are not enough other disks large enough for it.",
+                           "%s must be written to %u disks, but there are not enough other disks large enough for it.",
+                           gis_store_get_split_disks ()->len),
+              gis_store_get_image_name (),
+              gis_store_get_split_disks ()->len);
+          gtk_label_set_text (priv->too_small_label, msg);
+          gtk_widget_hide (GTK_WIDGET (priv->confirm_box));
+          gtk_widget_show (GTK_WIDGET (priv->error_box));
+          check_can_continue (disktarget);
+          return;
+        }
     }
 
   if (gis_store_is_unattended())
     {
-      if (gtk_tree_model_iter_n_children (model, NULL) > 1)
+      GPtrArray *split_disks = gis_store_get_split_disks ();
+      gint n_needed = split_disks != NULL ? split_disks->len : 1;
+
+      if (!priv->select_fastest &&
+          gtk_tree_model_iter_n_children (model, NULL) > n_needed)
         {
           g_autoptr(GError) error =
             g_error_new_literal (GIS_UNATTENDED_ERROR,
@@ -262,6 +335,346 @@ gis_disktarget_page_get_root_drive (UDisksClient *client)
   return drive;
 }
 
+static guint64
+gis_disktarget_page_get_available_size (UDisksClient *client,
+                                        UDisksBlock  *block)
+{
+  UDisksDrive *drive = udisks_client_get_drive_for_block (client, block);
+  guint64 available = drive ? udisks_drive_get_size (drive) : udisks_block_get_size (block);
+
+  g_clear_object (&drive);
+  return available;
+}
+
+/* Split images have their first disk written to @block, and each of the
+ * others to the smallest remaining target which is large enough for it. The
+ * confirmation checkbox lists every target. Returns FALSE if some disk has
+ * nowhere to go.
+ */
+static gboolean
+gis_disktarget_page_assign_split_disks (GisDiskTargetPage *page,
+                                        UDisksBlock       *block)
+{
+  GisDiskTargetPagePrivate *priv = gis_disktarget_page_get_instance_private (page);
+  GtkTreeModel *model = GTK_TREE_MODEL (priv->target_store);
+  GPtrArray *disks = gis_store_get_split_disks ();
+  g_autoptr(GPtrArray) devices = NULL;
+  g_autofree gchar *device_list = NULL;
+  g_autofree gchar *markup = NULL;
+  GisSplitDisk *first;
+  guint j;
+
+  if (disks == NULL)
+    {
+      gtk_label_set_markup (priv->confirm_label,
+                            _("I agree to erasing <b>all of my files and apps</b>"));
+      return TRUE;
+    }
+
+  for (j = 0; j < disks->len; j++)
+    {
+      GisSplitDisk *disk = g_ptr_array_index (disks, j);
+
+      g_clear_object (&disk->target);
+    }
+
+  devices = g_ptr_array_new_with_free_func (g_free);
+  first = g_ptr_array_index (disks, 0);
+  first->target = g_object_ref (G_OBJECT (block));
+  g_ptr_array_add (devices,
+                   g_markup_escape_text (udisks_block_get_device (block), -1));
+
+  for (j = 1; j < disks->len; j++)
+    {
+      GisSplitDisk *disk = g_ptr_array_index (disks, j);
+      g_autoptr(GObject) best = NULL;
+      guint64 best_size = 0;
+      GtkTreeIter iter;
+      gboolean valid;
+
+      for (valid = gtk_tree_model_get_iter_first (model, &iter);
+           valid;
+           valid = gtk_tree_model_iter_next (model, &iter))
+        {
+          g_autoptr(GObject) candidate = NULL;
+          gboolean taken = FALSE;
+          guint64 available;
+          guint k;
+
+          gtk_tree_model_get (model, &iter, TARGET_BLOCK, &candidate, -1);
+          if (candidate == NULL)
+            continue;
+
+          for (k = 0; k < j; k++)
+            {
+              GisSplitDisk *other = g_ptr_array_index (disks, k);
+
+              taken |= (other->target == candidate);
+            }
+
+          if (taken)
+            continue;
+
+          available = gis_disktarget_page_get_available_size (
+              priv->client, UDISKS_BLOCK (candidate));
+          if (available >= disk->required_size &&
+              (best == NULL || available < best_size))
+            {
+              g_set_object (&best, candidate);
+              best_size = available;
+            }
+        }
+
+      if (best == NULL)
+        {
+          g_message ("no target is large enough for %s", disk->image);
+          return FALSE;
+        }
+
+      g_message ("%s will be written to %s", disk->image,
+                 udisks_block_get_device (UDISKS_BLOCK (best)));
+      disk->target = g_steal_pointer (&best);
+      g_ptr_array_add (devices,
+                       g_markup_escape_text (
+                         udisks_block_get_device (UDISKS_BLOCK (disk->target)),
+                         -1));
+    }
+
+  g_ptr_array_add (devices, NULL);
+  device_list = g_strjoinv (", ", (gchar **) devices->pdata);
+  /* Translators: the placeholder is a list of disks, such as "/dev/sda,
+   * /dev/sdb" */
+  markup = g_strdup_printf (_("I agree to erasing <b>all of my files and apps</b> on %s"),
+                            device_list);
+  gtk_label_set_markup (priv->confirm_label, markup);
+  return TRUE;
+}
+
+static void
+gis_disktarget_page_select_fastest (GisDiskTargetPage *page)
+{
+  GisDiskTargetPagePrivate *priv = gis_disktarget_page_get_instance_private (page);
+  GtkTreeModel *model = GTK_TREE_MODEL (priv->target_store);
+  GtkTreeIter i, fastest = { 0 };
+  gdouble fastest_rate = 0;
+  gboolean valid;
+
+  for (valid = gtk_tree_model_get_iter_first (model, &i);
+       valid;
+       valid = gtk_tree_model_iter_next (model, &i))
+    {
+      g_autoptr(GObject) block = NULL;
+      gdouble rate = 0;
+
+      gtk_tree_model_get (model, &i,
+                          TARGET_BLOCK, &block,
+                          TARGET_WRITE_RATE, &rate,
+                          -1);
+
+      if (rate > fastest_rate &&
+          gis_disktarget_page_get_available_size (priv->client, UDISKS_BLOCK (block))
+            >= gis_store_get_required_size ())
+        {
+          fastest = i;
+          fastest_rate = rate;
+        }
+    }
+
+  if (fastest_rate > 0)
+    {
+      gtk_combo_box_set_active_iter (priv->disk_combo, &fastest);
+    }
+  else
+    {
+      g_autoptr(GError) error =
+        g_error_new_literal (GIS_UNATTENDED_ERROR,
+                             GIS_UNATTENDED_ERROR_DEVICE_AMBIGUOUS,
+                             _("More than one candidate block device was found, and none could be benchmarked."));
+      gis_store_set_error (error);
+      gis_assistant_next_page (gis_driver_get_assistant (GIS_PAGE (page)->driver));
+    }
+}
+
+static void gis_disktarget_page_benchmark_next (GisDiskTargetPage *page);
+
+static void
+gis_disktarget_page_benchmark_done (GisDiskTargetPage       *page,
+                                    const GisDriveBenchmark *benchmark)
+{
+  GisDiskTargetPagePrivate *priv = gis_disktarget_page_get_instance_private (page);
+  g_autoptr(GtkTreePath) path = NULL;
+  GtkTreeIter i;
+
+  g_return_if_fail (priv->benchmark_row != NULL);
+
+  path = gtk_tree_row_reference_get_path (priv->benchmark_row);
+  if (path != NULL &&
+      gtk_tree_model_get_iter (GTK_TREE_MODEL (priv->target_store), &i, path))
+    {
+      g_autofree gchar *estimate = NULL;
+
+      if (benchmark != NULL)
+        estimate = gis_calibration_format_estimate (
+            gis_drive_benchmark_estimate_seconds (benchmark,
+                                                  gis_store_get_required_size ()));
+
+      gtk_list_store_set (priv->target_store, &i,
+                          TARGET_ESTIMATE, estimate,
+                          TARGET_WRITE_RATE, benchmark != NULL ? benchmark->write_rate : 0.,
+                          -1);
+    }
+
+  g_clear_pointer (&priv->benchmark_row, gtk_tree_row_reference_free);
+  gis_disktarget_page_benchmark_next (page);
+}
+
+static void
+gis_disktarget_page_drive_benchmark_cb (GObject      *source,
+                                        GAsyncResult *result,
+                                        gpointer      data)
+{
+  g_autoptr(GError) error = NULL;
+  g_autoptr(GisDriveBenchmark) benchmark =
+    gis_drive_benchmark_finish (result, &error);
+
+  if (g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+    return;
+
+  if (benchmark == NULL)
+    g_warning ("Failed to benchmark drive: %s", error->message);
+
+  gis_disktarget_page_benchmark_done (GIS_DISK_TARGET_PAGE (data), benchmark);
+}
+
+static void
+gis_disktarget_page_open_for_benchmark_cb (GObject      *source,
+                                           GAsyncResult *result,
+                                           gpointer      data)
+{
+  GisDiskTargetPage *page = GIS_DISK_TARGET_PAGE (data);
+  GisDiskTargetPagePrivate *priv = gis_disktarget_page_get_instance_private (page);
+  UDisksBlock *block = UDISKS_BLOCK (source);
+  g_autoptr(GUnixFDList) fd_list = NULL;
+  g_autoptr(GVariant) fd_index = NULL;
+  UDisksDrive *drive = NULL;
+  g_autoptr(GError) error = NULL;
+  gint fd = -1;
+
+  if (!udisks_block_call_open_for_benchmark_finish (block, &fd_index, &fd_list,
+                                                    result, &error))
+    {
+      if (g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+        return;
+
+      g_warning ("Failed to open %s for benchmarking: %s",
+                 udisks_block_get_device (block), error->message);
+      gis_disktarget_page_benchmark_done (page, NULL);
+      return;
+    }
+
+  fd = g_unix_fd_list_get (fd_list, g_variant_get_handle (fd_index), &error);
+  if (fd < 0)
+    {
+      g_warning ("Error extracting fd with handle %d from D-Bus message: %s",
+                 g_variant_get_handle (fd_index), error->message);
+      gis_disktarget_page_benchmark_done (page, NULL);
+      return;
+    }
+
+  drive = udisks_client_get_drive_for_block (priv->client, block);
+  gis_drive_benchmark_async (fd,
+                             udisks_block_get_device (block),
+                             drive != NULL ? udisks_drive_get_connection_bus (drive) : NULL,
+                             priv->benchmark_cancellable,
+                             gis_disktarget_page_drive_benchmark_cb,
+                             page);
+  g_clear_object (&drive);
+}
+
+static void
+gis_disktarget_page_benchmark_next (GisDiskTargetPage *page)
+{
+  GisDiskTargetPagePrivate *priv = gis_disktarget_page_get_instance_private (page);
+  GtkTreeRowReference *row;
+
+  g_return_if_fail (priv->benchmark_row == NULL);
+
+  while ((row = g_queue_pop_head (&priv->benchmark_queue)) != NULL)
+    {
+      g_autoptr(GtkTreePath) path = gtk_tree_row_reference_get_path (row);
+      g_autoptr(GObject) block = NULL;
+      GtkTreeIter i;
+
+      if (path == NULL ||
+          !gtk_tree_model_get_iter (GTK_TREE_MODEL (priv->target_store), &i, path))
+        {
+          gtk_tree_row_reference_free (row);
+          continue;
+        }
+
+      gtk_tree_model_get (GTK_TREE_MODEL (priv->target_store), &i,
+                          TARGET_BLOCK, &block,
+                          -1);
+      priv->benchmark_row = row;
+      udisks_block_call_open_for_benchmark (UDISKS_BLOCK (block),
+                                            g_variant_new ("a{sv}", NULL), /* options */
+                                            NULL, /* fd_list */
+                                            priv->benchmark_cancellable,
+                                            gis_disktarget_page_open_for_benchmark_cb,
+                                            page);
+      return;
+    }
+
+  if (priv->select_fastest)
+    gis_disktarget_page_select_fastest (page);
+}
+
+static void
+gis_disktarget_page_cancel_benchmark (GisDiskTargetPage *page)
+{
+  GisDiskTargetPagePrivate *priv = gis_disktarget_page_get_instance_private (page);
+
+  if (priv->benchmark_cancellable != NULL)
+    g_cancellable_cancel (priv->benchmark_cancellable);
+  g_clear_object (&priv->benchmark_cancellable);
+
+  g_queue_foreach (&priv->benchmark_queue,
+                   (GFunc) gtk_tree_row_reference_free, NULL);
+  g_queue_clear (&priv->benchmark_queue);
+  g_clear_pointer (&priv->benchmark_row, gtk_tree_row_reference_free);
+}
+
+/* Benchmarks every listed target, in the background, to show how long
+ * writing the image is likely to take. The benchmark only reads from the
+ * drives, so it is safe to run before the user has confirmed their choice.
+ */
+static void
+gis_disktarget_page_start_benchmark (GisDiskTargetPage *page)
+{
+  GisDiskTargetPagePrivate *priv = gis_disktarget_page_get_instance_private (page);
+  GtkTreeModel *model = GTK_TREE_MODEL (priv->target_store);
+  GtkTreeIter i;
+  gboolean valid;
+
+  gis_disktarget_page_cancel_benchmark (page);
+  priv->benchmark_cancellable = g_cancellable_new ();
+
+  for (valid = gtk_tree_model_get_iter_first (model, &i);
+       valid;
+       valid = gtk_tree_model_iter_next (model, &i))
+    {
+      g_autoptr(GtkTreePath) path = gtk_tree_model_get_path (model, &i);
+
+      gtk_list_store_set (priv->target_store, &i,
+                          TARGET_ESTIMATE, _("measuring speed…"),
+                          -1);
+      g_queue_push_tail (&priv->benchmark_queue,
+                         gtk_tree_row_reference_new (model, path));
+    }
+
+  gis_disktarget_page_benchmark_next (page);
+}
+
 static void
 gis_disktarget_page_populate_model(GisPage *page, UDisksClient *client)
 {
@@ -276,6 +689,7 @@ gis_disktarget_page_populate_model(GisPage *page, UDisksClient *client)
   GObject *image_source = gis_store_get_object (GIS_STORE_IMAGE_SOURCE);
   const gchar *image_drive_path = NULL;
   const gchar *image_loop_path = NULL;
+  gint n_targets;
 
   if (image_source != NULL)
     {
@@ -285,6 +699,8 @@ gis_disktarget_page_populate_model(GisPage *page, UDisksClient *client)
         image_loop_path = g_dbus_proxy_get_object_path (G_DBUS_PROXY (UDISKS_LOOP (image_source)));
     }
 
+  gis_disktarget_page_cancel_benchmark (disktarget);
+  priv->select_fastest = FALSE;
   priv->has_valid_disks = FALSE;
   gtk_list_store_clear (priv->target_store);
   root = gis_disktarget_page_get_root_drive (client);
@@ -375,19 +791,32 @@ gis_disktarget_page_populate_model(GisPage *page, UDisksClient *client)
 
       gtk_list_store_append (priv->target_store, &i);
       gtk_list_store_set (priv->target_store, &i,
-                          0, targetname,
-                          1, targetsize,
-                          2, G_OBJECT(block),
-                          3, has_data_partitions,
+                          TARGET_NAME, targetname,
+                          TARGET_SIZE, targetsize,
+                          TARGET_BLOCK, G_OBJECT(block),
+                          TARGET_HAS_DATA_PARTITIONS, has_data_partitions,
                           -1);
       g_free(targetname);
       g_free(targetsize);
     }
   g_clear_object (&root);
 
-  if (gtk_tree_model_get_iter_first (GTK_TREE_MODEL (priv->target_store), &i))
+  n_targets = gtk_tree_model_iter_n_children (GTK_TREE_MODEL (priv->target_store), NULL);
+  if (config != NULL && n_targets > 1 &&
+      gis_unattended_config_get_device_selection (config) ==
+        GIS_UNATTENDED_DEVICE_SELECTION_FASTEST)
+    {
+      /* The target is chosen once every candidate has been benchmarked */
+      priv->select_fastest = TRUE;
+      gis_disktarget_page_start_benchmark (disktarget);
+    }
+  else if (gtk_tree_model_get_iter_first (GTK_TREE_MODEL (priv->target_store), &i))
     {
       gtk_combo_box_set_active_iter (priv->disk_combo, &i);
+
+      if (!gis_store_is_unattended () &&
+          g_getenv ("EI_SKIP_TARGET_BENCHMARK") == NULL)
+        gis_disktarget_page_start_benchmark (disktarget);
     }
   else
     {
@@ -469,6 +898,14 @@ gis_disktarget_page_constructed (GObject *object)
 
 }
 
+static void
+gis_disktarget_page_dispose (GObject *object)
+{
+  gis_disktarget_page_cancel_benchmark (GIS_DISK_TARGET_PAGE (object));
+
+  G_OBJECT_CLASS (gis_disktarget_page_parent_class)->dispose (object);
+}
+
 static void
 gis_disktarget_page_locale_changed (GisPage *page)
 {
@@ -488,6 +925,7 @@ gis_disktarget_page_class_init (GisDiskTargetPageClass *klass)
 
   gtk_widget_class_bind_template_child_private (GTK_WIDGET_CLASS (klass), GisDiskTargetPage, confirm_box);
   gtk_widget_class_bind_template_child_private (GTK_WIDGET_CLASS (klass), GisDiskTargetPage, confirm_button);
+  gtk_widget_class_bind_template_child_private (GTK_WIDGET_CLASS (klass), GisDiskTargetPage, confirm_label);
   gtk_widget_class_bind_template_child_private (GTK_WIDGET_CLASS (klass), GisDiskTargetPage, partition_button);
 
   gtk_widget_class_bind_template_child_private (GTK_WIDGET_CLASS (klass), GisDiskTargetPage, error_box);
@@ -500,6 +938,7 @@ gis_disktarget_page_class_init (GisDiskTargetPageClass *klass)
   page_class->locale_changed = gis_disktarget_page_locale_changed;
   page_class->shown = gis_disktarget_page_shown;
   object_class->constructed = gis_disktarget_page_constructed;
+  object_class->dispose = gis_disktarget_page_dispose;
 }
 
 static void
@@ -513,8 +952,10 @@ gis_disktarget_page_init (GisDiskTargetPage *page)
 void
 gis_prepare_disktarget_page (GisDriver *driver)
 {
-  gis_driver_add_page (driver,
-                       g_object_new (GIS_TYPE_DISK_TARGET_PAGE,
-                                     "driver", driver,
-                                     NULL));
+  /* In station mode, targets are chosen as they are plugged in */
+  if (!gis_store_is_station ())
+    gis_driver_add_page (driver,
+                         g_object_new (GIS_TYPE_DISK_TARGET_PAGE,
+                                       "driver", driver,
+                                       NULL));
 }
@@ -30,6 +30,7 @@
 #include "gis-finished-page.h"
 #include "gis-store.h"
 #include "gis-dmi.h"
+#include "gis-trace.h"
 #include "gis-write-diagnostics.h"
 
 #include <gtk/gtkx.h>
@@ -188,6 +189,28 @@ write_diagnostics_cb (GObject      *source,
 #define EOS_IMAGE_VERSION_PATH "/sysroot"
 #define EOS_IMAGE_VERSION_ALT_PATH "/"
 
+static void
+save_trace_cb (GObject      *source,
+               GAsyncResult *result,
+               gpointer      user_data)
+{
+  g_autoptr(GisFinishedPage) self = GIS_FINISHED_PAGE (user_data);
+  g_autoptr(GError) error = NULL;
+  g_autoptr(GFile) output = gis_trace_save_finish (result, &error);
+
+  g_application_release (G_APPLICATION (GIS_PAGE (self)->driver));
+
+  if (output != NULL)
+    {
+      g_autofree gchar *path = g_file_get_path (output);
+      g_message ("saved trace to %s", path);
+    }
+  else if (error != NULL)
+    {
+      g_warning ("%s: %s", G_STRFUNC, error->message);
+    }
+}
+
 static gchar *
 gis_page_util_get_image_version (const gchar *path,
                                  GError     **error)
@@ -252,6 +275,16 @@ gis_finished_page_shown (GisPage *page)
 
   gis_driver_save_data (GIS_PAGE (page)->driver);
 
+  /* Whether or not the write succeeded, alongside the diagnostics */
+  if (gis_trace_is_enabled ())
+    {
+      GFile *image_dir = G_FILE (gis_store_get_object (GIS_STORE_IMAGE_DIR));
+
+      g_application_hold (G_APPLICATION (page->driver));
+      gis_trace_save_async (image_dir, g_get_home_dir (), NULL, save_trace_cb,
+                            g_object_ref (self));
+    }
+
   if (error != NULL)
     {
       GisAssistant *assistant = gis_driver_get_assistant (page->driver);
@@ -311,6 +344,7 @@ gis_finished_page_shown (GisPage *page)
 
           g_application_hold (G_APPLICATION (page->driver));
           gis_write_diagnostics_async (NULL, image_dir, home_dir,
+                                       gis_store_get_perf_report (),
                                        NULL, write_diagnostics_cb,
                                        g_object_ref (self));
         }
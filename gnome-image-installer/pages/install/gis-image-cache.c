@@ -0,0 +1,472 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*- */
+/*
+ * Copyright © 2018 Endless Mobile, Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* A decompressed copy of an image on local storage, so that writing the same
+ * image several times only decompresses it once. The copy is verified while
+ * it is created, in the same way as any other write, and hashed as it is
+ * written; that checksum is stored alongside it, against which later writes
+ * from the copy are verified. The copy is tied to the image's signature (or
+ * checksum) file, so replacing the image invalidates the copy.
+ */
+
+#include "config.h"
+#include "gis-image-cache.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <glib/gstdio.h>
+
+#include "gis-chunk-manifest.h"
+#include "gis-image-format.h"
+#include "gis-scribe.h"
+
+typedef struct _GisImageCache {
+  GObject parent;
+
+  GFile *cache_dir;
+
+  GFile *image;
+  guint64 image_size;
+  guint64 compressed_size;
+  GFile *signature;
+  GFile *checksum;
+
+  /* Identifies the image the cache was created from */
+  gchar *key;
+
+  GFile *cache_image;
+  /* Never created; passed to GisScribe so that it uses cache_checksum */
+  GFile *cache_signature;
+  GFile *cache_checksum;
+  /* Contains key; written last, once the cache is complete */
+  GFile *cache_source;
+} GisImageCache;
+
+G_DEFINE_TYPE (GisImageCache, gis_image_cache, G_TYPE_OBJECT)
+
+static void
+gis_image_cache_finalize (GObject *object)
+{
+  GisImageCache *self = GIS_IMAGE_CACHE (object);
+
+  g_clear_object (&self->cache_dir);
+  g_clear_object (&self->image);
+  g_clear_object (&self->signature);
+  g_clear_object (&self->checksum);
+  g_free (self->key);
+  g_clear_object (&self->cache_image);
+  g_clear_object (&self->cache_signature);
+  g_clear_object (&self->cache_checksum);
+  g_clear_object (&self->cache_source);
+
+  G_OBJECT_CLASS (gis_image_cache_parent_class)->finalize (object);
+}
+
+static void
+gis_image_cache_class_init (GisImageCacheClass *klass)
+{
+  GObjectClass *object_class = G_OBJECT_CLASS (klass);
+
+  object_class->finalize = gis_image_cache_finalize;
+}
+
+static void
+gis_image_cache_init (GisImageCache *self)
+{
+}
+
+/**
+ * gis_image_cache_get_default_dir:
+ *
+ * Returns: (transfer full): the directory given by the EI_IMAGE_CACHE_DIR
+ *  environment variable, which allows a fast local disk or tmpfs to be chosen,
+ *  or a subdirectory of the user's cache directory.
+ */
+GFile *
+gis_image_cache_get_default_dir (void)
+{
+  const gchar *dir = g_getenv ("EI_IMAGE_CACHE_DIR");
+  g_autofree gchar *default_dir = NULL;
+
+  if (dir != NULL && *dir != '\0')
+    return g_file_new_for_path (dir);
+
+  default_dir = g_build_filename (g_get_user_cache_dir (), "eos-installer", NULL);
+  return g_file_new_for_path (default_dir);
+}
+
+/**
+ * gis_image_cache_is_useful:
+ *
+ * Returns: %TRUE if @image is compressed, so caching a decompressed copy would
+ *  save time when writing it repeatedly.
+ */
+gboolean
+gis_image_cache_is_useful (GFile *image)
+{
+  const GisImageFormat *format = gis_image_format_detect_file (image, NULL,
+                                                               NULL);
+
+  return format != NULL && format->decompressor != NULL;
+}
+
+/**
+ * gis_image_cache_new:
+ * @cache_dir: directory to hold the decompressed copy
+ * @image: the (compressed) image, with @image_size, @compressed_size,
+ *  @signature and @checksum having the same meanings as for gis_scribe_new()
+ *
+ * Returns: (transfer full): a new #GisImageCache. Call
+ *  gis_image_cache_prepare_async() before using the copy.
+ */
+GisImageCache *
+gis_image_cache_new (GFile   *cache_dir,
+                     GFile   *image,
+                     guint64  image_size,
+                     guint64  compressed_size,
+                     GFile   *signature,
+                     GFile   *checksum)
+{
+  GisImageCache *self;
+  g_autofree gchar *basename = NULL;
+  g_autofree gchar *cache_basename = NULL;
+  g_autofree gchar *signature_basename = NULL;
+  g_autofree gchar *checksum_basename = NULL;
+  g_autofree gchar *source_basename = NULL;
+  const GisImageFormat *format;
+
+  g_return_val_if_fail (G_IS_FILE (cache_dir), NULL);
+  g_return_val_if_fail (G_IS_FILE (image), NULL);
+  g_return_val_if_fail (gis_image_cache_is_useful (image), NULL);
+  g_return_val_if_fail (G_IS_FILE (signature), NULL);
+  g_return_val_if_fail (G_IS_FILE (checksum), NULL);
+
+  self = g_object_new (GIS_TYPE_IMAGE_CACHE, NULL);
+  self->cache_dir = g_object_ref (cache_dir);
+  self->image = g_object_ref (image);
+  self->image_size = image_size;
+  self->compressed_size = compressed_size;
+  self->signature = g_object_ref (signature);
+  self->checksum = g_object_ref (checksum);
+
+  /* Named as if the image had never been compressed: stripping ".gz" or
+   * ".xz" if it has one, since GisScribe goes by contents, not names.
+   */
+  basename = g_file_get_basename (image);
+  format = gis_image_format_guess (basename);
+  if (format->decompressor != NULL)
+    cache_basename = g_strndup (basename,
+                                strlen (basename) - strlen (format->suffix));
+  else
+    cache_basename = g_strconcat (basename, ".img", NULL);
+  signature_basename = g_strconcat (cache_basename, ".asc", NULL);
+  checksum_basename = g_strconcat (cache_basename, ".sha256", NULL);
+  source_basename = g_strconcat (cache_basename, ".source", NULL);
+
+  self->cache_image = g_file_get_child (cache_dir, cache_basename);
+  self->cache_signature = g_file_get_child (cache_dir, signature_basename);
+  self->cache_checksum = g_file_get_child (cache_dir, checksum_basename);
+  self->cache_source = g_file_get_child (cache_dir, source_basename);
+
+  return self;
+}
+
+/* Identifies the image by the file GisScribe will verify it against (which is
+ * the signature, if there is one) along with its name and sizes.
+ */
+static gchar *
+gis_image_cache_compute_key (GisImageCache *self,
+                             GCancellable  *cancellable,
+                             GError       **error)
+{
+  GFile *verify_file = g_file_query_exists (self->signature, cancellable)
+                       ? self->signature : self->checksum;
+  g_autoptr(GChecksum) key = g_checksum_new (G_CHECKSUM_SHA256);
+  g_autofree gchar *basename = g_file_get_basename (self->image);
+  g_autofree gchar *sizes = g_strdup_printf ("%" G_GUINT64_FORMAT " %" G_GUINT64_FORMAT,
+                                             self->image_size,
+                                             self->compressed_size);
+  g_autofree gchar *contents = NULL;
+  gsize len;
+
+  if (!g_file_load_contents (verify_file, cancellable, &contents, &len, NULL,
+                             error))
+    return NULL;
+
+  g_checksum_update (key, (const guchar *) basename, strlen (basename) + 1);
+  g_checksum_update (key, (const guchar *) sizes, strlen (sizes) + 1);
+  g_checksum_update (key, (const guchar *) contents, len);
+
+  return g_strdup (g_checksum_get_string (key));
+}
+
+/* Returns whether a complete copy of this image is already cached. */
+static gboolean
+gis_image_cache_is_valid (GisImageCache *self,
+                          GCancellable  *cancellable)
+{
+  g_autoptr(GFileInfo) info = NULL;
+  g_autofree gchar *source = NULL;
+
+  if (!g_file_load_contents (self->cache_source, cancellable, &source, NULL,
+                             NULL, NULL))
+    return FALSE;
+
+  if (g_strcmp0 (g_strstrip (source), self->key) != 0)
+    return FALSE;
+
+  info = g_file_query_info (self->cache_image,
+                            G_FILE_ATTRIBUTE_STANDARD_SIZE,
+                            G_FILE_QUERY_INFO_NONE,
+                            cancellable, NULL);
+  if (info == NULL || (guint64) g_file_info_get_size (info) != self->image_size)
+    return FALSE;
+
+  return g_file_query_exists (self->cache_checksum, cancellable) &&
+         !g_file_query_exists (self->cache_signature, cancellable);
+}
+
+static void
+gis_image_cache_delete (GisImageCache *self)
+{
+  /* The marker goes first, so a partial deletion leaves an invalid cache */
+  g_file_delete (self->cache_source, NULL, NULL);
+  g_file_delete (self->cache_signature, NULL, NULL);
+  g_file_delete (self->cache_checksum, NULL, NULL);
+  g_file_delete (self->cache_image, NULL, NULL);
+}
+
+static void
+gis_image_cache_return_error (GTask  *task,
+                              GError *error)
+{
+  GisImageCache *self = g_task_get_source_object (task);
+
+  gis_image_cache_delete (self);
+  g_task_return_error (task, error);
+}
+
+/* Stores the copy's checksum (the task data), followed by the key which marks
+ * the copy as complete.
+ */
+static void
+gis_image_cache_commit_thread (GTask        *task,
+                               gpointer      source_object,
+                               gpointer      task_data,
+                               GCancellable *cancellable)
+{
+  GisImageCache *self = GIS_IMAGE_CACHE (source_object);
+  const gchar *image_checksum = task_data;
+  g_autofree gchar *basename = g_file_get_basename (self->cache_image);
+  g_autofree gchar *contents = NULL;
+  GError *error = NULL;
+
+  /* Same format as sha256sum(1), which is what GisScribe expects */
+  contents = g_strdup_printf ("%s  %s\n", image_checksum, basename);
+  if (!g_file_replace_contents (self->cache_checksum, contents, strlen (contents),
+                                NULL, FALSE, G_FILE_CREATE_NONE, NULL,
+                                cancellable, &error) ||
+      !g_file_replace_contents (self->cache_source, self->key, strlen (self->key),
+                                NULL, FALSE, G_FILE_CREATE_NONE, NULL,
+                                cancellable, &error))
+    {
+      gis_image_cache_return_error (task, error);
+      return;
+    }
+
+  g_task_return_boolean (task, TRUE);
+}
+
+static void
+gis_image_cache_write_cb (GObject      *source,
+                          GAsyncResult *result,
+                          gpointer      data)
+{
+  g_autoptr(GTask) task = G_TASK (data);
+  GisScribe *scribe = GIS_SCRIBE (source);
+  GError *error = NULL;
+
+  if (!gis_scribe_write_finish (scribe, result, &error))
+    {
+      gis_image_cache_return_error (task, error);
+      return;
+    }
+
+  /* The scribe verified the image's signature or checksum as it decompressed
+   * it, and hashed it as it wrote the copy, so we have a trustworthy checksum
+   * for the copy without reading it back.
+   */
+  g_task_set_task_data (task,
+                        g_strdup (gis_scribe_get_image_checksum (scribe)),
+                        g_free);
+  g_task_run_in_thread (task, gis_image_cache_commit_thread);
+}
+
+/**
+ * gis_image_cache_prepare_async:
+ *
+ * Ensures that a complete, verified, decompressed copy of the image is in the
+ * cache directory, reusing an existing copy if it was made from the same
+ * image, and otherwise decompressing the image. Fails if there is not enough
+ * space, in which case the image should be used directly.
+ */
+void
+gis_image_cache_prepare_async (GisImageCache      *self,
+                               GCancellable       *cancellable,
+                               GAsyncReadyCallback callback,
+                               gpointer            user_data)
+{
+  g_autoptr(GTask) task = g_task_new (self, cancellable, callback, user_data);
+  g_autofree gchar *cache_dir = g_file_get_path (self->cache_dir);
+  g_autofree gchar *cache_path = g_file_get_path (self->cache_image);
+  g_autoptr(GFileInfo) fs_info = NULL;
+  g_autoptr(GisScribe) scribe = NULL;
+  g_autoptr(GFile) manifest = gis_chunk_manifest_get_default_file (self->image);
+  GError *error = NULL;
+  gint fd;
+
+  g_task_set_source_tag (task, gis_image_cache_prepare_async);
+
+  if (self->key == NULL)
+    {
+      self->key = gis_image_cache_compute_key (self, cancellable, &error);
+      if (self->key == NULL)
+        {
+          g_task_return_error (task, error);
+          return;
+        }
+    }
+
+  if (gis_image_cache_is_valid (self, cancellable))
+    {
+      g_message ("reusing decompressed image at %s", cache_path);
+      g_task_return_boolean (task, TRUE);
+      return;
+    }
+
+  gis_image_cache_delete (self);
+
+  if (g_mkdir_with_parents (cache_dir, 0700) < 0)
+    {
+      int errsv = errno;
+
+      g_task_return_new_error (task, G_IO_ERROR, g_io_error_from_errno (errsv),
+                               "Failed to create %s: %s",
+                               cache_dir, g_strerror (errsv));
+      return;
+    }
+
+  fs_info = g_file_query_filesystem_info (self->cache_dir,
+                                          G_FILE_ATTRIBUTE_FILESYSTEM_FREE,
+                                          cancellable, &error);
+  if (fs_info == NULL)
+    {
+      g_task_return_error (task, error);
+      return;
+    }
+
+  if (g_file_info_get_attribute_uint64 (fs_info, G_FILE_ATTRIBUTE_FILESYSTEM_FREE)
+      < self->image_size)
+    {
+      g_task_return_new_error (task, G_IO_ERROR, G_IO_ERROR_NO_SPACE,
+                               "Not enough space in %s for decompressed image",
+                               cache_dir);
+      return;
+    }
+
+  fd = open (cache_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+  if (fd < 0)
+    {
+      int errsv = errno;
+
+      g_task_return_new_error (task, G_IO_ERROR, g_io_error_from_errno (errsv),
+                               "Failed to create %s: %s",
+                               cache_path, g_strerror (errsv));
+      return;
+    }
+
+  g_message ("decompressing image to %s", cache_path);
+  scribe = gis_scribe_new (self->image, self->image_size, self->compressed_size,
+                           self->signature, self->checksum, cache_path, fd,
+                           FALSE);
+  g_object_set (scribe,
+                "manifest", manifest,
+                "hash-image", TRUE,
+                NULL);
+  gis_scribe_write_async (scribe, cancellable, gis_image_cache_write_cb,
+                          g_steal_pointer (&task));
+}
+
+/**
+ * gis_image_cache_prepare_finish:
+ *
+ * Returns: %TRUE if the decompressed copy is ready to use
+ */
+gboolean
+gis_image_cache_prepare_finish (GisImageCache *self,
+                                GAsyncResult  *result,
+                                GError       **error)
+{
+  g_return_val_if_fail (g_task_is_valid (result, self), FALSE);
+  g_return_val_if_fail (g_task_get_source_tag (G_TASK (result)) ==
+                        gis_image_cache_prepare_async, FALSE);
+
+  return g_task_propagate_boolean (G_TASK (result), error);
+}
+
+/**
+ * gis_image_cache_get_image:
+ *
+ * Returns: (transfer none): the decompressed copy of the image
+ */
+GFile *
+gis_image_cache_get_image (GisImageCache *self)
+{
+  g_return_val_if_fail (GIS_IS_IMAGE_CACHE (self), NULL);
+
+  return self->cache_image;
+}
+
+/**
+ * gis_image_cache_get_signature:
+ *
+ * Returns: (transfer none): a signature file for the copy, which never
+ *  exists, to pass to gis_scribe_new() alongside
+ *  gis_image_cache_get_checksum()
+ */
+GFile *
+gis_image_cache_get_signature (GisImageCache *self)
+{
+  g_return_val_if_fail (GIS_IS_IMAGE_CACHE (self), NULL);
+
+  return self->cache_signature;
+}
+
+/**
+ * gis_image_cache_get_checksum:
+ *
+ * Returns: (transfer none): the checksum of the decompressed copy
+ */
+GFile *
+gis_image_cache_get_checksum (GisImageCache *self)
+{
+  g_return_val_if_fail (GIS_IS_IMAGE_CACHE (self), NULL);
+
+  return self->cache_checksum;
+}
@@ -0,0 +1,52 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*- */
+/*
+ * Copyright © 2018 Endless Mobile, Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <gio/gio.h>
+
+G_BEGIN_DECLS
+
+#define GIS_TYPE_IMAGE_CACHE (gis_image_cache_get_type ())
+G_DECLARE_FINAL_TYPE (GisImageCache, gis_image_cache, GIS, IMAGE_CACHE, GObject)
+
+GFile *gis_image_cache_get_default_dir (void);
+
+gboolean gis_image_cache_is_useful (GFile *image);
+
+GisImageCache *gis_image_cache_new (GFile   *cache_dir,
+                                    GFile   *image,
+                                    guint64  image_size,
+                                    guint64  compressed_size,
+                                    GFile   *signature,
+                                    GFile   *checksum);
+
+void gis_image_cache_prepare_async (GisImageCache      *self,
+                                    GCancellable       *cancellable,
+                                    GAsyncReadyCallback callback,
+                                    gpointer            user_data);
+
+gboolean gis_image_cache_prepare_finish (GisImageCache *self,
+                                         GAsyncResult  *result,
+                                         GError       **error);
+
+GFile *gis_image_cache_get_image (GisImageCache *self);
+GFile *gis_image_cache_get_signature (GisImageCache *self);
+GFile *gis_image_cache_get_checksum (GisImageCache *self);
+
+G_END_DECLS
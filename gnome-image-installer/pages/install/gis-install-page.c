@@ -26,10 +26,18 @@
 
 #include "config.h"
 #include "install-resources.h"
+#include "gis-buffer-pool.h"
+#include "gis-calibration.h"
+#include "gis-chunk-manifest.h"
 #include "gis-errors.h"
+#include "gis-http-source.h"
+#include "gis-image-prewarm.h"
 #include "gis-install-page.h"
 #include "gis-scribe.h"
+#include "gis-split-image.h"
+#include "gis-station.h"
 #include "gis-store.h"
+#include "gis-trace.h"
 
 #include <udisks/udisks.h>
 #include <glib/gstdio.h>
@@ -41,6 +49,7 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <unistd.h>
 
 struct _GisInstallPagePrivate {
   guint pulse_id;
@@ -50,11 +59,50 @@ struct _GisInstallPagePrivate {
 
   GtkLabel *install_label;
   GtkProgressBar *install_progress;
+
+  GisStation *station;
+
+  /* When writing a split image, a GisInstallSplitJob for each disk; how many
+   * of them are still being opened or written; the index of the next to be
+   * written; and the first error.
+   */
+  GPtrArray *split_jobs;
+  guint split_pending;
+  guint split_next;
+  GError *split_error;
+
+  /* Cancelled if the user asks to stop writing, in which case 'stopping' is
+   * set, and the window is closed once writing has stopped.
+   */
+  GCancellable *cancellable;
+  gboolean stopping;
 };
 typedef struct _GisInstallPagePrivate GisInstallPagePrivate;
 
 G_DEFINE_TYPE_WITH_PRIVATE (GisInstallPage, gis_install_page, GIS_TYPE_PAGE);
 
+/* One disk of a split image; see gis_install_page_prepare_split_write() */
+typedef struct {
+  GisInstallPage *page;
+  GisSplitDisk *disk;
+  gint fd;
+  gint compare_fd;
+  GisScribe *scribe;
+} GisInstallSplitJob;
+
+static void
+gis_install_split_job_free (GisInstallSplitJob *job)
+{
+  if (job->fd >= 0)
+    g_close (job->fd, NULL);
+  if (job->compare_fd >= 0)
+    g_close (job->compare_fd, NULL);
+  if (job->scribe != NULL)
+    g_signal_handlers_disconnect_by_data (job->scribe, job->page);
+  g_clear_object (&job->scribe);
+  g_free (job);
+}
+
 static const gchar *REFORMATTING_IN_PROGRESS_TITLE =
   N_("Stop reformatting the disk?");
 static const gchar *REFORMATTING_IN_PROGRESS_WARNING =
@@ -68,7 +116,6 @@ delete_event_cb (GtkWidget      *toplevel,
 {
   GisInstallPagePrivate *priv = gis_install_page_get_instance_private (self);
   GtkWidget *button;
-  gboolean should_propagate;
   gint response_id;
 
   priv->warning_dialog = gtk_message_dialog_new (GTK_WINDOW (toplevel),
@@ -105,9 +152,26 @@ delete_event_cb (GtkWidget      *toplevel,
   gtk_widget_destroy (priv->warning_dialog);
   priv->warning_dialog = NULL;
 
-  should_propagate = response_id == GTK_RESPONSE_OK ? GDK_EVENT_PROPAGATE : GDK_EVENT_STOP;
+  if (response_id != GTK_RESPONSE_OK)
+    return GDK_EVENT_STOP;
+
+  /* Each drive written in station mode is stopped when the station is
+   * destroyed along with the window.
+   */
+  if (priv->station != NULL)
+    return GDK_EVENT_PROPAGATE;
 
-  return should_propagate;
+  /* Rather than exiting in the middle of writing, stop writing, and close the
+   * window once every thread has stopped; see gis_install_page_write_done().
+   */
+  if (!priv->stopping)
+    {
+      priv->stopping = TRUE;
+      gtk_label_set_text (priv->install_label, _("Stopping…"));
+      g_cancellable_cancel (priv->cancellable);
+    }
+
+  return GDK_EVENT_STOP;
 }
 
 static void
@@ -130,6 +194,7 @@ gis_install_page_teardown (GisPage *page)
 
   gis_install_page_stop_pulsing (install);
 
+  gtk_progress_bar_set_show_text (priv->install_progress, FALSE);
   gtk_progress_bar_set_fraction (priv->install_progress, 1.0);
 
   /*
@@ -214,77 +279,136 @@ gis_install_page_step_cb (GObject    *object,
   gis_install_page_update_step (install, step);
 }
 
+static void
+gis_install_page_update_progress (GisInstallPage *self,
+                                  gdouble         progress)
+{
+  GisInstallPagePrivate *priv = gis_install_page_get_instance_private (self);
+
+  if (progress < 0)
+    gis_install_page_ensure_pulsing (self);
+  else
+    gtk_progress_bar_set_fraction (priv->install_progress, progress);
+}
+
 static void
 gis_install_page_progress_cb (GObject    *object,
                               GParamSpec *pspec,
                               gpointer    data)
 {
   GisInstallPage *self = GIS_INSTALL_PAGE (data);
+  GisScribe *scribe = GIS_SCRIBE (object);
+
+  gis_install_page_update_progress (self, gis_scribe_get_progress (scribe));
+}
+
+static void
+gis_install_page_update_remaining (GisInstallPage *self,
+                                   gint64          remaining)
+{
   GisInstallPagePrivate *priv = gis_install_page_get_instance_private (self);
+  g_autofree gchar *estimate = NULL;
+  g_autofree gchar *text = NULL;
+
+  if (remaining < 0)
+    {
+      gtk_progress_bar_set_show_text (priv->install_progress, FALSE);
+      return;
+    }
+
+  estimate = gis_calibration_format_estimate (remaining);
+  /* Translators: %s is a rough duration such as "about 5 minutes" */
+  text = g_strdup_printf (_("%s remaining"), estimate);
+  gtk_progress_bar_set_text (priv->install_progress, text);
+  gtk_progress_bar_set_show_text (priv->install_progress, TRUE);
+}
+
+static void
+gis_install_page_remaining_cb (GObject    *object,
+                               GParamSpec *pspec,
+                               gpointer    data)
+{
+  GisInstallPage *self = GIS_INSTALL_PAGE (data);
   GisScribe *scribe = GIS_SCRIBE (object);
-  gdouble progress = gis_scribe_get_progress (scribe);
 
-  if (progress < 0)
-    gis_install_page_ensure_pulsing (self);
-  else
-    gtk_progress_bar_set_fraction (priv->install_progress, progress);
+  gis_install_page_update_remaining (self,
+                                     gis_scribe_get_remaining_seconds (scribe));
 }
 
+/* Called once writing has finished, or failed with @error. */
 static void
-gis_install_page_write_cb (GObject      *source,
-                           GAsyncResult *result,
-                           gpointer      data)
+gis_install_page_write_done (GisPage *page,
+                             GError  *error)
 {
-  GisPage *page = GIS_PAGE (data);
-  GisScribe *scribe = GIS_SCRIBE (source);
-  g_autoptr(GError) error = NULL;
+  GisInstallPage *install = GIS_INSTALL_PAGE (page);
+  GisInstallPagePrivate *priv = gis_install_page_get_instance_private (install);
+  GtkWidget *toplevel = gtk_widget_get_toplevel (GTK_WIDGET (page));
+
+  if (priv->stopping)
+    {
+      g_message ("stopped writing; closing");
 
-  if (!gis_scribe_write_finish (scribe, result, &error))
+      if (priv->inhibit_cookie != 0)
+        {
+          gtk_application_uninhibit (GTK_APPLICATION (page->driver),
+                                     priv->inhibit_cookie);
+          priv->inhibit_cookie = 0;
+        }
+
+      g_signal_handlers_disconnect_by_func (toplevel, delete_event_cb, page);
+      gtk_widget_destroy (toplevel);
+      return;
+    }
+
+  if (error != NULL)
     gis_store_set_error (error);
 
   gis_install_page_teardown (page);
 }
 
 static void
-gis_install_page_open_for_restore_cb (GObject      *source,
-                                      GAsyncResult *result,
-                                      gpointer      data)
+gis_install_page_write_cb (GObject      *source,
+                           GAsyncResult *result,
+                           gpointer      data)
 {
   GisPage *page = GIS_PAGE (data);
-  UDisksBlock *block = UDISKS_BLOCK (source);
-  g_autoptr(GUnixFDList) fd_list = NULL;
-  g_autoptr(GVariant) fd_index = NULL;
-  gint fd = -1;
+  GisScribe *scribe = GIS_SCRIBE (source);
   g_autoptr(GError) error = NULL;
-  g_autoptr(GFile) image = NULL;
-  const gchar *signature_path = NULL;
-  g_autoptr(GFile) signature = NULL;
-  const gchar *checksum_path = NULL;
-  g_autoptr(GFile) checksum = NULL;
-  g_autoptr(GisScribe) scribe = NULL;
-  guint64 uncompressed_size_bytes = gis_store_get_required_size ();
-  guint64 compressed_size_bytes = gis_store_get_image_size ();
 
-  if (!udisks_block_call_open_for_restore_finish (block, &fd_index, &fd_list,
-                                                  result, &error))
-    {
-      goto error;
-    }
-
-  fd = g_unix_fd_list_get (fd_list, g_variant_get_handle (fd_index), &error);
-  if (fd < 0)
-    {
-      g_prefix_error (&error,
-                      "Error extracting fd with handle %d from D-Bus message: ",
-                      g_variant_get_handle (fd_index));
-      goto error;
-    }
+  gis_scribe_write_finish (scribe, result, &error);
+  gis_store_append_perf_report (gis_scribe_get_report (scribe));
+  gis_install_page_write_done (page, error);
+}
 
-  image = g_object_ref (G_FILE (gis_store_get_object (GIS_STORE_IMAGE)));
-  signature_path = gis_store_get_image_signature ();
-  signature = g_file_new_for_path (signature_path);
-  checksum_path = gis_store_get_image_checksum ();
-  checksum = g_file_new_for_path (checksum_path);
+/* Creates a scribe to write @image to the drive open as @fd, and compare it
+ * with the drive through @compare_fd unless that is -1, with the options
+ * chosen on earlier pages, using at most @memory_budget bytes (0 for the
+ * default).
+ */
+static GisScribe *
+gis_install_page_new_scribe (GisPage     *page,
+                             GFile       *image,
+                             guint64      uncompressed_size_bytes,
+                             guint64      compressed_size_bytes,
+                             const gchar *signature_path,
+                             const gchar *checksum_path,
+                             const gchar *device,
+                             gint         fd,
+                             gint         compare_fd,
+                             gboolean     convert_to_mbr,
+                             guint64      memory_budget)
+{
+  g_autoptr(GFile) signature = g_file_new_for_path (signature_path);
+  g_autoptr(GFile) checksum = g_file_new_for_path (checksum_path);
+  g_autofree gchar *uri = g_file_get_uri (image);
+  gboolean remote = gis_http_source_is_uri (uri);
+  g_autoptr(GFile) manifest = NULL;
+  g_autoptr(GInputStream) image_input = NULL;
+  GisScribe *scribe;
+
+  /* There is no manifest to skip unused chunks of images on a server with */
+  if (!remote)
+    manifest = gis_chunk_manifest_get_default_file (image);
 
   /* For squashfs images, gis_store_get_image_size() is the size of the
    * squashfs image, but the file we read is the mapped uncompressed image from
@@ -295,39 +419,557 @@ gis_install_page_open_for_restore_cb (GObject      *source,
   if (g_str_has_suffix (signature_path, ".img.asc"))
     compressed_size_bytes = uncompressed_size_bytes;
 
+  if (gis_store_is_tracing ())
+    gis_trace_enable ();
+
   scribe = gis_scribe_new (image,
                            uncompressed_size_bytes,
                            compressed_size_bytes,
                            signature,
                            checksum,
-                           udisks_block_get_device (block),
+                           device,
                            fd,
-                           !gis_install_page_is_efi_system (page));
+                           convert_to_mbr);
+  g_object_set (scribe,
+                "verify-first", gis_store_is_verify_first (),
+                "skip-unused", gis_store_is_skip_unused (),
+                "compare-before-write", gis_store_is_compare_before_write (),
+                "compare-fd", compare_fd,
+                "manifest", manifest,
+                "memory-budget", memory_budget,
+                NULL);
+
+  /* Images on a server are fetched several segments at a time, within the
+   * scribe's memory budget, and verified as they are written.
+   */
+  if (remote)
+    {
+      image_input = gis_http_source_open (uri, compressed_size_bytes, 0, 0,
+                                          gis_scribe_get_buffer_pool (scribe));
+      g_object_set (scribe, "image-input", image_input, NULL);
+    }
+
+  return scribe;
+}
+
+/* Takes the fd which a UDisks Open* method returned */
+static gint
+gis_install_page_get_fd (GVariant     *fd_index,
+                         GUnixFDList  *fd_list,
+                         GError      **error)
+{
+  gint fd = g_unix_fd_list_get (fd_list, g_variant_get_handle (fd_index), error);
+
+  if (fd < 0)
+    g_prefix_error (error,
+                    "Error extracting fd with handle %d from D-Bus message: ",
+                    g_variant_get_handle (fd_index));
+
+  return fd;
+}
+
+typedef struct {
+  gint fd;
+  gint compare_fd;
+} GisInstallOpenDriveData;
+
+static void
+gis_install_open_drive_data_free (GisInstallOpenDriveData *data)
+{
+  if (data->fd >= 0)
+    g_close (data->fd, NULL);
+  if (data->compare_fd >= 0)
+    g_close (data->compare_fd, NULL);
+  g_free (data);
+}
+
+static void
+gis_install_page_open_for_compare_cb (GObject      *source,
+                                      GAsyncResult *result,
+                                      gpointer      user_data)
+{
+  g_autoptr(GTask) task = G_TASK (user_data);
+  GisInstallOpenDriveData *data = g_task_get_task_data (task);
+  UDisksBlock *block = UDISKS_BLOCK (source);
+  g_autoptr(GUnixFDList) fd_list = NULL;
+  g_autoptr(GVariant) fd_index = NULL;
+  GError *error = NULL;
+  gint flags;
+
+  if (!udisks_block_call_open_for_benchmark_finish (block, &fd_index,
+                                                    &fd_list, result, &error) ||
+      (data->compare_fd = gis_install_page_get_fd (fd_index, fd_list,
+                                                   &error)) < 0)
+    {
+      g_task_return_error (task, error);
+      return;
+    }
+
+  /* Not everything the scribe compares is suitably aligned for O_DIRECT.
+   * OpenForBenchmark also sets O_SYNC, which F_SETFL can't clear; but this
+   * fd is only read from.
+   */
+  flags = fcntl (data->compare_fd, F_GETFL);
+  if (flags >= 0 && (flags & O_DIRECT) != 0 &&
+      fcntl (data->compare_fd, F_SETFL, flags & ~O_DIRECT) < 0)
+    {
+      int errsv = errno;
+
+      g_task_return_new_error (task, G_IO_ERROR, g_io_error_from_errno (errsv),
+                               "Error clearing O_DIRECT on %s: %s",
+                               udisks_block_get_device (block),
+                               g_strerror (errsv));
+      return;
+    }
+
+  g_task_return_boolean (task, TRUE);
+}
+
+static void
+gis_install_page_open_for_restore_cb (GObject      *source,
+                                      GAsyncResult *result,
+                                      gpointer      user_data)
+{
+  g_autoptr(GTask) task = G_TASK (user_data);
+  GisInstallOpenDriveData *data = g_task_get_task_data (task);
+  UDisksBlock *block = UDISKS_BLOCK (source);
+  g_autoptr(GUnixFDList) fd_list = NULL;
+  g_autoptr(GVariant) fd_index = NULL;
+  GError *error = NULL;
+  GVariantBuilder options;
+
+  if (!udisks_block_call_open_for_restore_finish (block, &fd_index, &fd_list,
+                                                  result, &error) ||
+      (data->fd = gis_install_page_get_fd (fd_index, fd_list, &error)) < 0)
+    {
+      g_task_return_error (task, error);
+      return;
+    }
+
+  if (!gis_store_is_compare_before_write ())
+    {
+      g_task_return_boolean (task, TRUE);
+      return;
+    }
+
+  g_variant_builder_init (&options, G_VARIANT_TYPE_VARDICT);
+  g_variant_builder_add (&options, "{sv}", "writable",
+                         g_variant_new_boolean (FALSE));
+  udisks_block_call_open_for_benchmark (block,
+                                        g_variant_builder_end (&options),
+                                        NULL, /* fd_list */
+                                        g_task_get_cancellable (task),
+                                        gis_install_page_open_for_compare_cb,
+                                        g_steal_pointer (&task));
+}
+
+/* Opens @block for writing with OpenForRestore. That fd is write-only, so if
+ * the image is to be compared with the drive before writing, a second,
+ * read-only fd is opened with OpenForBenchmark to read it through.
+ */
+static void
+gis_install_page_open_drive (UDisksBlock         *block,
+                             GCancellable        *cancellable,
+                             GAsyncReadyCallback  callback,
+                             gpointer             user_data)
+{
+  g_autoptr(GTask) task = g_task_new (block, cancellable, callback, user_data);
+  GisInstallOpenDriveData *data = g_new0 (GisInstallOpenDriveData, 1);
+
+  data->fd = -1;
+  data->compare_fd = -1;
+  g_task_set_source_tag (task, gis_install_page_open_drive);
+  g_task_set_task_data (task, data,
+                        (GDestroyNotify) gis_install_open_drive_data_free);
+
+  udisks_block_call_open_for_restore (block,
+                                      g_variant_new ("a{sv}", NULL), /* options */
+                                      NULL, /* fd_list */
+                                      cancellable,
+                                      gis_install_page_open_for_restore_cb,
+                                      g_steal_pointer (&task));
+}
+
+/* Returns the fd to write to, and sets @compare_fd to the fd to compare the
+ * image with the drive through, or -1 if it is not to be compared.
+ */
+static gint
+gis_install_page_open_drive_finish (UDisksBlock   *block,
+                                    GAsyncResult  *result,
+                                    gint          *compare_fd,
+                                    GError       **error)
+{
+  GisInstallOpenDriveData *data = g_task_get_task_data (G_TASK (result));
+  gint fd;
+
+  g_return_val_if_fail (g_task_is_valid (result, block), -1);
+
+  *compare_fd = -1;
+
+  if (!g_task_propagate_boolean (G_TASK (result), error))
+    return -1;
+
+  fd = data->fd;
+  data->fd = -1;
+  *compare_fd = data->compare_fd;
+  data->compare_fd = -1;
+
+  return fd;
+}
+
+static void
+gis_install_page_open_drive_cb (GObject      *source,
+                                GAsyncResult *result,
+                                gpointer      data)
+{
+  GisPage *page = GIS_PAGE (data);
+  GisInstallPagePrivate *priv =
+    gis_install_page_get_instance_private (GIS_INSTALL_PAGE (page));
+  UDisksBlock *block = UDISKS_BLOCK (source);
+  gint fd = -1;
+  gint compare_fd = -1;
+  g_autoptr(GError) error = NULL;
+  GFile *image = NULL;
+  g_autoptr(GisScribe) scribe = NULL;
+
+  fd = gis_install_page_open_drive_finish (block, result, &compare_fd, &error);
+  if (fd < 0)
+    goto error;
+
+  image = G_FILE (gis_store_get_object (GIS_STORE_IMAGE));
+  scribe = gis_install_page_new_scribe (page,
+                                        image,
+                                        gis_store_get_required_size (),
+                                        gis_store_get_image_size (),
+                                        gis_store_get_image_signature (),
+                                        gis_store_get_image_checksum (),
+                                        udisks_block_get_device (block),
+                                        fd,
+                                        compare_fd,
+                                        !gis_install_page_is_efi_system (page),
+                                        0);
   g_signal_connect (scribe, "notify::step",
                     (GCallback) gis_install_page_step_cb, page);
   g_signal_connect (scribe, "notify::progress",
                     (GCallback) gis_install_page_progress_cb, page);
+  g_signal_connect (scribe, "notify::remaining-seconds",
+                    (GCallback) gis_install_page_remaining_cb, page);
 
   gis_scribe_write_async (scribe,
-                          NULL,
+                          priv->cancellable,
                           gis_install_page_write_cb,
                           page);
   return;
 
 error:
-  gis_store_set_error (error);
-  gis_install_page_teardown (page);
+  gis_install_page_write_done (page, error);
+}
+
+/* The disks of a split image are written at once, so overall progress is
+ * that of the whole set, weighted by size, and the time remaining is that of
+ * the slowest.
+ */
+static void
+gis_install_page_split_notify_cb (GObject    *object,
+                                  GParamSpec *pspec,
+                                  gpointer    data)
+{
+  GisInstallPage *self = GIS_INSTALL_PAGE (data);
+  GisInstallPagePrivate *priv = gis_install_page_get_instance_private (self);
+  guint64 total_size = 0;
+  gdouble written = 0;
+  gdouble progress;
+  gint64 remaining = 0;
+  guint step = G_MAXUINT;
+  guint j;
+
+  for (j = 0; j < priv->split_jobs->len; j++)
+    {
+      GisInstallSplitJob *job = g_ptr_array_index (priv->split_jobs, j);
+      gdouble job_progress;
+      gint64 job_remaining;
+
+      if (job->scribe == NULL)
+        continue;
+
+      job_progress = gis_scribe_get_progress (job->scribe);
+      job_remaining = gis_scribe_get_remaining_seconds (job->scribe);
+
+      if (job_progress < 0 || written < 0)
+        written = -1;
+      else
+        written += job_progress * job->disk->required_size;
+
+      if (job_remaining < 0 || remaining < 0)
+        remaining = -1;
+      else
+        remaining = MAX (remaining, job_remaining);
+
+      total_size += job->disk->required_size;
+      step = MIN (step, gis_scribe_get_step (job->scribe));
+    }
+
+  if (total_size == 0)
+    return;
+
+  progress = written < 0 ? -1 : written / total_size;
+  gis_install_page_update_step (self, step);
+  gis_install_page_update_progress (self, progress);
+  gis_install_page_update_remaining (self, remaining);
+}
+
+static void gis_install_page_split_write_next (GisInstallPage *self);
+
+static void
+gis_install_page_split_write_cb (GObject      *source,
+                                 GAsyncResult *result,
+                                 gpointer      data)
+{
+  GisInstallSplitJob *job = data;
+  GisInstallPage *self = job->page;
+  GisInstallPagePrivate *priv = gis_install_page_get_instance_private (self);
+  g_autoptr(GError) error = NULL;
+  gboolean ok = gis_scribe_write_finish (GIS_SCRIBE (source), result, &error);
+
+  gis_store_append_perf_report (gis_scribe_get_report (GIS_SCRIBE (source)));
+
+  if (ok)
+    {
+      g_message ("finished writing %s", job->disk->image);
+    }
+  else if (priv->split_error == NULL)
+    {
+      /* The disks are only useful together, so stop writing the others */
+      g_message ("writing %s failed: %s; stopping", job->disk->image,
+                 error->message);
+      priv->split_error = g_steal_pointer (&error);
+      g_cancellable_cancel (priv->cancellable);
+    }
+
+  /* Once one disk is done, the next can have its memory */
+  if (priv->split_error == NULL && priv->split_next < priv->split_jobs->len)
+    gis_install_page_split_write_next (self);
+  else if (--priv->split_pending == 0)
+    gis_install_page_write_done (GIS_PAGE (self), priv->split_error);
+}
+
+static void
+gis_install_page_split_write_next (GisInstallPage *self)
+{
+  GisInstallPagePrivate *priv = gis_install_page_get_instance_private (self);
+  GisInstallSplitJob *job =
+    g_ptr_array_index (priv->split_jobs, priv->split_next++);
+
+  g_message ("writing %s to %s", job->disk->image,
+             udisks_block_get_device (UDISKS_BLOCK (job->disk->target)));
+  gis_scribe_write_async (job->scribe, priv->cancellable,
+                          gis_install_page_split_write_cb, job);
+}
+
+/* Starts writing the disks of a split image, once they have all been opened.
+ * Like drives in station mode, they share the memory one would have had: as
+ * many are written at once as the budget has room for, each with an equal
+ * share of it, and the rest wait their turn.
+ */
+static void
+gis_install_page_start_split_write (GisInstallPage *self)
+{
+  GisPage *page = GIS_PAGE (self);
+  GisInstallPagePrivate *priv = gis_install_page_get_instance_private (self);
+  guint n_disks = priv->split_jobs->len;
+  guint64 budget = gis_buffer_pool_get_default_budget ();
+  guint n_at_once = MIN (n_disks, gis_buffer_pool_count_shares (budget));
+  guint j;
+
+  for (j = 0; j < n_disks; j++)
+    {
+      GisInstallSplitJob *job = g_ptr_array_index (priv->split_jobs, j);
+      g_autoptr(GFile) image = g_file_new_for_path (job->disk->image);
+
+      /* Only the first disk is booted from */
+      job->scribe = gis_install_page_new_scribe (
+          page, image, job->disk->required_size, job->disk->image_size,
+          job->disk->signature, job->disk->checksum,
+          udisks_block_get_device (UDISKS_BLOCK (job->disk->target)),
+          job->fd,
+          job->compare_fd,
+          j == 0 && !gis_install_page_is_efi_system (page),
+          budget / n_at_once);
+      /* The scribe now owns the fds */
+      job->fd = -1;
+      job->compare_fd = -1;
+      g_signal_connect (job->scribe, "notify",
+                        (GCallback) gis_install_page_split_notify_cb, self);
+    }
+
+  priv->split_pending = n_at_once;
+  priv->split_next = 0;
+  for (j = 0; j < n_at_once; j++)
+    gis_install_page_split_write_next (self);
+}
+
+static void
+gis_install_page_split_open_cb (GObject      *source,
+                                GAsyncResult *result,
+                                gpointer      data)
+{
+  GisInstallSplitJob *job = data;
+  GisInstallPage *self = job->page;
+  GisInstallPagePrivate *priv = gis_install_page_get_instance_private (self);
+  UDisksBlock *block = UDISKS_BLOCK (source);
+  g_autoptr(GError) error = NULL;
+
+  job->fd = gis_install_page_open_drive_finish (block, result,
+                                                &job->compare_fd, &error);
+
+  if (error != NULL && priv->split_error == NULL)
+    priv->split_error = g_steal_pointer (&error);
+
+  if (--priv->split_pending > 0)
+    return;
+
+  /* Nothing has been written yet, so if any disk couldn't be opened, give up
+   * while every drive is intact.
+   */
+  if (priv->split_error != NULL)
+    {
+      /* Closes the drives which were opened */
+      g_ptr_array_set_size (priv->split_jobs, 0);
+      gis_install_page_write_done (GIS_PAGE (self), priv->split_error);
+    }
+  else
+    {
+      gis_install_page_start_split_write (self);
+    }
+}
+
+/* Split images are written to several drives, chosen on the disk target page,
+ * at the same time. Each disk is verified as usual as it is written.
+ */
+static void
+gis_install_page_prepare_split_write (GisInstallPage *self)
+{
+  GisInstallPagePrivate *priv = gis_install_page_get_instance_private (self);
+  GPtrArray *disks = gis_store_get_split_disks ();
+  guint j;
+
+  priv->split_jobs =
+    g_ptr_array_new_with_free_func ((GDestroyNotify) gis_install_split_job_free);
+  priv->split_pending = disks->len;
+
+  for (j = 0; j < disks->len; j++)
+    {
+      GisInstallSplitJob *job = g_new0 (GisInstallSplitJob, 1);
+
+      job->page = self;
+      job->disk = g_ptr_array_index (disks, j);
+      job->fd = -1;
+      job->compare_fd = -1;
+      g_ptr_array_add (priv->split_jobs, job);
+
+      gis_install_page_open_drive (UDISKS_BLOCK (job->disk->target),
+                                   priv->cancellable,
+                                   gis_install_page_split_open_cb,
+                                   job);
+    }
+}
+
+static void
+gis_install_page_station_changed_cb (GObject    *object,
+                                     GParamSpec *pspec,
+                                     gpointer    data)
+{
+  GisInstallPage *self = GIS_INSTALL_PAGE (data);
+  GisInstallPagePrivate *priv = gis_install_page_get_instance_private (self);
+  GisStation *station = GIS_STATION (object);
+  guint n_active = gis_station_get_n_active (station);
+  g_autofree gchar *active = NULL;
+  g_autofree gchar *msg = NULL;
+
+  if (n_active == 0)
+    {
+      gis_install_page_stop_pulsing (self);
+      gtk_progress_bar_set_fraction (priv->install_progress, 0.0);
+      active = g_strdup (_("Waiting for drives…"));
+    }
+  else
+    {
+      gis_install_page_ensure_pulsing (self);
+      active = g_strdup_printf (g_dngettext (GETTEXT_PACKAGE,
+                                             "Writing to %u drive…",
+                                             "Writing to %u drives…",
+                                             n_active),
+                                n_active);
+    }
+
+  /* Translators: the first placeholder is a message such as "Writing to 2
+   * drives…"; the second and third are numbers of drives. */
+  msg = g_strdup_printf (_("%s\nSucceeded: %u. Failed: %u."),
+                         active,
+                         gis_station_get_n_succeeded (station),
+                         gis_station_get_n_failed (station));
+  gtk_label_set_text (priv->install_label, msg);
+}
+
+/* In station mode, rather than writing to the selected drive, we write to
+ * every matching drive which is plugged in until the installer is closed.
+ */
+static void
+gis_install_page_start_station (GisInstallPage *page)
+{
+  GisInstallPagePrivate *priv = gis_install_page_get_instance_private (page);
+  UDisksClient *client = UDISKS_CLIENT (gis_store_get_object (GIS_STORE_UDISKS_CLIENT));
+  GFile *image = G_FILE (gis_store_get_object (GIS_STORE_IMAGE));
+  GFile *image_dir = G_FILE (gis_store_get_object (GIS_STORE_IMAGE_DIR));
+  const gchar *signature_path = gis_store_get_image_signature ();
+  g_autoptr(GFile) signature = g_file_new_for_path (signature_path);
+  g_autoptr(GFile) checksum = g_file_new_for_path (gis_store_get_image_checksum ());
+  guint64 uncompressed_size_bytes = gis_store_get_required_size ();
+  guint64 compressed_size_bytes = gis_store_get_image_size ();
+
+  if (gis_store_get_split_disks () != NULL)
+    {
+      g_autoptr(GError) error =
+        g_error_new_literal (GIS_IMAGE_ERROR, GIS_IMAGE_ERROR_NOT_SUPPORTED,
+                             _("Images split across several disks cannot be written in station mode."));
+
+      gis_install_page_write_done (GIS_PAGE (page), error);
+      return;
+    }
+
+  /* See gis_install_page_new_scribe() */
+  if (g_str_has_suffix (signature_path, ".img.asc"))
+    compressed_size_bytes = uncompressed_size_bytes;
+
+  priv->station = gis_station_new (client,
+                                   gis_store_get_unattended_config (),
+                                   image,
+                                   uncompressed_size_bytes,
+                                   compressed_size_bytes,
+                                   signature,
+                                   checksum,
+                                   image_dir);
+  g_signal_connect (priv->station, "notify",
+                    (GCallback) gis_install_page_station_changed_cb, page);
+  gis_install_page_station_changed_cb (G_OBJECT (priv->station), NULL, page);
+
+  gis_station_start (priv->station);
 }
 
 static void
 gis_install_page_prepare_write (GisPage *page)
 {
   GisInstallPage *install = GIS_INSTALL_PAGE (page);
+  GisInstallPagePrivate *priv = gis_install_page_get_instance_private (install);
   g_autoptr(GUnixFDList) fd_list = NULL;
   g_autoptr(GVariant) fd_index = NULL;
   UDisksBlock *block = UDISKS_BLOCK(gis_store_get_object(GIS_STORE_BLOCK_DEVICE));
 
-  if (block == NULL)
+  if (gis_store_get_split_disks () != NULL)
+    {
+      gis_install_page_prepare_split_write (install);
+    }
+  else if (block == NULL)
     {
       /* This path should not be reached: by this point, we should either have
        * an error (in which case this function is not called) or we should know
@@ -346,12 +988,10 @@ gis_install_page_prepare_write (GisPage *page)
     }
   else
     {
-      udisks_block_call_open_for_restore (block,
-                                          g_variant_new ("a{sv}", NULL), /* options */
-                                          NULL, /* fd_list */
-                                          NULL, /* cancellable */
-                                          gis_install_page_open_for_restore_cb,
-                                          install);
+      gis_install_page_open_drive (block,
+                                   priv->cancellable,
+                                   gis_install_page_open_drive_cb,
+                                   install);
     }
 }
 
@@ -392,7 +1032,15 @@ gis_install_page_shown (GisPage *page)
   if (priv->inhibit_cookie == 0)
     g_warning ("Failed to inhibit suspend/logout/shutdown");
 
-  gis_install_page_prepare_write (page);
+  /* If the image has been verified by now, the scribe will skip doing so
+   * again; if not, stop so as not to compete with it for the source disk.
+   */
+  gis_image_prewarm_cancel ();
+
+  if (gis_store_is_station ())
+    gis_install_page_start_station (install);
+  else
+    gis_install_page_prepare_write (page);
 }
 
 static void
@@ -408,6 +1056,22 @@ gis_install_page_constructed (GObject *object)
   gtk_widget_show (GTK_WIDGET (page));
 }
 
+static void
+gis_install_page_dispose (GObject *object)
+{
+  GisInstallPage *page = GIS_INSTALL_PAGE (object);
+  GisInstallPagePrivate *priv = gis_install_page_get_instance_private (page);
+
+  if (priv->station != NULL)
+    g_signal_handlers_disconnect_by_data (priv->station, page);
+  g_clear_object (&priv->station);
+  g_clear_pointer (&priv->split_jobs, g_ptr_array_unref);
+  g_clear_error (&priv->split_error);
+  g_clear_object (&priv->cancellable);
+
+  G_OBJECT_CLASS (gis_install_page_parent_class)->dispose (object);
+}
+
 static void
 gis_install_page_locale_changed (GisPage *page)
 {
@@ -432,11 +1096,16 @@ gis_install_page_class_init (GisInstallPageClass *klass)
   page_class->locale_changed = gis_install_page_locale_changed;
   page_class->shown = gis_install_page_shown;
   object_class->constructed = gis_install_page_constructed;
+  object_class->dispose = gis_install_page_dispose;
 }
 
 static void
 gis_install_page_init (GisInstallPage *self)
 {
+  GisInstallPagePrivate *priv = gis_install_page_get_instance_private (self);
+
+  priv->cancellable = g_cancellable_new ();
+
   g_resources_register (install_get_resource ());
 
   gtk_widget_init_template (GTK_WIDGET (self));
@@ -19,6 +19,8 @@
 #include "gis-scribe.h"
 
 #include <errno.h>
+/* for splice() */
+#include <fcntl.h>
 #include <gio/gfiledescriptorbased.h>
 #include <gio/gunixinputstream.h>
 #include <gio/gunixoutputstream.h>
@@ -26,16 +28,30 @@
 #include <glib/gi18n.h>
 
 #include <sys/ioctl.h>
+#include <sys/stat.h>
 /* for BLKGETSIZE64, BLKDISCARD */
 #include <linux/fs.h>
-/* for sysconf() */
 #include <unistd.h>
 
 #include "glnx-errors.h"
+#include "gis-buffer-pool.h"
+#include "gis-calibration.h"
+#include "gis-chunk-manifest.h"
 #include "gis-errors.h"
+#include "gis-image-format.h"
+#include "gis-image-verifier.h"
+#include "gis-perf-report.h"
+#include "gis-reread-partitions.h"
+#include "gis-sched.h"
+#include "gis-trace.h"
+#include "gis-write-map.h"
+#include "gpt.h"
 
-#define IMAGE_KEYRING "/usr/share/keyrings/eos-image-keyring.gpg"
 #define BUFFER_SIZE (1 * 1024 * 1024)
+/* How long to wait for udev to announce the new partitions */
+#define REREAD_PARTITIONS_TIMEOUT_MSEC (10 * 1000)
+/* Verify input, decompressor stdin and decompressor stdout */
+#define N_PIPES 3
 /* MBR + two copies of (GPT header plus at least 32 512-byte sectors of
  * partition entries)
  */
@@ -44,6 +60,14 @@
  * disk image to one byte.
  */
 #define MINIMUM_COMPRESSED_SIZE 1
+#define N_STAGES (GIS_SCHED_STAGE_WRITE + 1)
+
+static const gchar * const stage_names[N_STAGES] = {
+  [GIS_SCHED_STAGE_READ] = "read",
+  [GIS_SCHED_STAGE_DECODE] = "decompress",
+  [GIS_SCHED_STAGE_VERIFY] = "verify",
+  [GIS_SCHED_STAGE_WRITE] = "write",
+};
 
 typedef enum {
   GIS_SCRIBE_TASK_TEE        = 1 << 0,
@@ -70,6 +94,13 @@ gis_scribe_task_get_label (GisScribeTask flag)
     }
 }
 
+/* What the image is verified against */
+typedef enum {
+  GIS_SCRIBE_VERIFY_GPG,
+  GIS_SCRIBE_VERIFY_CHECKSUM,
+  GIS_SCRIBE_VERIFY_MANIFEST,
+} GisScribeVerifyMethod;
+
 typedef struct _GisScribe {
   GObject parent;
 
@@ -78,6 +109,8 @@ typedef struct _GisScribe {
    * error cases.
    */
   GInputStream *image_input;
+  /* Found by gis_scribe_write_async() */
+  const GisImageFormat *format;
   guint64 image_size_bytes;
   /* Compressed size of 'image'. We need to provide this to GPG so it can
    * indicate its progress, since it reads the image data from a pipe. Equal to
@@ -86,18 +119,69 @@ typedef struct _GisScribe {
   guint64 compressed_size_bytes;
   GFile *signature;
   GFile *checksum;
+  GFile *manifest;
   gchar *keyring_path;
   gchar *drive_path;
   gboolean convert_to_mbr;
   gchar *gpg_path;
+  gboolean verify_first;
+  guint64 memory_budget;
+  gboolean skip_unused;
+  gboolean compare_before_write;
+  gboolean hash_image;
+  /* SHA-256 of the decompressed image, set by the write thread once the
+   * whole image has been written if hash_image is set
+   */
+  gchar *image_checksum;
+
+  /* Every buffer used by the worker threads comes from here. Created by
+   * gis_scribe_write_async().
+   */
+  GisBufferPool *buffers;
+  /* Size to enlarge the pipes between stages to, or 0 to leave them alone */
+  gint pipe_size;
 
   gboolean started;
   guint step;
+  /* How responsive the main loop was while writing, from
+   * gis_scribe_write_async() until every subtask has finished
+   */
+  GisLatencyMonitor *latency;
+  /* Likewise, if tracing */
+  GisTraceSpan *span;
+  /* What each stage did, and when it started (or 0 if it didn't). Each is
+   * only touched by the thread or callbacks running that stage, and only read
+   * once every subtask has finished.
+   */
+  GisPerfStage stages[N_STAGES];
+  gint64 stage_start_usec[N_STAGES];
+  /* How the image was verified, and the report built from all of the above
+   * once every subtask has finished
+   */
+  const gchar *verify_policy;
+  gchar *report;
   gdouble verify_progress;
 
-  /* MIN(verify_progress, bytes_written / image_size_bytes) */
+  /* MIN(verify_progress, bytes_written / image_size_bytes), scaled to follow
+   * verify_first_fraction
+   */
   gdouble overall_progress;
 
+  /* If verify_first is set, the share of step 1 taken by verifying the image
+   * before writing it; otherwise 0.
+   */
+  gdouble verify_first_fraction;
+  /* How the image is verified as it is written, whether or not it was
+   * verified first
+   */
+  GisScribeVerifyMethod verify_method;
+  /* Only set while verifying the image before writing it */
+  GisImageVerifier *verifier;
+  guint verify_first_progress_id;
+
+  /* Estimated from the throughput of each stage so far, or -1 if unknown */
+  gint64 remaining_seconds;
+
   GMutex mutex;
   GCond cond;
 
@@ -119,9 +203,28 @@ typedef struct _GisScribe {
   GError *error;
 
   gint drive_fd;
+  /* Readable fd for drive_path to compare the image with, or -1 to read
+   * drive_fd
+   */
+  gint compare_fd;
+  /* Compressed bytes read from 'image' by the tee thread */
+  guint64 bytes_read;
   guint64 bytes_written;
+  /* When the write thread started copying, or 0 if it hasn't yet */
+  gint64 copy_start_time_usec;
   guint set_indeterminate_progress_id;
   gint64 start_time_usec;
+
+  /* Subprocesses which must be killed if the write is cancelled, while they
+   * are running
+   */
+  GSubprocess *gpg_subprocess;
+  GSubprocess *decompress_subprocess;
+
+  /* Handler on the cancellable passed to gis_scribe_write_async(), while the
+   * pipeline is running
+   */
+  gulong cancelled_id;
 } GisScribe;
 
 /* Data for the subtask which reads the file from disk and feeds it to the
@@ -141,6 +244,8 @@ typedef struct {
    * then reading a line is expected to succeed (or fail) without blocking.
    */
   GDataInputStream *stdout_;
+  /* From spawning GPG until it exits, if tracing */
+  GisTraceSpan *span;
 } GisScribeGpgData;
 
 static void
@@ -154,21 +259,20 @@ gis_scribe_gpg_data_free (GisScribeGpgData *data)
 
   g_clear_object (&data->stdout_);
   g_clear_object (&data->subprocess);
+  g_clear_pointer (&data->span, gis_trace_end);
 
   g_slice_free (GisScribeGpgData, data);
 }
 
-/* String length of a sha256 checksum hex digest */
-#define CHECKSUM_STRLEN 64
-
 typedef struct {
-  gchar expected_checksum[CHECKSUM_STRLEN + 1];
+  gchar *expected_checksum;
   GInputStream *input;
 } GisScribeChecksumData;
 
 static void
 gis_scribe_checksum_data_free (GisScribeChecksumData *data)
 {
+  g_free (data->expected_checksum);
   g_clear_object (&data->input);
   g_slice_free (GisScribeChecksumData, data);
 }
@@ -188,7 +292,15 @@ typedef enum {
   PROP_CONVERT_TO_MBR,
   PROP_STEP,
   PROP_PROGRESS,
+  PROP_REMAINING_SECONDS,
   PROP_GPG_PATH,
+  PROP_VERIFY_FIRST,
+  PROP_MANIFEST,
+  PROP_MEMORY_BUDGET,
+  PROP_SKIP_UNUSED,
+  PROP_COMPARE_BEFORE_WRITE,
+  PROP_COMPARE_FD,
+  PROP_HASH_IMAGE,
   N_PROPERTIES
 } GisScribePropertyId;
 
@@ -257,8 +369,47 @@ gis_scribe_set_property (GObject      *object,
       self->gpg_path = g_value_dup_string (value);
       break;
 
+    case PROP_VERIFY_FIRST:
+      g_return_if_fail (!self->started);
+      self->verify_first = g_value_get_boolean (value);
+      break;
+
+    case PROP_MANIFEST:
+      g_return_if_fail (!self->started);
+      g_clear_object (&self->manifest);
+      self->manifest = G_FILE (g_value_dup_object (value));
+      break;
+
+    case PROP_MEMORY_BUDGET:
+      g_return_if_fail (!self->started);
+      self->memory_budget = g_value_get_uint64 (value);
+      break;
+
+    case PROP_SKIP_UNUSED:
+      g_return_if_fail (!self->started);
+      self->skip_unused = g_value_get_boolean (value);
+      break;
+
+    case PROP_COMPARE_BEFORE_WRITE:
+      g_return_if_fail (!self->started);
+      self->compare_before_write = g_value_get_boolean (value);
+      break;
+
+    case PROP_COMPARE_FD:
+      g_return_if_fail (!self->started);
+      if (self->compare_fd != -1)
+        close (self->compare_fd);
+      self->compare_fd = g_value_get_int (value);
+      break;
+
+    case PROP_HASH_IMAGE:
+      g_return_if_fail (!self->started);
+      self->hash_image = g_value_get_boolean (value);
+      break;
+
     case PROP_STEP:
     case PROP_PROGRESS:
+    case PROP_REMAINING_SECONDS:
     case N_PROPERTIES:
     default:
       G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
@@ -324,10 +475,42 @@ gis_scribe_get_property (GObject      *object,
       g_value_set_double (value, self->overall_progress);
       break;
 
+    case PROP_REMAINING_SECONDS:
+      g_value_set_int64 (value, self->remaining_seconds);
+      break;
+
     case PROP_GPG_PATH:
       g_value_set_string (value, self->gpg_path);
       break;
 
+    case PROP_VERIFY_FIRST:
+      g_value_set_boolean (value, self->verify_first);
+      break;
+
+    case PROP_MANIFEST:
+      g_value_set_object (value, self->manifest);
+      break;
+
+    case PROP_MEMORY_BUDGET:
+      g_value_set_uint64 (value, self->memory_budget);
+      break;
+
+    case PROP_SKIP_UNUSED:
+      g_value_set_boolean (value, self->skip_unused);
+      break;
+
+    case PROP_COMPARE_BEFORE_WRITE:
+      g_value_set_boolean (value, self->compare_before_write);
+      break;
+
+    case PROP_COMPARE_FD:
+      g_value_set_int (value, self->compare_fd);
+      break;
+
+    case PROP_HASH_IMAGE:
+      g_value_set_boolean (value, self->hash_image);
+      break;
+
     case N_PROPERTIES:
     default:
       G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
@@ -361,6 +544,10 @@ gis_scribe_dispose (GObject *object)
   g_clear_object (&self->image_input);
   g_clear_object (&self->signature);
   g_clear_object (&self->checksum);
+  g_clear_object (&self->manifest);
+  g_clear_object (&self->verifier);
+  g_clear_object (&self->gpg_subprocess);
+  g_clear_object (&self->decompress_subprocess);
 
   G_OBJECT_CLASS (gis_scribe_parent_class)->dispose (object);
 }
@@ -375,6 +562,11 @@ gis_scribe_finalize (GObject *object)
   g_clear_pointer (&self->keyring_path, g_free);
   g_clear_pointer (&self->drive_path, g_free);
   g_clear_pointer (&self->gpg_path, g_free);
+  g_clear_pointer (&self->buffers, gis_buffer_pool_unref);
+  g_clear_pointer (&self->latency, gis_latency_monitor_free);
+  g_clear_pointer (&self->span, gis_trace_end);
+  g_clear_pointer (&self->report, g_free);
+  g_clear_pointer (&self->image_checksum, g_free);
   g_clear_error (&self->error);
   g_mutex_clear (&self->mutex);
   g_cond_clear (&self->cond);
@@ -383,6 +575,10 @@ gis_scribe_finalize (GObject *object)
     close (self->drive_fd);
   self->drive_fd = -1;
 
+  if (self->compare_fd != -1)
+    close (self->compare_fd);
+  self->compare_fd = -1;
+
   G_OBJECT_CLASS (gis_scribe_parent_class)->finalize (object);
 }
 
@@ -419,9 +615,9 @@ gis_scribe_class_init (GisScribeClass *klass)
       "image-input",
       "Image input stream",
       "Input stream to read :image from, or %NULL to allow this class to open "
-      "it itself. (Used by test suite.)",
+      "it itself. Must be set before writing begins.",
       G_TYPE_INPUT_STREAM,
-      G_PARAM_READWRITE | G_PARAM_CONSTRUCT_ONLY | G_PARAM_STATIC_STRINGS);
+      G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS);
 
   props[PROP_IMAGE_SIZE] = g_param_spec_uint64 (
       "image-size",
@@ -455,13 +651,13 @@ gis_scribe_class_init (GisScribeClass *klass)
       "keyring-path",
       "Keyring path",
       "Path to GPG keyring holding image signing public keys",
-      IMAGE_KEYRING,
+      GIS_IMAGE_VERIFIER_DEFAULT_KEYRING,
       G_PARAM_READWRITE | G_PARAM_CONSTRUCT_ONLY | G_PARAM_STATIC_STRINGS);
 
   /* Providing both the path and the fd seems redundant. However: in the app
    * proper, we open the fd using udisks so we can write to it as an
-   * unprivileged user, but also need to be able to run a script on the device,
-   * elevated with pkexec.
+   * unprivileged user, but also describe the device by name in log messages
+   * and the performance report. All I/O goes through the fd.
    *
    * Why not accept a UDisksBlock and perform this step internally? It's
    * convenient for testing to be able to operate on a regular file, too.
@@ -484,7 +680,7 @@ gis_scribe_class_init (GisScribeClass *klass)
   props[PROP_CONVERT_TO_MBR] = g_param_spec_boolean (
       "convert-to-mbr",
       "Convert to MBR?",
-      "Whether to convert the partition table from GPT to MBR after writing",
+      "Whether to convert the partition table from GPT to MBR as it is written",
       FALSE,
       G_PARAM_READWRITE | G_PARAM_CONSTRUCT_ONLY | G_PARAM_STATIC_STRINGS);
 
@@ -495,6 +691,120 @@ gis_scribe_class_init (GisScribeClass *klass)
       GPG_PATH,
       G_PARAM_READWRITE | G_PARAM_CONSTRUCT_ONLY | G_PARAM_STATIC_STRINGS);
 
+  /**
+   * GisScribe:verify-first:
+   *
+   * If %TRUE, the image is verified in full before anything is written to the
+   * drive, so that a corrupt image leaves the drive untouched. It is verified
+   * again as it is written, since it is read again to write it, so this is
+   * slower than only verifying it while writing. Verifying first is skipped
+   * if the image has already been verified. This must be set before
+   * calling gis_scribe_write_async(), and has no effect if
+   * #GisScribe:image-input is set.
+   */
+  props[PROP_VERIFY_FIRST] = g_param_spec_boolean (
+      "verify-first",
+      "Verify first?",
+      "Whether to verify the image before writing it, rather than while",
+      FALSE,
+      G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS);
+
+  /**
+   * GisScribe:manifest:
+   *
+   * Chunk manifest for #GisScribe:image (see #GisChunkManifest), or %NULL. If
+   * it and its signature exist, the image is verified against it rather than
+   * #GisScribe:signature or #GisScribe:checksum, hashing chunks on every core.
+   * This must be set before calling gis_scribe_write_async().
+   */
+  props[PROP_MANIFEST] = g_param_spec_object (
+      "manifest",
+      "Manifest",
+      "Signed chunk manifest for :image, or NULL.",
+      G_TYPE_FILE,
+      G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS);
+
+  /**
+   * GisScribe:memory-budget:
+   *
+   * The most memory, in bytes, to use for buffers and pipes while writing, or
+   * 0 to use gis_buffer_pool_get_default_budget(). Budgets below
+   * %GIS_BUFFER_POOL_MIN_BUDGET are raised to it. This must be set before
+   * calling gis_scribe_write_async() or gis_scribe_get_buffer_pool().
+   */
+  props[PROP_MEMORY_BUDGET] = g_param_spec_uint64 (
+      "memory-budget",
+      "Memory budget",
+      "Most memory to use for buffers while writing, or 0 for the default",
+      0, G_MAXUINT64, 0,
+      G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS);
+
+  /**
+   * GisScribe:skip-unused:
+   *
+   * If %TRUE, only the parts of the image which are in use are written: the
+   * partition tables, and the partitions, less the free blocks of any ext4
+   * filesystems on them (see #GisWriteMap). The rest of the drive is left as
+   * it was, or as #GisScribe discarded it. If the image's partition table is
+   * not understood, the whole image is written. This must be set before
+   * calling gis_scribe_write_async().
+   */
+  props[PROP_SKIP_UNUSED] = g_param_spec_boolean (
+      "skip-unused",
+      "Skip unused?",
+      "Whether to skip the parts of the image which no partition uses",
+      FALSE,
+      G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS);
+
+  /**
+   * GisScribe:compare-before-write:
+   *
+   * If %TRUE, each part of the image is compared with what the drive already
+   * holds there, which is read first, and only the blocks which differ are
+   * written. This suits reinstalling onto a drive which holds an older build
+   * of the same image: reads are much cheaper than writes, particularly on
+   * eMMC. The drive is not discarded first, and is read through @compare-fd,
+   * or if that is -1, through @drive-fd, which must then be open for reading
+   * as well as writing. This must be set before calling
+   * gis_scribe_write_async().
+   */
+  props[PROP_COMPARE_BEFORE_WRITE] = g_param_spec_boolean (
+      "compare-before-write",
+      "Compare before write?",
+      "Whether to only write the parts of the image which differ from the drive",
+      FALSE,
+      G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS);
+
+  /**
+   * GisScribe:compare-fd:
+   *
+   * A read-only file descriptor for @drive-path, through which the drive is
+   * read to compare the image with if @compare-before-write is set; or -1 to
+   * read it through @drive-fd. It is close()d by this class. This must be
+   * set before calling gis_scribe_write_async().
+   */
+  props[PROP_COMPARE_FD] = g_param_spec_int (
+      "compare-fd",
+      "Compare FD",
+      "Readable file descriptor for drive-path to compare the image with, or -1",
+      -1, G_MAXINT, -1,
+      G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS);
+
+  /**
+   * GisScribe:hash-image:
+   *
+   * If %TRUE, the decompressed image is hashed as it is written, so that its
+   * checksum can be had from gis_scribe_get_image_checksum() without reading
+   * it back. This stops the image being spliced to the drive. This must be
+   * set before calling gis_scribe_write_async().
+   */
+  props[PROP_HASH_IMAGE] = g_param_spec_boolean (
+      "hash-image",
+      "Hash image?",
+      "Whether to compute the SHA-256 checksum of the image as it is written",
+      FALSE,
+      G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS);
+
   /**
    * GisScribe:step:
    *
@@ -523,6 +833,23 @@ gis_scribe_class_init (GisScribeClass *klass)
       -1, 1, 0,
       G_PARAM_READABLE | G_PARAM_STATIC_STRINGS);
 
+  /**
+   * GisScribe:remaining-seconds:
+   *
+   * Estimated time until the image is fully written, in seconds, or -1 if
+   * this can't be determined. This is recalculated from the throughput of each
+   * stage of the write process as it progresses, so may go up as well as
+   * down. It does not include the time taken to sync the disk once the image
+   * has been written.
+   */
+  props[PROP_REMAINING_SECONDS] = g_param_spec_int64 (
+      "remaining-seconds",
+      "Remaining seconds",
+      "Estimated time until the image is fully written, in seconds, "
+      "or -1 if unknown.",
+      -1, G_MAXINT64, -1,
+      G_PARAM_READABLE | G_PARAM_STATIC_STRINGS);
+
   g_object_class_install_properties (object_class, N_PROPERTIES, props);
 }
 
@@ -533,7 +860,9 @@ gis_scribe_init (GisScribe *self)
   g_cond_init (&self->cond);
 
   self->drive_fd = -1;
+  self->compare_fd = -1;
   self->step = 1;
+  self->remaining_seconds = -1;
 }
 
 GisScribe *
@@ -571,6 +900,18 @@ task_return_error (GisScribe *self,
                    GTask     *task,
                    GError    *error)
 {
+  /* Once the write is cancelled, other stages fail as a consequence, for
+   * example because a subprocess was killed; report the cancellation rather
+   * than whichever of them noticed first.
+   */
+  if (!g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED) &&
+      g_cancellable_is_cancelled (g_task_get_cancellable (task)))
+    {
+      g_clear_error (&error);
+      g_cancellable_set_error_if_cancelled (g_task_get_cancellable (task),
+                                            &error);
+    }
+
   g_mutex_lock (&self->mutex);
   if (self->error == NULL)
     self->error = g_error_copy (error);
@@ -620,26 +961,85 @@ gis_scribe_close_output_stream_or_warn (GOutputStream *stream,
     g_warning ("error closing %s: %s", label, error->message);
 }
 
+static void
+gis_scribe_set_remaining_seconds (GisScribe *self,
+                                  gint64     remaining_seconds)
+{
+  if (remaining_seconds != self->remaining_seconds)
+    {
+      self->remaining_seconds = remaining_seconds;
+      g_object_notify_by_pspec (G_OBJECT (self), props[PROP_REMAINING_SECONDS]);
+    }
+}
+
+/* The tee thread's throughput is bounded by both the source medium and the
+ * verifier, since it writes every block to the verify pipe before reading the
+ * next; similarly the write thread's throughput is bounded by both the
+ * decompressor and the target. Since the pipes between them are small, the
+ * slowest stage dominates, and we can estimate the remaining time in the same
+ * way as we did for the calibration before we started.
+ */
+static void
+gis_scribe_update_remaining_seconds (GisScribe *self,
+                                     guint64    bytes_read,
+                                     guint64    bytes_written,
+                                     gint64     copy_start_time_usec)
+{
+  GisCalibration rates = { 0 };
+  gdouble elapsed;
+  guint64 remaining;
+
+  if (copy_start_time_usec == 0 || bytes_written == 0)
+    return;
+
+  elapsed = (gdouble) (g_get_monotonic_time () - copy_start_time_usec)
+            / G_USEC_PER_SEC;
+  if (elapsed <= 0)
+    return;
+
+  rates.read_rate = bytes_read / elapsed;
+  rates.write_rate = bytes_written / elapsed;
+  remaining = gis_calibration_estimate_seconds (
+      &rates,
+      self->compressed_size_bytes - MIN (bytes_read, self->compressed_size_bytes),
+      self->image_size_bytes - MIN (bytes_written, self->image_size_bytes));
+
+  g_debug ("%s: read %.1f MB/s, write %.1f MB/s, %" G_GUINT64_FORMAT
+           " seconds remaining",
+           G_STRFUNC, rates.read_rate / 1e6, rates.write_rate / 1e6,
+           remaining);
+
+  gis_scribe_set_remaining_seconds (self, remaining);
+}
+
 /* Called once per second while the main write operation is in progress.
  */
 static gboolean
 gis_scribe_update_progress (gpointer data)
 {
   GisScribe *self = GIS_SCRIBE (data);
+  guint64 bytes_read;
   guint64 bytes_written;
+  gint64 copy_start_time_usec;
   gdouble write_progress;
   gdouble progress;
 
   g_mutex_lock (&self->mutex);
+  bytes_read = self->bytes_read;
   bytes_written = self->bytes_written;
+  copy_start_time_usec = self->copy_start_time_usec;
   g_mutex_unlock (&self->mutex);
 
+  gis_scribe_update_remaining_seconds (self, bytes_read, bytes_written,
+                                       copy_start_time_usec);
+
   write_progress = ((gdouble) bytes_written) / ((gdouble) self->image_size_bytes);
   /* You'd expect these to be identical ± 1 MiB in the uncompressed case, and
    * pretty close in the compressed case assuming the compression ratio is
    * roughly constant throughout the file.
    */
-  progress = MIN (self->verify_progress, write_progress);
+  progress = self->verify_first_fraction +
+    (1 - self->verify_first_fraction) * MIN (self->verify_progress, write_progress);
 
   g_debug ("%s: verify progress %3.0f%%, write progress %3.0f%%",
            G_STRFUNC, self->verify_progress * 100, write_progress * 100);
@@ -653,6 +1053,35 @@ gis_scribe_update_progress (gpointer data)
   return G_SOURCE_CONTINUE;
 }
 
+/* Called by each stage as it starts. If @measured, the stage adds up its own
+ * busy and stalled time in the returned struct; otherwise, such as for
+ * subprocesses, only its elapsed time is known.
+ */
+static GisPerfStage *
+gis_scribe_stage_begin (GisScribe     *self,
+                        GisSchedStage  stage,
+                        gboolean       measured)
+{
+  GisPerfStage *stats = &self->stages[stage];
+
+  self->stage_start_usec[stage] = g_get_monotonic_time ();
+  stats->busy_usec = measured ? 0 : -1;
+  stats->stalled_usec = measured ? 0 : -1;
+
+  return stats;
+}
+
+static void
+gis_scribe_stage_end (GisScribe     *self,
+                      GisSchedStage  stage,
+                      guint64        bytes)
+{
+  GisPerfStage *stats = &self->stages[stage];
+
+  stats->bytes = bytes;
+  stats->elapsed_usec = g_get_monotonic_time () - self->stage_start_usec[stage];
+}
+
 /* Run BLKDISCARD on the whole device. This tells flash-based disks that all
  * data is now unused, which frees up wear levelling algorithms and boosts
  * performance for next time each eraseblock is written.
@@ -702,23 +1131,6 @@ gis_scribe_write_thread_await_verify (GisScribe *self,
   return FALSE;
 }
 
-/* Allocates size bytes, page-aligned. */
-G_GNUC_MALLOC
-G_GNUC_ALLOC_SIZE(1)
-static void *
-gis_scribe_malloc_aligned (size_t size)
-{
-  const size_t pagesize = sysconf (_SC_PAGESIZE);
-  void *buf = NULL;
-
-  if (posix_memalign (&buf, pagesize, size) != 0 || buf == NULL)
-    g_error ("%s: failed to allocate %" G_GSIZE_FORMAT " bytes "
-             "aligned to page size %" G_GSIZE_FORMAT ": %s",
-             G_STRFUNC, size, pagesize, g_strerror (errno));
-
-  return buf;
-}
-
 static gchar *
 format_bytes (guint64 bytes)
 {
@@ -736,166 +1148,778 @@ format_bytes (guint64 bytes)
   return g_strdup_printf ("%'" G_GUINT64_FORMAT, bytes);
 }
 
+/* Moves the rest of @in_fd to @fd with splice(), so the data is not copied
+ * through userspace. If the kernel cannot splice between these fds, returns
+ * %TRUE with @spliced set to %FALSE, having moved nothing, and the caller
+ * should fall back to reading and writing.
+ */
 static gboolean
-gis_scribe_write_thread_copy (GisScribe     *self,
-                              GInputStream  *decompressed,
-                              gint           fd,
-                              GOutputStream *output,
-                              GCancellable  *cancellable,
-                              GError       **error)
+gis_scribe_write_thread_splice (GisScribe     *self,
+                                gint           in_fd,
+                                gint           fd,
+                                gboolean      *spliced,
+                                GCancellable  *cancellable,
+                                GError       **error)
 {
-  g_autofree gchar *buffer = gis_scribe_malloc_aligned (BUFFER_SIZE);
-  g_autofree gchar *first_mib = gis_scribe_malloc_aligned (BUFFER_SIZE);
-  gsize first_mib_bytes_read = 0;
-  gsize r = 0;
-  gsize w = 0;
-
-  /* Read the first 1 MiB; write zeros to the target drive. This ensures the
-   * system won't boot until the image is fully written.
-   */
-  memset (first_mib, 0, BUFFER_SIZE);
-  if (!g_output_stream_write_all (output, first_mib, BUFFER_SIZE,
-                                  &w, cancellable, error)
-      || !g_input_stream_read_all (decompressed, first_mib, BUFFER_SIZE,
-                                   &first_mib_bytes_read, cancellable, error))
-    return FALSE;
+  *spliced = FALSE;
 
-  do
+  for (;;)
     {
-      if (!g_input_stream_read_all (decompressed, buffer, BUFFER_SIZE,
-                                    &r, cancellable, error))
-        return FALSE;
+      ssize_t n;
 
-      if (!g_output_stream_write_all (output, buffer, r,
-                                      &w, cancellable, error))
+      if (g_cancellable_set_error_if_cancelled (cancellable, error))
         return FALSE;
 
+      n = splice (in_fd, NULL, fd, NULL, BUFFER_SIZE,
+                  SPLICE_F_MOVE | SPLICE_F_MORE);
+      if (n < 0)
+        {
+          if (errno == EINTR)
+            continue;
+
+          if (!*spliced && (errno == EINVAL || errno == ENOSYS))
+            return TRUE;
+
+          return glnx_throw_errno_prefix (error, "can't write to disk");
+        }
+
+      *spliced = TRUE;
+
+      if (n == 0)
+        return TRUE;
+
       /* We lock to protect bytes_written */
       g_mutex_lock (&self->mutex);
-      self->bytes_written += w;
+      self->bytes_written += n;
       g_mutex_unlock (&self->mutex);
     }
-  while (r > 0);
-
-  if (!g_input_stream_close (decompressed, cancellable, error))
-    return FALSE;
-
-  /* Wait for verification to complete */
-  if (!gis_scribe_write_thread_await_verify (self, error))
-    return FALSE;
+}
 
-  /* Check that we've written the same amount of data as we expected from the
-   * GPT header. This would only fail if there's something seriously wrong with
-   * the image builder, the decompressor, or the read/write loop above.
-   */
-  g_mutex_lock (&self->mutex);
-  /* Don't forget the first <= 1 MiB we saved for later! */
-  guint64 bytes_written = self->bytes_written + first_mib_bytes_read;
-  g_mutex_unlock (&self->mutex);
+static gboolean
+gis_scribe_pwrite_all (gint          fd,
+                       const gchar  *buffer,
+                       gsize         len,
+                       guint64       offset,
+                       GError      **error)
+{
+  gsize done = 0;
 
-  if (bytes_written != self->image_size_bytes)
+  while (done < len)
     {
-      /* See comment on format_bytes() to understand why these are formatted
-       * separately.
-       */
-      g_autofree gchar *bytes_written_str = format_bytes (bytes_written);
-      g_autofree gchar *expected_bytes_str = format_bytes (self->image_size_bytes);
-      g_set_error (error,
-                   GIS_IMAGE_ERROR, GIS_IMAGE_ERROR_WRONG_SIZE,
-                   _("Wrote %s bytes, but expected to write %s bytes."),
-                   bytes_written_str, expected_bytes_str);
-      return FALSE;
-    }
+      ssize_t w = pwrite (fd, buffer + done, len - done, offset + done);
 
-  /* Now write the first 1 MiB to disk. Unfortunately GUnixOutputStream does
-   * not implement GSeekable.
-   */
-  if (lseek (fd, 0, SEEK_SET) < 0)
-    return glnx_throw_errno_prefix (error, "can't seek to start of disk");
+      if (w < 0)
+        {
+          if (errno == EINTR)
+            continue;
 
-  if (!g_output_stream_write_all (output, first_mib, first_mib_bytes_read,
-                                  &w, cancellable, error))
-    return FALSE;
+          return glnx_throw_errno_prefix (error, "can't write to disk");
+        }
 
-  g_mutex_lock (&self->mutex);
-  self->bytes_written += w;
-  g_mutex_unlock (&self->mutex);
+      done += w;
+    }
 
   return TRUE;
 }
 
 static gboolean
-gis_scribe_set_indeterminate_progress (gpointer data)
+gis_scribe_pread_all (gint          fd,
+                      gchar        *buffer,
+                      gsize         len,
+                      guint64       offset,
+                      GError      **error)
 {
-  GisScribe *self = GIS_SCRIBE (data);
+  gsize done = 0;
 
-  g_mutex_lock (&self->mutex);
-  self->set_indeterminate_progress_id = 0;
-  g_mutex_unlock (&self->mutex);
+  while (done < len)
+    {
+      ssize_t r = pread (fd, buffer + done, len - done, offset + done);
 
-  self->step = 2;
-  self->overall_progress = -1;
-  g_object_notify_by_pspec (G_OBJECT (self), props[PROP_STEP]);
-  g_object_notify_by_pspec (G_OBJECT (self), props[PROP_PROGRESS]);
+      if (r < 0)
+        {
+          if (errno == EINTR)
+            continue;
 
-  return G_SOURCE_REMOVE;
-}
+          return glnx_throw_errno_prefix (error, "can't read from disk");
+        }
 
-static gboolean
-gis_scribe_convert_to_mbr (GisScribe *self,
-                           GError   **error)
-{
-  const char *cmd = "/usr/sbin/eos-repartition-mbr";
-  g_autoptr(GSubprocessLauncher) launcher = NULL;
-  g_autoptr(GSubprocess) process = NULL;
+      if (r == 0)
+        {
+          g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                       "can't read from disk: unexpected end of drive at "
+                       "%" G_GUINT64_FORMAT,
+                       offset + done);
+          return FALSE;
+        }
 
-  launcher = g_subprocess_launcher_new (G_SUBPROCESS_FLAGS_NONE);
-  /* pkexec won't let us run the program if $SHELL isn't in /etc/shells,
-   * so remove it from the environment.
-   */
-  g_subprocess_launcher_unsetenv (launcher, "SHELL");
-  process = g_subprocess_launcher_spawn (launcher, error,
-                                         "pkexec", cmd, self->drive_path, NULL);
-  if (process == NULL ||
-      !g_subprocess_wait_check (process, NULL, error))
-    {
-      g_prefix_error (error, "failed to run %s %s: ",
-                      cmd, self->drive_path);
-      return FALSE;
+      done += r;
     }
 
   return TRUE;
 }
 
-static void
-gis_scribe_log_duration (GisScribe   *self,
-                         const gchar *label)
-{
-  gint64 now_usec = g_get_monotonic_time ();
-  gint64 duration = now_usec - self->start_time_usec;
-  gint64 hours = (duration / G_USEC_PER_SEC) / (60 * 60);
-  int minutes = ((duration / G_USEC_PER_SEC) / 60) % 60;
-  int seconds = (duration / G_USEC_PER_SEC) % 60;
+/* What became of each byte of the image after the first MiB */
+typedef struct {
+  guint64 written;
+  /* Not in use, according to the write map */
+  guint64 skipped;
+  /* Already on the drive, when comparing before writing */
+  guint64 unchanged;
+} GisScribeWriteCounts;
 
-  g_message ("%s: %01" G_GINT64_FORMAT ":%02d:%02d",
-             label, hours, minutes, seconds);
+/* Blocks of the image are compared with the drive in units of this size */
+#define COMPARE_BLOCK_SIZE 4096
+
+static gboolean
+gis_scribe_block_differs (const gchar *a,
+                          const gchar *b,
+                          gsize        pos,
+                          gsize        len)
+{
+  /* glibc's memcmp() is vectorised, so there's no need to do better here */
+  return memcmp (a + pos, b + pos, MIN (COMPARE_BLOCK_SIZE, len - pos)) != 0;
 }
 
-static void
-gis_scribe_write_thread (GTask        *task,
-                         gpointer      source_object,
-                         gpointer      task_data,
-                         GCancellable *cancellable)
+/* Writes @len bytes of @buffer to @fd at @offset. If @scratch is not %NULL,
+ * what the drive holds there is read into it first, through @read_fd, and
+ * only the runs of blocks which differ are written.
+ */
+static gboolean
+gis_scribe_write_thread_write_range (gint                  fd,
+                                     gint                  read_fd,
+                                     guint64               offset,
+                                     const gchar          *buffer,
+                                     gchar                *scratch,
+                                     gsize                 len,
+                                     GisScribeWriteCounts *counts,
+                                     GError              **error)
 {
-  GisScribe *self = GIS_SCRIBE (source_object);
-  GInputStream *decompressed = G_INPUT_STREAM (task_data);
-  gint fd = -1;
-  g_autoptr(GOutputStream) output = NULL;
-  gboolean ret;
-  g_autoptr(GError) error = NULL;
-  guint timer_id;
+  gsize pos = 0;
 
-  /* Transfer ownership of drive_fd; the GOutputStream will close it. */
+  if (scratch == NULL)
+    {
+      if (!gis_scribe_pwrite_all (fd, buffer, len, offset, error))
+        return FALSE;
+
+      counts->written += len;
+      return TRUE;
+    }
+
+  if (!gis_scribe_pread_all (read_fd, scratch, len, offset, error))
+    return FALSE;
+
+  while (pos < len)
+    {
+      gsize start = pos;
+      gboolean differs = gis_scribe_block_differs (buffer, scratch, pos, len);
+
+      do
+        pos += MIN (COMPARE_BLOCK_SIZE, len - pos);
+      while (pos < len &&
+             gis_scribe_block_differs (buffer, scratch, pos, len) == differs);
+
+      if (!differs)
+        counts->unchanged += pos - start;
+      else if (!gis_scribe_pwrite_all (fd, buffer + start, pos - start,
+                                       offset + start, error))
+        return FALSE;
+      else
+        counts->written += pos - start;
+    }
+
+  return TRUE;
+}
+
+/* Writes the parts of @buffer, which holds @len bytes of the image starting at
+ * @offset, which @map says are needed, or all of it if @map is %NULL. If
+ * @scratch (BUFFER_SIZE bytes) is not %NULL, each part is compared with the
+ * drive, read through @read_fd, before it is written.
+ */
+static gboolean
+gis_scribe_write_thread_write_mapped (GisWriteMap          *map,
+                                      gint                  fd,
+                                      gint                  read_fd,
+                                      guint64               offset,
+                                      const gchar          *buffer,
+                                      gchar                *scratch,
+                                      gsize                 len,
+                                      GisScribeWriteCounts *counts,
+                                      GError              **error)
+{
+  gsize pos = 0;
+
+  if (map == NULL)
+    return gis_scribe_write_thread_write_range (fd, read_fd, offset, buffer,
+                                                scratch, len, counts, error);
+
+  gis_write_map_observe (map, offset, (const guint8 *) buffer, len);
+
+  while (pos < len)
+    {
+      gboolean needed;
+      gsize n = gis_write_map_lookup (map, offset + pos, len - pos, &needed);
+
+      /* The part of @scratch used mirrors that of @buffer, which keeps it
+       * aligned for drives opened with O_DIRECT.
+       */
+      if (!needed)
+        counts->skipped += n;
+      else if (!gis_scribe_write_thread_write_range (
+                   fd, read_fd, offset + pos, buffer + pos,
+                   scratch != NULL ? scratch + pos : NULL,
+                   n, counts, error))
+        return FALSE;
+
+      pos += n;
+    }
+
+  return TRUE;
+}
+
+static gboolean
+gis_scribe_get_drive_size (gint      fd,
+                           guint64  *size,
+                           GError  **error)
+{
+  struct stat buf;
+
+  if (fstat (fd, &buf) < 0)
+    return glnx_throw_errno_prefix (error, "can't stat drive");
+
+  /* The tests write to regular files */
+  if (!S_ISBLK (buf.st_mode))
+    {
+      *size = buf.st_size;
+      return TRUE;
+    }
+
+  if (ioctl (fd, BLKGETSIZE64, size))
+    return glnx_throw_errno_prefix (error, "can't get size of drive");
+
+  return TRUE;
+}
+
+/* Replaces the GPT in @first_mib with the equivalent MBR partition table, and
+ * erases the backup GPT header which was written at the end of the image, so
+ * that nothing mistakes the drive for a GPT disk with a damaged primary GPT.
+ */
+static gboolean
+gis_scribe_convert_to_mbr (GisScribe  *self,
+                           gint        fd,
+                           gchar      *first_mib,
+                           gsize       first_mib_len,
+                           GError    **error)
+{
+  static const gchar zeroes[SECTOR_SIZE] = { 0 };
+  guint64 backup_lba;
+
+  if (!gpt_convert_to_mbr ((uint8_t *) first_mib, first_mib_len, &backup_lba))
+    {
+      g_set_error (error, GIS_IMAGE_ERROR, GIS_IMAGE_ERROR_NOT_SUPPORTED,
+                   _("The image's partition table cannot be converted for "
+                     "this computer."));
+      return FALSE;
+    }
+
+  if (backup_lba < self->image_size_bytes / SECTOR_SIZE &&
+      !gis_scribe_pwrite_all (fd, zeroes, sizeof zeroes,
+                              backup_lba * SECTOR_SIZE, error))
+    return FALSE;
+
+  g_message ("converted partition table to MBR");
+  return TRUE;
+}
+
+/* If the drive is larger than the image, rewrites the primary GPT in
+ * @first_mib to span the whole drive, and writes the corresponding backup GPT
+ * to the end of the drive. Otherwise, the backup GPT would be left where the
+ * image ends, and have to be moved when the system first boots. The image's
+ * own backup GPT header is then erased, so that nothing finds a second,
+ * stale backup in the middle of the drive.
+ */
+static gboolean
+gis_scribe_relocate_gpt (GisScribe  *self,
+                         gint        fd,
+                         gchar      *first_mib,
+                         gsize       first_mib_len,
+                         GError    **error)
+{
+  static const gchar zeroes[SECTOR_SIZE] = { 0 };
+  guint64 drive_size;
+  guint64 drive_sectors;
+  guint64 old_backup_lba;
+  g_autofree guint8 *backup = NULL;
+  size_t backup_len = 0;
+
+  if (!gis_scribe_get_drive_size (fd, &drive_size, error))
+    return FALSE;
+
+  drive_sectors = drive_size / SECTOR_SIZE;
+  if (drive_sectors <= self->image_size_bytes / SECTOR_SIZE)
+    return TRUE;
+
+  /* The image has been verified by now, so this is not expected, but the
+   * image can still be written as it is.
+   */
+  if (!gpt_relocate ((uint8_t *) first_mib, first_mib_len, drive_sectors,
+                     &old_backup_lba, &backup, &backup_len))
+    {
+      g_message ("image has no GPT which can be moved; leaving it as it is");
+      return TRUE;
+    }
+
+  if (!gis_scribe_pwrite_all (fd, (const gchar *) backup, backup_len,
+                              drive_sectors * SECTOR_SIZE - backup_len, error))
+    return FALSE;
+
+  if (old_backup_lba < self->image_size_bytes / SECTOR_SIZE &&
+      !gis_scribe_pwrite_all (fd, zeroes, sizeof zeroes,
+                              old_backup_lba * SECTOR_SIZE, error))
+    return FALSE;
+
+  g_message ("moved backup GPT to sector %" G_GUINT64_FORMAT,
+             drive_sectors - 1);
+  return TRUE;
+}
+
+/* @buffer and @first_mib are BUFFER_SIZE bytes each, from self->buffers, as
+ * is @scratch if the image is to be compared with the drive before writing
+ */
+static gboolean
+gis_scribe_write_thread_copy (GisScribe     *self,
+                              GInputStream  *decompressed,
+                              gint           fd,
+                              GOutputStream *output,
+                              gchar         *buffer,
+                              gchar         *first_mib,
+                              gchar         *scratch,
+                              GCancellable  *cancellable,
+                              GError       **error)
+{
+  gsize first_mib_bytes_read = 0;
+  gsize r = 0;
+  gsize w = 0;
+  gboolean spliced = FALSE;
+  g_autoptr(GisWriteMap) map = NULL;
+  guint64 offset;
+  GisScribeWriteCounts counts = { 0 };
+  GisPerfStage *stats = &self->stages[GIS_SCHED_STAGE_WRITE];
+  gint read_fd = self->compare_fd != -1 ? self->compare_fd : fd;
+  gint64 before_usec;
+  GisTraceSpan *span;
+  gboolean ok;
+  g_autoptr(GChecksum) sha256sum = NULL;
+
+  if (self->hash_image)
+    sha256sum = g_checksum_new (G_CHECKSUM_SHA256);
+
+  /* Read the first 1 MiB; write zeros to the target drive. This ensures the
+   * system won't boot until the image is fully written.
+   */
+  memset (first_mib, 0, BUFFER_SIZE);
+  if (!g_output_stream_write_all (output, first_mib, BUFFER_SIZE,
+                                  &w, cancellable, error)
+      || !g_input_stream_read_all (decompressed, first_mib, BUFFER_SIZE,
+                                   &first_mib_bytes_read, cancellable, error))
+    return FALSE;
+
+  offset = first_mib_bytes_read;
+
+  /* Hashed now, before the partition table in it is rewritten below */
+  if (sha256sum != NULL)
+    g_checksum_update (sha256sum, (const guchar *) first_mib,
+                       first_mib_bytes_read);
+
+  /* The first MiB holds the whole primary GPT, which tells us which parts of
+   * the rest are worth writing.
+   */
+  if (self->skip_unused)
+    {
+      g_autoptr(GError) local_error = NULL;
+
+      map = gis_write_map_new ((const guint8 *) first_mib,
+                               first_mib_bytes_read, self->image_size_bytes,
+                               &local_error);
+      if (map == NULL)
+        g_message ("writing the whole image: %s", local_error->message);
+      else
+        gis_write_map_observe (map, 0, (const guint8 *) first_mib,
+                               first_mib_bytes_read);
+    }
+
+  /* The decompressed stream is normally a pipe, which does no buffering of
+   * its own, so the rest can be moved straight from the pipe to the disk;
+   * unless it must pass through the write map, be compared with the drive,
+   * or be hashed.
+   */
+  if (map == NULL && scratch == NULL && sha256sum == NULL &&
+      G_IS_FILE_DESCRIPTOR_BASED (decompressed))
+    {
+      GFileDescriptorBased *in = G_FILE_DESCRIPTOR_BASED (decompressed);
+
+      /* Splicing blocks on either end, so can't be told apart */
+      before_usec = g_get_monotonic_time ();
+      span = gis_trace_begin ("write", "splice");
+      ok = gis_scribe_write_thread_splice (self,
+                                           g_file_descriptor_based_get_fd (in),
+                                           fd, &spliced, cancellable, error);
+      gis_trace_end (span);
+      stats->busy_usec += g_get_monotonic_time () - before_usec;
+      if (!ok)
+        return FALSE;
+    }
+
+  while (!spliced)
+    {
+      /* Time spent here is time the decompressor kept the writer waiting */
+      before_usec = g_get_monotonic_time ();
+      span = gis_trace_begin ("write", "read");
+      ok = g_input_stream_read_all (decompressed, buffer, BUFFER_SIZE,
+                                    &r, cancellable, error);
+      gis_trace_span_set_arg (span, "bytes", r);
+      gis_trace_end (span);
+      stats->stalled_usec += g_get_monotonic_time () - before_usec;
+      if (!ok)
+        return FALSE;
+
+      if (sha256sum != NULL)
+        g_checksum_update (sha256sum, (const guchar *) buffer, r);
+
+      before_usec = g_get_monotonic_time ();
+      span = gis_trace_begin ("write", "write");
+      gis_trace_span_set_arg (span, "offset", offset);
+      gis_trace_span_set_arg (span, "bytes", r);
+
+      if (map != NULL || scratch != NULL)
+        {
+          ok = gis_scribe_write_thread_write_mapped (map, fd, read_fd, offset,
+                                                     buffer, scratch, r,
+                                                     &counts, error);
+          w = r;
+        }
+      else
+        {
+          ok = g_output_stream_write_all (output, buffer, r,
+                                          &w, cancellable, error);
+        }
+
+      gis_trace_end (span);
+      stats->busy_usec += g_get_monotonic_time () - before_usec;
+      if (!ok)
+        return FALSE;
+
+      offset += r;
+
+      /* Skipped and unchanged bytes count as written, for progress and the
+       * size check below. We lock to protect bytes_written.
+       */
+      g_mutex_lock (&self->mutex);
+      self->bytes_written += w;
+      g_mutex_unlock (&self->mutex);
+
+      if (r == 0)
+        break;
+    }
+
+  if (map != NULL)
+    {
+      g_autofree gchar *skipped_str =
+        g_format_size_full (counts.skipped, G_FORMAT_SIZE_IEC_UNITS);
+      g_autofree gchar *image_size_str =
+        g_format_size_full (self->image_size_bytes, G_FORMAT_SIZE_IEC_UNITS);
+
+      g_message ("skipped %s of %s image which is not in use",
+                 skipped_str, image_size_str);
+    }
+
+  if (scratch != NULL)
+    {
+      g_autofree gchar *unchanged_str =
+        g_format_size_full (counts.unchanged, G_FORMAT_SIZE_IEC_UNITS);
+      g_autofree gchar *written_str =
+        g_format_size_full (counts.written, G_FORMAT_SIZE_IEC_UNITS);
+
+      g_message ("left %s unchanged on the drive; wrote %s which differed",
+                 unchanged_str, written_str);
+    }
+
+  if (!g_input_stream_close (decompressed, cancellable, error))
+    return FALSE;
+
+  /* Wait for verification to complete */
+  if (!gis_scribe_write_thread_await_verify (self, error))
+    return FALSE;
+
+  /* Check that we've written the same amount of data as we expected from the
+   * GPT header. This would only fail if there's something seriously wrong with
+   * the image builder, the decompressor, or the read/write loop above.
+   */
+  g_mutex_lock (&self->mutex);
+  /* Don't forget the first <= 1 MiB we saved for later! */
+  guint64 bytes_written = self->bytes_written + first_mib_bytes_read;
+  g_mutex_unlock (&self->mutex);
+
+  if (bytes_written != self->image_size_bytes)
+    {
+      /* See comment on format_bytes() to understand why these are formatted
+       * separately.
+       */
+      g_autofree gchar *bytes_written_str = format_bytes (bytes_written);
+      g_autofree gchar *expected_bytes_str = format_bytes (self->image_size_bytes);
+      g_set_error (error,
+                   GIS_IMAGE_ERROR, GIS_IMAGE_ERROR_WRONG_SIZE,
+                   _("Wrote %s bytes, but expected to write %s bytes."),
+                   bytes_written_str, expected_bytes_str);
+      return FALSE;
+    }
+
+  if (sha256sum != NULL)
+    self->image_checksum = g_strdup (g_checksum_get_string (sha256sum));
+
+  /* This is the last chance to stop with the target left unbootable */
+  if (g_cancellable_set_error_if_cancelled (cancellable, error))
+    return FALSE;
+
+  /* The backup GPT goes before the primary GPT, so that the drive never has
+   * a primary GPT pointing at a missing backup. Likewise, the backup GPT is
+   * erased before the MBR replaces the primary GPT.
+   */
+  if (self->convert_to_mbr)
+    {
+      span = gis_trace_begin ("write", "convert to MBR");
+      ok = gis_scribe_convert_to_mbr (self, fd, first_mib,
+                                      first_mib_bytes_read, error);
+    }
+  else
+    {
+      span = gis_trace_begin ("write", "relocate GPT");
+      ok = gis_scribe_relocate_gpt (self, fd, first_mib, first_mib_bytes_read,
+                                    error);
+    }
+
+  gis_trace_end (span);
+  if (!ok)
+    return FALSE;
+
+  /* Now write the first 1 MiB to disk. Unfortunately GUnixOutputStream does
+   * not implement GSeekable. The tests simulate slow drives with a pipe, so
+   * the first MiB follows the rest of the image, and the far end of the pipe
+   * puts it back in place.
+   */
+  if (lseek (fd, 0, SEEK_SET) < 0 && errno != ESPIPE)
+    return glnx_throw_errno_prefix (error, "can't seek to start of disk");
+
+  if (!g_output_stream_write_all (output, first_mib, first_mib_bytes_read,
+                                  &w, cancellable, error))
+    return FALSE;
+
+  g_mutex_lock (&self->mutex);
+  self->bytes_written += w;
+  g_mutex_unlock (&self->mutex);
+
+  return TRUE;
+}
+
+static gboolean
+gis_scribe_set_indeterminate_progress (gpointer data)
+{
+  GisScribe *self = GIS_SCRIBE (data);
+
+  g_mutex_lock (&self->mutex);
+  self->set_indeterminate_progress_id = 0;
+  g_mutex_unlock (&self->mutex);
+
+  self->step = 2;
+  self->overall_progress = -1;
+  g_object_notify_by_pspec (G_OBJECT (self), props[PROP_STEP]);
+  g_object_notify_by_pspec (G_OBJECT (self), props[PROP_PROGRESS]);
+  gis_scribe_set_remaining_seconds (self, -1);
+
+  return G_SOURCE_REMOVE;
+}
+
+/* Makes the kernel, udev and UDisks aware of the new partitions before the
+ * write is reported as complete. None of this is fatal: the image has been
+ * written, and failing that, udev rereads the partition table itself when
+ * the drive is closed.
+ */
+static void
+gis_scribe_reread_partitions (GisScribe *self,
+                              gint       fd)
+{
+  guint n_partitions = 0;
+  gint64 latency_usec = 0;
+  g_autoptr(GError) error = NULL;
+
+  if (!gis_reread_partitions (fd, REREAD_PARTITIONS_TIMEOUT_MSEC,
+                              &n_partitions, &latency_usec, &error))
+    {
+      /* The tests write to regular files */
+      if (!g_error_matches (error, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED))
+        g_message ("%s", error->message);
+      return;
+    }
+
+  g_message ("udev announced %u partitions on %s after %" G_GINT64_FORMAT
+             " ms", n_partitions, self->drive_path,
+             latency_usec / G_TIME_SPAN_MILLISECOND);
+}
+
+static void
+gis_scribe_log_duration (GisScribe   *self,
+                         const gchar *label)
+{
+  gint64 now_usec = g_get_monotonic_time ();
+  gint64 duration = now_usec - self->start_time_usec;
+  gint64 hours = (duration / G_USEC_PER_SEC) / (60 * 60);
+  int minutes = ((duration / G_USEC_PER_SEC) / 60) % 60;
+  int seconds = (duration / G_USEC_PER_SEC) % 60;
+
+  g_message ("%s: %01" G_GINT64_FORMAT ":%02d:%02d",
+             label, hours, minutes, seconds);
+}
+
+static void
+gis_scribe_log_memory (GisScribe *self)
+{
+  g_autofree gchar *budget =
+    g_format_size_full (gis_buffer_pool_get_budget (self->buffers),
+                        G_FORMAT_SIZE_IEC_UNITS);
+  g_autofree gchar *high_water_mark =
+    g_format_size_full (gis_buffer_pool_get_high_water_mark (self->buffers),
+                        G_FORMAT_SIZE_IEC_UNITS);
+  g_autofree gchar *pipes =
+    g_format_size_full ((guint64) N_PIPES * self->pipe_size,
+                        G_FORMAT_SIZE_IEC_UNITS);
+  g_autofree gchar *peak_rss =
+    g_format_size_full (gis_get_peak_rss (), G_FORMAT_SIZE_IEC_UNITS);
+
+  g_message ("memory: at most %s of %s in buffers, %s in pipes; "
+             "peak RSS %s",
+             high_water_mark, budget, pipes, peak_rss);
+}
+
+static void
+gis_scribe_log_latency (GisScribe *self)
+{
+  GisLatencyStats stats;
+
+  gis_latency_monitor_get_stats (self->latency, &stats);
+  g_message ("main loop: %.1f ms late on average, at worst %.1f ms; "
+             "%u of %u samples at least %d ms late",
+             stats.mean_usec / 1000., stats.max_usec / 1000.,
+             stats.n_late, stats.n_samples,
+             GIS_LATENCY_MONITOR_LATE_USEC / 1000);
+}
+
+/* Describes how the write went, including why it might have been slow, for
+ * gis_scribe_get_report(). Called once every subtask has finished.
+ */
+static gchar *
+gis_scribe_build_report (GisScribe    *self,
+                         const GError *error)
+{
+  GString *report = g_string_new ("Write performance report\n");
+  g_autofree gchar *image_name = g_file_get_parse_name (self->image);
+  g_autofree gchar *image_size =
+    g_format_size_full (self->image_size_bytes, G_FORMAT_SIZE_IEC_UNITS);
+  g_autofree gchar *compressed_size =
+    g_format_size_full (self->compressed_size_bytes, G_FORMAT_SIZE_IEC_UNITS);
+  g_autofree gchar *source = gis_perf_report_describe_file (self->image);
+  g_autofree gchar *target = gis_perf_report_describe_device (self->drive_path);
+  g_autofree gchar *sched = gis_sched_describe ();
+  g_autofree gchar *budget =
+    g_format_size_full (gis_buffer_pool_get_budget (self->buffers),
+                        G_FORMAT_SIZE_IEC_UNITS);
+  g_autofree gchar *high_water_mark =
+    g_format_size_full (gis_buffer_pool_get_high_water_mark (self->buffers),
+                        G_FORMAT_SIZE_IEC_UNITS);
+  g_autofree gchar *peak_rss =
+    g_format_size_full (gis_get_peak_rss (), G_FORMAT_SIZE_IEC_UNITS);
+  gint64 duration = g_get_monotonic_time () - self->start_time_usec;
+  GisPerfStage stages[N_STAGES];
+  gsize n_stages = 0;
+  gsize i;
+
+  g_string_append_printf (report, "image: %s (%s, %s; %s compressed)\n",
+                          image_name, self->format->name, image_size,
+                          compressed_size);
+  g_string_append_printf (report, "source: %s\n", source);
+  g_string_append_printf (report, "target: %s\n", target);
+  g_string_append_printf (report, "verify: %s%s\n",
+                          self->verify_policy != NULL
+                          ? self->verify_policy : "not started",
+                          self->verify_first_fraction > 0
+                          ? ", and before writing" : "");
+  g_string_append_printf (report, "write: %s%s%s\n",
+                          self->skip_unused ? "used blocks" : "everything",
+                          self->compare_before_write
+                          ? ", compared with drive" : "",
+                          self->convert_to_mbr ? ", converted to MBR" : "");
+  g_string_append_printf (report, "scheduling: %s\n", sched);
+  g_string_append_printf (report,
+                          "memory: at most %s of %s in buffers, pipes of "
+                          "%d bytes; peak RSS %s\n",
+                          high_water_mark, budget, self->pipe_size, peak_rss);
+
+  if (self->latency != NULL)
+    {
+      GisLatencyStats stats;
+
+      gis_latency_monitor_get_stats (self->latency, &stats);
+      g_string_append_printf (report,
+                              "main loop: %.1f ms late on average, at worst "
+                              "%.1f ms\n",
+                              stats.mean_usec / 1000., stats.max_usec / 1000.);
+    }
+
+  g_string_append_printf (report, "result: %s after %.1f s\n",
+                          error != NULL ? error->message : "succeeded",
+                          (gdouble) duration / G_USEC_PER_SEC);
+
+  /* The decompressor's output is what the write thread read */
+  self->stages[GIS_SCHED_STAGE_DECODE].bytes =
+    self->stages[GIS_SCHED_STAGE_WRITE].bytes;
+
+  for (i = 0; i < N_STAGES; i++)
+    {
+      if (self->stage_start_usec[i] == 0)
+        continue;
+
+      stages[n_stages] = self->stages[i];
+      stages[n_stages].name = stage_names[i];
+      n_stages++;
+    }
+
+  gis_perf_report_append_stages (report, stages, n_stages);
+
+  return g_string_free (report, FALSE);
+}
+
+static void
+gis_scribe_write_thread (GTask        *task,
+                         gpointer      source_object,
+                         gpointer      task_data,
+                         GCancellable *cancellable)
+{
+  GisScribe *self = GIS_SCRIBE (source_object);
+  GInputStream *decompressed = G_INPUT_STREAM (task_data);
+  gint fd = -1;
+  g_autoptr(GOutputStream) output = NULL;
+  gboolean ret;
+  g_autoptr(GError) error = NULL;
+  guint timer_id;
+  gchar *buffer;
+  gchar *first_mib;
+  gchar *scratch = NULL;
+  guint64 bytes_written;
+  gint64 before_usec;
+  g_autoptr(GisSchedScope) sched = gis_sched_enter (GIS_SCHED_STAGE_WRITE);
+  GisTraceSpan *span;
+
+  gis_scribe_stage_begin (self, GIS_SCHED_STAGE_WRITE, TRUE);
+
+  /* Transfer ownership of drive_fd; the GOutputStream will close it. */
   g_mutex_lock (&self->mutex);
   fd = self->drive_fd;
   self->drive_fd = -1;
@@ -906,20 +1930,51 @@ gis_scribe_write_thread (GTask        *task,
 
   g_thread_yield ();
 
-  if (!gis_scribe_blkdiscard (fd, &error))
+  /* Discarding the drive would throw away what is to be compared with */
+  if (self->compare_before_write)
     {
-      /* Not fatal: the target device may not support this. */
-      g_message ("%s", error->message);
-      g_clear_error (&error);
+      g_message ("comparing image with drive before writing");
+    }
+  else
+    {
+      span = gis_trace_begin ("write", "blkdiscard");
+      ret = gis_scribe_blkdiscard (fd, &error);
+      gis_trace_end (span);
+
+      if (!ret)
+        {
+          /* Not fatal: the target device may not support this. */
+          g_message ("%s", error->message);
+          g_clear_error (&error);
+        }
     }
 
+  g_mutex_lock (&self->mutex);
+  self->copy_start_time_usec = g_get_monotonic_time ();
+  g_mutex_unlock (&self->mutex);
+
+  buffer = gis_buffer_pool_acquire (self->buffers, BUFFER_SIZE);
+  first_mib = gis_buffer_pool_acquire (self->buffers, BUFFER_SIZE);
+  if (self->compare_before_write)
+    scratch = gis_buffer_pool_acquire (self->buffers, BUFFER_SIZE);
   ret = gis_scribe_write_thread_copy (self, decompressed, fd, output,
-                                      cancellable, &error);
+                                      buffer, first_mib, scratch, cancellable,
+                                      &error);
+  if (scratch != NULL)
+    gis_buffer_pool_release (self->buffers, scratch);
+  gis_buffer_pool_release (self->buffers, first_mib);
+  gis_buffer_pool_release (self->buffers, buffer);
 
   g_source_remove (timer_id);
 
+  g_mutex_lock (&self->mutex);
+  bytes_written = self->bytes_written;
+  g_mutex_unlock (&self->mutex);
+
   if (!ret)
     {
+      gis_scribe_stage_end (self, GIS_SCHED_STAGE_WRITE, bytes_written);
+
       if (error == NULL)
         {
           /* This path should not be reached. To avoid translators
@@ -948,7 +2003,7 @@ gis_scribe_write_thread (GTask        *task,
 
   gis_scribe_log_duration (self, "image fully written");
 
-  /* Sync, probe and repartition  can take a long time; notify the UI thread of
+  /* Syncing and probing can take a long time; notify the UI thread of
    * indeterminate progress.
    */
   g_mutex_lock (&self->mutex);
@@ -960,23 +2015,38 @@ gis_scribe_write_thread (GTask        *task,
 
   g_thread_yield ();
 
-  if (syncfs (fd) < 0)
+  /* Only this drive's data needs to reach the disk, so there's no need to
+   * sync every other filesystem too. The tests simulate slow drives with a
+   * pipe, which has nothing to sync.
+   */
+  span = gis_trace_begin ("write", "fsync");
+  before_usec = g_get_monotonic_time ();
+  ret = fsync (fd) == 0 || errno == EINVAL;
+  if (!ret)
+    glnx_throw_errno_prefix (&error, "fsync failed");
+  self->stages[GIS_SCHED_STAGE_WRITE].busy_usec +=
+    g_get_monotonic_time () - before_usec;
+  gis_trace_end (span);
+
+  /* Until the data is on the disk, it hasn't really been written */
+  gis_scribe_stage_end (self, GIS_SCHED_STAGE_WRITE, bytes_written);
+
+  if (!ret)
     {
-      glnx_throw_errno_prefix (&error, "syncfs failed");
       task_return_error (self, task, g_steal_pointer (&error));
       return;
     }
 
+  span = gis_trace_begin ("write", "reread partitions");
+  gis_scribe_reread_partitions (self, fd);
+  gis_trace_end (span);
+
   if (!g_output_stream_close (output, cancellable, &error))
     {
       task_return_error (self, task, g_steal_pointer (&error));
       return;
     }
 
-  g_spawn_command_line_sync ("partprobe", NULL, NULL, NULL, NULL);
-  if (self->convert_to_mbr)
-    gis_scribe_convert_to_mbr (self, &error);
-
   g_mutex_lock (&self->mutex);
   /* If we didn't get around to setting progress to -1 in the main thread, it's
    * too late now anyway!
@@ -986,12 +2056,10 @@ gis_scribe_write_thread (GTask        *task,
   self->set_indeterminate_progress_id = 0;
   g_mutex_unlock (&self->mutex);
 
-  if (error != NULL)
-    task_return_error (self, task, g_steal_pointer (&error));
-  else
-    g_task_return_boolean (task, TRUE);
+  g_task_return_boolean (task, TRUE);
 
   gis_scribe_log_duration (self, "write complete");
+  gis_scribe_log_memory (self);
 }
 
 static void
@@ -1016,10 +2084,11 @@ gis_scribe_gpg_progress (GObject *pollable_stream,
   GisScribeGpgData *task_data = g_task_get_task_data (task);
   GisScribe *self = GIS_SCRIBE (g_task_get_source_object (task));
   g_autofree gchar *line = NULL;
-  g_auto(GStrv) arr = NULL;
-  guint64 curr, full;
-  gchar *units = NULL;
-  g_autoptr(GError) error = NULL;
+  gdouble progress;
+
+  /* The source also fires once cancelled, but GPG is being killed */
+  if (g_cancellable_is_cancelled (g_task_get_cancellable (task)))
+    return G_SOURCE_REMOVE;
 
   line = g_data_input_stream_read_line_utf8 (task_data->stdout_, NULL,
                                              g_task_get_cancellable (task),
@@ -1029,55 +2098,8 @@ gis_scribe_gpg_progress (GObject *pollable_stream,
 
   g_debug ("%s: %s", G_STRFUNC, line);
 
-  if (!g_str_has_prefix (line, "[GNUPG:] PROGRESS"))
-    {
-      /* TODO: handle GOODSIG/EXPSIG/BADSIG/etc. to surface the exact
-       * verification error. Or use GPGME?
-       */
-      return G_SOURCE_CONTINUE;
-    }
-
-  /* https://git.gnupg.org/cgi-bin/gitweb.cgi?p=gnupg.git;a=blob;f=doc/DETAILS;h=0be55f4d;hb=refs/heads/master#l1043
-   * [GNUPG:] PROGRESS <what> <char> <cur> <total> [<units>]
-   * For example:
-   * [GNUPG:] PROGRESS /dev/mapper/endless- ? 676 4442 MiB
-   */
-  arr = g_strsplit (g_strchomp (line), " ", -1);
-  if (g_strv_length (arr) < 6)
-    {
-      g_warning ("%s: GPG progress message has too few fields: %s",
-                 G_STRFUNC, line);
-      return G_SOURCE_CONTINUE;
-    }
-
-  if (!g_ascii_string_to_unsigned (arr[4], 10, 0, G_MAXUINT64, &curr, &error) ||
-      !g_ascii_string_to_unsigned (arr[5], 10, 0, G_MAXUINT64, &full, &error))
-    {
-      g_warning ("%s: couldn't parse GPG progress message '%s': %s",
-                 G_STRFUNC, line, error->message);
-      return G_SOURCE_CONTINUE;
-    }
-  units = arr[6];
-
-  if (full < 1024 && g_strcmp0 (units, "B") == 0)
-    {
-      /* GPG reports progress reading the signature, not just the image. Assume
-       * any file less than 1 KiB is the signature and ignore it.
-       */
-      return G_SOURCE_CONTINUE;
-    }
-
-  if (full == 0)
-    {
-      /* gpg can't determine the file size. Should not happen, since we
-       * gave it a hint.
-       */
-      self->verify_progress = -1;
-    }
-  else
-    {
-      self->verify_progress = CLAMP ((gdouble) curr / (gdouble) full, 0, 1);
-    }
+  if (gis_image_verifier_parse_gpg_progress (line, &progress))
+    self->verify_progress = progress;
 
   return G_SOURCE_CONTINUE;
 }
@@ -1095,6 +2117,13 @@ gis_scribe_gpg_wait_check_cb (GObject      *source,
   g_autoptr(GError) error = NULL;
 
   g_clear_pointer (&task_data->stdout_source, g_source_destroy);
+  g_clear_pointer (&task_data->span, gis_trace_end);
+
+  g_mutex_lock (&self->mutex);
+  g_clear_object (&self->gpg_subprocess);
+  /* GPG reads everything the tee thread does */
+  gis_scribe_stage_end (self, GIS_SCHED_STAGE_VERIFY, self->bytes_read);
+  g_mutex_unlock (&self->mutex);
 
   ok = g_subprocess_wait_check_finish (gpg_subprocess, result, &error);
   if (ok)
@@ -1162,6 +2191,7 @@ gis_scribe_begin_verify_gpg (GisScribe *self,
   g_message ("Spawning %s", args_flat);
   launcher = g_subprocess_launcher_new (G_SUBPROCESS_FLAGS_STDIN_PIPE |
                                         G_SUBPROCESS_FLAGS_STDOUT_PIPE);
+  gis_sched_setup_launcher (launcher, GIS_SCHED_STAGE_VERIFY);
   task_data->subprocess = g_subprocess_launcher_spawnv (launcher, args, &error);
   if (task_data->subprocess == NULL)
     {
@@ -1169,6 +2199,9 @@ gis_scribe_begin_verify_gpg (GisScribe *self,
       return NULL;
     }
 
+  task_data->span = gis_trace_begin ("subprocess", "gpg");
+  gis_scribe_stage_begin (self, GIS_SCHED_STAGE_VERIFY, FALSE);
+
   gpg_stdin = g_subprocess_get_stdin_pipe (task_data->subprocess);
 
   gpg_stdout = g_subprocess_get_stdout_pipe (task_data->subprocess);
@@ -1180,7 +2213,14 @@ gis_scribe_begin_verify_gpg (GisScribe *self,
   g_task_attach_source (task, task_data->stdout_source,
                         (GSourceFunc) (void (*)(void)) gis_scribe_gpg_progress);
 
-  g_subprocess_wait_check_async (task_data->subprocess, cancellable,
+  g_mutex_lock (&self->mutex);
+  self->gpg_subprocess = g_object_ref (task_data->subprocess);
+  g_mutex_unlock (&self->mutex);
+
+  /* If the write is cancelled, GPG is killed, so there is no need to stop
+   * waiting for it; and this way it has exited by the time the write fails.
+   */
+  g_subprocess_wait_check_async (task_data->subprocess, NULL,
                                  gis_scribe_gpg_wait_check_cb,
                                  g_steal_pointer (&task));
 
@@ -1196,29 +2236,49 @@ checksum_in_thread (GTask        *task,
   GisScribe *self = source;
   GisScribeChecksumData *checksum_data = task_data;
   gsize len;
-  guint8 buf[BUFFER_SIZE];
+  guint8 *buf = gis_buffer_pool_acquire (self->buffers, BUFFER_SIZE);
   g_autoptr(GChecksum) sha256sum = g_checksum_new (G_CHECKSUM_SHA256);
   g_autoptr(GError) error = NULL;
   guint64 bytes_checksummed = 0;
+  g_autoptr(GisSchedScope) sched = gis_sched_enter (GIS_SCHED_STAGE_VERIFY);
+  GisPerfStage *stats = gis_scribe_stage_begin (self, GIS_SCHED_STAGE_VERIFY,
+                                                TRUE);
+  gint64 before_usec;
+  gboolean ok;
+  GisTraceSpan *span;
   const gchar *digest;
 
   for (;;) {
-    if (!g_input_stream_read_all (checksum_data->input, buf, sizeof (buf), &len,
-                                  NULL, &error))
-      {
-        task_return_error (self, task, g_steal_pointer (&error));
-        return;
-      }
+    before_usec = g_get_monotonic_time ();
+    ok = g_input_stream_read_all (checksum_data->input, buf, BUFFER_SIZE, &len,
+                                  cancellable, &error);
+    stats->stalled_usec += g_get_monotonic_time () - before_usec;
+    if (!ok)
+      break;
 
     if (len == 0)
       break;
 
+    before_usec = g_get_monotonic_time ();
+    span = gis_trace_begin ("verify", "sha256");
+    gis_trace_span_set_arg (span, "bytes", len);
     g_checksum_update (sha256sum, buf, len);
+    gis_trace_end (span);
+    stats->busy_usec += g_get_monotonic_time () - before_usec;
 
     bytes_checksummed += len;
     self->verify_progress = ((gdouble) bytes_checksummed) / ((gdouble) self->image_size_bytes);
   }
 
+  gis_buffer_pool_release (self->buffers, buf);
+  gis_scribe_stage_end (self, GIS_SCHED_STAGE_VERIFY, bytes_checksummed);
+
+  if (error != NULL)
+    {
+      task_return_error (self, task, g_steal_pointer (&error));
+      return;
+    }
+
   digest = g_checksum_get_string (sha256sum);
   if (g_strcmp0 (digest, checksum_data->expected_checksum) != 0)
     {
@@ -1240,11 +2300,6 @@ gis_scribe_begin_verify_checksum (GisScribe           *self,
 {
   g_autoptr(GTask) task = g_task_new (self, cancellable, callback, data);
   GisScribeChecksumData *task_data = g_slice_new0 (GisScribeChecksumData);
-  g_autofree gchar *checksum_path = g_file_get_path (self->checksum);
-  g_autofree gchar *checksum_contents = NULL;
-  g_auto(GStrv) checksum_words = NULL;
-  gsize checksum_len;
-  gchar *cur;
   gint pipefd[2];
   g_autoptr(GError) error = NULL;
 
@@ -1252,65 +2307,142 @@ gis_scribe_begin_verify_checksum (GisScribe           *self,
   g_task_set_task_data (task, task_data,
                         (GDestroyNotify) gis_scribe_checksum_data_free);
 
-  if (!g_file_query_exists (self->checksum, NULL))
+  task_data->expected_checksum =
+    gis_image_verifier_read_checksum_file (self->checksum, cancellable, &error);
+  if (task_data->expected_checksum == NULL)
     {
-      task_return_new_error (
-          self, task, GIS_IMAGE_ERROR, GIS_IMAGE_ERROR_VERIFICATION_FAILED,
-          _("The checksum file ‘%s’ does not exist."),
-          checksum_path);
+      task_return_error (self, task, g_steal_pointer (&error));
       return NULL;
     }
 
-  /* Read in the checksum file to get the expected checksum. */
-  if (!g_file_load_contents (self->checksum, cancellable, &checksum_contents,
-                             &checksum_len, NULL, &error))
+  if (!g_unix_open_pipe (pipefd, FD_CLOEXEC, &error))
     {
       task_return_error (self, task, g_steal_pointer (&error));
-      return NULL;
+      return FALSE;
+    }
+
+  task_data->input = g_unix_input_stream_new (pipefd[0], TRUE);
+  g_task_run_in_thread (task, checksum_in_thread);
+
+  return g_unix_output_stream_new (pipefd[1], TRUE);
+}
+
+/* Reads the image from the verify pipe a chunk at a time, and checks the
+ * chunks against the manifest in parallel, so that verification is not
+ * limited to the speed of one core.
+ */
+static void
+manifest_in_thread (GTask        *task,
+                    gpointer      source,
+                    gpointer      task_data,
+                    GCancellable *cancellable)
+{
+  GisScribe *self = source;
+  GInputStream *input = G_INPUT_STREAM (task_data);
+  g_autoptr(GisChunkManifest) manifest = NULL;
+  g_autoptr(GisChunkVerifier) chunks = NULL;
+  gsize chunk_size;
+  guint64 image_size;
+  guint64 bytes_received = 0;
+  GisPerfStage *stats;
+  gint64 before_usec;
+  gboolean ok = TRUE;
+  g_autoptr(GError) error = NULL;
+  g_autoptr(GisSchedScope) sched = gis_sched_enter (GIS_SCHED_STAGE_VERIFY);
+
+  if (!gis_chunk_manifest_verify_signature (self->manifest, self->keyring_path,
+                                            self->gpg_path, cancellable,
+                                            &error))
+    {
+      task_return_error (self, task, g_steal_pointer (&error));
+      return;
     }
 
-  g_strstrip (checksum_contents);
-  checksum_words = g_strsplit (checksum_contents, " ", -1);
-  if (checksum_words[0] == NULL)
+  manifest = gis_chunk_manifest_load (self->manifest, cancellable, &error);
+  if (manifest == NULL)
     {
-      task_return_new_error (
-          self, task, GIS_IMAGE_ERROR, GIS_IMAGE_ERROR_VERIFICATION_FAILED,
-          _("The checksum file ‘%s’ does not contain a checksum."),
-          checksum_path);
-      return NULL;
+      task_return_error (self, task, g_steal_pointer (&error));
+      return;
     }
 
-  if (strlen (checksum_words[0]) != CHECKSUM_STRLEN)
+  chunks = gis_chunk_verifier_new (manifest, self->buffers);
+  chunk_size = gis_chunk_manifest_get_chunk_size (manifest);
+  image_size = gis_chunk_manifest_get_image_size (manifest);
+
+  /* Hashing happens in the verifier's pool; time spent pushing into it,
+   * including waiting for it to catch up, counts as busy.
+   */
+  stats = gis_scribe_stage_begin (self, GIS_SCHED_STAGE_VERIFY, TRUE);
+
+  for (;;)
     {
-      task_return_new_error (
-          self, task, GIS_IMAGE_ERROR, GIS_IMAGE_ERROR_VERIFICATION_FAILED,
-          _("The checksum ‘%s’ does not contain %d characters."),
-          checksum_words[0], CHECKSUM_STRLEN);
-      return NULL;
+      guint8 *buf = gis_buffer_pool_acquire (self->buffers, chunk_size);
+      gsize len;
+
+      before_usec = g_get_monotonic_time ();
+      ok = g_input_stream_read_all (input, buf, chunk_size, &len,
+                                    cancellable, &error);
+      stats->stalled_usec += g_get_monotonic_time () - before_usec;
+
+      if (!ok || len == 0)
+        {
+          gis_buffer_pool_release (self->buffers, buf);
+          break;
+        }
+
+      bytes_received += len;
+
+      before_usec = g_get_monotonic_time ();
+      ok = gis_chunk_verifier_push (chunks, buf, len, &error);
+      stats->busy_usec += g_get_monotonic_time () - before_usec;
+      if (!ok)
+        break;
+
+      if (image_size > 0)
+        self->verify_progress =
+          (gdouble) gis_chunk_verifier_get_bytes_verified (chunks) / image_size;
+    }
+
+  if (ok)
+    {
+      before_usec = g_get_monotonic_time ();
+      ok = gis_chunk_verifier_finish (chunks, &error);
+      stats->busy_usec += g_get_monotonic_time () - before_usec;
     }
 
-  for (cur = checksum_words[0]; cur && *cur; cur++)
+  gis_scribe_stage_end (self, GIS_SCHED_STAGE_VERIFY, bytes_received);
+
+  if (!ok)
     {
-      if (!g_ascii_isxdigit (*cur)) {
-        task_return_new_error (
-            self, task, GIS_IMAGE_ERROR, GIS_IMAGE_ERROR_VERIFICATION_FAILED,
-            _("The checksum ‘%s’ contains invalid character ‘%c’."),
-            checksum_words[0], *cur);
-        return NULL;
-      }
+      task_return_error (self, task, g_steal_pointer (&error));
+      return;
     }
 
-  g_strlcpy (task_data->expected_checksum, checksum_words[0],
-             sizeof (task_data->expected_checksum));
+  self->verify_progress = 1;
+  g_task_return_boolean (task, TRUE);
+}
+
+static GOutputStream *
+gis_scribe_begin_verify_manifest (GisScribe           *self,
+                                  GCancellable        *cancellable,
+                                  GAsyncReadyCallback  callback,
+                                  gpointer             data)
+{
+  g_autoptr(GTask) task = g_task_new (self, cancellable, callback, data);
+  gint pipefd[2];
+  g_autoptr(GError) error = NULL;
+
+  g_task_set_source_tag (task, GUINT_TO_POINTER (GIS_SCRIBE_TASK_VERIFY));
 
   if (!g_unix_open_pipe (pipefd, FD_CLOEXEC, &error))
     {
       task_return_error (self, task, g_steal_pointer (&error));
-      return FALSE;
+      return NULL;
     }
 
-  task_data->input = g_unix_input_stream_new (pipefd[0], TRUE);
-  g_task_run_in_thread (task, checksum_in_thread);
+  g_task_set_task_data (task, g_unix_input_stream_new (pipefd[0], TRUE),
+                        g_object_unref);
+  g_task_run_in_thread (task, manifest_in_thread);
 
   return g_unix_output_stream_new (pipefd[1], TRUE);
 }
@@ -1356,15 +2488,25 @@ gis_scribe_tee_thread (GTask            *task,
                        GCancellable     *cancellable)
 {
   GisScribe *self = GIS_SCRIBE (source_object);
-  g_autofree gchar *buffer = gis_scribe_malloc_aligned (BUFFER_SIZE);
+  gchar *buffer = gis_buffer_pool_acquire (self->buffers, BUFFER_SIZE);
   g_autoptr(GError) error = NULL;
   guint64 bytes_teed = 0;
   gssize r = -1;
+  g_autoptr(GisSchedScope) sched = gis_sched_enter (GIS_SCHED_STAGE_READ);
+  GisPerfStage *stats = gis_scribe_stage_begin (self, GIS_SCHED_STAGE_READ,
+                                                TRUE);
+  gint64 before_usec;
+  GisTraceSpan *span;
 
   do
     {
+      before_usec = g_get_monotonic_time ();
+      span = gis_trace_begin ("tee", "read");
       r = g_input_stream_read (task_data->image_input, buffer, BUFFER_SIZE,
                                cancellable, &error);
+      gis_trace_span_set_arg (span, "bytes", r);
+      gis_trace_end (span);
+      stats->busy_usec += g_get_monotonic_time () - before_usec;
 
       if (r < 0)
         {
@@ -1372,10 +2514,17 @@ gis_scribe_tee_thread (GTask            *task,
           break;
         }
 
+      /* Time spent here is time the verifier or decompressor kept the tee
+       * waiting.
+       */
+      before_usec = g_get_monotonic_time ();
+      span = gis_trace_begin ("tee", "forward");
+
       if (!g_output_stream_write_all (task_data->verify_pipe, buffer, r,
                                       NULL, cancellable, &error))
         {
           g_prefix_error (&error, "error writing image to verifier: ");
+          gis_trace_end (span);
           break;
         }
 
@@ -1383,13 +2532,25 @@ gis_scribe_tee_thread (GTask            *task,
                                       NULL, cancellable, &error))
         {
           g_prefix_error (&error, "error writing image to self: ");
+          gis_trace_end (span);
           break;
         }
 
+      gis_trace_span_set_arg (span, "bytes", r);
+      gis_trace_end (span);
+      stats->stalled_usec += g_get_monotonic_time () - before_usec;
+
       bytes_teed += r;
+
+      g_mutex_lock (&self->mutex);
+      self->bytes_read = bytes_teed;
+      g_mutex_unlock (&self->mutex);
     }
   while (r > 0);
 
+  gis_buffer_pool_release (self->buffers, buffer);
+  gis_scribe_stage_end (self, GIS_SCHED_STAGE_READ, bytes_teed);
+
   if (error == NULL && bytes_teed != self->compressed_size_bytes)
     g_set_error (&error, GIS_INSTALL_ERROR, GIS_INSTALL_ERROR_INTERNAL_ERROR,
                  "%s: teed %" G_GUINT64_FORMAT " bytes but "
@@ -1405,6 +2566,15 @@ gis_scribe_tee_thread (GTask            *task,
   gis_scribe_tee_close (task_data, cancellable);
 }
 
+/* Squashfs images, as found on ISOs, hold the disk image uncompressed at
+ * GIS_SQUASHFS_IMAGE_PATH, which is read out of them directly.
+ */
+static gboolean
+gis_scribe_image_is_squashfs (GisScribe *self)
+{
+  return self->format->id == GIS_IMAGE_FORMAT_SQUASHFS;
+}
+
 static void
 gis_scribe_begin_tee (GisScribe          *self,
                       GOutputStream      *verify_pipe,
@@ -1427,8 +2597,9 @@ gis_scribe_begin_tee (GisScribe          *self,
   if (self->image_input != NULL)
     task_data->image_input = g_steal_pointer (&self->image_input);
   else
-    task_data->image_input =
-      G_INPUT_STREAM (g_file_read (self->image, cancellable, &error));
+    task_data->image_input = self->format->open (self->image, 0,
+                                                 self->buffers, cancellable,
+                                                 &error);
 
   if (task_data->image_input == NULL)
     {
@@ -1451,6 +2622,16 @@ gis_scribe_decompress_wait_check_cb (GObject      *source,
   GisScribe *self = GIS_SCRIBE (g_task_get_source_object (task));
   g_autoptr(GError) error = NULL;
 
+  g_mutex_lock (&self->mutex);
+  g_clear_object (&self->decompress_subprocess);
+  g_mutex_unlock (&self->mutex);
+
+  /* Its output is counted by the write thread; see gis_scribe_build_report() */
+  gis_scribe_stage_end (self, GIS_SCHED_STAGE_DECODE, 0);
+
+  /* Ends the span begun by gis_scribe_begin_decompress() */
+  g_task_set_task_data (task, NULL, NULL);
+
   if (g_subprocess_wait_check_finish (subprocess, result, &error))
     {
       g_task_return_boolean (task, TRUE);
@@ -1464,17 +2645,15 @@ gis_scribe_decompress_wait_check_cb (GObject      *source,
     }
 }
 
-
 /* Spawns a subprocess to decompress the image. This function returns %TRUE
  * with @compressed and @decompressed set if spawning the subprocess succeeds;
  * and %FALSE with both unset if not. In either case, callback will fire when
  * the subprocess terminates (which may be immediately).
  *
- * The appropriate decompressor is determined from the image file name. If it's
- * uncompressed, @compressed and @decompressed will be the two ends of a
- * pipe-to-self and no subprocess will be launched. (@callback will fire with
- * success.) If the decompressor can't be determined, returns %FALSE and fires
- * @callback with error.
+ * The decompressor is that of the image's format, found by
+ * gis_scribe_write_async(). If it's uncompressed, @compressed and
+ * @decompressed will be the two ends of a pipe-to-self and no subprocess will
+ * be launched. (@callback will fire with success.)
  *
  * @compressed: (out): socket to write compressed image data to
  * @decompressed: (out): socket to read decompressed image data from
@@ -1488,42 +2667,17 @@ gis_scribe_begin_decompress (GisScribe          *self,
                              gpointer            user_data)
 {
   g_autoptr(GTask) task = g_task_new (self, cancellable, callback, user_data);
-  g_autofree gchar *basename = NULL;
-  const gchar *args[] = { NULL, "-cd", NULL };
+  const gchar *args[] = { self->format->decompressor, "-cd", NULL };
   g_autoptr(GSubprocessLauncher) launcher = NULL;
   GSubprocess *subprocess = NULL;
   g_autoptr(GError) error = NULL;
 
   g_task_set_source_tag (task, GUINT_TO_POINTER (GIS_SCRIBE_TASK_DECOMPRESS));
 
-  basename = g_file_get_basename (self->image);
-  if (basename == NULL)
-    {
-      /* This path should not be reached since g_file_get_basename() cannot
-       * return NULL for local files. To avoid translators translating a
-       * technical message which should never be shown, we only mark "Internal
-       * error" for translation.
-       */
-      g_set_error (&error, GIS_INSTALL_ERROR, GIS_INSTALL_ERROR_INTERNAL_ERROR,
-                   "%s: %s",
-                   _("Internal error"),
-                   "g_file_get_basename returned NULL.");
-      g_critical ("%s", error->message);
-      task_return_error (self, task, g_steal_pointer (&error));
-      return FALSE;
-    }
-
-  /* TODO: use more magical means */
-  if (g_str_has_suffix (basename, "gz"))
-    {
-      args[0] = "gzip";
-    }
-  else if (g_str_has_suffix (basename, "xz"))
-    {
-      args[0] = "xz";
-    }
-  else if (g_str_has_suffix (basename, "img")
-           || g_strcmp0 (basename, "endless-image") == 0)
+  /* Disk images stored as they are, possibly within a container, are passed
+   * straight through a pipe.
+   */
+  if (self->format->decompressor == NULL)
     {
       gint pipefd[2];
 
@@ -1538,21 +2692,10 @@ gis_scribe_begin_decompress (GisScribe          *self,
       g_task_return_boolean (task, TRUE);
       return TRUE;
     }
-  else
-    {
-      /* This should not be reachable, because only images with known
-       * extensions are shown on the image selection page.
-       */
-      task_return_new_error (self, task, GIS_INSTALL_ERROR,
-                             GIS_INSTALL_ERROR_INTERNAL_ERROR,
-                             "%s: ‘%s’ ends in neither ‘.xz’, ‘.gz’ nor ‘.img’.",
-                             _("Internal error"),
-                             basename);
-      return FALSE;
-    }
 
   launcher = g_subprocess_launcher_new (G_SUBPROCESS_FLAGS_STDIN_PIPE |
                                         G_SUBPROCESS_FLAGS_STDOUT_PIPE);
+  gis_sched_setup_launcher (launcher, GIS_SCHED_STAGE_DECODE);
   subprocess = g_subprocess_launcher_spawnv (launcher, args, &error);
   if (subprocess == NULL)
     {
@@ -1560,16 +2703,70 @@ gis_scribe_begin_decompress (GisScribe          *self,
       return FALSE;
     }
 
+  g_task_set_task_data (task,
+                        gis_trace_begin ("subprocess",
+                                         self->format->decompressor),
+                        (GDestroyNotify) gis_trace_end);
+  gis_scribe_stage_begin (self, GIS_SCHED_STAGE_DECODE, FALSE);
+
   *compressed = g_object_ref (g_subprocess_get_stdin_pipe (subprocess));
   *decompressed = g_object_ref (g_subprocess_get_stdout_pipe (subprocess));
 
-  g_subprocess_wait_check_async (subprocess, cancellable,
+  g_mutex_lock (&self->mutex);
+  self->decompress_subprocess = g_object_ref (subprocess);
+  g_mutex_unlock (&self->mutex);
+
+  /* As for GPG, this is killed rather than abandoned if the write is
+   * cancelled.
+   */
+  g_subprocess_wait_check_async (subprocess, NULL,
                                  gis_scribe_decompress_wait_check_cb,
                                  g_steal_pointer (&task));
 
   return TRUE;
 }
 
+/* Called in whichever thread cancels the write, or from
+ * gis_scribe_begin_pipeline() if it was cancelled already. The worker threads
+ * notice cancellation by themselves, between chunks or while waiting on a pipe,
+ * and then close their pipes; but GPG and the decompressor would only notice
+ * once they next read or write a pipe, so are killed at once.
+ */
+static void
+gis_scribe_cancelled_cb (GCancellable *cancellable,
+                         gpointer      data)
+{
+  GisScribe *self = GIS_SCRIBE (data);
+
+  g_mutex_lock (&self->mutex);
+  g_message ("write cancelled; stopping");
+  if (self->gpg_subprocess != NULL)
+    g_subprocess_force_exit (self->gpg_subprocess);
+  if (self->decompress_subprocess != NULL)
+    g_subprocess_force_exit (self->decompress_subprocess);
+  g_mutex_unlock (&self->mutex);
+}
+
+/* Called once the write has succeeded or failed, and nothing more is running:
+ * either every subtask has finished, or verifying the image before writing
+ * it failed.
+ */
+static void
+gis_scribe_finish (GisScribe    *self,
+                   const GError *error)
+{
+  self->report = gis_scribe_build_report (self, error);
+  g_message ("%s", self->report);
+
+  if (self->latency != NULL)
+    {
+      gis_scribe_log_latency (self);
+      g_clear_pointer (&self->latency, gis_latency_monitor_free);
+    }
+
+  g_clear_pointer (&self->span, gis_trace_end);
+}
+
 static void
 gis_scribe_subtask_cb (GObject      *source,
                        GAsyncResult *result,
@@ -1581,6 +2778,8 @@ gis_scribe_subtask_cb (GObject      *source,
   GisScribeTask task_flag = GPOINTER_TO_INT (g_task_get_source_tag (inner_task));
   const gchar *inner_task_name = gis_scribe_task_get_label (task_flag);
   g_autoptr(GError) error = NULL;
+  g_autoptr(GError) outer_error = NULL;
+  gboolean done;
 
   /* Guard access to self->outstanding_tasks and self->error. */
   g_mutex_lock (&self->mutex);
@@ -1603,88 +2802,69 @@ gis_scribe_subtask_cb (GObject      *source,
   g_assert_cmpint (self->outstanding_tasks & task_flag, ==, task_flag);
   self->outstanding_tasks &= ~task_flag;
 
-  if (self->outstanding_tasks == 0)
-    {
-      if (self->error == NULL)
-        g_task_return_boolean (outer_task, TRUE);
-      else
-        /* could steal self->error since all subtasks are now dead but it's
-         * useful to know that once set, it remains set until destruction.
-         */
-        g_task_return_error (outer_task, g_error_copy (self->error));
-    }
+  done = self->outstanding_tasks == 0;
+  /* could steal self->error since all subtasks are now dead but it's useful
+   * to know that once set, it remains set until destruction.
+   */
+  if (done && self->error != NULL)
+    outer_error = g_error_copy (self->error);
 
   /* Alert the write thread, if it's already waiting, that
    * self->outstanding_tasks and self->error have been updated.
    */
   g_cond_signal (&self->cond);
   g_mutex_unlock (&self->mutex);
+
+  if (!done)
+    return;
+
+  gis_scribe_finish (self, outer_error);
+
+  /* Every thread and subprocess has finished, so there is nothing left to
+   * cancel. This may block until gis_scribe_cancelled_cb() returns, so must
+   * not be called with the mutex held.
+   */
+  if (self->cancelled_id != 0)
+    {
+      g_cancellable_disconnect (g_task_get_cancellable (outer_task),
+                                self->cancelled_id);
+      self->cancelled_id = 0;
+    }
+
+  if (outer_error == NULL)
+    g_task_return_boolean (outer_task, TRUE);
+  else
+    g_task_return_error (outer_task, g_steal_pointer (&outer_error));
 }
 
 static void
-gis_scribe_setpipe_sz (const gchar          *what,
+gis_scribe_setpipe_sz (GisScribe            *self,
+                       const gchar          *what,
                        GFileDescriptorBased *stream)
 {
   int fd = g_file_descriptor_based_get_fd (stream);
 
-  if (fcntl (fd, F_SETPIPE_SZ, BUFFER_SIZE) < 0)
+  if (self->pipe_size == 0)
+    return;
+
+  if (fcntl (fd, F_SETPIPE_SZ, self->pipe_size) < 0)
     g_warning ("failed to set %s pipe size to %d: %s",
-               what, BUFFER_SIZE, g_strerror (errno));
+               what, self->pipe_size, g_strerror (errno));
 }
 
-/**
- * gis_scribe_write_async:
- *
- * Begins writing #GisScribe:image to #GisScribe:drive-fd. This may be called
- * at most once on any given #GisScribe object. Once called, the target drive's
- * contents should be considered lost, even if @cancellable is subsequently
- * triggered.
+/* Starts the decompress, verify (using @verify_method), tee and write
+ * subtasks, which will return @task once they have all completed.
  */
-void
-gis_scribe_write_async (GisScribe          *self,
-                        GCancellable       *cancellable,
-                        GAsyncReadyCallback callback,
-                        gpointer            user_data)
+static void
+gis_scribe_begin_pipeline (GisScribe             *self,
+                           GTask                 *task,
+                           GisScribeVerifyMethod  verify_method)
 {
-  g_autoptr(GTask) task = g_task_new (self, cancellable, callback, user_data);
-  gboolean verify_gpg;
+  GCancellable *cancellable = g_task_get_cancellable (task);
   g_autoptr(GInputStream) decompressed = NULL;
   g_autoptr(GOutputStream) write_pipe = NULL;
   g_autoptr(GOutputStream) verify_pipe = NULL;
 
-  if (self->started)
-    {
-      g_task_return_new_error (task, GIS_INSTALL_ERROR,
-                               GIS_INSTALL_ERROR_INTERNAL_ERROR,
-                               "already started");
-      return;
-    }
-
-  /* Make sure one of the verification files exists before starting any
-   * subtasks.
-   */
-  if (g_file_query_exists (self->signature, cancellable))
-    {
-      verify_gpg = TRUE;
-    }
-  else if (g_file_query_exists (self->checksum, cancellable))
-    {
-      verify_gpg = FALSE;
-    }
-  else
-    {
-      g_autofree gchar *signature_path = g_file_get_path (self->signature);
-      g_autofree gchar *checksum_path = g_file_get_path (self->checksum);
-      g_task_return_new_error (
-          task, GIS_IMAGE_ERROR, GIS_IMAGE_ERROR_VERIFICATION_FAILED,
-          _("Neither the signature file ‘%s’ nor the checksum file ‘%s’ exist."),
-          signature_path, checksum_path);
-      return;
-    }
-
-  self->started = TRUE;
-  self->start_time_usec = g_get_monotonic_time ();
-
   /* Attempt to spawn decompressor subprocess (or pipe-to-self) */
   g_mutex_lock (&self->mutex);
   self->outstanding_tasks |= GIS_SCRIBE_TASK_DECOMPRESS;
@@ -1698,17 +2878,31 @@ gis_scribe_write_async (GisScribe          *self,
   g_mutex_lock (&self->mutex);
   self->outstanding_tasks |= GIS_SCRIBE_TASK_VERIFY;
   g_mutex_unlock (&self->mutex);
-  if (verify_gpg)
+  switch (verify_method)
     {
+    case GIS_SCRIBE_VERIFY_GPG:
+      self->verify_policy = "signature, while writing";
       verify_pipe = gis_scribe_begin_verify_gpg (self, cancellable,
                                                  gis_scribe_subtask_cb,
                                                  g_object_ref (task));
-    }
-  else
-    {
+      break;
+
+    case GIS_SCRIBE_VERIFY_CHECKSUM:
+      self->verify_policy = "checksum, while writing";
       verify_pipe = gis_scribe_begin_verify_checksum (self, cancellable,
                                                       gis_scribe_subtask_cb,
                                                       g_object_ref (task));
+      break;
+
+    case GIS_SCRIBE_VERIFY_MANIFEST:
+      self->verify_policy = "chunk manifest, while writing";
+      verify_pipe = gis_scribe_begin_verify_manifest (self, cancellable,
+                                                      gis_scribe_subtask_cb,
+                                                      g_object_ref (task));
+      break;
+
+    default:
+      g_assert_not_reached ();
     }
 
   if (verify_pipe == NULL)
@@ -1720,9 +2914,15 @@ gis_scribe_write_async (GisScribe          *self,
       return;
     }
 
-  gis_scribe_setpipe_sz ("verify input", G_FILE_DESCRIPTOR_BASED (verify_pipe));
-  gis_scribe_setpipe_sz ("decompressor stdin", G_FILE_DESCRIPTOR_BASED (write_pipe));
-  gis_scribe_setpipe_sz ("decompressor stdout", G_FILE_DESCRIPTOR_BASED (decompressed));
+  gis_scribe_setpipe_sz (self, "verify input", G_FILE_DESCRIPTOR_BASED (verify_pipe));
+  gis_scribe_setpipe_sz (self, "decompressor stdin", G_FILE_DESCRIPTOR_BASED (write_pipe));
+  gis_scribe_setpipe_sz (self, "decompressor stdout", G_FILE_DESCRIPTOR_BASED (decompressed));
+
+  /* Every subprocess has been spawned, so can now be killed on cancellation */
+  if (cancellable != NULL)
+    self->cancelled_id = g_cancellable_connect (cancellable,
+                                                G_CALLBACK (gis_scribe_cancelled_cb),
+                                                self, NULL);
 
   /* Start feeding the image to the verification pipe and to one end of a
    * pipe-to-self
@@ -1741,6 +2941,252 @@ gis_scribe_write_async (GisScribe          *self,
                           gis_scribe_subtask_cb, g_object_ref (task));
 }
 
+/* Called once per second while verifying the image before writing it.
+ */
+static gboolean
+gis_scribe_update_verify_first_progress (gpointer data)
+{
+  GisScribe *self = GIS_SCRIBE (data);
+  gdouble progress = gis_image_verifier_get_progress (self->verifier);
+
+  /* GPG may not be able to tell */
+  if (progress < 0)
+    progress = 0;
+
+  progress *= self->verify_first_fraction;
+  if (progress != self->overall_progress)
+    {
+      self->overall_progress = progress;
+      g_object_notify_by_pspec (G_OBJECT (self), props[PROP_PROGRESS]);
+    }
+
+  return G_SOURCE_CONTINUE;
+}
+
+static void
+gis_scribe_verify_first_cb (GObject      *source,
+                            GAsyncResult *result,
+                            gpointer      user_data)
+{
+  GisImageVerifier *verifier = GIS_IMAGE_VERIFIER (source);
+  g_autoptr(GTask) task = G_TASK (user_data);
+  GisScribe *self = GIS_SCRIBE (g_task_get_source_object (task));
+  g_autoptr(GError) error = NULL;
+
+  g_source_remove (self->verify_first_progress_id);
+  self->verify_first_progress_id = 0;
+
+  if (!gis_image_verifier_verify_finish (verifier, result, &error))
+    {
+      /* The drive has not been touched */
+      g_clear_object (&self->verifier);
+      gis_scribe_finish (self, error);
+      task_return_error (self, task, g_steal_pointer (&error));
+      return;
+    }
+
+  g_message ("image verified in %.1f seconds; writing it",
+             (gdouble) (g_get_monotonic_time () - self->start_time_usec)
+             / G_USEC_PER_SEC);
+  g_clear_object (&self->verifier);
+
+  self->overall_progress = self->verify_first_fraction;
+  g_object_notify_by_pspec (G_OBJECT (self), props[PROP_PROGRESS]);
+
+  /* The image is read again to write it, and it is what is read then which
+   * must match, so it is verified again as it is written.
+   */
+  gis_scribe_begin_pipeline (self, task, self->verify_method);
+}
+
+/* Divides the memory budget between the pipes between stages and the buffers
+ * used by the worker threads. Enlarging the pipes lets each stage run further
+ * ahead of the next, but the kernel's memory for them is just as scarce, so
+ * they are only enlarged if the budget allows.
+ */
+static void
+gis_scribe_init_buffers (GisScribe *self)
+{
+  guint64 budget = self->memory_budget;
+  guint64 pipes = (guint64) N_PIPES * BUFFER_SIZE;
+
+  if (self->buffers != NULL)
+    return;
+
+  if (budget == 0)
+    budget = gis_buffer_pool_get_default_budget ();
+
+  if (budget >= GIS_BUFFER_POOL_MIN_BUDGET + pipes)
+    {
+      self->pipe_size = BUFFER_SIZE;
+      budget -= pipes;
+    }
+  else
+    {
+      self->pipe_size = 0;
+    }
+
+  self->buffers = gis_buffer_pool_new (budget);
+}
+
+/**
+ * gis_scribe_write_async:
+ *
+ * Begins writing #GisScribe:image to #GisScribe:drive-fd. This may be called
+ * at most once on any given #GisScribe object. Once called, the target drive's
+ * contents should be considered lost, even if @cancellable is subsequently
+ * triggered, unless #GisScribe:verify-first is set and verification fails.
+ *
+ * If @cancellable is triggered before the image has been written in full, the
+ * write fails with %G_IO_ERROR_CANCELLED once every thread and subprocess has
+ * stopped, which should take well under a second. The first MiB of the drive
+ * is zeroed before anything else is written to it, and only written last, so
+ * a partly-written drive will not boot.
+ *
+ * If the drive is larger than the image, the image's GPT is rewritten as it
+ * is written, so that it spans the whole drive, with the backup GPT at the
+ * end of the drive.
+ */
+void
+gis_scribe_write_async (GisScribe          *self,
+                        GCancellable       *cancellable,
+                        GAsyncReadyCallback callback,
+                        gpointer            user_data)
+{
+  g_autoptr(GTask) task = g_task_new (self, cancellable, callback, user_data);
+  g_autoptr(GisImageVerifier) verifier = NULL;
+  g_autoptr(GFile) manifest_signature = NULL;
+  GisScribeVerifyMethod verify_method;
+  g_autoptr(GError) error = NULL;
+
+  if (self->started)
+    {
+      g_task_return_new_error (task, GIS_INSTALL_ERROR,
+                               GIS_INSTALL_ERROR_INTERNAL_ERROR,
+                               "already started");
+      return;
+    }
+
+  /* The decompressor is chosen by the image's contents. Images on a server
+   * can't be read until they are written, so go by their names, which the
+   * image page has checked agree with their contents.
+   */
+  if (g_file_is_native (self->image))
+    {
+      self->format = gis_image_format_detect_file (self->image, cancellable,
+                                                   &error);
+      if (self->format == NULL)
+        {
+          g_task_return_error (task, g_steal_pointer (&error));
+          return;
+        }
+    }
+  else
+    {
+      g_autofree gchar *uri = g_file_get_uri (self->image);
+
+      self->format = gis_image_format_guess (uri);
+    }
+
+  g_message ("image is in %s format", self->format->name);
+
+  /* Make sure one of the verification files exists before starting any
+   * subtasks.
+   */
+  if (self->manifest != NULL)
+    manifest_signature = gis_chunk_manifest_get_signature_file (self->manifest);
+
+  if (manifest_signature != NULL &&
+      g_file_query_exists (self->manifest, cancellable) &&
+      g_file_query_exists (manifest_signature, cancellable))
+    {
+      verify_method = GIS_SCRIBE_VERIFY_MANIFEST;
+    }
+  else if (g_file_query_exists (self->signature, cancellable))
+    {
+      verify_method = GIS_SCRIBE_VERIFY_GPG;
+    }
+  else if (g_file_query_exists (self->checksum, cancellable))
+    {
+      verify_method = GIS_SCRIBE_VERIFY_CHECKSUM;
+    }
+  else
+    {
+      g_autofree gchar *signature_path = g_file_get_path (self->signature);
+      g_autofree gchar *checksum_path = g_file_get_path (self->checksum);
+      g_task_return_new_error (
+          task, GIS_IMAGE_ERROR, GIS_IMAGE_ERROR_VERIFICATION_FAILED,
+          _("Neither the signature file ‘%s’ nor the checksum file ‘%s’ exist."),
+          signature_path, checksum_path);
+      return;
+    }
+
+  gis_scribe_init_buffers (self);
+
+  /* The image may have been verified before we were asked to write it (see
+   * gis_image_prewarm_start()), in which case it need not be verified before
+   * writing it too. It is always verified as it is written, though: the
+   * record of past verifications only goes by the file's size and
+   * modification time, and what is read now is what must match.
+   *
+   * Tests, and images on a server (see gis_http_source_open()), provide
+   * their own input stream, which is read only once, so is never verified
+   * first. Squashfs images are signed over the disk image within them rather
+   * than the file itself, so can only be verified as that is read out.
+   */
+  if (self->verify_first && self->image_input == NULL &&
+      !gis_scribe_image_is_squashfs (self))
+    {
+      /* Verifying is over before writing begins, so it can have the whole
+       * budget.
+       */
+      verifier = g_object_new (GIS_TYPE_IMAGE_VERIFIER,
+                               "image", self->image,
+                               "signature", self->signature,
+                               "checksum", self->checksum,
+                               "manifest", self->manifest,
+                               "keyring-path", self->keyring_path,
+                               "gpg-path", self->gpg_path,
+                               "buffer-pool", self->buffers,
+                               NULL);
+
+      if (gis_image_verifier_is_verified (verifier))
+        {
+          g_message ("image has already been verified; checking it only as "
+                     "it is written");
+          g_clear_object (&verifier);
+        }
+    }
+
+  self->started = TRUE;
+  self->verify_method = verify_method;
+  self->start_time_usec = g_get_monotonic_time ();
+  self->latency = gis_latency_monitor_new ();
+  self->span = gis_trace_begin ("scribe", "write image");
+
+  if (verifier != NULL)
+    {
+      /* Verifying first means reading the compressed image once more before
+       * writing out the uncompressed image; weight step 1 by the number of
+       * bytes each pass handles.
+       */
+      self->verify_first_fraction =
+        (gdouble) self->compressed_size_bytes /
+        (gdouble) (self->compressed_size_bytes + self->image_size_bytes);
+      self->verifier = g_steal_pointer (&verifier);
+      self->verify_first_progress_id =
+        g_timeout_add_seconds (1, gis_scribe_update_verify_first_progress, self);
+
+      g_message ("verifying image before writing it");
+      gis_image_verifier_verify_async (self->verifier, cancellable,
+                                       gis_scribe_verify_first_cb,
+                                       g_steal_pointer (&task));
+      return;
+    }
+
+  gis_scribe_begin_pipeline (self, task, self->verify_method);
+}
+
 /**
  * gis_scribe_write_finish:
  *
@@ -1756,6 +3202,39 @@ gis_scribe_write_finish (GisScribe    *self,
   return g_task_propagate_boolean (task, error);
 }
 
+/**
+ * gis_scribe_get_report:
+ *
+ * Returns: (nullable): a description of how the write went, including the
+ *  throughput of each stage and the devices involved, once
+ *  gis_scribe_write_async() has completed; or %NULL if it failed before
+ *  writing began.
+ */
+const gchar *
+gis_scribe_get_report (GisScribe *self)
+{
+  g_return_val_if_fail (GIS_IS_SCRIBE (self), NULL);
+
+  return self->report;
+}
+
+/**
+ * gis_scribe_get_image_checksum:
+ *
+ * Returns: the SHA-256 checksum of the decompressed image, as a hex string,
+ *  if #GisScribe:hash-image was set and the image was written successfully;
+ *  or %NULL. This is the checksum of what was written to the drive, unless
+ *  #GisScribe:convert-to-mbr was set or the drive is larger than the image,
+ *  in which case the partition table was rewritten.
+ */
+const gchar *
+gis_scribe_get_image_checksum (GisScribe *self)
+{
+  g_return_val_if_fail (GIS_IS_SCRIBE (self), NULL);
+
+  return self->image_checksum;
+}
+
 /**
  * gis_scribe_get_step:
  *
@@ -1781,3 +3260,34 @@ gis_scribe_get_progress (GisScribe *self)
 
   return self->overall_progress;
 }
+
+/**
+ * gis_scribe_get_buffer_pool:
+ *
+ * Returns the pool which the scribe takes its buffers from, creating it within
+ * #GisScribe:memory-budget if writing hasn't begun. A #GisScribe:image-input
+ * which reads ahead should take its buffers from this pool too.
+ *
+ * Returns: (transfer none): the pool
+ */
+GisBufferPool *
+gis_scribe_get_buffer_pool (GisScribe *self)
+{
+  g_return_val_if_fail (GIS_IS_SCRIBE (self), NULL);
+
+  gis_scribe_init_buffers (self);
+  return self->buffers;
+}
+
+/**
+ * gis_scribe_get_remaining_seconds:
+ *
+ * Returns: the #GisScribe:remaining-seconds property.
+ */
+gint64
+gis_scribe_get_remaining_seconds (GisScribe *self)
+{
+  g_return_val_if_fail (GIS_IS_SCRIBE (self), -1);
+
+  return self->remaining_seconds;
+}
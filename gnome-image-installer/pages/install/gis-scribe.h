@@ -21,6 +21,8 @@
 
 #include <gio/gio.h>
 
+#include "gis-buffer-pool.h"
+
 G_BEGIN_DECLS
 
 #define GIS_TYPE_SCRIBE (gis_scribe_get_type ())
@@ -47,12 +49,24 @@ gis_scribe_write_finish (GisScribe    *self,
                          GAsyncResult *result,
                          GError      **error);
 
+const gchar *
+gis_scribe_get_report (GisScribe *self);
+
+const gchar *
+gis_scribe_get_image_checksum (GisScribe *self);
+
 guint
 gis_scribe_get_step (GisScribe *self);
 
 gdouble
 gis_scribe_get_progress (GisScribe *self);
 
+gint64
+gis_scribe_get_remaining_seconds (GisScribe *self);
+
+GisBufferPool *
+gis_scribe_get_buffer_pool (GisScribe *self);
+
 G_END_DECLS
 
 #endif /* GIS_SCRIBE_H */
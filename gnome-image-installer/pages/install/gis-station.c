@@ -0,0 +1,775 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*- */
+/*
+ * Copyright © 2018 Endless Mobile, Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Unattended "station" mode: rather than writing the image to one drive and
+ * finishing, wait for drives to be plugged in and write the image to each in
+ * turn (or concurrently), logging the outcome for each drive.
+ */
+
+#include "config.h"
+#include "gis-station.h"
+
+#include <gio/gunixfdlist.h>
+#include <glib/gstdio.h>
+
+#include "gis-buffer-pool.h"
+#include "gis-chunk-manifest.h"
+#include "gis-image-cache.h"
+#include "gis-scribe.h"
+#include "gis-store.h"
+
+typedef enum {
+  /* The image is written directly, either because it is not compressed or
+   * because the decompressed cache could not be created.
+   */
+  GIS_STATION_CACHE_NONE,
+  /* The image is being decompressed to the cache. Drives which appear in the
+   * meantime wait for it to finish.
+   */
+  GIS_STATION_CACHE_PREPARING,
+  /* The decompressed image is cached and has a checksum. */
+  GIS_STATION_CACHE_READY,
+} GisStationCacheState;
+
+typedef struct _GisStation {
+  GObject parent;
+
+  UDisksClient *client;
+  GisUnattendedConfig *config;
+
+  GFile *image;
+  guint64 image_size;
+  guint64 compressed_size;
+  GFile *signature;
+  GFile *checksum;
+  /* Where per-drive logs are written; may be NULL */
+  GFile *log_dir;
+
+  GCancellable *cancellable;
+  gulong object_added_id;
+  gulong object_removed_id;
+
+  /* Owned object path => unowned GisStationJob *, for each drive being
+   * written. Jobs remove themselves when they complete.
+   */
+  GHashTable *jobs;
+  /* GisStationJob *s which are waiting for the cache to be ready, or for
+   * another drive to finish
+   */
+  GQueue waiting;
+  /* How many drives are being written, and the most which may be at once so
+   * that each has at least GIS_BUFFER_POOL_MIN_BUDGET of the memory budget
+   */
+  guint n_writing;
+  guint max_writing;
+
+  GisStationCacheState cache_state;
+  GisImageCache *cache;
+
+  guint n_succeeded;
+  guint n_failed;
+} GisStation;
+
+G_DEFINE_TYPE (GisStation, gis_station, G_TYPE_OBJECT)
+
+typedef enum {
+  PROP_N_ACTIVE = 1,
+  PROP_N_SUCCEEDED,
+  PROP_N_FAILED,
+  N_PROPERTIES
+} GisStationPropertyId;
+
+static GParamSpec *props[N_PROPERTIES] = { 0 };
+
+typedef struct {
+  GisStation *station;
+  gchar *object_path;
+  gchar *device;
+  gchar *description;
+  gchar *serial;
+  gint fd;
+  gboolean from_cache;
+  /* Cancelled if the drive is unplugged before it has been written */
+  GCancellable *cancellable;
+  GisScribe *scribe;
+  GDateTime *started;
+  gint64 start_time_usec;
+} GisStationJob;
+
+static void
+gis_station_job_free (GisStationJob *job)
+{
+  g_clear_object (&job->station);
+  g_free (job->object_path);
+  g_free (job->device);
+  g_free (job->description);
+  g_free (job->serial);
+  if (job->fd >= 0)
+    g_close (job->fd, NULL);
+  g_clear_object (&job->cancellable);
+  g_clear_object (&job->scribe);
+  g_clear_pointer (&job->started, g_date_time_unref);
+  g_free (job);
+}
+
+static void
+gis_station_get_property (GObject    *object,
+                          guint       property_id,
+                          GValue     *value,
+                          GParamSpec *pspec)
+{
+  GisStation *self = GIS_STATION (object);
+
+  switch ((GisStationPropertyId) property_id)
+    {
+    case PROP_N_ACTIVE:
+      g_value_set_uint (value, gis_station_get_n_active (self));
+      break;
+
+    case PROP_N_SUCCEEDED:
+      g_value_set_uint (value, self->n_succeeded);
+      break;
+
+    case PROP_N_FAILED:
+      g_value_set_uint (value, self->n_failed);
+      break;
+
+    case N_PROPERTIES:
+    default:
+      G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
+      break;
+    }
+}
+
+static void
+gis_station_dispose (GObject *object)
+{
+  GisStation *self = GIS_STATION (object);
+  GHashTableIter iter;
+  GisStationJob *job;
+
+  if (self->cancellable != NULL)
+    g_cancellable_cancel (self->cancellable);
+
+  g_hash_table_iter_init (&iter, self->jobs);
+  while (g_hash_table_iter_next (&iter, NULL, (gpointer *) &job))
+    g_cancellable_cancel (job->cancellable);
+
+  if (self->object_added_id != 0)
+    {
+      GDBusObjectManager *manager = udisks_client_get_object_manager (self->client);
+
+      g_signal_handler_disconnect (manager, self->object_added_id);
+      self->object_added_id = 0;
+    }
+
+  if (self->object_removed_id != 0)
+    {
+      GDBusObjectManager *manager = udisks_client_get_object_manager (self->client);
+
+      g_signal_handler_disconnect (manager, self->object_removed_id);
+      self->object_removed_id = 0;
+    }
+
+  G_OBJECT_CLASS (gis_station_parent_class)->dispose (object);
+}
+
+static void
+gis_station_finalize (GObject *object)
+{
+  GisStation *self = GIS_STATION (object);
+
+  /* Every job holds a reference to the station */
+  g_assert (g_hash_table_size (self->jobs) == 0);
+  g_assert (g_queue_is_empty (&self->waiting));
+
+  g_clear_object (&self->client);
+  g_clear_object (&self->config);
+  g_clear_object (&self->image);
+  g_clear_object (&self->signature);
+  g_clear_object (&self->checksum);
+  g_clear_object (&self->log_dir);
+  g_clear_object (&self->cancellable);
+  g_clear_pointer (&self->jobs, g_hash_table_unref);
+  g_clear_object (&self->cache);
+
+  G_OBJECT_CLASS (gis_station_parent_class)->finalize (object);
+}
+
+static void
+gis_station_class_init (GisStationClass *klass)
+{
+  GObjectClass *object_class = G_OBJECT_CLASS (klass);
+
+  object_class->get_property = gis_station_get_property;
+  object_class->dispose = gis_station_dispose;
+  object_class->finalize = gis_station_finalize;
+
+  /**
+   * GisStation:n-active:
+   *
+   * Number of drives currently being written.
+   */
+  props[PROP_N_ACTIVE] = g_param_spec_uint (
+      "n-active",
+      "Active",
+      "Number of drives currently being written",
+      0, G_MAXUINT, 0,
+      G_PARAM_READABLE | G_PARAM_STATIC_STRINGS);
+
+  /**
+   * GisStation:n-succeeded:
+   *
+   * Number of drives which have been written successfully.
+   */
+  props[PROP_N_SUCCEEDED] = g_param_spec_uint (
+      "n-succeeded",
+      "Succeeded",
+      "Number of drives which have been written successfully",
+      0, G_MAXUINT, 0,
+      G_PARAM_READABLE | G_PARAM_STATIC_STRINGS);
+
+  /**
+   * GisStation:n-failed:
+   *
+   * Number of drives which could not be written.
+   */
+  props[PROP_N_FAILED] = g_param_spec_uint (
+      "n-failed",
+      "Failed",
+      "Number of drives which could not be written",
+      0, G_MAXUINT, 0,
+      G_PARAM_READABLE | G_PARAM_STATIC_STRINGS);
+
+  g_object_class_install_properties (object_class, N_PROPERTIES, props);
+}
+
+static void
+gis_station_init (GisStation *self)
+{
+  self->cancellable = g_cancellable_new ();
+  self->jobs = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+  g_queue_init (&self->waiting);
+  self->max_writing =
+    gis_buffer_pool_count_shares (gis_buffer_pool_get_default_budget ());
+  self->cache_state = GIS_STATION_CACHE_NONE;
+}
+
+/**
+ * gis_station_new:
+ * @client: the shared UDisks client
+ * @config: the unattended configuration, used to decide which drives to write
+ * @image: the image to write, with @image_size, @compressed_size, @signature
+ *  and @checksum having the same meanings as for gis_scribe_new()
+ * @log_dir: (nullable): directory in which to write a log file for each drive
+ *
+ * Returns: (transfer full): a new #GisStation, which does nothing until
+ *  gis_station_start() is called.
+ */
+GisStation *
+gis_station_new (UDisksClient        *client,
+                 GisUnattendedConfig *config,
+                 GFile               *image,
+                 guint64              image_size,
+                 guint64              compressed_size,
+                 GFile               *signature,
+                 GFile               *checksum,
+                 GFile               *log_dir)
+{
+  GisStation *self;
+
+  g_return_val_if_fail (UDISKS_IS_CLIENT (client), NULL);
+  g_return_val_if_fail (GIS_IS_UNATTENDED_CONFIG (config), NULL);
+  g_return_val_if_fail (G_IS_FILE (image), NULL);
+  g_return_val_if_fail (G_IS_FILE (signature), NULL);
+  g_return_val_if_fail (G_IS_FILE (checksum), NULL);
+  g_return_val_if_fail (log_dir == NULL || G_IS_FILE (log_dir), NULL);
+
+  self = g_object_new (GIS_TYPE_STATION, NULL);
+  self->client = g_object_ref (client);
+  self->config = g_object_ref (config);
+  self->image = g_object_ref (image);
+  self->image_size = image_size;
+  self->compressed_size = compressed_size;
+  self->signature = g_object_ref (signature);
+  self->checksum = g_object_ref (checksum);
+  self->log_dir = log_dir != NULL ? g_object_ref (log_dir) : NULL;
+
+  return self;
+}
+
+static void
+gis_station_log_written_cb (GObject      *source,
+                            GAsyncResult *result,
+                            gpointer      data)
+{
+  GFile *file = G_FILE (source);
+  g_autoptr(GError) error = NULL;
+
+  if (!g_file_replace_contents_finish (file, result, NULL, &error))
+    {
+      g_autofree gchar *path = g_file_get_path (file);
+
+      g_warning ("Failed to write %s: %s", path, error->message);
+    }
+}
+
+/* Writes a short report for @job to the log directory, named after the
+ * drive's serial number (or device name) and the time it was plugged in, so
+ * that the report for any given drive is easy to find after a batch.
+ */
+static void
+gis_station_job_write_log (GisStationJob *job,
+                           gint64         duration_usec,
+                           const GError  *error)
+{
+  GisStation *self = job->station;
+  g_autofree gchar *started_str = g_date_time_format (job->started, "%y%m%d_%H%M%S_UTC%z");
+  g_autofree gchar *iso_started_str = g_date_time_format (job->started, "%Y-%m-%d %H:%M:%S %z");
+  g_autofree gchar *device_basename = g_path_get_basename (job->device);
+  g_autofree gchar *basename = NULL;
+  g_autofree gchar *image_basename = g_file_get_basename (self->image);
+  g_autoptr(GString) contents = g_string_new (NULL);
+  g_autoptr(GFile) log_file = NULL;
+  g_autoptr(GBytes) bytes = NULL;
+  gint64 duration = duration_usec / G_USEC_PER_SEC;
+
+  if (self->log_dir == NULL)
+    return;
+
+  basename = g_strdup_printf ("eos-installer-station-%s-%s.txt",
+                              job->serial != NULL && *job->serial != '\0'
+                                ? job->serial : device_basename,
+                              started_str);
+  g_strdelimit (basename, "/", '_');
+  log_file = g_file_get_child (self->log_dir, basename);
+
+  g_string_append_printf (contents, "Device: %s\n", job->device);
+  g_string_append_printf (contents, "Drive: %s\n", job->description);
+  g_string_append_printf (contents, "Serial: %s\n", job->serial ?: "");
+  g_string_append_printf (contents, "Image: %s\n", image_basename);
+  g_string_append_printf (contents, "Source: %s\n",
+                          job->from_cache ? "decompressed cache" : "image");
+  g_string_append_printf (contents, "Started: %s\n", iso_started_str);
+  g_string_append_printf (contents,
+                          "Duration: %01" G_GINT64_FORMAT ":%02d:%02d\n",
+                          duration / 3600,
+                          (gint) (duration / 60) % 60,
+                          (gint) duration % 60);
+  if (error == NULL)
+    g_string_append (contents, "Result: success\n");
+  else
+    g_string_append_printf (contents, "Result: failed: %s\n", error->message);
+
+  bytes = g_string_free_to_bytes (g_steal_pointer (&contents));
+  g_file_replace_contents_bytes_async (log_file, bytes,
+                                       NULL, FALSE, G_FILE_CREATE_NONE,
+                                       NULL,
+                                       gis_station_log_written_cb, NULL);
+}
+
+static void gis_station_flush_waiting (GisStation *self);
+
+static void
+gis_station_job_finish (GisStationJob *job,
+                        const GError  *error)
+{
+  g_autoptr(GisStation) self = g_object_ref (job->station);
+  gint64 duration_usec = g_get_monotonic_time () - job->start_time_usec;
+
+  if (error == NULL)
+    {
+      g_message ("station: wrote %s (%s) in %" G_GINT64_FORMAT " s",
+                 job->device, job->description, duration_usec / G_USEC_PER_SEC);
+      self->n_succeeded++;
+      g_object_notify_by_pspec (G_OBJECT (self), props[PROP_N_SUCCEEDED]);
+    }
+  else
+    {
+      g_warning ("station: failed to write %s (%s): %s",
+                 job->device, job->description, error->message);
+      self->n_failed++;
+      g_object_notify_by_pspec (G_OBJECT (self), props[PROP_N_FAILED]);
+    }
+
+  gis_station_job_write_log (job, duration_usec, error);
+
+  if (job->scribe != NULL)
+    self->n_writing--;
+
+  g_hash_table_remove (self->jobs, job->object_path);
+  gis_station_job_free (job);
+  g_object_notify_by_pspec (G_OBJECT (self), props[PROP_N_ACTIVE]);
+
+  if (self->cache_state != GIS_STATION_CACHE_PREPARING)
+    gis_station_flush_waiting (self);
+}
+
+static void
+gis_station_write_cb (GObject      *source,
+                      GAsyncResult *result,
+                      gpointer      data)
+{
+  GisStationJob *job = data;
+  g_autoptr(GError) error = NULL;
+
+  gis_scribe_write_finish (GIS_SCRIBE (source), result, &error);
+  gis_station_job_finish (job, error);
+}
+
+static void
+gis_station_job_write (GisStationJob *job)
+{
+  GisStation *self = job->station;
+  GFile *image = self->image;
+  guint64 compressed_size = self->compressed_size;
+  GFile *signature = self->signature;
+  GFile *checksum = self->checksum;
+  g_autoptr(GFile) manifest = NULL;
+
+  if (self->cache_state == GIS_STATION_CACHE_READY)
+    {
+      image = gis_image_cache_get_image (self->cache);
+      compressed_size = self->image_size;
+      signature = gis_image_cache_get_signature (self->cache);
+      checksum = gis_image_cache_get_checksum (self->cache);
+      job->from_cache = TRUE;
+    }
+
+  /* The drives are destined for other computers, so whether this one boots
+   * with EFI is irrelevant; leave the partition table as it is.
+   */
+  job->scribe = gis_scribe_new (image, self->image_size, compressed_size,
+                                signature, checksum, job->device, job->fd,
+                                FALSE);
+  manifest = gis_chunk_manifest_get_default_file (image);
+  /* Drives written at the same time share the memory one would have had */
+  g_object_set (job->scribe,
+                "verify-first", gis_store_is_verify_first (),
+                "skip-unused", gis_store_is_skip_unused (),
+                "manifest", manifest,
+                "memory-budget",
+                gis_buffer_pool_get_default_budget () / self->max_writing,
+                NULL);
+  self->n_writing++;
+  /* The scribe now owns the fd */
+  job->fd = -1;
+
+  g_message ("station: writing %s to %s (%s)",
+             job->from_cache ? "cached image" : "image",
+             job->device, job->description);
+  gis_scribe_write_async (job->scribe, job->cancellable,
+                          gis_station_write_cb, job);
+}
+
+static void
+gis_station_open_for_restore_cb (GObject      *source,
+                                 GAsyncResult *result,
+                                 gpointer      data)
+{
+  GisStationJob *job = data;
+  GisStation *self = job->station;
+  UDisksBlock *block = UDISKS_BLOCK (source);
+  g_autoptr(GUnixFDList) fd_list = NULL;
+  g_autoptr(GVariant) fd_index = NULL;
+  g_autoptr(GError) error = NULL;
+
+  if (!udisks_block_call_open_for_restore_finish (block, &fd_index, &fd_list,
+                                                  result, &error))
+    {
+      gis_station_job_finish (job, error);
+      return;
+    }
+
+  job->fd = g_unix_fd_list_get (fd_list, g_variant_get_handle (fd_index), &error);
+  if (job->fd < 0)
+    {
+      g_prefix_error (&error,
+                      "Error extracting fd with handle %d from D-Bus message: ",
+                      g_variant_get_handle (fd_index));
+      gis_station_job_finish (job, error);
+      return;
+    }
+
+  if (self->cache_state == GIS_STATION_CACHE_PREPARING)
+    {
+      g_message ("station: %s is waiting for the image to be decompressed",
+                 job->device);
+      g_queue_push_tail (&self->waiting, job);
+    }
+  else if (self->n_writing >= self->max_writing)
+    {
+      g_message ("station: %s is waiting for another drive to finish",
+                 job->device);
+      g_queue_push_tail (&self->waiting, job);
+    }
+  else
+    {
+      gis_station_job_write (job);
+    }
+}
+
+static void
+gis_station_flush_waiting (GisStation *self)
+{
+  while (self->n_writing < self->max_writing &&
+         !g_queue_is_empty (&self->waiting))
+    gis_station_job_write (g_queue_pop_head (&self->waiting));
+}
+
+/**
+ * gis_station_drive_is_removable:
+ * @drive: a drive
+ *
+ * Returns: whether @drive, or its media, can be unplugged: that is, whether it
+ *  is on a hotpluggable bus such as USB, or is a card reader. Station mode
+ *  only ever writes to such drives, so that a matching but internal disk is
+ *  never overwritten.
+ */
+gboolean
+gis_station_drive_is_removable (UDisksDrive *drive)
+{
+  g_return_val_if_fail (UDISKS_IS_DRIVE (drive), FALSE);
+
+  /* UDisks sets Removable for drives on hotpluggable buses as well as those
+   * with removable media
+   */
+  return udisks_drive_get_removable (drive) ||
+         udisks_drive_get_media_removable (drive);
+}
+
+/* Returns whether @block, which has just appeared, is a drive we should
+ * write to. Only whole disks backed by a hotpluggable drive qualify; in
+ * particular, loop devices, internal disks and the drive hosting the image
+ * are never used.
+ */
+static gboolean
+gis_station_is_target (GisStation  *self,
+                       UDisksObject *object,
+                       UDisksBlock  *block,
+                       UDisksDrive  *drive)
+{
+  GObject *image_source = gis_store_get_object (GIS_STORE_IMAGE_SOURCE);
+  const gchar *object_path = g_dbus_object_get_object_path (G_DBUS_OBJECT (object));
+  const gchar *device = udisks_block_get_device (block);
+
+#define reject_if(cond, reason) \
+  if (cond) \
+    { \
+      g_message ("station: ignoring %s (%s): %s", device, object_path, reason); \
+      return FALSE; \
+    }
+
+  reject_if (drive == NULL, "not a drive");
+  reject_if (!gis_station_drive_is_removable (drive), "not removable");
+  reject_if (udisks_object_peek_partition (object) != NULL, "it is a partition");
+  reject_if (image_source != NULL && UDISKS_IS_DRIVE (image_source) &&
+             g_strcmp0 (g_dbus_proxy_get_object_path (G_DBUS_PROXY (image_source)),
+                        udisks_block_get_drive (block)) == 0,
+             "it hosts the image partition");
+  reject_if (udisks_drive_get_optical (drive), "optical");
+  reject_if (udisks_block_get_read_only (block), "block device is read-only");
+  reject_if (udisks_block_get_size (block) < self->image_size, "too small");
+  reject_if (!gis_unattended_config_matches_device (self->config, device),
+             "it doesn't match the unattended config");
+  reject_if (g_hash_table_contains (self->jobs, object_path),
+             "it is already being written");
+#undef reject_if
+
+  return TRUE;
+}
+
+static void
+gis_station_object_added_cb (GDBusObjectManager *manager,
+                             GDBusObject        *dbus_object,
+                             gpointer            data)
+{
+  GisStation *self = GIS_STATION (data);
+  UDisksObject *object = UDISKS_OBJECT (dbus_object);
+  UDisksBlock *block = udisks_object_peek_block (object);
+  /* TODO: given support in libudisks2, use g_autoptr(UDisksDrive) here and
+   * remove g_clear_object() below.
+   */
+  UDisksDrive *drive = NULL;
+  GisStationJob *job;
+
+  if (block == NULL)
+    return;
+
+  drive = udisks_client_get_drive_for_block (self->client, block);
+  if (!gis_station_is_target (self, object, block, drive))
+    {
+      g_clear_object (&drive);
+      return;
+    }
+
+  job = g_new0 (GisStationJob, 1);
+  job->station = g_object_ref (self);
+  job->object_path = g_strdup (g_dbus_object_get_object_path (dbus_object));
+  job->device = g_strdup (udisks_block_get_device (block));
+  job->description = g_strstrip (g_strdup_printf ("%s %s",
+                                                  udisks_drive_get_vendor (drive),
+                                                  udisks_drive_get_model (drive)));
+  job->serial = g_strdup (udisks_drive_get_serial (drive));
+  job->fd = -1;
+  job->cancellable = g_cancellable_new ();
+  job->started = g_date_time_new_now_local ();
+  job->start_time_usec = g_get_monotonic_time ();
+  g_clear_object (&drive);
+
+  g_hash_table_insert (self->jobs, g_strdup (job->object_path), job);
+  g_object_notify_by_pspec (G_OBJECT (self), props[PROP_N_ACTIVE]);
+
+  g_message ("station: %s (%s) plugged in", job->device, job->description);
+  udisks_block_call_open_for_restore (block,
+                                      g_variant_new ("a{sv}", NULL), /* options */
+                                      NULL, /* fd_list */
+                                      job->cancellable,
+                                      gis_station_open_for_restore_cb,
+                                      job);
+}
+
+static void
+gis_station_object_removed_cb (GDBusObjectManager *manager,
+                               GDBusObject        *dbus_object,
+                               gpointer            data)
+{
+  GisStation *self = GIS_STATION (data);
+  GisStationJob *job = g_hash_table_lookup (self->jobs,
+                                            g_dbus_object_get_object_path (dbus_object));
+
+  if (job == NULL)
+    return;
+
+  /* The job finishes, as a failure, once the scribe has stopped */
+  g_message ("station: %s (%s) removed; abandoning it",
+             job->device, job->description);
+  g_cancellable_cancel (job->cancellable);
+}
+
+static void
+gis_station_cache_prepare_cb (GObject      *source,
+                              GAsyncResult *result,
+                              gpointer      data)
+{
+  g_autoptr(GisStation) self = GIS_STATION (data);
+  GisImageCache *cache = GIS_IMAGE_CACHE (source);
+  g_autoptr(GError) error = NULL;
+
+  if (!gis_image_cache_prepare_finish (cache, result, &error))
+    {
+      g_warning ("station: failed to cache decompressed image; "
+                 "will decompress it for each drive: %s",
+                 error->message);
+      g_clear_object (&self->cache);
+      self->cache_state = GIS_STATION_CACHE_NONE;
+    }
+  else
+    {
+      g_message ("station: decompressed image is ready");
+      self->cache_state = GIS_STATION_CACHE_READY;
+    }
+
+  gis_station_flush_waiting (self);
+}
+
+/* Decompresses the image once, to a file in the cache directory, so that
+ * drives after the first can skip decompression. This is only worthwhile for
+ * compressed images, and only if there is enough space.
+ */
+static void
+gis_station_prepare_cache (GisStation *self)
+{
+  g_autoptr(GFile) cache_dir = NULL;
+
+  if (!gis_image_cache_is_useful (self->image))
+    return;
+
+  cache_dir = gis_image_cache_get_default_dir ();
+  self->cache = gis_image_cache_new (cache_dir, self->image, self->image_size,
+                                     self->compressed_size, self->signature,
+                                     self->checksum);
+  self->cache_state = GIS_STATION_CACHE_PREPARING;
+  gis_image_cache_prepare_async (self->cache, self->cancellable,
+                                 gis_station_cache_prepare_cb,
+                                 g_object_ref (self));
+}
+
+/**
+ * gis_station_start:
+ *
+ * Starts watching for drives. Every matching drive which is plugged in from
+ * now on is written to; drives which are already present are left alone.
+ */
+void
+gis_station_start (GisStation *self)
+{
+  GDBusObjectManager *manager;
+
+  g_return_if_fail (GIS_IS_STATION (self));
+  g_return_if_fail (self->object_added_id == 0);
+
+  manager = udisks_client_get_object_manager (self->client);
+  self->object_added_id =
+    g_signal_connect (manager, "object-added",
+                      G_CALLBACK (gis_station_object_added_cb), self);
+  self->object_removed_id =
+    g_signal_connect (manager, "object-removed",
+                      G_CALLBACK (gis_station_object_removed_cb), self);
+
+  gis_station_prepare_cache (self);
+}
+
+/**
+ * gis_station_get_n_active:
+ *
+ * Returns: the #GisStation:n-active property.
+ */
+guint
+gis_station_get_n_active (GisStation *self)
+{
+  g_return_val_if_fail (GIS_IS_STATION (self), 0);
+
+  return g_hash_table_size (self->jobs);
+}
+
+/**
+ * gis_station_get_n_succeeded:
+ *
+ * Returns: the #GisStation:n-succeeded property.
+ */
+guint
+gis_station_get_n_succeeded (GisStation *self)
+{
+  g_return_val_if_fail (GIS_IS_STATION (self), 0);
+
+  return self->n_succeeded;
+}
+
+/**
+ * gis_station_get_n_failed:
+ *
+ * Returns: the #GisStation:n-failed property.
+ */
+guint
+gis_station_get_n_failed (GisStation *self)
+{
+  g_return_val_if_fail (GIS_IS_STATION (self), 0);
+
+  return self->n_failed;
+}
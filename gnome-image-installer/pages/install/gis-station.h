@@ -0,0 +1,48 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*- */
+/*
+ * Copyright © 2018 Endless Mobile, Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <gio/gio.h>
+#include <udisks/udisks.h>
+
+#include "gis-unattended-config.h"
+
+G_BEGIN_DECLS
+
+#define GIS_TYPE_STATION (gis_station_get_type ())
+G_DECLARE_FINAL_TYPE (GisStation, gis_station, GIS, STATION, GObject)
+
+GisStation *gis_station_new (UDisksClient        *client,
+                             GisUnattendedConfig *config,
+                             GFile               *image,
+                             guint64              image_size,
+                             guint64              compressed_size,
+                             GFile               *signature,
+                             GFile               *checksum,
+                             GFile               *log_dir);
+
+void gis_station_start (GisStation *self);
+
+guint gis_station_get_n_active (GisStation *self);
+guint gis_station_get_n_succeeded (GisStation *self);
+guint gis_station_get_n_failed (GisStation *self);
+
+gboolean gis_station_drive_is_removable (UDisksDrive *drive);
+
+G_END_DECLS
@@ -0,0 +1,384 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*- */
+/*
+ * Copyright © 2018 Endless Mobile, Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+#include "config.h"
+#include "gis-buffer-pool.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define MIB (1024 * 1024)
+
+/* Without an explicit budget, use this fraction of physical memory, up to
+ * MAX_DEFAULT_BUDGET: 32 MiB on a 2 GiB machine. The installer often runs from
+ * a live session, whose root filesystem is itself in memory.
+ */
+#define DEFAULT_BUDGET_DIVISOR 64
+#define MAX_DEFAULT_BUDGET (256 * MIB)
+
+struct _GisBufferPool {
+  gint ref_count;
+  guint64 budget;
+  gsize page_size;
+
+  GMutex mutex;
+  GCond cond;
+
+  /* Guarded by mutex */
+  /* Every buffer allocated and not yet freed → its size */
+  GHashTable *sizes;
+  /* Released buffers, kept for reuse */
+  GSList *released;
+  /* Total size of the buffers in 'sizes' */
+  guint64 allocated;
+  /* Total size of the buffers not in 'released' */
+  guint64 in_use;
+  guint64 high_water_mark;
+};
+
+/**
+ * gis_buffer_pool_get_default_budget:
+ *
+ * Returns: the memory budget to use for writing an image, which is the
+ *  value of the EI_MEMORY_BUDGET_MIB environment variable (in MiB) if set, or
+ *  otherwise a fraction of physical memory
+ */
+guint64
+gis_buffer_pool_get_default_budget (void)
+{
+  const gchar *env = g_getenv ("EI_MEMORY_BUDGET_MIB");
+  glong pages = sysconf (_SC_PHYS_PAGES);
+  glong page_size = sysconf (_SC_PAGESIZE);
+  guint64 mib;
+
+  if (env != NULL)
+    {
+      if (g_ascii_string_to_unsigned (env, 10, 1, G_MAXUINT32, &mib, NULL))
+        return MAX (mib * MIB, GIS_BUFFER_POOL_MIN_BUDGET);
+
+      g_warning ("Ignoring invalid EI_MEMORY_BUDGET_MIB=%s", env);
+    }
+
+  if (pages <= 0 || page_size <= 0)
+    return GIS_BUFFER_POOL_MIN_BUDGET;
+
+  return CLAMP ((guint64) pages * page_size / DEFAULT_BUDGET_DIVISOR,
+                GIS_BUFFER_POOL_MIN_BUDGET, MAX_DEFAULT_BUDGET);
+}
+
+/**
+ * gis_buffer_pool_count_shares:
+ * @budget: a memory budget, in bytes
+ *
+ * Returns: how many pools of at least %GIS_BUFFER_POOL_MIN_BUDGET @budget can
+ *  be divided into, which is the most images that should be written at once
+ *  within it; always at least 1
+ */
+guint
+gis_buffer_pool_count_shares (guint64 budget)
+{
+  return MAX (1, MIN (budget / GIS_BUFFER_POOL_MIN_BUDGET, G_MAXUINT));
+}
+
+/**
+ * gis_buffer_pool_new:
+ * @budget: the most memory, in bytes, to hand out at once; raised to
+ *  %GIS_BUFFER_POOL_MIN_BUDGET if smaller
+ *
+ * Returns: (transfer full): a new, empty pool
+ */
+GisBufferPool *
+gis_buffer_pool_new (guint64 budget)
+{
+  GisBufferPool *self = g_new0 (GisBufferPool, 1);
+  glong page_size = sysconf (_SC_PAGESIZE);
+
+  self->ref_count = 1;
+  self->budget = MAX (budget, GIS_BUFFER_POOL_MIN_BUDGET);
+  self->page_size = page_size > 0 ? page_size : 4096;
+  self->sizes = g_hash_table_new (NULL, NULL);
+  g_mutex_init (&self->mutex);
+  g_cond_init (&self->cond);
+
+  return self;
+}
+
+GisBufferPool *
+gis_buffer_pool_ref (GisBufferPool *self)
+{
+  g_return_val_if_fail (self != NULL, NULL);
+
+  g_atomic_int_inc (&self->ref_count);
+  return self;
+}
+
+/**
+ * gis_buffer_pool_unref:
+ *
+ * Drops a reference to the pool, freeing it and every buffer it holds once
+ * the last is gone. All buffers must have been released by then.
+ */
+void
+gis_buffer_pool_unref (GisBufferPool *self)
+{
+  GHashTableIter iter;
+  gpointer buffer;
+
+  g_return_if_fail (self != NULL);
+
+  if (!g_atomic_int_dec_and_test (&self->ref_count))
+    return;
+
+  g_warn_if_fail (self->in_use == 0);
+
+  g_hash_table_iter_init (&iter, self->sizes);
+  while (g_hash_table_iter_next (&iter, &buffer, NULL))
+    free (buffer);
+
+  g_hash_table_unref (self->sizes);
+  g_slist_free (self->released);
+  g_mutex_clear (&self->mutex);
+  g_cond_clear (&self->cond);
+  g_free (self);
+}
+
+G_DEFINE_BOXED_TYPE (GisBufferPool, gis_buffer_pool,
+                     gis_buffer_pool_ref, gis_buffer_pool_unref)
+
+static gsize
+gis_buffer_pool_get_size (GisBufferPool *self,
+                          gpointer       buffer)
+{
+  return GPOINTER_TO_SIZE (g_hash_table_lookup (self->sizes, buffer));
+}
+
+/* Takes a released buffer of exactly @size for reuse, if there is one. Must be
+ * called with the mutex held.
+ */
+static gpointer
+gis_buffer_pool_steal_released (GisBufferPool *self,
+                                gsize          size)
+{
+  GSList *l;
+
+  for (l = self->released; l != NULL; l = l->next)
+    {
+      gpointer buffer = l->data;
+
+      if (gis_buffer_pool_get_size (self, buffer) == size)
+        {
+          self->released = g_slist_delete_link (self->released, l);
+          return buffer;
+        }
+    }
+
+  return NULL;
+}
+
+/* Allocates a new buffer, first freeing released buffers if keeping them would
+ * exceed the budget. Must be called with the mutex held.
+ */
+static gpointer
+gis_buffer_pool_allocate (GisBufferPool *self,
+                          gsize          size)
+{
+  void *buffer = NULL;
+
+  while (self->allocated + size > self->budget && self->released != NULL)
+    {
+      gpointer victim = self->released->data;
+
+      self->released = g_slist_delete_link (self->released, self->released);
+      self->allocated -= gis_buffer_pool_get_size (self, victim);
+      g_hash_table_remove (self->sizes, victim);
+      free (victim);
+    }
+
+  if (posix_memalign (&buffer, self->page_size, size) != 0 || buffer == NULL)
+    g_error ("%s: failed to allocate %" G_GSIZE_FORMAT " bytes "
+             "aligned to page size %" G_GSIZE_FORMAT ": %s",
+             G_STRFUNC, size, self->page_size, g_strerror (errno));
+
+  g_hash_table_insert (self->sizes, buffer, GSIZE_TO_POINTER (size));
+  self->allocated += size;
+
+  return buffer;
+}
+
+/* Hands out a buffer of @size, which must fit in the budget. Must be called
+ * with the mutex held.
+ */
+static gpointer
+gis_buffer_pool_take (GisBufferPool *self,
+                      gsize          size)
+{
+  gpointer buffer = gis_buffer_pool_steal_released (self, size);
+
+  if (buffer == NULL)
+    buffer = gis_buffer_pool_allocate (self, size);
+
+  self->in_use += size;
+  self->high_water_mark = MAX (self->high_water_mark, self->in_use);
+
+  return buffer;
+}
+
+/**
+ * gis_buffer_pool_acquire:
+ * @size: size of the buffer, which must not exceed the pool's budget
+ *
+ * Returns a page-aligned buffer of @size bytes, blocking until enough of the
+ * budget is free. Return it with gis_buffer_pool_release().
+ *
+ * Returns: (transfer full): the buffer
+ */
+gpointer
+gis_buffer_pool_acquire (GisBufferPool *self,
+                         gsize          size)
+{
+  gpointer buffer = NULL;
+
+  g_return_val_if_fail (size > 0, NULL);
+  g_return_val_if_fail (size <= self->budget, NULL);
+
+  g_mutex_lock (&self->mutex);
+
+  while (self->in_use + size > self->budget)
+    g_cond_wait (&self->cond, &self->mutex);
+
+  buffer = gis_buffer_pool_take (self, size);
+
+  g_mutex_unlock (&self->mutex);
+
+  return buffer;
+}
+
+/**
+ * gis_buffer_pool_try_acquire:
+ * @size: size of the buffer
+ *
+ * Like gis_buffer_pool_acquire(), but returns %NULL rather than blocking if
+ * the budget doesn't have room for @size bytes now. This suits buffers used to
+ * read ahead, which are only worth having if the memory is free.
+ *
+ * Returns: (transfer full) (nullable): the buffer, or %NULL
+ */
+gpointer
+gis_buffer_pool_try_acquire (GisBufferPool *self,
+                             gsize          size)
+{
+  gpointer buffer = NULL;
+
+  g_return_val_if_fail (size > 0, NULL);
+
+  g_mutex_lock (&self->mutex);
+
+  if (self->in_use + size <= self->budget)
+    buffer = gis_buffer_pool_take (self, size);
+
+  g_mutex_unlock (&self->mutex);
+
+  return buffer;
+}
+
+/**
+ * gis_buffer_pool_release:
+ * @buffer: (transfer full): a buffer returned by gis_buffer_pool_acquire()
+ *
+ * Returns @buffer to the pool, waking any thread waiting for room in the
+ * budget.
+ */
+void
+gis_buffer_pool_release (GisBufferPool *self,
+                         gpointer       buffer)
+{
+  gsize size;
+
+  if (buffer == NULL)
+    return;
+
+  g_mutex_lock (&self->mutex);
+
+  size = gis_buffer_pool_get_size (self, buffer);
+  if (size == 0)
+    {
+      g_mutex_unlock (&self->mutex);
+      g_return_if_reached ();
+    }
+
+  self->in_use -= size;
+  self->released = g_slist_prepend (self->released, buffer);
+  g_cond_broadcast (&self->cond);
+
+  g_mutex_unlock (&self->mutex);
+}
+
+guint64
+gis_buffer_pool_get_budget (GisBufferPool *self)
+{
+  return self->budget;
+}
+
+/**
+ * gis_buffer_pool_get_high_water_mark:
+ *
+ * Returns: the most memory, in bytes, that has been handed out at once
+ */
+guint64
+gis_buffer_pool_get_high_water_mark (GisBufferPool *self)
+{
+  guint64 ret;
+
+  g_mutex_lock (&self->mutex);
+  ret = self->high_water_mark;
+  g_mutex_unlock (&self->mutex);
+
+  return ret;
+}
+
+/**
+ * gis_get_peak_rss:
+ *
+ * Returns: the peak resident set size of this process, in bytes, or 0 if it
+ *  can't be determined
+ */
+guint64
+gis_get_peak_rss (void)
+{
+  g_autofree gchar *status = NULL;
+  g_auto(GStrv) lines = NULL;
+  gsize i;
+
+  if (!g_file_get_contents ("/proc/self/status", &status, NULL, NULL))
+    return 0;
+
+  lines = g_strsplit (status, "\n", -1);
+  for (i = 0; lines[i] != NULL; i++)
+    {
+      guint64 kib;
+
+      /* For example "VmHWM:     12345 kB" */
+      if (g_str_has_prefix (lines[i], "VmHWM:") &&
+          sscanf (lines[i] + strlen ("VmHWM:"), "%" G_GUINT64_FORMAT, &kib) == 1)
+        return kib * 1024;
+    }
+
+  return 0;
+}
@@ -0,0 +1,68 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*- */
+/*
+ * Copyright © 2018 Endless Mobile, Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+#pragma once
+
+#include <glib-object.h>
+
+G_BEGIN_DECLS
+
+/* Enough for the buffers of every stage of writing one image, plus one
+ * maximum-sized manifest chunk being verified.
+ */
+#define GIS_BUFFER_POOL_MIN_BUDGET (24 * 1024 * 1024)
+
+/**
+ * GisBufferPool:
+ *
+ * Hands out page-aligned buffers to the threads which read, verify and write
+ * an image, keeping the total they hold within a fixed memory budget. A thread
+ * which asks for a buffer when the budget is exhausted blocks until another
+ * releases one, so the threads themselves must not wait on each other while
+ * holding more than a small, fixed number of buffers. Released buffers are
+ * kept for reuse while they fit in the budget.
+ *
+ * A pool is reference-counted, so that everything reading, verifying and
+ * writing one image can share it.
+ */
+typedef struct _GisBufferPool GisBufferPool;
+
+#define GIS_TYPE_BUFFER_POOL (gis_buffer_pool_get_type ())
+GType gis_buffer_pool_get_type (void);
+
+guint64 gis_buffer_pool_get_default_budget (void);
+guint gis_buffer_pool_count_shares (guint64 budget);
+
+GisBufferPool *gis_buffer_pool_new (guint64 budget);
+GisBufferPool *gis_buffer_pool_ref (GisBufferPool *self);
+void gis_buffer_pool_unref (GisBufferPool *self);
+
+gpointer gis_buffer_pool_acquire (GisBufferPool *self,
+                                  gsize          size);
+gpointer gis_buffer_pool_try_acquire (GisBufferPool *self,
+                                      gsize          size);
+void gis_buffer_pool_release (GisBufferPool *self,
+                              gpointer       buffer);
+
+guint64 gis_buffer_pool_get_budget (GisBufferPool *self);
+guint64 gis_buffer_pool_get_high_water_mark (GisBufferPool *self);
+
+guint64 gis_get_peak_rss (void);
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (GisBufferPool, gis_buffer_pool_unref)
+
+G_END_DECLS
@@ -0,0 +1,356 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*- */
+/*
+ * Copyright © 2018 Endless Mobile, Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+#include "gis-calibration.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <glib/gi18n.h>
+#include <glib/gstdio.h>
+
+#include "glnx-errors.h"
+
+#include "gis-drive-benchmark.h"
+#include "gis-image-format.h"
+
+#define CALIBRATION_BUFFER_SIZE (1024 * 1024)
+
+/* Each stage is sampled until whichever of these limits is reached first. */
+#define CALIBRATION_MAX_BYTES (64 * CALIBRATION_BUFFER_SIZE)
+#define CALIBRATION_MAX_USEC (G_USEC_PER_SEC)
+
+typedef struct {
+    GFile *image;
+    gint drive_fd;
+    gchar *device;
+    gchar *connection_bus;
+} CalibrationData;
+
+static void
+calibration_data_free (CalibrationData *d)
+{
+  g_clear_object (&d->image);
+  if (d->drive_fd >= 0)
+    g_close (d->drive_fd, NULL);
+  g_free (d->device);
+  g_free (d->connection_bus);
+  g_free (d);
+}
+
+/* Returns a decompressor for @image, chosen by its contents in the same way
+ * as GisScribe, or %NULL if it is not compressed.
+ */
+static GConverter *
+calibration_get_decompressor (GFile *image)
+{
+  const GisImageFormat *format = gis_image_format_detect_file (image, NULL,
+                                                               NULL);
+
+  if (format == NULL || format->new_converter == NULL)
+    return NULL;
+
+  return format->new_converter ();
+}
+
+/* Times sequential reads from the start of the image file. The kernel is
+ * asked to drop any cached pages first, since the image has typically just
+ * been partially read to validate its partition table, and we want to
+ * measure the source medium rather than the page cache.
+ */
+static gboolean
+calibrate_read (GFile         *image,
+                gdouble       *read_rate,
+                GCancellable  *cancellable,
+                GError       **error)
+{
+  g_autofree gchar *path = g_file_get_path (image);
+  g_autofree gchar *buf = NULL;
+  gint fd;
+  guint64 total = 0;
+  gint64 start, elapsed = 0;
+  gboolean ret = TRUE;
+
+  if (path == NULL)
+    {
+      g_autofree gchar *uri = g_file_get_uri (image);
+
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED,
+                   "Image %s is not a local file", uri);
+      return FALSE;
+    }
+
+  fd = open (path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    return glnx_throw_errno_prefix (error, "Error opening %s", path);
+
+  (void) posix_fadvise (fd, 0, 0, POSIX_FADV_DONTNEED);
+
+  buf = g_malloc (CALIBRATION_BUFFER_SIZE);
+  start = g_get_monotonic_time ();
+  while (total < CALIBRATION_MAX_BYTES && elapsed < CALIBRATION_MAX_USEC)
+    {
+      ssize_t r;
+
+      if (g_cancellable_set_error_if_cancelled (cancellable, error))
+        {
+          ret = FALSE;
+          break;
+        }
+
+      r = pread (fd, buf, CALIBRATION_BUFFER_SIZE, total);
+      if (r < 0)
+        {
+          if (errno == EINTR)
+            continue;
+
+          ret = glnx_throw_errno_prefix (error, "Error reading %s", path);
+          break;
+        }
+      else if (r == 0)
+        {
+          break;
+        }
+
+      total += r;
+      elapsed = g_get_monotonic_time () - start;
+    }
+
+  g_close (fd, NULL);
+
+  if (!ret)
+    return FALSE;
+
+  *read_rate = (gdouble) total * G_USEC_PER_SEC / MAX (elapsed, 1);
+  g_message ("%s: read %" G_GUINT64_FORMAT " bytes in %" G_GINT64_FORMAT
+             " us (%.1f MB/s)",
+             path, total, elapsed, *read_rate / 1e6);
+
+  return TRUE;
+}
+
+/* Times decompression from the start of the image, measured in uncompressed
+ * bytes. This runs after calibrate_read(), so the compressed input mostly
+ * comes from the page cache, and this largely measures CPU time.
+ */
+static gboolean
+calibrate_decode (GFile         *image,
+                  GConverter    *decompressor,
+                  gdouble       *decode_rate,
+                  GCancellable  *cancellable,
+                  GError       **error)
+{
+  g_autoptr(GInputStream) file_input = NULL;
+  g_autoptr(GInputStream) input = NULL;
+  g_autofree gchar *buf = NULL;
+  guint64 total = 0;
+  gint64 start, elapsed = 0;
+
+  file_input = G_INPUT_STREAM (g_file_read (image, cancellable, error));
+  if (file_input == NULL)
+    return FALSE;
+
+  input = g_converter_input_stream_new (file_input, decompressor);
+
+  buf = g_malloc (CALIBRATION_BUFFER_SIZE);
+  start = g_get_monotonic_time ();
+  while (elapsed < CALIBRATION_MAX_USEC)
+    {
+      gssize r = g_input_stream_read (input, buf, CALIBRATION_BUFFER_SIZE,
+                                      cancellable, error);
+      if (r < 0)
+        return FALSE;
+      else if (r == 0)
+        break;
+
+      total += r;
+      elapsed = g_get_monotonic_time () - start;
+    }
+
+  *decode_rate = (gdouble) total * G_USEC_PER_SEC / MAX (elapsed, 1);
+  g_message ("decompressed %" G_GUINT64_FORMAT " bytes in %" G_GINT64_FORMAT
+             " us (%.1f MB/s)",
+             total, elapsed, *decode_rate / 1e6);
+
+  return TRUE;
+}
+
+static void
+calibration_thread_func (GTask        *task,
+                         gpointer      source_object,
+                         gpointer      task_data,
+                         GCancellable *cancellable)
+{
+  CalibrationData *d = task_data;
+  g_autoptr(GisCalibration) calibration = g_new0 (GisCalibration, 1);
+  g_autoptr(GConverter) decompressor = calibration_get_decompressor (d->image);
+  g_autoptr(GError) error = NULL;
+
+  if (!calibrate_read (d->image, &calibration->read_rate, cancellable, &error))
+    {
+      g_task_return_error (task, g_steal_pointer (&error));
+      return;
+    }
+
+  if (decompressor != NULL &&
+      !calibrate_decode (d->image, decompressor, &calibration->decode_rate,
+                         cancellable, &error))
+    {
+      g_task_return_error (task, g_steal_pointer (&error));
+      return;
+    }
+
+  if (d->drive_fd >= 0)
+    {
+      g_autoptr(GisDriveBenchmark) benchmark =
+        gis_drive_benchmark_run (d->drive_fd, d->device, d->connection_bus,
+                                 cancellable, &error);
+
+      /* Not fatal: we can still give an estimate based on the other stages. */
+      if (benchmark == NULL)
+        {
+          if (g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+            {
+              g_task_return_error (task, g_steal_pointer (&error));
+              return;
+            }
+
+          g_warning ("Failed to benchmark %s: %s", d->device, error->message);
+          g_clear_error (&error);
+        }
+      else
+        {
+          calibration->write_rate = benchmark->write_rate;
+        }
+    }
+
+  g_task_return_pointer (task, g_steal_pointer (&calibration), g_free);
+}
+
+/**
+ * gis_calibration_async:
+ * @image: the image file which will be written
+ * @drive_fd: a file descriptor open for reading on @device, as returned by
+ *  UDisks' OpenForBenchmark method, or -1 to skip benchmarking the target.
+ *  Ownership is transferred to this function.
+ * @device: (nullable): path to the target block device
+ * @connection_bus: (nullable): how the target drive is connected, as reported
+ *  by UDisks' Drive:ConnectionBus property
+ *
+ * Samples each stage of the reformatting pipeline for about a second: reading
+ * @image from its source, decompressing it (if compressed), and reading from
+ * the target drive to estimate its write rate. The results can be passed to
+ * gis_calibration_estimate_seconds(). Nothing is written to the drive.
+ */
+void
+gis_calibration_async (GFile              *image,
+                       gint                drive_fd,
+                       const gchar        *device,
+                       const gchar        *connection_bus,
+                       GCancellable       *cancellable,
+                       GAsyncReadyCallback callback,
+                       gpointer            user_data)
+{
+  g_autoptr(GTask) task = NULL;
+  CalibrationData *d = g_new0 (CalibrationData, 1);
+
+  d->image = g_object_ref (image);
+  d->drive_fd = drive_fd;
+  d->device = g_strdup (device);
+  d->connection_bus = g_strdup (connection_bus);
+
+  task = g_task_new (NULL, cancellable, callback, user_data);
+  g_task_set_source_tag (task, gis_calibration_async);
+  g_task_set_task_data (task, d, (GDestroyNotify) calibration_data_free);
+  g_task_run_in_thread (task, calibration_thread_func);
+}
+
+/**
+ * gis_calibration_finish:
+ *
+ * Returns: (transfer full): the calibration results, or %NULL with @error set
+ */
+GisCalibration *
+gis_calibration_finish (GAsyncResult *result,
+                        GError      **error)
+{
+  g_return_val_if_fail (g_task_is_valid (result, NULL), NULL);
+  g_return_val_if_fail (g_task_get_source_tag (G_TASK (result)) ==
+                        gis_calibration_async, NULL);
+
+  return g_task_propagate_pointer (G_TASK (result), error);
+}
+
+/**
+ * gis_calibration_estimate_seconds:
+ * @compressed_size: bytes of the image file still to be read
+ * @image_size: uncompressed bytes still to be decompressed and written
+ *
+ * The stages of the pipeline run concurrently, connected by pipes, so the
+ * whole operation takes about as long as its slowest stage. Stages whose rate
+ * is unknown are ignored.
+ *
+ * Returns: the estimated time to write the image, in seconds, or 0 if no
+ *  estimate is available
+ */
+guint64
+gis_calibration_estimate_seconds (const GisCalibration *calibration,
+                                  guint64               compressed_size,
+                                  guint64               image_size)
+{
+  gdouble seconds = 0;
+
+  if (calibration == NULL)
+    return 0;
+
+  if (calibration->read_rate > 0)
+    seconds = MAX (seconds, compressed_size / calibration->read_rate);
+
+  if (calibration->decode_rate > 0)
+    seconds = MAX (seconds, image_size / calibration->decode_rate);
+
+  if (calibration->write_rate > 0)
+    seconds = MAX (seconds, image_size / calibration->write_rate);
+
+  return (guint64) (seconds + 0.5);
+}
+
+/**
+ * gis_calibration_format_estimate:
+ * @seconds: an estimate, as returned by gis_calibration_estimate_seconds()
+ *
+ * Returns: (transfer full): @seconds as a short, deliberately vague, phrase
+ *  such as "about 5 minutes"
+ */
+gchar *
+gis_calibration_format_estimate (guint64 seconds)
+{
+  guint minutes = (seconds + 59) / 60;
+
+  if (minutes <= 1)
+    return g_strdup (_("less than a minute"));
+
+  return g_strdup_printf (g_dngettext (GETTEXT_PACKAGE,
+                                       "about %u minute",
+                                       "about %u minutes",
+                                       minutes),
+                          minutes);
+}
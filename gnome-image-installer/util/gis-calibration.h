@@ -0,0 +1,62 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*- */
+/*
+ * Copyright © 2018 Endless Mobile, Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <gio/gio.h>
+
+G_BEGIN_DECLS
+
+/**
+ * GisCalibration:
+ * @read_rate: measured throughput reading the image file from its source, in
+ *  bytes per second
+ * @decode_rate: measured throughput of the decompressor, in uncompressed bytes
+ *  per second, or 0 if the image is not compressed
+ * @write_rate: estimated throughput writing to the target drive, in bytes per
+ *  second, or 0 if unknown
+ *
+ * Rates of each stage of the reformatting pipeline, as sampled by
+ * gis_calibration_async() or observed while writing.
+ */
+typedef struct {
+  gdouble read_rate;
+  gdouble decode_rate;
+  gdouble write_rate;
+} GisCalibration;
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (GisCalibration, g_free)
+
+void gis_calibration_async (GFile              *image,
+                            gint                drive_fd,
+                            const gchar        *device,
+                            const gchar        *connection_bus,
+                            GCancellable       *cancellable,
+                            GAsyncReadyCallback callback,
+                            gpointer            user_data);
+
+GisCalibration *gis_calibration_finish (GAsyncResult *result,
+                                        GError      **error);
+
+guint64 gis_calibration_estimate_seconds (const GisCalibration *calibration,
+                                          guint64               compressed_size,
+                                          guint64               image_size);
+
+gchar *gis_calibration_format_estimate (guint64 seconds);
+
+G_END_DECLS
@@ -0,0 +1,748 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*- */
+/*
+ * Copyright © 2018 Endless Mobile, Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+#include "config.h"
+#include "gis-chunk-manifest.h"
+
+#include <string.h>
+#include <glib/gi18n.h>
+
+#include "gis-buffer-pool.h"
+#include "gis-errors.h"
+#include "gis-sched.h"
+#include "gis-trace.h"
+
+#define MANIFEST_HEADER "eos-image-chunks 1"
+#define DIGEST_LEN 32
+#define DIGEST_STRLEN (DIGEST_LEN * 2)
+
+/* Bounds on what a well-formed manifest may ask for, so a corrupt one can't
+ * make us allocate absurd amounts of memory.
+ */
+#define MIN_CHUNK_SIZE GIS_CHUNK_MANIFEST_MIN_CHUNK_SIZE
+#define MAX_CHUNK_SIZE GIS_CHUNK_MANIFEST_MAX_CHUNK_SIZE
+#define MAX_N_CHUNKS (16 * 1024 * 1024)
+
+struct _GisChunkManifest {
+  gsize chunk_size;
+  guint64 image_size;
+  guint n_chunks;
+  gchar *root;
+  /* n_chunks binary SHA-256 digests, back to back */
+  guint8 *digests;
+};
+
+/**
+ * gis_chunk_manifest_get_default_file:
+ * @image: an image file
+ *
+ * Returns: (transfer full): where the manifest for @image would be, if it has
+ *  one
+ */
+GFile *
+gis_chunk_manifest_get_default_file (GFile *image)
+{
+  g_autoptr(GFile) parent = g_file_get_parent (image);
+  g_autofree gchar *basename = g_file_get_basename (image);
+  g_autofree gchar *name = g_strconcat (basename, GIS_CHUNK_MANIFEST_SUFFIX,
+                                        NULL);
+
+  return g_file_get_child (parent, name);
+}
+
+/**
+ * gis_chunk_manifest_get_signature_file:
+ * @manifest: a manifest file
+ *
+ * Returns: (transfer full): the detached signature for @manifest
+ */
+GFile *
+gis_chunk_manifest_get_signature_file (GFile *manifest)
+{
+  g_autoptr(GFile) parent = g_file_get_parent (manifest);
+  g_autofree gchar *basename = g_file_get_basename (manifest);
+  g_autofree gchar *name = g_strconcat (basename,
+                                        GIS_CHUNK_MANIFEST_SIGNATURE_SUFFIX,
+                                        NULL);
+
+  return g_file_get_child (parent, name);
+}
+
+/**
+ * gis_chunk_manifest_verify_signature:
+ * @manifest: a manifest file
+ * @keyring_path: GPG keyring holding the trusted signing keys
+ * @gpg_path: GPG executable
+ *
+ * Checks @manifest against its detached signature. The manifest is small, so
+ * this runs GPG synchronously; call it from a worker thread.
+ *
+ * Returns: %TRUE if @manifest is signed by a key in @keyring_path
+ */
+gboolean
+gis_chunk_manifest_verify_signature (GFile        *manifest,
+                                     const gchar  *keyring_path,
+                                     const gchar  *gpg_path,
+                                     GCancellable *cancellable,
+                                     GError      **error)
+{
+  g_autoptr(GFile) signature = gis_chunk_manifest_get_signature_file (manifest);
+  g_autofree gchar *manifest_path = g_file_get_path (manifest);
+  g_autofree gchar *signature_path = g_file_get_path (signature);
+  const gchar * const args[] = {
+      gpg_path,
+      /* Trust the one key in this keyring, and no others */
+      "--keyring", keyring_path,
+      "--no-default-keyring",
+      "--trust-model", "always",
+      "--verify", signature_path, manifest_path, NULL
+  };
+  g_autofree gchar *args_flat = g_strjoinv (" ", (gchar **) args);
+  g_autoptr(GSubprocess) subprocess = NULL;
+  g_autoptr(GError) local_error = NULL;
+
+  if (!g_file_query_exists (signature, cancellable))
+    {
+      g_set_error (error, GIS_IMAGE_ERROR, GIS_IMAGE_ERROR_VERIFICATION_FAILED,
+                   _("The signature file ‘%s’ does not exist."),
+                   signature_path);
+      return FALSE;
+    }
+
+  g_message ("Spawning %s", args_flat);
+  subprocess = g_subprocess_newv (args, G_SUBPROCESS_FLAGS_STDOUT_SILENCE,
+                                  error);
+  if (subprocess == NULL)
+    return FALSE;
+
+  if (!g_subprocess_wait_check (subprocess, cancellable, &local_error))
+    {
+      if (g_error_matches (local_error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+        {
+          g_subprocess_force_exit (subprocess);
+          g_propagate_error (error, g_steal_pointer (&local_error));
+          return FALSE;
+        }
+
+      g_message ("GPG subprocess failed: %s", local_error->message);
+      g_set_error (error, GIS_IMAGE_ERROR, GIS_IMAGE_ERROR_VERIFICATION_FAILED,
+                   _("The signature on the manifest file ‘%s’ is not valid."),
+                   manifest_path);
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
+static gboolean
+manifest_invalid (GError     **error,
+                  const gchar *path,
+                  const gchar *detail)
+{
+  g_set_error (error, GIS_IMAGE_ERROR, GIS_IMAGE_ERROR_VERIFICATION_FAILED,
+               /* Translators: the second placeholder is an untranslated
+                * technical description of the problem.
+                */
+               _("The manifest file ‘%s’ is invalid: %s"),
+               path, detail);
+  return FALSE;
+}
+
+static gboolean
+parse_field (const gchar *line,
+             const gchar *name,
+             guint64      min,
+             guint64      max,
+             guint64     *value_out)
+{
+  gsize name_len = strlen (name);
+
+  if (line == NULL ||
+      strncmp (line, name, name_len) != 0 ||
+      line[name_len] != ' ')
+    return FALSE;
+
+  return g_ascii_string_to_unsigned (line + name_len + 1, 10, min, max,
+                                     value_out, NULL);
+}
+
+static gboolean
+parse_digest (const gchar *hex,
+              guint8      *digest_out)
+{
+  gsize i;
+
+  if (hex == NULL || strlen (hex) != DIGEST_STRLEN)
+    return FALSE;
+
+  for (i = 0; i < DIGEST_LEN; i++)
+    {
+      gint hi = g_ascii_xdigit_value (hex[2 * i]);
+      gint lo = g_ascii_xdigit_value (hex[2 * i + 1]);
+
+      if (hi < 0 || lo < 0)
+        return FALSE;
+
+      digest_out[i] = (hi << 4) | lo;
+    }
+
+  return TRUE;
+}
+
+/**
+ * gis_chunk_manifest_load:
+ * @manifest: a manifest file, as described for #GisChunkManifest
+ *
+ * Parses @manifest, and checks that its root digest matches its chunk
+ * digests. This does not check its signature; see
+ * gis_chunk_manifest_verify_signature().
+ *
+ * Returns: (transfer full): the manifest
+ */
+GisChunkManifest *
+gis_chunk_manifest_load (GFile        *manifest,
+                         GCancellable *cancellable,
+                         GError      **error)
+{
+  g_autofree gchar *path = g_file_get_path (manifest);
+  g_autofree gchar *contents = NULL;
+  g_auto(GStrv) lines = NULL;
+  g_autoptr(GChecksum) root = g_checksum_new (G_CHECKSUM_SHA256);
+  g_autoptr(GisChunkManifest) self = NULL;
+  guint64 chunk_size, image_size, n_chunks;
+  guint8 root_digest[DIGEST_LEN];
+  guint i;
+
+  if (!g_file_load_contents (manifest, cancellable, &contents, NULL, NULL,
+                             error))
+    return NULL;
+
+  lines = g_strsplit (g_strstrip (contents), "\n", -1);
+
+  if (g_strcmp0 (lines[0], MANIFEST_HEADER) != 0)
+    {
+      manifest_invalid (error, path, "unknown format");
+      return NULL;
+    }
+
+  if (!parse_field (lines[1], "chunk-size", MIN_CHUNK_SIZE, MAX_CHUNK_SIZE,
+                    &chunk_size) ||
+      !parse_field (lines[2], "size", 0, G_MAXUINT64, &image_size))
+    {
+      manifest_invalid (error, path, "bad chunk-size or size");
+      return NULL;
+    }
+
+  n_chunks = image_size / chunk_size + (image_size % chunk_size != 0);
+  if (n_chunks > MAX_N_CHUNKS)
+    {
+      manifest_invalid (error, path, "too many chunks");
+      return NULL;
+    }
+
+  if (lines[3] == NULL || !g_str_has_prefix (lines[3], "root ") ||
+      !parse_digest (lines[3] + strlen ("root "), root_digest))
+    {
+      manifest_invalid (error, path, "bad root");
+      return NULL;
+    }
+
+  if (g_strv_length (lines) != 4 + n_chunks)
+    {
+      manifest_invalid (error, path, "wrong number of chunks");
+      return NULL;
+    }
+
+  self = g_new0 (GisChunkManifest, 1);
+  self->chunk_size = chunk_size;
+  self->image_size = image_size;
+  self->n_chunks = n_chunks;
+  self->digests = g_malloc (n_chunks * DIGEST_LEN);
+
+  for (i = 0; i < n_chunks; i++)
+    {
+      guint8 *digest = self->digests + i * DIGEST_LEN;
+
+      if (!parse_digest (g_strstrip (lines[4 + i]), digest))
+        {
+          manifest_invalid (error, path, "bad chunk digest");
+          return NULL;
+        }
+
+      g_checksum_update (root, digest, DIGEST_LEN);
+    }
+
+  self->root = g_ascii_strdown (lines[3] + strlen ("root "), -1);
+  if (g_strcmp0 (g_checksum_get_string (root), self->root) != 0)
+    {
+      manifest_invalid (error, path, "root does not match chunks");
+      return NULL;
+    }
+
+  return g_steal_pointer (&self);
+}
+
+void
+gis_chunk_manifest_free (GisChunkManifest *self)
+{
+  g_free (self->root);
+  g_free (self->digests);
+  g_free (self);
+}
+
+gsize
+gis_chunk_manifest_get_chunk_size (GisChunkManifest *self)
+{
+  return self->chunk_size;
+}
+
+guint64
+gis_chunk_manifest_get_image_size (GisChunkManifest *self)
+{
+  return self->image_size;
+}
+
+guint
+gis_chunk_manifest_get_n_chunks (GisChunkManifest *self)
+{
+  return self->n_chunks;
+}
+
+/**
+ * gis_chunk_manifest_get_root:
+ *
+ * Returns: the root digest, as lower-case hexadecimal digits, which identifies
+ *  the whole image
+ */
+const gchar *
+gis_chunk_manifest_get_root (GisChunkManifest *self)
+{
+  return self->root;
+}
+
+/**
+ * gis_chunk_manifest_check_chunk:
+ * @index: which chunk @data is, counting from 0
+ * @data: the contents of chunk @index
+ * @len: length of @data, which must be the chunk size except for the last
+ *  chunk
+ *
+ * Returns: %TRUE if @data matches the manifest
+ */
+gboolean
+gis_chunk_manifest_check_chunk (GisChunkManifest *self,
+                                guint             index,
+                                const guint8     *data,
+                                gsize             len,
+                                GError          **error)
+{
+  g_autoptr(GChecksum) sha256sum = NULL;
+  guint8 digest[DIGEST_LEN];
+  gsize digest_len = sizeof (digest);
+  guint64 expected_len;
+
+  if (index >= self->n_chunks)
+    {
+      g_set_error (error, GIS_IMAGE_ERROR, GIS_IMAGE_ERROR_VERIFICATION_FAILED,
+                   _("The image is larger than its manifest says."));
+      return FALSE;
+    }
+
+  expected_len = MIN (self->chunk_size,
+                      self->image_size - (guint64) index * self->chunk_size);
+  if (len != expected_len)
+    {
+      g_set_error (error, GIS_IMAGE_ERROR, GIS_IMAGE_ERROR_VERIFICATION_FAILED,
+                   _("The image is smaller than its manifest says."));
+      return FALSE;
+    }
+
+  sha256sum = g_checksum_new (G_CHECKSUM_SHA256);
+  g_checksum_update (sha256sum, data, len);
+  g_checksum_get_digest (sha256sum, digest, &digest_len);
+
+  if (memcmp (digest, self->digests + index * DIGEST_LEN, DIGEST_LEN) != 0)
+    {
+      g_set_error (error, GIS_IMAGE_ERROR, GIS_IMAGE_ERROR_VERIFICATION_FAILED,
+                   _("Chunk %u of the image does not match its manifest."),
+                   index);
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
+struct _GisChunkManifestBuilder {
+  gsize chunk_size;
+  guint64 image_size;
+  /* Digest of the chunk in progress, which holds chunk_len bytes so far */
+  GChecksum *chunk;
+  gsize chunk_len;
+  /* Binary digests of each complete chunk, back to back */
+  GByteArray *digests;
+};
+
+/**
+ * gis_chunk_manifest_builder_new:
+ * @chunk_size: size of each chunk, between %GIS_CHUNK_MANIFEST_MIN_CHUNK_SIZE
+ *  and %GIS_CHUNK_MANIFEST_MAX_CHUNK_SIZE
+ *
+ * Returns: (transfer full): a builder for a manifest with chunks of
+ *  @chunk_size bytes
+ */
+GisChunkManifestBuilder *
+gis_chunk_manifest_builder_new (gsize chunk_size)
+{
+  GisChunkManifestBuilder *self;
+
+  g_return_val_if_fail (chunk_size >= MIN_CHUNK_SIZE, NULL);
+  g_return_val_if_fail (chunk_size <= MAX_CHUNK_SIZE, NULL);
+
+  self = g_new0 (GisChunkManifestBuilder, 1);
+  self->chunk_size = chunk_size;
+  self->chunk = g_checksum_new (G_CHECKSUM_SHA256);
+  self->digests = g_byte_array_new ();
+
+  return self;
+}
+
+void
+gis_chunk_manifest_builder_free (GisChunkManifestBuilder *self)
+{
+  g_checksum_free (self->chunk);
+  g_byte_array_unref (self->digests);
+  g_free (self);
+}
+
+static void
+gis_chunk_manifest_builder_end_chunk (GisChunkManifestBuilder *self)
+{
+  guint8 digest[DIGEST_LEN];
+  gsize digest_len = sizeof (digest);
+
+  g_checksum_get_digest (self->chunk, digest, &digest_len);
+  g_byte_array_append (self->digests, digest, DIGEST_LEN);
+  g_checksum_reset (self->chunk);
+  self->chunk_len = 0;
+}
+
+/**
+ * gis_chunk_manifest_builder_update:
+ * @data: the next @len bytes of the image
+ *
+ * Feeds @data into the manifest. Chunks may span several calls.
+ */
+void
+gis_chunk_manifest_builder_update (GisChunkManifestBuilder *self,
+                                   const guint8            *data,
+                                   gsize                    len)
+{
+  while (len > 0)
+    {
+      gsize n = MIN (len, self->chunk_size - self->chunk_len);
+
+      g_checksum_update (self->chunk, data, n);
+      self->chunk_len += n;
+      self->image_size += n;
+      data += n;
+      len -= n;
+
+      if (self->chunk_len == self->chunk_size)
+        gis_chunk_manifest_builder_end_chunk (self);
+    }
+}
+
+/**
+ * gis_chunk_manifest_builder_end:
+ *
+ * Finishes the last chunk, if it is partial. No more data may be fed in
+ * afterwards.
+ *
+ * Returns: (transfer full): the manifest, in the format read by
+ *  gis_chunk_manifest_load()
+ */
+gchar *
+gis_chunk_manifest_builder_end (GisChunkManifestBuilder *self)
+{
+  g_autoptr(GChecksum) root = g_checksum_new (G_CHECKSUM_SHA256);
+  GString *manifest = g_string_new (MANIFEST_HEADER "\n");
+  gsize i, j;
+
+  if (self->chunk_len > 0)
+    gis_chunk_manifest_builder_end_chunk (self);
+
+  g_checksum_update (root, self->digests->data, self->digests->len);
+
+  g_string_append_printf (manifest, "chunk-size %" G_GSIZE_FORMAT "\n",
+                          self->chunk_size);
+  g_string_append_printf (manifest, "size %" G_GUINT64_FORMAT "\n",
+                          self->image_size);
+  g_string_append_printf (manifest, "root %s\n",
+                          g_checksum_get_string (root));
+
+  for (i = 0; i < self->digests->len; i += DIGEST_LEN)
+    {
+      for (j = 0; j < DIGEST_LEN; j++)
+        g_string_append_printf (manifest, "%02x", self->digests->data[i + j]);
+
+      g_string_append_c (manifest, '\n');
+    }
+
+  return g_string_free (manifest, FALSE);
+}
+
+typedef struct {
+  GisChunkVerifier *verifier;
+  guint index;
+  guint8 *data;
+  gsize len;
+} GisChunkVerifierItem;
+
+struct _GisChunkVerifier {
+  GisChunkManifest *manifest;
+  GisBufferPool *buffers;
+  guint next_index;
+  guint max_in_flight;
+  gboolean finished;
+
+  GMutex mutex;
+  GCond cond;
+
+  /* Guarded by mutex, since they are updated by the pool's threads */
+  guint in_flight;
+  guint64 bytes_verified;
+  GError *error;
+};
+
+static void
+gis_chunk_verifier_free_data (GisChunkVerifier *self,
+                              guint8           *data)
+{
+  if (self->buffers != NULL)
+    gis_buffer_pool_release (self->buffers, data);
+  else
+    g_free (data);
+}
+
+static void
+gis_chunk_verifier_check_item (gpointer data,
+                               gpointer user_data)
+{
+  GisChunkVerifierItem *item = data;
+  GisChunkVerifier *self = item->verifier;
+  g_autoptr(GError) error = NULL;
+  gboolean failed;
+  g_autoptr(GisSchedScope) sched = gis_sched_enter (GIS_SCHED_STAGE_VERIFY);
+
+  /* Once one chunk has failed, there's no point checking the rest */
+  g_mutex_lock (&self->mutex);
+  failed = self->error != NULL;
+  g_mutex_unlock (&self->mutex);
+
+  if (!failed)
+    {
+      GisTraceSpan *span = gis_trace_begin ("verify", "chunk");
+
+      gis_trace_span_set_arg (span, "index", item->index);
+      gis_trace_span_set_arg (span, "bytes", item->len);
+      gis_chunk_manifest_check_chunk (self->manifest, item->index, item->data,
+                                      item->len, &error);
+      gis_trace_end (span);
+    }
+
+  /* Once in_flight reaches 0, the verifier may be freed at any moment */
+  gis_chunk_verifier_free_data (self, item->data);
+
+  g_mutex_lock (&self->mutex);
+  self->in_flight--;
+  if (error != NULL && self->error == NULL)
+    self->error = g_steal_pointer (&error);
+  else if (!failed && error == NULL)
+    self->bytes_verified += item->len;
+  g_cond_broadcast (&self->cond);
+  g_mutex_unlock (&self->mutex);
+
+  g_slice_free (GisChunkVerifierItem, item);
+}
+
+/* One thread per core, shared by every verifier in the process, so that
+ * writing a split image to several drives at once doesn't start more hashing
+ * threads than there are cores to run them.
+ */
+static GThreadPool *
+gis_chunk_verifier_get_pool (void)
+{
+  static gsize pool = 0;
+
+  if (g_once_init_enter (&pool))
+    {
+      guint n_threads = MAX (1, g_get_num_processors ());
+      GThreadPool *new_pool = g_thread_pool_new (gis_chunk_verifier_check_item,
+                                                 NULL, n_threads, FALSE, NULL);
+
+      g_once_init_leave (&pool, (gsize) new_pool);
+    }
+
+  return (GThreadPool *) pool;
+}
+
+/* Waits for every chunk pushed so far to be checked */
+static void
+gis_chunk_verifier_wait (GisChunkVerifier *self)
+{
+  g_mutex_lock (&self->mutex);
+  while (self->in_flight > 0)
+    g_cond_wait (&self->cond, &self->mutex);
+  g_mutex_unlock (&self->mutex);
+}
+
+/**
+ * gis_chunk_verifier_new:
+ * @manifest: the manifest to check chunks against, which must outlive the
+ *  verifier
+ * @buffers: (nullable): the pool chunks pushed to the verifier come from,
+ *  which must outlive the verifier; if %NULL, they are allocated with
+ *  g_malloc()
+ *
+ * Returns: (transfer full): a new verifier, which checks chunks on a pool of
+ *  one thread per core shared with every other verifier
+ */
+GisChunkVerifier *
+gis_chunk_verifier_new (GisChunkManifest *manifest,
+                        GisBufferPool    *buffers)
+{
+  GisChunkVerifier *self = g_new0 (GisChunkVerifier, 1);
+  guint n_threads = MAX (1, g_get_num_processors ());
+
+  self->manifest = manifest;
+  self->buffers = buffers;
+  /* Enough chunks to keep every thread busy, plus one being filled. If they
+   * come from a pool, its budget bounds the memory they use, so queue more to
+   * smooth over uneven reads.
+   */
+  self->max_in_flight = buffers != NULL ? 2 * n_threads + 1 : n_threads + 1;
+  g_mutex_init (&self->mutex);
+  g_cond_init (&self->cond);
+
+  return self;
+}
+
+void
+gis_chunk_verifier_free (GisChunkVerifier *self)
+{
+  /* Waits for any chunks still being checked */
+  gis_chunk_verifier_wait (self);
+
+  g_clear_error (&self->error);
+  g_mutex_clear (&self->mutex);
+  g_cond_clear (&self->cond);
+  g_free (self);
+}
+
+/**
+ * gis_chunk_verifier_push:
+ * @data: (transfer full): the next chunk of the image, allocated as described
+ *  for gis_chunk_verifier_new()
+ * @len: length of @data
+ *
+ * Queues @data to be checked against the manifest. If too many chunks are
+ * already queued, this blocks until one has been checked, which bounds the
+ * memory used.
+ *
+ * Returns: %FALSE if a chunk has already failed verification
+ */
+gboolean
+gis_chunk_verifier_push (GisChunkVerifier *self,
+                         guint8           *data,
+                         gsize             len,
+                         GError          **error)
+{
+  GisChunkVerifierItem *item;
+
+  g_mutex_lock (&self->mutex);
+  while (self->in_flight >= self->max_in_flight && self->error == NULL)
+    g_cond_wait (&self->cond, &self->mutex);
+
+  if (self->error != NULL)
+    {
+      g_propagate_error (error, g_error_copy (self->error));
+      g_mutex_unlock (&self->mutex);
+      gis_chunk_verifier_free_data (self, data);
+      return FALSE;
+    }
+
+  self->in_flight++;
+  g_mutex_unlock (&self->mutex);
+
+  item = g_slice_new (GisChunkVerifierItem);
+  item->verifier = self;
+  item->index = self->next_index++;
+  item->data = data;
+  item->len = len;
+  g_thread_pool_push (gis_chunk_verifier_get_pool (), item, NULL);
+
+  return TRUE;
+}
+
+/**
+ * gis_chunk_verifier_finish:
+ *
+ * Waits for all queued chunks to be checked. No more may be pushed after this.
+ *
+ * Returns: %TRUE if every chunk in the manifest was pushed and matched
+ */
+gboolean
+gis_chunk_verifier_finish (GisChunkVerifier *self,
+                           GError          **error)
+{
+  g_return_val_if_fail (!self->finished, FALSE);
+
+  self->finished = TRUE;
+  gis_chunk_verifier_wait (self);
+
+  if (self->error != NULL)
+    {
+      g_propagate_error (error, g_error_copy (self->error));
+      return FALSE;
+    }
+
+  if (self->next_index != gis_chunk_manifest_get_n_chunks (self->manifest))
+    {
+      g_set_error (error, GIS_IMAGE_ERROR, GIS_IMAGE_ERROR_VERIFICATION_FAILED,
+                   _("The image is smaller than its manifest says."));
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
+/**
+ * gis_chunk_verifier_get_bytes_verified:
+ *
+ * Returns: how many bytes of the image have been checked so far
+ */
+guint64
+gis_chunk_verifier_get_bytes_verified (GisChunkVerifier *self)
+{
+  guint64 ret;
+
+  g_mutex_lock (&self->mutex);
+  ret = self->bytes_verified;
+  g_mutex_unlock (&self->mutex);
+
+  return ret;
+}
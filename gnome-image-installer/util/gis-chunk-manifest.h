@@ -0,0 +1,130 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*- */
+/*
+ * Copyright © 2018 Endless Mobile, Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+#pragma once
+
+#include <gio/gio.h>
+
+#include "gis-buffer-pool.h"
+
+G_BEGIN_DECLS
+
+/* Appended to the image's filename to find its manifest, and to the
+ * manifest's filename to find its detached signature.
+ */
+#define GIS_CHUNK_MANIFEST_SUFFIX ".chunks"
+#define GIS_CHUNK_MANIFEST_SIGNATURE_SUFFIX ".asc"
+
+/**
+ * GisChunkManifest:
+ *
+ * The contents of an image's chunk manifest: the SHA-256 digest of each
+ * fixed-size chunk of the (possibly compressed) image file, and a root digest
+ * over all of them. Since each chunk can be checked independently, they can be
+ * hashed on every core at once, and a mismatch identifies the corrupt chunk.
+ *
+ * The manifest is a text file:
+ *
+ * |[
+ * eos-image-chunks 1
+ * chunk-size 4194304
+ * size 1234567890
+ * root <hex SHA-256 of the concatenated binary chunk digests>
+ * <hex SHA-256 of chunk 0>
+ * <hex SHA-256 of chunk 1>
+ * …
+ * ]|
+ *
+ * and is trusted by virtue of a detached GPG signature alongside it.
+ */
+typedef struct _GisChunkManifest GisChunkManifest;
+
+/* Bounds on the chunk size a manifest may use. A chunk must fit in a
+ * #GisBufferPool alongside the other buffers used while writing an image.
+ */
+#define GIS_CHUNK_MANIFEST_MIN_CHUNK_SIZE (64 * 1024)
+#define GIS_CHUNK_MANIFEST_MAX_CHUNK_SIZE (16 * 1024 * 1024)
+
+GFile *gis_chunk_manifest_get_default_file (GFile *image);
+GFile *gis_chunk_manifest_get_signature_file (GFile *manifest);
+
+gboolean gis_chunk_manifest_verify_signature (GFile        *manifest,
+                                              const gchar  *keyring_path,
+                                              const gchar  *gpg_path,
+                                              GCancellable *cancellable,
+                                              GError      **error);
+
+GisChunkManifest *gis_chunk_manifest_load (GFile        *manifest,
+                                           GCancellable *cancellable,
+                                           GError      **error);
+void gis_chunk_manifest_free (GisChunkManifest *self);
+
+gsize gis_chunk_manifest_get_chunk_size (GisChunkManifest *self);
+guint64 gis_chunk_manifest_get_image_size (GisChunkManifest *self);
+guint gis_chunk_manifest_get_n_chunks (GisChunkManifest *self);
+const gchar *gis_chunk_manifest_get_root (GisChunkManifest *self);
+
+gboolean gis_chunk_manifest_check_chunk (GisChunkManifest *self,
+                                         guint             index,
+                                         const guint8     *data,
+                                         gsize             len,
+                                         GError          **error);
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (GisChunkManifest, gis_chunk_manifest_free)
+
+/**
+ * GisChunkManifestBuilder:
+ *
+ * Computes the manifest for an image as it is fed through in pieces of any
+ * size, for tools which produce images.
+ */
+typedef struct _GisChunkManifestBuilder GisChunkManifestBuilder;
+
+GisChunkManifestBuilder *gis_chunk_manifest_builder_new (gsize chunk_size);
+void gis_chunk_manifest_builder_free (GisChunkManifestBuilder *self);
+
+void gis_chunk_manifest_builder_update (GisChunkManifestBuilder *self,
+                                        const guint8            *data,
+                                        gsize                    len);
+gchar *gis_chunk_manifest_builder_end (GisChunkManifestBuilder *self);
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (GisChunkManifestBuilder,
+                               gis_chunk_manifest_builder_free)
+
+/**
+ * GisChunkVerifier:
+ *
+ * Checks consecutive chunks of an image against a #GisChunkManifest on a pool
+ * of threads, so that verification is not limited to a single core.
+ */
+typedef struct _GisChunkVerifier GisChunkVerifier;
+
+GisChunkVerifier *gis_chunk_verifier_new (GisChunkManifest *manifest,
+                                          GisBufferPool    *buffers);
+void gis_chunk_verifier_free (GisChunkVerifier *self);
+
+gboolean gis_chunk_verifier_push (GisChunkVerifier *self,
+                                  guint8           *data,
+                                  gsize             len,
+                                  GError          **error);
+gboolean gis_chunk_verifier_finish (GisChunkVerifier *self,
+                                    GError          **error);
+guint64 gis_chunk_verifier_get_bytes_verified (GisChunkVerifier *self);
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (GisChunkVerifier, gis_chunk_verifier_free)
+
+G_END_DECLS
@@ -0,0 +1,288 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*- */
+/*
+ * Copyright © 2018 Endless Mobile, Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+#include "gis-drive-benchmark.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <glib/gstdio.h>
+
+#include "glnx-errors.h"
+
+/* Reads are made in chunks of this size, at offsets which are multiples of
+ * it, which satisfies the alignment requirements of O_DIRECT.
+ */
+#define BENCHMARK_BUFFER_SIZE (1024 * 1024)
+
+/* We stop after whichever of these limits is reached first. */
+#define BENCHMARK_MAX_BYTES (64 * BENCHMARK_BUFFER_SIZE)
+#define BENCHMARK_MAX_USEC (G_USEC_PER_SEC)
+
+typedef struct {
+    gint fd;
+    gchar *device;
+    gchar *connection_bus;
+} BenchmarkData;
+
+static void
+benchmark_data_free (BenchmarkData *d)
+{
+  if (d->fd >= 0)
+    g_close (d->fd, NULL);
+  g_free (d->device);
+  g_free (d->connection_bus);
+  g_free (d);
+}
+
+/* Returns whether /sys/class/block/$name/queue/rotational is 1. Drives
+ * without this attribute, or where it can't be read, are assumed not to be
+ * rotational.
+ */
+static gboolean
+read_sysfs_rotational (const gchar *device)
+{
+  g_autofree gchar *name = g_path_get_basename (device);
+  g_autofree gchar *path = g_build_filename ("/sys/class/block", name,
+                                             "queue", "rotational", NULL);
+  g_autofree gchar *contents = NULL;
+  g_autoptr(GError) error = NULL;
+
+  if (!g_file_get_contents (path, &contents, NULL, &error))
+    {
+      g_debug ("couldn't read %s: %s", path, error->message);
+      return FALSE;
+    }
+
+  return g_strstrip (contents)[0] == '1';
+}
+
+static gboolean
+is_removable_bus (const gchar *connection_bus)
+{
+  /* These are the values UDisks uses for Drive:ConnectionBus */
+  return g_strcmp0 (connection_bus, "usb") == 0 ||
+         g_strcmp0 (connection_bus, "sdio") == 0 ||
+         g_strcmp0 (connection_bus, "ieee1394") == 0;
+}
+
+/**
+ * gis_drive_benchmark_run:
+ * @fd: a file descriptor open for reading on @device, ideally with O_DIRECT
+ *  (as returned by UDisks' OpenForBenchmark method). Ownership is not
+ *  transferred.
+ * @device: path to the block device, used to look up its queue parameters in
+ *  sysfs
+ * @connection_bus: (nullable): how the drive is connected, as reported by
+ *  UDisks' Drive:ConnectionBus property
+ *
+ * Synchronous version of gis_drive_benchmark_async(), for callers which are
+ * already running in a worker thread.
+ *
+ * Returns: (transfer full): the benchmark results, or %NULL with @error set
+ */
+GisDriveBenchmark *
+gis_drive_benchmark_run (gint           fd,
+                         const gchar   *device,
+                         const gchar   *connection_bus,
+                         GCancellable  *cancellable,
+                         GError       **error)
+{
+  g_autoptr(GisDriveBenchmark) benchmark = g_new0 (GisDriveBenchmark, 1);
+  void *buf = NULL;
+  guint64 total = 0;
+  gint64 start, elapsed = 0;
+  gboolean ret = TRUE;
+
+  if (posix_memalign (&buf, sysconf (_SC_PAGESIZE), BENCHMARK_BUFFER_SIZE) != 0)
+    g_error ("%s: failed to allocate %d bytes: %s",
+             G_STRFUNC, BENCHMARK_BUFFER_SIZE, g_strerror (errno));
+
+  start = g_get_monotonic_time ();
+  while (total < BENCHMARK_MAX_BYTES && elapsed < BENCHMARK_MAX_USEC)
+    {
+      ssize_t r;
+
+      if (g_cancellable_set_error_if_cancelled (cancellable, error))
+        {
+          ret = FALSE;
+          break;
+        }
+
+      r = pread (fd, buf, BENCHMARK_BUFFER_SIZE, total);
+      if (r < 0)
+        {
+          if (errno == EINTR)
+            continue;
+
+          ret = glnx_throw_errno_prefix (error, "Error reading %s", device);
+          break;
+        }
+      else if (r == 0)
+        {
+          break;
+        }
+
+      total += r;
+      elapsed = g_get_monotonic_time () - start;
+    }
+
+  free (buf);
+
+  if (!ret)
+    return NULL;
+
+  if (total == 0)
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                   "No data could be read from %s", device);
+      return NULL;
+    }
+
+  benchmark->read_rate = (gdouble) total * G_USEC_PER_SEC / MAX (elapsed, 1);
+  benchmark->rotational = read_sysfs_rotational (device);
+  benchmark->removable_bus = is_removable_bus (connection_bus);
+  benchmark->write_rate =
+    gis_drive_benchmark_estimate_write_rate (benchmark->read_rate,
+                                             benchmark->rotational,
+                                             benchmark->removable_bus);
+
+  g_message ("%s: read %" G_GUINT64_FORMAT " bytes in %" G_GINT64_FORMAT
+             " us (%.1f MB/s); rotational: %d; bus: %s; "
+             "estimated write rate %.1f MB/s",
+             device, total, elapsed, benchmark->read_rate / 1e6,
+             benchmark->rotational, connection_bus ?: "(unknown)",
+             benchmark->write_rate / 1e6);
+
+  return g_steal_pointer (&benchmark);
+}
+
+static void
+benchmark_thread_func (GTask        *task,
+                       gpointer      source_object,
+                       gpointer      task_data,
+                       GCancellable *cancellable)
+{
+  BenchmarkData *d = task_data;
+  GError *error = NULL;
+  GisDriveBenchmark *benchmark;
+
+  benchmark = gis_drive_benchmark_run (d->fd, d->device, d->connection_bus,
+                                       cancellable, &error);
+  if (benchmark == NULL)
+    g_task_return_error (task, error);
+  else
+    g_task_return_pointer (task, benchmark, g_free);
+}
+
+/**
+ * gis_drive_benchmark_async:
+ * @fd: a file descriptor open for reading on @device, ideally with O_DIRECT
+ *  (as returned by UDisks' OpenForBenchmark method). Ownership is transferred
+ *  to this function.
+ * @device: path to the block device, used to look up its queue parameters in
+ *  sysfs
+ * @connection_bus: (nullable): how the drive is connected, as reported by
+ *  UDisks' Drive:ConnectionBus property
+ *
+ * Times sequential reads from the start of @fd for about a second, and
+ * combines this with what the kernel and UDisks report about the drive to
+ * estimate how quickly an image could be written to it. Nothing is written to
+ * the drive.
+ */
+void
+gis_drive_benchmark_async (gint                fd,
+                           const gchar        *device,
+                           const gchar        *connection_bus,
+                           GCancellable       *cancellable,
+                           GAsyncReadyCallback callback,
+                           gpointer            user_data)
+{
+  g_autoptr(GTask) task = NULL;
+  BenchmarkData *d = g_new0 (BenchmarkData, 1);
+
+  d->fd = fd;
+  d->device = g_strdup (device);
+  d->connection_bus = g_strdup (connection_bus);
+
+  task = g_task_new (NULL, cancellable, callback, user_data);
+  g_task_set_source_tag (task, gis_drive_benchmark_async);
+  g_task_set_task_data (task, d, (GDestroyNotify) benchmark_data_free);
+  g_task_run_in_thread (task, benchmark_thread_func);
+}
+
+/**
+ * gis_drive_benchmark_finish:
+ *
+ * Returns: (transfer full): the benchmark results, or %NULL with @error set
+ */
+GisDriveBenchmark *
+gis_drive_benchmark_finish (GAsyncResult *result,
+                            GError      **error)
+{
+  g_return_val_if_fail (g_task_is_valid (result, NULL), NULL);
+  g_return_val_if_fail (g_task_get_source_tag (G_TASK (result)) ==
+                        gis_drive_benchmark_async, NULL);
+
+  return g_task_propagate_pointer (G_TASK (result), error);
+}
+
+/**
+ * gis_drive_benchmark_estimate_write_rate:
+ * @read_rate: measured sequential read throughput, in bytes per second
+ *
+ * We don't write to drives to benchmark them, since they may hold data the
+ * user hasn't yet agreed to erase. Instead, the write rate is estimated from
+ * the read rate using rough ratios for each class of drive. In particular,
+ * USB sticks and SD cards typically write several times more slowly than
+ * they read, while internal SSDs and spinning disks are much closer.
+ *
+ * Returns: estimated sequential write throughput, in bytes per second
+ */
+gdouble
+gis_drive_benchmark_estimate_write_rate (gdouble  read_rate,
+                                         gboolean rotational,
+                                         gboolean removable_bus)
+{
+  if (rotational)
+    return read_rate * 0.9;
+
+  if (removable_bus)
+    return read_rate * 0.3;
+
+  return read_rate * 0.7;
+}
+
+/**
+ * gis_drive_benchmark_estimate_seconds:
+ * @bytes: number of bytes to be written
+ *
+ * Returns: the estimated time to write @bytes to the drive, in seconds, or 0
+ *  if no estimate is available
+ */
+guint64
+gis_drive_benchmark_estimate_seconds (const GisDriveBenchmark *benchmark,
+                                      guint64                  bytes)
+{
+  if (benchmark == NULL || benchmark->write_rate <= 0)
+    return 0;
+
+  return (guint64) (bytes / benchmark->write_rate + 0.5);
+}
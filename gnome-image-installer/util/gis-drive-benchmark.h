@@ -0,0 +1,64 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*- */
+/*
+ * Copyright © 2018 Endless Mobile, Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <gio/gio.h>
+
+G_BEGIN_DECLS
+
+/**
+ * GisDriveBenchmark:
+ * @read_rate: measured sequential read throughput, in bytes per second
+ * @write_rate: estimated sequential write throughput, in bytes per second
+ * @rotational: whether the kernel reports the drive as rotational
+ * @removable_bus: whether the drive is attached via USB, SDIO or similar
+ */
+typedef struct {
+  gdouble read_rate;
+  gdouble write_rate;
+  gboolean rotational;
+  gboolean removable_bus;
+} GisDriveBenchmark;
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (GisDriveBenchmark, g_free)
+
+GisDriveBenchmark *gis_drive_benchmark_run (gint           fd,
+                                            const gchar   *device,
+                                            const gchar   *connection_bus,
+                                            GCancellable  *cancellable,
+                                            GError       **error);
+
+void gis_drive_benchmark_async (gint                fd,
+                                const gchar        *device,
+                                const gchar        *connection_bus,
+                                GCancellable       *cancellable,
+                                GAsyncReadyCallback callback,
+                                gpointer            user_data);
+
+GisDriveBenchmark *gis_drive_benchmark_finish (GAsyncResult *result,
+                                               GError      **error);
+
+gdouble gis_drive_benchmark_estimate_write_rate (gdouble  read_rate,
+                                                 gboolean rotational,
+                                                 gboolean removable_bus);
+
+guint64 gis_drive_benchmark_estimate_seconds (const GisDriveBenchmark *benchmark,
+                                              guint64                  bytes);
+
+G_END_DECLS
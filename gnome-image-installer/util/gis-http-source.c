@@ -0,0 +1,721 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*- */
+/*
+ * Copyright © 2018 Endless Mobile, Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+#include "gis-http-source.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#include "gis-errors.h"
+
+/* Images can be read from an HTTP(S) server, rather than from the installer's
+ * own partition. Only what the installer needs of HTTP/1.1 is implemented:
+ * GET requests for a single byte range, over a fresh connection each time,
+ * which the server must answer with 206 Partial Content. Redirects are not
+ * followed.
+ */
+
+#define HTTP_PORT 80
+#define HTTPS_PORT 443
+#define HTTP_TIMEOUT_SECONDS 30
+#define HTTP_MAX_HEADERS 100
+
+/* Requests which fail in a way which might not recur, such as a dropped
+ * connection, a timeout or a 5xx status, are tried this many times in all,
+ * with an exponentially-increasing delay in between.
+ */
+#define HTTP_ATTEMPTS 4
+#define HTTP_RETRY_DELAY_MS 500
+
+#define DEFAULT_CONNECTIONS 4
+#define DEFAULT_SEGMENT_SIZE (4 * 1024 * 1024)
+
+/**
+ * gis_http_source_is_uri:
+ * @uri: a path or URI
+ *
+ * Returns: %TRUE if @uri is an http:// or https:// URI
+ */
+gboolean
+gis_http_source_is_uri (const gchar *uri)
+{
+  g_autofree gchar *scheme = g_uri_parse_scheme (uri);
+
+  return scheme != NULL &&
+    (g_ascii_strcasecmp (scheme, "http") == 0 ||
+     g_ascii_strcasecmp (scheme, "https") == 0);
+}
+
+/* Splits @uri into what is needed to connect to the server, and the Host
+ * header and request target to send it.
+ */
+static gboolean
+http_parse_uri (const gchar         *uri,
+                GSocketConnectable **address,
+                gboolean            *tls,
+                gchar              **host,
+                gchar              **target,
+                GError             **error)
+{
+  g_autofree gchar *scheme = g_uri_parse_scheme (uri);
+  const gchar *authority;
+  const gchar *path;
+  const gchar *at;
+  const gchar *end;
+
+  if (!gis_http_source_is_uri (uri))
+    {
+      g_set_error (error, GIS_IMAGE_ERROR, GIS_IMAGE_ERROR_NOT_SUPPORTED,
+                   "%s is not an http:// or https:// URI", uri);
+      return FALSE;
+    }
+
+  *tls = g_ascii_strcasecmp (scheme, "https") == 0;
+  *address = g_network_address_parse_uri (uri, *tls ? HTTPS_PORT : HTTP_PORT,
+                                          error);
+  if (*address == NULL)
+    return FALSE;
+
+  authority = uri + strlen (scheme) + strlen ("://");
+  path = authority + strcspn (authority, "/?#");
+  at = memchr (authority, '@', path - authority);
+  if (at != NULL)
+    authority = at + 1;
+
+  *host = g_strndup (authority, path - authority);
+
+  end = path + strcspn (path, "#");
+  if (*path == '/')
+    *target = g_strndup (path, end - path);
+  else
+    *target = g_strdup_printf ("/%.*s", (gint) (end - path), path);
+
+  return TRUE;
+}
+
+/* Reads the response's status line and headers from @input, checking that it
+ * holds exactly the @length bytes at @offset, and finding the size of the
+ * whole file.
+ */
+static gboolean
+http_read_response_head (GDataInputStream  *input,
+                         const gchar       *uri,
+                         guint64            offset,
+                         gsize              length,
+                         guint64           *total,
+                         GCancellable      *cancellable,
+                         GError           **error)
+{
+  g_autofree gchar *status_line = NULL;
+  guint status = 0;
+  guint64 content_length = G_MAXUINT64;
+  guint64 start = 0, end = 0;
+  gboolean has_range = FALSE;
+  guint i;
+
+  status_line = g_data_input_stream_read_line (input, NULL, cancellable,
+                                               error);
+  if (status_line == NULL)
+    {
+      if (error != NULL && *error == NULL)
+        g_set_error (error, G_IO_ERROR, G_IO_ERROR_CONNECTION_CLOSED,
+                     "%s: connection closed without a response", uri);
+      return FALSE;
+    }
+
+  if (sscanf (status_line, "HTTP/%*u.%*u %u", &status) != 1)
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+                   "%s: malformed status line ‘%s’", uri, status_line);
+      return FALSE;
+    }
+
+  if (status == 200)
+    {
+      g_set_error (error, GIS_IMAGE_ERROR, GIS_IMAGE_ERROR_NOT_SUPPORTED,
+                   "%s: server does not support range requests", uri);
+      return FALSE;
+    }
+  else if (status == 404 || status == 410)
+    {
+      g_set_error (error, GIS_IMAGE_ERROR, GIS_IMAGE_ERROR_NOT_FOUND,
+                   "%s: %s", uri, status_line);
+      return FALSE;
+    }
+  else if (status >= 500)
+    {
+      /* Perhaps the server is overloaded; worth trying again */
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                   "%s: %s", uri, status_line);
+      return FALSE;
+    }
+  else if (status != 206)
+    {
+      g_set_error (error, GIS_IMAGE_ERROR, GIS_IMAGE_ERROR_NOT_SUPPORTED,
+                   "%s: %s", uri, status_line);
+      return FALSE;
+    }
+
+  for (i = 0; i < HTTP_MAX_HEADERS; i++)
+    {
+      g_autofree gchar *line = g_data_input_stream_read_line (input, NULL,
+                                                              cancellable,
+                                                              error);
+      gchar *value;
+
+      if (line == NULL)
+        {
+          if (error != NULL && *error == NULL)
+            g_set_error (error, G_IO_ERROR, G_IO_ERROR_CONNECTION_CLOSED,
+                         "%s: connection closed during headers", uri);
+          return FALSE;
+        }
+
+      g_strchomp (line);
+      if (*line == '\0')
+        break;
+
+      value = strchr (line, ':');
+      if (value == NULL)
+        continue;
+
+      *value++ = '\0';
+      g_strstrip (value);
+
+      if (g_ascii_strcasecmp (line, "Content-Length") == 0)
+        {
+          content_length = g_ascii_strtoull (value, NULL, 10);
+        }
+      else if (g_ascii_strcasecmp (line, "Content-Range") == 0)
+        {
+          has_range = sscanf (value,
+                              "bytes %" G_GUINT64_FORMAT
+                              "-%" G_GUINT64_FORMAT
+                              "/%" G_GUINT64_FORMAT,
+                              &start, &end, total) == 3;
+        }
+      else if (g_ascii_strcasecmp (line, "Transfer-Encoding") == 0 &&
+               g_ascii_strcasecmp (value, "identity") != 0)
+        {
+          g_set_error (error, GIS_IMAGE_ERROR, GIS_IMAGE_ERROR_NOT_SUPPORTED,
+                       "%s: unsupported transfer encoding ‘%s’", uri, value);
+          return FALSE;
+        }
+    }
+
+  if (i == HTTP_MAX_HEADERS)
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+                   "%s: too many headers", uri);
+      return FALSE;
+    }
+
+  if (!has_range || start != offset || end != offset + length - 1 ||
+      (content_length != G_MAXUINT64 && content_length != length))
+    {
+      g_set_error (error, GIS_IMAGE_ERROR, GIS_IMAGE_ERROR_WRONG_SIZE,
+                   "%s: server did not return bytes %" G_GUINT64_FORMAT
+                   "-%" G_GUINT64_FORMAT,
+                   uri, offset, offset + length - 1);
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
+/* Fetches the @length bytes at @offset in @uri into @out, once */
+static gboolean
+http_get_range_once (const gchar   *uri,
+                     guint64        offset,
+                     gsize          length,
+                     guint8        *out,
+                     guint64       *total,
+                     GCancellable  *cancellable,
+                     GError       **error)
+{
+  g_autoptr(GSocketConnectable) address = NULL;
+  g_autoptr(GSocketClient) client = NULL;
+  g_autoptr(GSocketConnection) connection = NULL;
+  g_autoptr(GDataInputStream) input = NULL;
+  g_autofree gchar *host = NULL;
+  g_autofree gchar *target = NULL;
+  g_autofree gchar *request = NULL;
+  guint64 total_size = 0;
+  gboolean tls = FALSE;
+  gsize n_read;
+
+  g_return_val_if_fail (length > 0, FALSE);
+
+  if (!http_parse_uri (uri, &address, &tls, &host, &target, error))
+    return FALSE;
+
+  client = g_socket_client_new ();
+  g_socket_client_set_timeout (client, HTTP_TIMEOUT_SECONDS);
+  g_socket_client_set_tls (client, tls);
+
+  connection = g_socket_client_connect (client, address, cancellable, error);
+  if (connection == NULL)
+    return FALSE;
+
+  request = g_strdup_printf ("GET %s HTTP/1.1\r\n"
+                             "Host: %s\r\n"
+                             "Range: bytes=%" G_GUINT64_FORMAT
+                             "-%" G_GUINT64_FORMAT "\r\n"
+                             "Accept-Encoding: identity\r\n"
+                             "User-Agent: " PACKAGE_NAME "/" PACKAGE_VERSION "\r\n"
+                             "Connection: close\r\n"
+                             "\r\n",
+                             target, host, offset, offset + length - 1);
+
+  if (!g_output_stream_write_all (
+          g_io_stream_get_output_stream (G_IO_STREAM (connection)),
+          request, strlen (request), NULL, cancellable, error))
+    return FALSE;
+
+  input = g_data_input_stream_new (
+      g_io_stream_get_input_stream (G_IO_STREAM (connection)));
+  g_data_input_stream_set_newline_type (input,
+                                        G_DATA_STREAM_NEWLINE_TYPE_CR_LF);
+
+  if (!http_read_response_head (input, uri, offset, length, &total_size,
+                                cancellable, error))
+    return FALSE;
+
+  if (!g_input_stream_read_all (G_INPUT_STREAM (input), out, length, &n_read,
+                                cancellable, error))
+    return FALSE;
+
+  if (n_read < length)
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_CONNECTION_CLOSED,
+                   "%s: connection closed after %" G_GSIZE_FORMAT
+                   " of %" G_GSIZE_FORMAT " bytes",
+                   uri, n_read, length);
+      return FALSE;
+    }
+
+  if (total != NULL)
+    *total = total_size;
+
+  return TRUE;
+}
+
+static void
+sleep_unless_cancelled (GCancellable *cancellable,
+                        guint         delay_ms)
+{
+  GPollFD pollfd;
+
+  if (g_cancellable_make_pollfd (cancellable, &pollfd))
+    {
+      g_poll (&pollfd, 1, delay_ms);
+      g_cancellable_release_fd (cancellable);
+    }
+  else
+    {
+      g_usleep (delay_ms * G_TIME_SPAN_MILLISECOND);
+    }
+}
+
+/* As http_get_range_once(), but retrying errors which might be transient:
+ * those in the G_IO_ERROR domain, such as timeouts and dropped connections,
+ * other than cancellation.
+ */
+static gboolean
+http_get_range (const gchar   *uri,
+                guint64        offset,
+                gsize          length,
+                guint8        *out,
+                guint64       *total,
+                GCancellable  *cancellable,
+                GError       **error)
+{
+  guint delay_ms = HTTP_RETRY_DELAY_MS;
+  guint attempt;
+
+  for (attempt = 1; ; attempt++)
+    {
+      g_autoptr(GError) local_error = NULL;
+
+      if (http_get_range_once (uri, offset, length, out, total, cancellable,
+                               &local_error))
+        return TRUE;
+
+      if (attempt == HTTP_ATTEMPTS ||
+          local_error->domain != G_IO_ERROR ||
+          g_error_matches (local_error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+        {
+          g_propagate_error (error, g_steal_pointer (&local_error));
+          return FALSE;
+        }
+
+      g_message ("fetching bytes %" G_GUINT64_FORMAT "-%" G_GUINT64_FORMAT
+                 " of %s failed (%s); retrying in %u ms",
+                 offset, offset + length - 1, uri, local_error->message,
+                 delay_ms);
+      sleep_unless_cancelled (cancellable, delay_ms);
+      delay_ms *= 2;
+    }
+}
+
+/**
+ * gis_http_source_query_size:
+ * @uri: an http:// or https:// URI
+ * @size: (out): location to store the size of the file at @uri, in bytes
+ *
+ * Finds the size of the file at @uri, and checks that the server supports
+ * range requests for it.
+ *
+ * Returns: %TRUE on success, or %FALSE with @error set
+ */
+gboolean
+gis_http_source_query_size (const gchar   *uri,
+                            guint64       *size,
+                            GCancellable  *cancellable,
+                            GError       **error)
+{
+  guint8 first_byte;
+
+  g_return_val_if_fail (uri != NULL, FALSE);
+  g_return_val_if_fail (size != NULL, FALSE);
+
+  return http_get_range (uri, 0, 1, &first_byte, size, cancellable, error);
+}
+
+/**
+ * gis_http_source_fetch:
+ * @uri: an http:// or https:// URI
+ * @max_size: the largest file to accept, in bytes
+ *
+ * Fetches the whole of a small file, such as an image's signature.
+ *
+ * Returns: (transfer full): the contents of the file at @uri, or %NULL with
+ *  @error set
+ */
+GBytes *
+gis_http_source_fetch (const gchar   *uri,
+                       gsize          max_size,
+                       GCancellable  *cancellable,
+                       GError       **error)
+{
+  g_autofree guint8 *data = NULL;
+  guint64 size;
+
+  g_return_val_if_fail (uri != NULL, NULL);
+
+  if (!gis_http_source_query_size (uri, &size, cancellable, error))
+    return NULL;
+
+  if (size > max_size)
+    {
+      g_set_error (error, GIS_IMAGE_ERROR, GIS_IMAGE_ERROR_WRONG_SIZE,
+                   "%s is %" G_GUINT64_FORMAT " bytes; expected at most %"
+                   G_GSIZE_FORMAT,
+                   uri, size, max_size);
+      return NULL;
+    }
+
+  if (size == 0)
+    return g_bytes_new (NULL, 0);
+
+  data = g_malloc (size);
+  if (!http_get_range (uri, 0, size, data, NULL, cancellable, error))
+    return NULL;
+
+  return g_bytes_new_take (g_steal_pointer (&data), size);
+}
+
+/* GisHttpSourceStream: the contents of a file on an HTTP server, fetched as
+ * a series of fixed-size segments, several at a time over separate
+ * connections, and handed to the reader in order.
+ */
+
+#define GIS_TYPE_HTTP_SOURCE_STREAM (gis_http_source_stream_get_type ())
+G_DECLARE_FINAL_TYPE (GisHttpSourceStream, gis_http_source_stream,
+                      GIS, HTTP_SOURCE_STREAM, GInputStream);
+
+typedef struct {
+  GisHttpSourceStream *stream;
+  guint index;
+  gboolean done;
+  guint8 *data;
+  gsize len;
+  GError *error;
+} HttpSlot;
+
+struct _GisHttpSourceStream {
+  GInputStream parent;
+
+  gchar *uri;
+  guint64 size;
+  gsize segment_size;
+  guint n_segments;
+
+  /* Cancelled when the stream is closed, to abandon requests in flight */
+  GCancellable *cancellable;
+
+  /* Segment i is fetched into slots[i % n_slots], as in
+   * GisSquashfsFileStream. There are twice as many slots as connections, so
+   * that each connection has a segment queued behind the one it is fetching.
+   * As there, each slot's data comes from buffers while it is in use.
+   */
+  GisBufferPool *buffers;
+  GThreadPool *pool;
+  GMutex mutex;
+  GCond cond;
+  HttpSlot *slots;
+  guint n_slots;
+  guint next_read;
+  guint next_submit;
+  gsize read_pos;
+};
+
+G_DEFINE_TYPE (GisHttpSourceStream, gis_http_source_stream,
+               G_TYPE_INPUT_STREAM);
+
+static void
+gis_http_source_stream_fetch_cb (gpointer data,
+                                 gpointer user_data)
+{
+  HttpSlot *slot = data;
+  GisHttpSourceStream *self = slot->stream;
+  guint64 offset = (guint64) slot->index * self->segment_size;
+  gsize len = MIN (self->segment_size, self->size - offset);
+  GError *error = NULL;
+
+  http_get_range (self->uri, offset, len, slot->data, NULL, self->cancellable,
+                  &error);
+
+  g_mutex_lock (&self->mutex);
+  slot->len = len;
+  slot->error = error;
+  slot->done = TRUE;
+  g_cond_broadcast (&self->cond);
+  g_mutex_unlock (&self->mutex);
+}
+
+/* Queues as many of the following segments as there are free slots, fetching
+ * ahead of the reader only while the buffer pool has room.
+ */
+static void
+gis_http_source_stream_submit (GisHttpSourceStream *self)
+{
+  while (self->next_submit < self->n_segments &&
+         self->next_submit < self->next_read + self->n_slots)
+    {
+      HttpSlot *slot = &self->slots[self->next_submit % self->n_slots];
+      guint8 *data;
+
+      if (self->next_submit == self->next_read)
+        data = gis_buffer_pool_acquire (self->buffers, self->segment_size);
+      else
+        data = gis_buffer_pool_try_acquire (self->buffers, self->segment_size);
+
+      if (data == NULL)
+        break;
+
+      g_mutex_lock (&self->mutex);
+      slot->data = data;
+      slot->index = self->next_submit;
+      slot->done = FALSE;
+      slot->len = 0;
+      g_clear_error (&slot->error);
+      g_mutex_unlock (&self->mutex);
+
+      g_thread_pool_push (self->pool, slot, NULL);
+      self->next_submit++;
+    }
+}
+
+static gssize
+gis_http_source_stream_read (GInputStream  *stream,
+                             void          *buffer,
+                             gsize          count,
+                             GCancellable  *cancellable,
+                             GError       **error)
+{
+  GisHttpSourceStream *self = GIS_HTTP_SOURCE_STREAM (stream);
+  HttpSlot *slot;
+  gsize n;
+
+  if (g_cancellable_set_error_if_cancelled (cancellable, error))
+    return -1;
+
+  if (self->next_read >= self->n_segments)
+    return 0;
+
+  gis_http_source_stream_submit (self);
+
+  /* Unlike decompressing a block, fetching a segment may take a while, so
+   * keep an eye on @cancellable while waiting.
+   */
+  slot = &self->slots[self->next_read % self->n_slots];
+  g_mutex_lock (&self->mutex);
+  while (!slot->done && !g_cancellable_is_cancelled (cancellable))
+    g_cond_wait_until (&self->cond, &self->mutex,
+                       g_get_monotonic_time () + G_TIME_SPAN_SECOND / 10);
+  g_mutex_unlock (&self->mutex);
+
+  if (g_cancellable_set_error_if_cancelled (cancellable, error))
+    return -1;
+
+  if (slot->error != NULL)
+    {
+      g_propagate_error (error, g_error_copy (slot->error));
+      return -1;
+    }
+
+  n = MIN (count, slot->len - self->read_pos);
+  memcpy (buffer, slot->data + self->read_pos, n);
+  self->read_pos += n;
+
+  if (self->read_pos == slot->len)
+    {
+      gis_buffer_pool_release (self->buffers, g_steal_pointer (&slot->data));
+      self->next_read++;
+      self->read_pos = 0;
+    }
+
+  return n;
+}
+
+static void
+gis_http_source_stream_stop (GisHttpSourceStream *self)
+{
+  g_cancellable_cancel (self->cancellable);
+
+  /* Drop segments which haven't been started, and wait for the rest to
+   * notice the cancellation
+   */
+  if (self->pool != NULL)
+    g_thread_pool_free (self->pool, TRUE, TRUE);
+  self->pool = NULL;
+}
+
+static gboolean
+gis_http_source_stream_close (GInputStream  *stream,
+                              GCancellable  *cancellable,
+                              GError       **error)
+{
+  gis_http_source_stream_stop (GIS_HTTP_SOURCE_STREAM (stream));
+  return TRUE;
+}
+
+static void
+gis_http_source_stream_finalize (GObject *object)
+{
+  GisHttpSourceStream *self = GIS_HTTP_SOURCE_STREAM (object);
+  guint i;
+
+  gis_http_source_stream_stop (self);
+
+  for (i = 0; i < self->n_slots; i++)
+    {
+      gis_buffer_pool_release (self->buffers, self->slots[i].data);
+      g_clear_error (&self->slots[i].error);
+    }
+
+  g_free (self->slots);
+  g_clear_pointer (&self->buffers, gis_buffer_pool_unref);
+  g_free (self->uri);
+  g_clear_object (&self->cancellable);
+  g_mutex_clear (&self->mutex);
+  g_cond_clear (&self->cond);
+
+  G_OBJECT_CLASS (gis_http_source_stream_parent_class)->finalize (object);
+}
+
+static void
+gis_http_source_stream_class_init (GisHttpSourceStreamClass *klass)
+{
+  GObjectClass *object_class = G_OBJECT_CLASS (klass);
+  GInputStreamClass *stream_class = G_INPUT_STREAM_CLASS (klass);
+
+  object_class->finalize = gis_http_source_stream_finalize;
+
+  stream_class->read_fn = gis_http_source_stream_read;
+  stream_class->close_fn = gis_http_source_stream_close;
+}
+
+static void
+gis_http_source_stream_init (GisHttpSourceStream *self)
+{
+  self->cancellable = g_cancellable_new ();
+  g_mutex_init (&self->mutex);
+  g_cond_init (&self->cond);
+}
+
+/**
+ * gis_http_source_open:
+ * @uri: an http:// or https:// URI
+ * @size: the size of the file at @uri, as found by
+ *  gis_http_source_query_size()
+ * @n_connections: how many segments to fetch at once, or 0 for a default
+ * @segment_size: how many bytes to fetch per request, or 0 for a default
+ * @buffers: (nullable): pool to fetch segments into, or %NULL to use one of
+ *  the minimum size
+ *
+ * Opens the file at @uri for reading. Its contents are fetched ahead of the
+ * reader, several segments at a time over separate connections, which makes
+ * better use of a fast network than a single connection can; each failed
+ * segment is retried on its own. Segments are only fetched ahead while
+ * @buffers has room for them, and nothing is fetched until the stream is
+ * first read.
+ *
+ * Returns: (transfer full): a stream of the file's contents
+ */
+GInputStream *
+gis_http_source_open (const gchar   *uri,
+                      guint64        size,
+                      guint          n_connections,
+                      gsize          segment_size,
+                      GisBufferPool *buffers)
+{
+  GisHttpSourceStream *self;
+  guint i;
+
+  g_return_val_if_fail (uri != NULL, NULL);
+
+  if (n_connections == 0)
+    n_connections = DEFAULT_CONNECTIONS;
+
+  self = g_object_new (GIS_TYPE_HTTP_SOURCE_STREAM, NULL);
+  self->buffers = buffers != NULL ? gis_buffer_pool_ref (buffers)
+                                  : gis_buffer_pool_new (0);
+
+  /* Every segment must fit in the pool at once */
+  if (segment_size == 0)
+    segment_size = DEFAULT_SEGMENT_SIZE;
+  segment_size = MIN (segment_size, gis_buffer_pool_get_budget (self->buffers));
+
+  self->uri = g_strdup (uri);
+  self->size = size;
+  self->segment_size = segment_size;
+  self->n_segments = (size + segment_size - 1) / segment_size;
+
+  self->n_slots = MAX (1, MIN (2 * n_connections, self->n_segments));
+  self->slots = g_new0 (HttpSlot, self->n_slots);
+  for (i = 0; i < self->n_slots; i++)
+    self->slots[i].stream = self;
+
+  self->pool = g_thread_pool_new (gis_http_source_stream_fetch_cb, NULL,
+                                  n_connections, FALSE, NULL);
+
+  return G_INPUT_STREAM (self);
+}
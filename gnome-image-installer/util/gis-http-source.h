@@ -0,0 +1,44 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*- */
+/*
+ * Copyright © 2018 Endless Mobile, Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+#pragma once
+
+#include <gio/gio.h>
+
+#include "gis-buffer-pool.h"
+
+G_BEGIN_DECLS
+
+gboolean      gis_http_source_is_uri     (const gchar   *uri);
+
+gboolean      gis_http_source_query_size (const gchar   *uri,
+                                          guint64       *size,
+                                          GCancellable  *cancellable,
+                                          GError       **error);
+
+GBytes       *gis_http_source_fetch      (const gchar   *uri,
+                                          gsize          max_size,
+                                          GCancellable  *cancellable,
+                                          GError       **error);
+
+GInputStream *gis_http_source_open       (const gchar   *uri,
+                                          guint64        size,
+                                          guint          n_connections,
+                                          gsize          segment_size,
+                                          GisBufferPool *buffers);
+
+G_END_DECLS
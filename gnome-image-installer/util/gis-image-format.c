@@ -0,0 +1,273 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*- */
+/*
+ * Copyright © 2018 Endless Mobile, Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+#include "config.h"
+#include "gis-image-format.h"
+
+#include <string.h>
+
+#include "gduxzdecompressor.h"
+#include "gis-squashfs.h"
+
+static GInputStream *
+open_file (GFile          *file,
+           guint           n_threads,
+           GisBufferPool  *buffers,
+           GCancellable   *cancellable,
+           GError        **error)
+{
+  return G_INPUT_STREAM (g_file_read (file, cancellable, error));
+}
+
+static GInputStream *
+open_squashfs (GFile          *file,
+               guint           n_threads,
+               GisBufferPool  *buffers,
+               GCancellable   *cancellable,
+               GError        **error)
+{
+  return gis_squashfs_open_file (file, GIS_SQUASHFS_IMAGE_PATH, n_threads,
+                                 buffers, NULL, error);
+}
+
+static GConverter *
+new_gzip_converter (void)
+{
+  return G_CONVERTER (g_zlib_decompressor_new (G_ZLIB_COMPRESSOR_FORMAT_GZIP));
+}
+
+static GConverter *
+new_xz_converter (void)
+{
+  return G_CONVERTER (gdu_xz_decompressor_new ());
+}
+
+static gboolean
+get_raw_image_size (GFile    *file,
+                    guint64  *size,
+                    GError  **error)
+{
+  g_autoptr(GFileInfo) info =
+    g_file_query_info (file, G_FILE_ATTRIBUTE_STANDARD_SIZE,
+                       G_FILE_QUERY_INFO_NONE, NULL, error);
+
+  if (info == NULL)
+    return FALSE;
+
+  *size = g_file_info_get_size (info);
+  return TRUE;
+}
+
+/* The xz index, at the end of the file, records the uncompressed size */
+static gboolean
+get_xz_image_size (GFile    *file,
+                   guint64  *size,
+                   GError  **error)
+{
+  *size = gdu_xz_decompressor_get_uncompressed_size (file);
+  if (*size == 0)
+    {
+      g_autofree gchar *uri = g_file_get_uri (file);
+
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+                   "Can't read the xz index of %s", uri);
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
+static gboolean
+get_squashfs_image_size (GFile    *file,
+                         guint64  *size,
+                         GError  **error)
+{
+  g_autoptr(GInputStream) input =
+    gis_squashfs_open_file (file, GIS_SQUASHFS_IMAGE_PATH, 1, NULL, size,
+                            error);
+
+  return input != NULL;
+}
+
+/* gzip records the uncompressed size too, but only modulo 4 GiB, which is
+ * smaller than most images; so it has no size oracle.
+ */
+static const GisImageFormat formats[] = {
+  {
+    .id = GIS_IMAGE_FORMAT_RAW,
+    .name = "raw",
+    .suffix = ".img",
+    .probe_compression = GPT_PROBE_COMPRESSION_NONE,
+    .open = open_file,
+    .get_image_size = get_raw_image_size,
+    .random_access = TRUE,
+  },
+  {
+    .id = GIS_IMAGE_FORMAT_GZIP,
+    .name = "gzip",
+    .suffix = ".gz",
+    .magic = "\x1f\x8b",
+    .magic_len = 2,
+    .probe_compression = GPT_PROBE_COMPRESSION_GZIP,
+    .decompressor = "gzip",
+    .new_converter = new_gzip_converter,
+    .open = open_file,
+  },
+  {
+    .id = GIS_IMAGE_FORMAT_XZ,
+    .name = "xz",
+    .suffix = ".xz",
+    .magic = "\xfd" "7zXZ\0",
+    .magic_len = 6,
+    .probe_compression = GPT_PROBE_COMPRESSION_XZ,
+    .decompressor = "xz",
+    .new_converter = new_xz_converter,
+    .open = open_file,
+    .get_image_size = get_xz_image_size,
+  },
+  {
+    .id = GIS_IMAGE_FORMAT_SQUASHFS,
+    .name = "squashfs",
+    .suffix = ".squash",
+    .magic = "hsqs",
+    .magic_len = 4,
+    .probe_compression = GPT_PROBE_COMPRESSION_NONE,
+    .open = open_squashfs,
+    .get_image_size = get_squashfs_image_size,
+    .random_access = TRUE,
+  },
+};
+
+/**
+ * gis_image_format_get:
+ *
+ * Returns: the registry entry for @id
+ */
+const GisImageFormat *
+gis_image_format_get (GisImageFormatId id)
+{
+  g_return_val_if_fail (id < G_N_ELEMENTS (formats), NULL);
+
+  return &formats[id];
+}
+
+/**
+ * gis_image_format_detect:
+ * @data: the first @len bytes of a file, ideally at least
+ *  %GIS_IMAGE_FORMAT_PROBE_SIZE
+ *
+ * Returns: the format whose magic bytes @data starts with. Anything else is
+ *  assumed to be a raw disk image; reading its partition table will tell
+ *  whether it really is one.
+ */
+const GisImageFormat *
+gis_image_format_detect (const guint8 *data,
+                         gsize         len)
+{
+  gsize i;
+
+  for (i = 0; i < G_N_ELEMENTS (formats); i++)
+    {
+      if (formats[i].magic != NULL &&
+          len >= formats[i].magic_len &&
+          memcmp (data, formats[i].magic, formats[i].magic_len) == 0)
+        return &formats[i];
+    }
+
+  return &formats[GIS_IMAGE_FORMAT_RAW];
+}
+
+/**
+ * gis_image_format_detect_file:
+ *
+ * Reads the start of @file to find its format, as for
+ * gis_image_format_detect().
+ *
+ * Returns: the format of @file, or %NULL if it can't be read
+ */
+const GisImageFormat *
+gis_image_format_detect_file (GFile         *file,
+                              GCancellable  *cancellable,
+                              GError       **error)
+{
+  g_autoptr(GFileInputStream) input = g_file_read (file, cancellable, error);
+  guint8 data[GIS_IMAGE_FORMAT_PROBE_SIZE];
+  gsize len = 0;
+
+  if (input == NULL ||
+      !g_input_stream_read_all (G_INPUT_STREAM (input), data, sizeof data,
+                                &len, cancellable, error))
+    return NULL;
+
+  return gis_image_format_detect (data, len);
+}
+
+/**
+ * gis_image_format_peek:
+ *
+ * Finds the format of the stream @input without consuming any of it, so that
+ * the same stream can then be read from the start.
+ *
+ * Returns: the format of @input, or %NULL if it can't be read
+ */
+const GisImageFormat *
+gis_image_format_peek (GBufferedInputStream  *input,
+                       GCancellable          *cancellable,
+                       GError               **error)
+{
+  gsize available = 0;
+
+  while ((available = g_buffered_input_stream_get_available (input)) <
+         GIS_IMAGE_FORMAT_PROBE_SIZE)
+    {
+      gssize r = g_buffered_input_stream_fill (
+          input, GIS_IMAGE_FORMAT_PROBE_SIZE - available, cancellable, error);
+
+      if (r < 0)
+        return NULL;
+
+      if (r == 0)
+        break;
+    }
+
+  return gis_image_format_detect (
+      g_buffered_input_stream_peek_buffer (input, &available), available);
+}
+
+/**
+ * gis_image_format_guess:
+ * @name: a filename or URI
+ *
+ * Guesses the format of @name by its suffix. Only for images which can't be
+ * read until they are written, such as those on a server; otherwise, use
+ * gis_image_format_detect_file().
+ *
+ * Returns: the format conventionally named like @name, or raw if none is
+ */
+const GisImageFormat *
+gis_image_format_guess (const gchar *name)
+{
+  gsize i;
+
+  for (i = 0; i < G_N_ELEMENTS (formats); i++)
+    {
+      if (g_str_has_suffix (name, formats[i].suffix))
+        return &formats[i];
+    }
+
+  return &formats[GIS_IMAGE_FORMAT_RAW];
+}
@@ -0,0 +1,99 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*- */
+/*
+ * Copyright © 2018 Endless Mobile, Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+#pragma once
+
+#include <gio/gio.h>
+
+#include "gis-buffer-pool.h"
+#include "gpt_probe.h"
+
+G_BEGIN_DECLS
+
+typedef enum {
+  GIS_IMAGE_FORMAT_RAW,
+  GIS_IMAGE_FORMAT_GZIP,
+  GIS_IMAGE_FORMAT_XZ,
+  GIS_IMAGE_FORMAT_SQUASHFS,
+} GisImageFormatId;
+
+/* How much of the start of a file gis_image_format_detect() needs */
+#define GIS_IMAGE_FORMAT_PROBE_SIZE 16
+
+/**
+ * GisImageFormat:
+ * @id: which format this is
+ * @name: short name, for log messages
+ * @suffix: conventional filename suffix, only used for images which can't be
+ *  read before they are written; see gis_image_format_guess()
+ * @magic: bytes which files in this format start with, or %NULL for the
+ *  format assumed when no other matches
+ * @magic_len: length of @magic
+ * @probe_compression: how gpt_probe_stream() should read the disk image from
+ *  the stream returned by @open
+ * @decompressor: program which decompresses this format from stdin to stdout
+ *  when run with `-cd`, or %NULL if @open returns the disk image itself
+ * @new_converter: returns a new #GConverter which decompresses this format
+ *  in-process, or is %NULL if @decompressor is
+ * @open: opens a file in this format for reading; for containers, this reads
+ *  the disk image within, decoding it on up to the given number of threads
+ *  (0 for one per CPU) into buffers from the given pool (%NULL for a pool of
+ *  its own)
+ * @get_image_size: finds the size of the disk image in a file in this format
+ *  without decompressing it, or is %NULL if that isn't possible
+ * @random_access: whether any part of the disk image can be read without
+ *  reading everything before it
+ *
+ * An entry in the registry of image formats, which are told apart by their
+ * contents rather than their filenames.
+ */
+typedef struct {
+  GisImageFormatId id;
+  const gchar *name;
+  const gchar *suffix;
+
+  const gchar *magic;
+  gsize magic_len;
+
+  GptProbeCompression probe_compression;
+  const gchar *decompressor;
+  GConverter *(*new_converter) (void);
+
+  GInputStream *(*open) (GFile          *file,
+                         guint           n_threads,
+                         GisBufferPool  *buffers,
+                         GCancellable   *cancellable,
+                         GError        **error);
+  gboolean (*get_image_size) (GFile    *file,
+                              guint64  *size,
+                              GError  **error);
+  gboolean random_access;
+} GisImageFormat;
+
+const GisImageFormat *gis_image_format_get (GisImageFormatId id);
+
+const GisImageFormat *gis_image_format_detect (const guint8 *data,
+                                               gsize         len);
+const GisImageFormat *gis_image_format_detect_file (GFile         *file,
+                                                    GCancellable  *cancellable,
+                                                    GError       **error);
+const GisImageFormat *gis_image_format_peek (GBufferedInputStream  *input,
+                                             GCancellable          *cancellable,
+                                             GError               **error);
+const GisImageFormat *gis_image_format_guess (const gchar *name);
+
+G_END_DECLS
@@ -0,0 +1,199 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*- */
+/*
+ * Copyright © 2018 Endless Mobile, Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Speculative work on the selected image while the user is still choosing
+ * a disk and confirming: read ahead the start of the image, so the write can
+ * begin at full speed; and, only if it is to be verified before it is
+ * written, verify it, so that (if this finishes in time) GisScribe need not.
+ * It is still verified as it is written, since it will be read again.
+ * Otherwise, verifying it here would only compete with the write for the
+ * source disk. Squashfs images are signed over the disk image within them, so
+ * are left alone and verified as they are written instead.
+ */
+
+#include "config.h"
+#include "gis-image-prewarm.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <glib/gstdio.h>
+
+#include "gis-chunk-manifest.h"
+#include "gis-image-format.h"
+#include "gis-image-verifier.h"
+
+/* How much of the start of the image to read ahead */
+#define PREWARM_HEAD_SIZE (64 * 1024 * 1024)
+
+static GCancellable *prewarm_cancellable = NULL;
+static gint64 prewarm_verify_start_usec = 0;
+
+/* Asks the kernel to start reading the head of the image into the page cache,
+ * without waiting for it.
+ */
+static void
+gis_image_prewarm_read_ahead (GFile *image)
+{
+  g_autofree gchar *path = g_file_get_path (image);
+  gint fd;
+  gint ret;
+
+  fd = open (path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    {
+      g_message ("prewarm: can't open %s: %s", path, g_strerror (errno));
+      return;
+    }
+
+  ret = posix_fadvise (fd, 0, PREWARM_HEAD_SIZE, POSIX_FADV_WILLNEED);
+  if (ret != 0)
+    g_message ("prewarm: can't read ahead %s: %s", path, g_strerror (ret));
+
+  g_close (fd, NULL);
+}
+
+static void
+gis_image_prewarm_read_ahead_thread (GTask        *task,
+                                     gpointer      source_object,
+                                     gpointer      task_data,
+                                     GCancellable *cancellable)
+{
+  GFile *image = G_FILE (task_data);
+  const GisImageFormat *format;
+
+  /* Reading the image's header may itself take a while on a slow drive, so
+   * it is done here rather than by the caller.
+   */
+  format = gis_image_format_detect_file (image, cancellable, NULL);
+  if (format == NULL || format->id == GIS_IMAGE_FORMAT_SQUASHFS)
+    {
+      g_task_return_boolean (task, FALSE);
+      return;
+    }
+
+  gis_image_prewarm_read_ahead (image);
+
+  g_task_return_boolean (task, TRUE);
+}
+
+static void
+gis_image_prewarm_verify_cb (GObject      *source,
+                             GAsyncResult *result,
+                             gpointer      user_data)
+{
+  GisImageVerifier *verifier = GIS_IMAGE_VERIFIER (source);
+  g_autoptr(GError) error = NULL;
+
+  if (!gis_image_verifier_verify_finish (verifier, result, &error))
+    {
+      /* Not fatal: the scribe will verify the image as it writes it, and
+       * report any error then.
+       */
+      if (!g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+        g_message ("prewarm: verification failed: %s", error->message);
+      return;
+    }
+
+  g_message ("prewarm: image verified in %.1f seconds",
+             (gdouble) (g_get_monotonic_time () - prewarm_verify_start_usec)
+             / G_USEC_PER_SEC);
+}
+
+static void
+gis_image_prewarm_read_ahead_cb (GObject      *source,
+                                 GAsyncResult *result,
+                                 gpointer      user_data)
+{
+  g_autoptr(GisImageVerifier) verifier = user_data;
+  GCancellable *cancellable = g_task_get_cancellable (G_TASK (result));
+
+  if (!g_task_propagate_boolean (G_TASK (result), NULL) ||
+      verifier == NULL || g_cancellable_is_cancelled (cancellable))
+    return;
+
+  if (gis_image_verifier_is_verified (verifier))
+    {
+      g_message ("prewarm: image already verified");
+      return;
+    }
+
+  prewarm_verify_start_usec = g_get_monotonic_time ();
+  gis_image_verifier_verify_async (verifier, cancellable,
+                                   gis_image_prewarm_verify_cb, NULL);
+}
+
+/**
+ * gis_image_prewarm_start:
+ * @verify: whether the image is to be verified before it is written
+ *
+ * Starts reading ahead the head of @image in the background, and then if
+ * @verify is set, verifying it, cancelling any previous call. Nothing is done
+ * if @image is a squashfs image, or not an image at all. Errors are not
+ * reported; they will be encountered again when the image is written.
+ */
+void
+gis_image_prewarm_start (GFile    *image,
+                         GFile    *signature,
+                         GFile    *checksum,
+                         gboolean  verify)
+{
+  g_autoptr(GFile) manifest = NULL;
+  GisImageVerifier *verifier = NULL;
+  g_autoptr(GTask) task = NULL;
+
+  g_return_if_fail (G_IS_FILE (image));
+  g_return_if_fail (G_IS_FILE (signature));
+  g_return_if_fail (G_IS_FILE (checksum));
+
+  gis_image_prewarm_cancel ();
+  prewarm_cancellable = g_cancellable_new ();
+
+  /* Owned by gis_image_prewarm_read_ahead_cb() */
+  if (verify)
+    {
+      manifest = gis_chunk_manifest_get_default_file (image);
+      verifier = g_object_new (GIS_TYPE_IMAGE_VERIFIER,
+                               "image", image,
+                               "signature", signature,
+                               "checksum", checksum,
+                               "manifest", manifest,
+                               NULL);
+    }
+
+  task = g_task_new (NULL, prewarm_cancellable,
+                     gis_image_prewarm_read_ahead_cb, verifier);
+  g_task_set_source_tag (task, gis_image_prewarm_start);
+  g_task_set_task_data (task, g_object_ref (image), g_object_unref);
+  g_task_run_in_thread (task, gis_image_prewarm_read_ahead_thread);
+}
+
+/**
+ * gis_image_prewarm_cancel:
+ *
+ * Stops verifying the image, if gis_image_prewarm_start() is still doing so;
+ * for example, because the image is about to be written and verified anyway,
+ * and the two would compete for the source disk.
+ */
+void
+gis_image_prewarm_cancel (void)
+{
+  if (prewarm_cancellable != NULL)
+    g_cancellable_cancel (prewarm_cancellable);
+
+  g_clear_object (&prewarm_cancellable);
+}
@@ -0,0 +1,1037 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*- */
+/*
+ * Copyright © 2018 Endless Mobile, Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Verifies an image against its detached GPG signature, or failing that its
+ * SHA-256 checksum, by reading the image file directly rather than as part of
+ * writing it. Successful verifications are remembered for the lifetime of the
+ * process, keyed on the identity and modification time of the image and of the
+ * file it was verified against, so that the image need not be verified again
+ * before it is written.
+ */
+
+#include "config.h"
+#include "gis-image-verifier.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <glib/gi18n.h>
+#include <glib/gstdio.h>
+
+#include "glnx-errors.h"
+#include "gis-buffer-pool.h"
+#include "gis-chunk-manifest.h"
+#include "gis-errors.h"
+
+/* How much to hash between checks for cancellation and progress updates */
+#define HASH_CHUNK_SIZE (4 * 1024 * 1024)
+
+typedef struct _GisImageVerifier {
+  GObject parent;
+
+  GFile *image;
+  GFile *signature;
+  GFile *checksum;
+  GFile *manifest;
+  gchar *keyring_path;
+  gchar *gpg_path;
+  GisBufferPool *buffers;
+
+  GMutex mutex;
+  /* Guarded by mutex, since it is updated by the checksum thread */
+  gdouble progress;
+} GisImageVerifier;
+
+G_DEFINE_TYPE (GisImageVerifier, gis_image_verifier, G_TYPE_OBJECT)
+
+typedef enum {
+  PROP_IMAGE = 1,
+  PROP_SIGNATURE,
+  PROP_CHECKSUM,
+  PROP_KEYRING_PATH,
+  PROP_GPG_PATH,
+  PROP_MANIFEST,
+  PROP_BUFFER_POOL,
+  N_PROPERTIES
+} GisImageVerifierPropertyId;
+
+static GParamSpec *props[N_PROPERTIES] = { 0 };
+
+/* Owned keys, as returned by gis_image_verifier_get_key(), for images which
+ * have been verified.
+ */
+G_LOCK_DEFINE_STATIC (verified);
+static GHashTable *verified = NULL;
+
+typedef struct {
+  /* Identifies the image and verification file as they were when verification
+   * began.
+   */
+  gchar *key;
+  gchar *expected_checksum;
+  GSubprocess *subprocess;
+  GDataInputStream *stdout_;
+} GisImageVerifierTaskData;
+
+static void
+gis_image_verifier_task_data_free (GisImageVerifierTaskData *data)
+{
+  g_free (data->key);
+  g_free (data->expected_checksum);
+  g_clear_object (&data->subprocess);
+  g_clear_object (&data->stdout_);
+  g_slice_free (GisImageVerifierTaskData, data);
+}
+
+static void
+gis_image_verifier_set_property (GObject      *object,
+                                 guint         property_id,
+                                 const GValue *value,
+                                 GParamSpec   *pspec)
+{
+  GisImageVerifier *self = GIS_IMAGE_VERIFIER (object);
+
+  switch ((GisImageVerifierPropertyId) property_id)
+    {
+    case PROP_IMAGE:
+      g_clear_object (&self->image);
+      self->image = G_FILE (g_value_dup_object (value));
+      break;
+
+    case PROP_SIGNATURE:
+      g_clear_object (&self->signature);
+      self->signature = G_FILE (g_value_dup_object (value));
+      break;
+
+    case PROP_CHECKSUM:
+      g_clear_object (&self->checksum);
+      self->checksum = G_FILE (g_value_dup_object (value));
+      break;
+
+    case PROP_KEYRING_PATH:
+      g_free (self->keyring_path);
+      self->keyring_path = g_value_dup_string (value);
+      break;
+
+    case PROP_GPG_PATH:
+      g_free (self->gpg_path);
+      self->gpg_path = g_value_dup_string (value);
+      break;
+
+    case PROP_MANIFEST:
+      g_clear_object (&self->manifest);
+      self->manifest = G_FILE (g_value_dup_object (value));
+      break;
+
+    case PROP_BUFFER_POOL:
+      g_clear_pointer (&self->buffers, gis_buffer_pool_unref);
+      self->buffers = g_value_dup_boxed (value);
+      break;
+
+    case N_PROPERTIES:
+    default:
+      G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
+      break;
+    }
+}
+
+static void
+gis_image_verifier_get_property (GObject    *object,
+                                 guint       property_id,
+                                 GValue     *value,
+                                 GParamSpec *pspec)
+{
+  GisImageVerifier *self = GIS_IMAGE_VERIFIER (object);
+
+  switch ((GisImageVerifierPropertyId) property_id)
+    {
+    case PROP_IMAGE:
+      g_value_set_object (value, self->image);
+      break;
+
+    case PROP_SIGNATURE:
+      g_value_set_object (value, self->signature);
+      break;
+
+    case PROP_CHECKSUM:
+      g_value_set_object (value, self->checksum);
+      break;
+
+    case PROP_KEYRING_PATH:
+      g_value_set_string (value, self->keyring_path);
+      break;
+
+    case PROP_GPG_PATH:
+      g_value_set_string (value, self->gpg_path);
+      break;
+
+    case PROP_MANIFEST:
+      g_value_set_object (value, self->manifest);
+      break;
+
+    case PROP_BUFFER_POOL:
+      g_value_set_boxed (value, self->buffers);
+      break;
+
+    case N_PROPERTIES:
+    default:
+      G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
+      break;
+    }
+}
+
+static void
+gis_image_verifier_finalize (GObject *object)
+{
+  GisImageVerifier *self = GIS_IMAGE_VERIFIER (object);
+
+  g_clear_object (&self->image);
+  g_clear_object (&self->signature);
+  g_clear_object (&self->checksum);
+  g_clear_object (&self->manifest);
+  g_clear_pointer (&self->keyring_path, g_free);
+  g_clear_pointer (&self->gpg_path, g_free);
+  g_clear_pointer (&self->buffers, gis_buffer_pool_unref);
+  g_mutex_clear (&self->mutex);
+
+  G_OBJECT_CLASS (gis_image_verifier_parent_class)->finalize (object);
+}
+
+static void
+gis_image_verifier_class_init (GisImageVerifierClass *klass)
+{
+  GObjectClass *object_class = G_OBJECT_CLASS (klass);
+
+  object_class->set_property = gis_image_verifier_set_property;
+  object_class->get_property = gis_image_verifier_get_property;
+  object_class->finalize = gis_image_verifier_finalize;
+
+  props[PROP_IMAGE] = g_param_spec_object (
+      "image",
+      "Image",
+      "Image file to verify.",
+      G_TYPE_FILE,
+      G_PARAM_READWRITE | G_PARAM_CONSTRUCT_ONLY | G_PARAM_STATIC_STRINGS);
+
+  props[PROP_SIGNATURE] = g_param_spec_object (
+      "signature",
+      "Signature",
+      "Detached GPG signature for :image.",
+      G_TYPE_FILE,
+      G_PARAM_READWRITE | G_PARAM_CONSTRUCT_ONLY | G_PARAM_STATIC_STRINGS);
+
+  props[PROP_CHECKSUM] = g_param_spec_object (
+      "checksum",
+      "Checksum",
+      "File containing SHA256 checksum for :image.",
+      G_TYPE_FILE,
+      G_PARAM_READWRITE | G_PARAM_CONSTRUCT_ONLY | G_PARAM_STATIC_STRINGS);
+
+  props[PROP_KEYRING_PATH] = g_param_spec_string (
+      "keyring-path",
+      "Keyring path",
+      "Path to GPG keyring holding image signing public keys",
+      GIS_IMAGE_VERIFIER_DEFAULT_KEYRING,
+      G_PARAM_READWRITE | G_PARAM_CONSTRUCT_ONLY | G_PARAM_STATIC_STRINGS);
+
+  props[PROP_GPG_PATH] = g_param_spec_string (
+      "gpg-path",
+      "GPG path",
+      "Path to GPG executable",
+      GPG_PATH,
+      G_PARAM_READWRITE | G_PARAM_CONSTRUCT_ONLY | G_PARAM_STATIC_STRINGS);
+
+  /**
+   * GisImageVerifier:manifest:
+   *
+   * Chunk manifest for #GisImageVerifier:image, or %NULL. If it and its
+   * signature exist, they are used in preference to the signature or checksum,
+   * since the chunks can be checked in parallel.
+   */
+  props[PROP_MANIFEST] = g_param_spec_object (
+      "manifest",
+      "Manifest",
+      "Signed chunk manifest for :image, or NULL.",
+      G_TYPE_FILE,
+      G_PARAM_READWRITE | G_PARAM_CONSTRUCT_ONLY | G_PARAM_STATIC_STRINGS);
+
+  /**
+   * GisImageVerifier:buffer-pool:
+   *
+   * Pool to read chunks of #GisImageVerifier:image into when checking them
+   * against #GisImageVerifier:manifest, or %NULL to use one of the minimum
+   * size. A #GisScribe which verifies before writing passes its own, so that
+   * verifying doesn't use memory on top of its budget.
+   */
+  props[PROP_BUFFER_POOL] = g_param_spec_boxed (
+      "buffer-pool",
+      "Buffer pool",
+      "Pool to read chunks into, or NULL.",
+      GIS_TYPE_BUFFER_POOL,
+      G_PARAM_READWRITE | G_PARAM_CONSTRUCT_ONLY | G_PARAM_STATIC_STRINGS);
+
+  g_object_class_install_properties (object_class, N_PROPERTIES, props);
+}
+
+static void
+gis_image_verifier_init (GisImageVerifier *self)
+{
+  g_mutex_init (&self->mutex);
+}
+
+GisImageVerifier *
+gis_image_verifier_new (GFile *image,
+                        GFile *signature,
+                        GFile *checksum)
+{
+  g_return_val_if_fail (G_IS_FILE (image), NULL);
+  g_return_val_if_fail (G_IS_FILE (signature), NULL);
+  g_return_val_if_fail (G_IS_FILE (checksum), NULL);
+
+  return g_object_new (GIS_TYPE_IMAGE_VERIFIER,
+                       "image", image,
+                       "signature", signature,
+                       "checksum", checksum,
+                       NULL);
+}
+
+static void
+gis_image_verifier_set_progress (GisImageVerifier *self,
+                                 gdouble           progress)
+{
+  g_mutex_lock (&self->mutex);
+  self->progress = progress;
+  g_mutex_unlock (&self->mutex);
+}
+
+static gboolean
+gis_image_verifier_has_manifest (GisImageVerifier *self)
+{
+  g_autoptr(GFile) manifest_signature = NULL;
+
+  if (self->manifest == NULL || !g_file_query_exists (self->manifest, NULL))
+    return FALSE;
+
+  manifest_signature = gis_chunk_manifest_get_signature_file (self->manifest);
+  return g_file_query_exists (manifest_signature, NULL);
+}
+
+/* Returns the file the image will be verified against, which (as in
+ * GisScribe) is the manifest if it and its signature exist, or else the
+ * signature if it exists.
+ */
+static GFile *
+gis_image_verifier_get_verify_file (GisImageVerifier *self)
+{
+  if (gis_image_verifier_has_manifest (self))
+    return self->manifest;
+
+  if (g_file_query_exists (self->signature, NULL))
+    return self->signature;
+
+  return self->checksum;
+}
+
+static gchar *
+describe_file (GFile   *file,
+               GError **error)
+{
+  g_autoptr(GFileInfo) info = NULL;
+  g_autofree gchar *uri = g_file_get_uri (file);
+
+  info = g_file_query_info (file,
+                            G_FILE_ATTRIBUTE_STANDARD_SIZE ","
+                            G_FILE_ATTRIBUTE_TIME_MODIFIED ","
+                            G_FILE_ATTRIBUTE_TIME_MODIFIED_USEC ","
+                            G_FILE_ATTRIBUTE_UNIX_DEVICE ","
+                            G_FILE_ATTRIBUTE_UNIX_INODE,
+                            G_FILE_QUERY_INFO_NONE, NULL, error);
+  if (info == NULL)
+    return NULL;
+
+  return g_strdup_printf (
+      "%s %u:%" G_GUINT64_FORMAT " %" G_GOFFSET_FORMAT " %" G_GUINT64_FORMAT ".%u",
+      uri,
+      g_file_info_get_attribute_uint32 (info, G_FILE_ATTRIBUTE_UNIX_DEVICE),
+      g_file_info_get_attribute_uint64 (info, G_FILE_ATTRIBUTE_UNIX_INODE),
+      g_file_info_get_size (info),
+      g_file_info_get_attribute_uint64 (info, G_FILE_ATTRIBUTE_TIME_MODIFIED),
+      g_file_info_get_attribute_uint32 (info, G_FILE_ATTRIBUTE_TIME_MODIFIED_USEC));
+}
+
+/* Identifies the image, the file it is verified against, and what it is
+ * trusted by. If any of these change, the image must be verified again.
+ */
+static gchar *
+gis_image_verifier_get_key (GisImageVerifier *self,
+                            GError          **error)
+{
+  g_autofree gchar *image = describe_file (self->image, error);
+  g_autofree gchar *verify_file = NULL;
+
+  if (image == NULL)
+    return NULL;
+
+  verify_file = describe_file (gis_image_verifier_get_verify_file (self), error);
+  if (verify_file == NULL)
+    return NULL;
+
+  if (gis_image_verifier_has_manifest (self))
+    {
+      g_autoptr(GFile) signature =
+        gis_chunk_manifest_get_signature_file (self->manifest);
+      g_autofree gchar *manifest_signature = describe_file (signature, error);
+
+      if (manifest_signature == NULL)
+        return NULL;
+
+      return g_strjoin ("\n", image, verify_file, manifest_signature,
+                        self->keyring_path, self->gpg_path, NULL);
+    }
+
+  return g_strjoin ("\n", image, verify_file, self->keyring_path,
+                    self->gpg_path, NULL);
+}
+
+/**
+ * gis_image_verifier_is_verified:
+ *
+ * Returns: %TRUE if the image has already been verified, by this or another
+ *  #GisImageVerifier with the same parameters, and neither it nor the file it
+ *  was verified against has changed since.
+ */
+gboolean
+gis_image_verifier_is_verified (GisImageVerifier *self)
+{
+  g_autofree gchar *key = NULL;
+  gboolean ret;
+
+  g_return_val_if_fail (GIS_IS_IMAGE_VERIFIER (self), FALSE);
+
+  key = gis_image_verifier_get_key (self, NULL);
+  if (key == NULL)
+    return FALSE;
+
+  G_LOCK (verified);
+  ret = verified != NULL && g_hash_table_contains (verified, key);
+  G_UNLOCK (verified);
+
+  return ret;
+}
+
+/* Records that verification succeeded, and completes @task. */
+static void
+gis_image_verifier_return_verified (GTask *task)
+{
+  GisImageVerifier *self = g_task_get_source_object (task);
+  GisImageVerifierTaskData *data = g_task_get_task_data (task);
+  g_autofree gchar *key = gis_image_verifier_get_key (self, NULL);
+
+  /* If either file changed while it was being read, what we verified may not
+   * be what is there now.
+   */
+  if (g_strcmp0 (key, data->key) == 0)
+    {
+      G_LOCK (verified);
+      if (verified == NULL)
+        verified = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+      g_hash_table_add (verified, g_steal_pointer (&key));
+      G_UNLOCK (verified);
+    }
+  else
+    {
+      g_message ("image changed during verification; not caching the result");
+    }
+
+  gis_image_verifier_set_progress (self, 1);
+  g_task_return_boolean (task, TRUE);
+}
+
+/**
+ * gis_image_verifier_parse_gpg_progress:
+ * @line: a line from GPG's status output
+ * @progress: (out): set to the fraction of the image verified, or -1 if GPG
+ *  can't tell
+ *
+ * Returns: %TRUE if @line reported progress verifying the image
+ */
+gboolean
+gis_image_verifier_parse_gpg_progress (const gchar *line,
+                                       gdouble     *progress)
+{
+  g_autofree gchar *stripped = NULL;
+  g_auto(GStrv) arr = NULL;
+  guint64 curr, full;
+  gchar *units = NULL;
+  g_autoptr(GError) error = NULL;
+
+  if (!g_str_has_prefix (line, "[GNUPG:] PROGRESS"))
+    {
+      /* TODO: handle GOODSIG/EXPSIG/BADSIG/etc. to surface the exact
+       * verification error. Or use GPGME?
+       */
+      return FALSE;
+    }
+
+  /* https://git.gnupg.org/cgi-bin/gitweb.cgi?p=gnupg.git;a=blob;f=doc/DETAILS;h=0be55f4d;hb=refs/heads/master#l1043
+   * [GNUPG:] PROGRESS <what> <char> <cur> <total> [<units>]
+   * For example:
+   * [GNUPG:] PROGRESS /dev/mapper/endless- ? 676 4442 MiB
+   */
+  stripped = g_strchomp (g_strdup (line));
+  arr = g_strsplit (stripped, " ", -1);
+  if (g_strv_length (arr) < 6)
+    {
+      g_warning ("%s: GPG progress message has too few fields: %s",
+                 G_STRFUNC, line);
+      return FALSE;
+    }
+
+  if (!g_ascii_string_to_unsigned (arr[4], 10, 0, G_MAXUINT64, &curr, &error) ||
+      !g_ascii_string_to_unsigned (arr[5], 10, 0, G_MAXUINT64, &full, &error))
+    {
+      g_warning ("%s: couldn't parse GPG progress message '%s': %s",
+                 G_STRFUNC, line, error->message);
+      return FALSE;
+    }
+  units = arr[6];
+
+  if (full < 1024 && g_strcmp0 (units, "B") == 0)
+    {
+      /* GPG reports progress reading the signature, not just the image. Assume
+       * any file less than 1 KiB is the signature and ignore it.
+       */
+      return FALSE;
+    }
+
+  if (full == 0)
+    {
+      /* gpg can't determine the file size. */
+      *progress = -1;
+    }
+  else
+    {
+      *progress = CLAMP ((gdouble) curr / (gdouble) full, 0, 1);
+    }
+
+  return TRUE;
+}
+
+/**
+ * gis_image_verifier_read_checksum_file:
+ * @checksum: a file in the format written by sha256sum(1)
+ *
+ * Returns: (transfer full): the SHA-256 checksum held in @checksum, as
+ *  hexadecimal digits
+ */
+gchar *
+gis_image_verifier_read_checksum_file (GFile        *checksum,
+                                       GCancellable *cancellable,
+                                       GError      **error)
+{
+  g_autofree gchar *checksum_path = g_file_get_path (checksum);
+  g_autofree gchar *checksum_contents = NULL;
+  g_auto(GStrv) checksum_words = NULL;
+  gsize checksum_len;
+  gchar *cur;
+
+  if (!g_file_query_exists (checksum, NULL))
+    {
+      g_set_error (error, GIS_IMAGE_ERROR, GIS_IMAGE_ERROR_VERIFICATION_FAILED,
+                   _("The checksum file ‘%s’ does not exist."),
+                   checksum_path);
+      return NULL;
+    }
+
+  /* Read in the checksum file to get the expected checksum. */
+  if (!g_file_load_contents (checksum, cancellable, &checksum_contents,
+                             &checksum_len, NULL, error))
+    return NULL;
+
+  g_strstrip (checksum_contents);
+  checksum_words = g_strsplit (checksum_contents, " ", -1);
+  if (checksum_words[0] == NULL)
+    {
+      g_set_error (error, GIS_IMAGE_ERROR, GIS_IMAGE_ERROR_VERIFICATION_FAILED,
+                   _("The checksum file ‘%s’ does not contain a checksum."),
+                   checksum_path);
+      return NULL;
+    }
+
+  if (strlen (checksum_words[0]) != GIS_IMAGE_VERIFIER_CHECKSUM_STRLEN)
+    {
+      g_set_error (error, GIS_IMAGE_ERROR, GIS_IMAGE_ERROR_VERIFICATION_FAILED,
+                   _("The checksum ‘%s’ does not contain %d characters."),
+                   checksum_words[0], GIS_IMAGE_VERIFIER_CHECKSUM_STRLEN);
+      return NULL;
+    }
+
+  for (cur = checksum_words[0]; cur && *cur; cur++)
+    {
+      if (!g_ascii_isxdigit (*cur)) {
+        g_set_error (error, GIS_IMAGE_ERROR, GIS_IMAGE_ERROR_VERIFICATION_FAILED,
+                     _("The checksum ‘%s’ contains invalid character ‘%c’."),
+                     checksum_words[0], *cur);
+        return NULL;
+      }
+    }
+
+  return g_strdup (checksum_words[0]);
+}
+
+/* Hashes the file at @fd, which is @size bytes long, in large reads so the
+ * kernel can read ahead in large requests. The image is usually on removable
+ * media, so it is not mapped: a read error there, or the drive being
+ * unplugged, would raise SIGBUS rather than returning an error. Nor is it read
+ * with O_DIRECT, which would stop the kernel reading ahead while we hash, and
+ * bypass the page cache which pre-warming fills for the write to follow. The
+ * copy which either would save costs far less than SHA-256 itself.
+ */
+static gboolean
+gis_image_verifier_hash_fd (GisImageVerifier *self,
+                            gint              fd,
+                            guint64           size,
+                            GChecksum        *sha256sum,
+                            GCancellable     *cancellable,
+                            GError          **error)
+{
+  g_autofree guchar *buf = NULL;
+  guint64 offset = 0;
+
+  (void) posix_fadvise (fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+  buf = g_malloc (HASH_CHUNK_SIZE);
+
+  for (;;)
+    {
+      gssize n;
+
+      if (g_cancellable_set_error_if_cancelled (cancellable, error))
+        return FALSE;
+
+      n = read (fd, buf, HASH_CHUNK_SIZE);
+      if (n < 0 && errno == EINTR)
+        continue;
+      if (n < 0)
+        return glnx_throw_errno_prefix (error, "error reading image");
+      if (n == 0)
+        return TRUE;
+
+      g_checksum_update (sha256sum, buf, n);
+      offset += n;
+      if (size > 0)
+        gis_image_verifier_set_progress (self, MIN ((gdouble) offset / size, 1));
+    }
+}
+
+static void
+gis_image_verifier_checksum_thread (GTask        *task,
+                                    gpointer      source_object,
+                                    gpointer      task_data,
+                                    GCancellable *cancellable)
+{
+  GisImageVerifier *self = GIS_IMAGE_VERIFIER (source_object);
+  GisImageVerifierTaskData *data = task_data;
+  g_autofree gchar *path = g_file_get_path (self->image);
+  g_autoptr(GChecksum) sha256sum = g_checksum_new (G_CHECKSUM_SHA256);
+  GError *error = NULL;
+  const gchar *digest;
+  struct stat st;
+  gboolean ret;
+  gint fd;
+
+  fd = open (path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    {
+      glnx_throw_errno_prefix (&error, "can't open %s", path);
+      g_task_return_error (task, error);
+      return;
+    }
+
+  if (fstat (fd, &st) < 0)
+    {
+      glnx_throw_errno_prefix (&error, "can't stat %s", path);
+      g_close (fd, NULL);
+      g_task_return_error (task, error);
+      return;
+    }
+
+  ret = gis_image_verifier_hash_fd (self, fd, st.st_size, sha256sum,
+                                    cancellable, &error);
+  g_close (fd, NULL);
+
+  if (!ret)
+    {
+      g_task_return_error (task, error);
+      return;
+    }
+
+  digest = g_checksum_get_string (sha256sum);
+  if (g_strcmp0 (digest, data->expected_checksum) != 0)
+    {
+      g_task_return_new_error (
+          task, GIS_IMAGE_ERROR, GIS_IMAGE_ERROR_VERIFICATION_FAILED,
+          _("Image checksum ‘%s‘ does not match expected checksum ‘%s‘."),
+          digest, data->expected_checksum);
+      return;
+    }
+
+  gis_image_verifier_return_verified (task);
+}
+
+/* Fills @buf from @fd, unless the end of the file comes first.
+ *
+ * Returns: the number of bytes read, or -1 on error
+ */
+static gssize
+read_full (gint     fd,
+           guint8  *buf,
+           gsize    len,
+           GError **error)
+{
+  gsize total = 0;
+
+  while (total < len)
+    {
+      gssize n = read (fd, buf + total, len - total);
+
+      if (n < 0 && errno == EINTR)
+        continue;
+      if (n < 0)
+        {
+          glnx_throw_errno_prefix (error, "error reading image");
+          return -1;
+        }
+      if (n == 0)
+        break;
+
+      total += n;
+    }
+
+  return total;
+}
+
+/* Reads the image one chunk at a time, sequentially so as to be kind to slow
+ * media, and checks the chunks against the manifest on every core, within the
+ * budget of #GisImageVerifier:buffer-pool.
+ */
+static gboolean
+gis_image_verifier_check_chunks (GisImageVerifier *self,
+                                 GisChunkManifest *manifest,
+                                 gint              fd,
+                                 GCancellable     *cancellable,
+                                 GError          **error)
+{
+  g_autoptr(GisBufferPool) buffers =
+    self->buffers != NULL ? gis_buffer_pool_ref (self->buffers)
+                          : gis_buffer_pool_new (0);
+  g_autoptr(GisChunkVerifier) chunks = gis_chunk_verifier_new (manifest, buffers);
+  gsize chunk_size = gis_chunk_manifest_get_chunk_size (manifest);
+  guint64 image_size = gis_chunk_manifest_get_image_size (manifest);
+
+  (void) posix_fadvise (fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+  for (;;)
+    {
+      guint8 *buf;
+      gssize n;
+
+      if (g_cancellable_set_error_if_cancelled (cancellable, error))
+        return FALSE;
+
+      buf = gis_buffer_pool_acquire (buffers, chunk_size);
+      n = read_full (fd, buf, chunk_size, error);
+      if (n <= 0)
+        {
+          gis_buffer_pool_release (buffers, buf);
+          if (n < 0)
+            return FALSE;
+
+          break;
+        }
+
+      if (!gis_chunk_verifier_push (chunks, buf, n, error))
+        return FALSE;
+
+      if (image_size > 0)
+        gis_image_verifier_set_progress (
+            self,
+            (gdouble) gis_chunk_verifier_get_bytes_verified (chunks) / image_size);
+    }
+
+  return gis_chunk_verifier_finish (chunks, error);
+}
+
+static void
+gis_image_verifier_manifest_thread (GTask        *task,
+                                    gpointer      source_object,
+                                    gpointer      task_data,
+                                    GCancellable *cancellable)
+{
+  GisImageVerifier *self = GIS_IMAGE_VERIFIER (source_object);
+  g_autofree gchar *path = g_file_get_path (self->image);
+  g_autoptr(GisChunkManifest) manifest = NULL;
+  GError *error = NULL;
+  gboolean ret;
+  gint fd;
+
+  if (!gis_chunk_manifest_verify_signature (self->manifest, self->keyring_path,
+                                            self->gpg_path, cancellable,
+                                            &error))
+    {
+      g_task_return_error (task, error);
+      return;
+    }
+
+  manifest = gis_chunk_manifest_load (self->manifest, cancellable, &error);
+  if (manifest == NULL)
+    {
+      g_task_return_error (task, error);
+      return;
+    }
+
+  fd = open (path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    {
+      glnx_throw_errno_prefix (&error, "can't open %s", path);
+      g_task_return_error (task, error);
+      return;
+    }
+
+  ret = gis_image_verifier_check_chunks (self, manifest, fd, cancellable,
+                                         &error);
+  g_close (fd, NULL);
+
+  if (!ret)
+    {
+      g_task_return_error (task, error);
+      return;
+    }
+
+  gis_image_verifier_return_verified (task);
+}
+
+static void
+gis_image_verifier_gpg_wait_check_cb (GObject      *source,
+                                      GAsyncResult *result,
+                                      gpointer      user_data)
+{
+  g_autoptr(GTask) task = G_TASK (user_data);
+  g_autoptr(GError) error = NULL;
+
+  if (g_subprocess_wait_check_finish (G_SUBPROCESS (source), result, &error))
+    {
+      gis_image_verifier_return_verified (task);
+    }
+  else if (g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+    {
+      g_task_return_error (task, g_steal_pointer (&error));
+    }
+  else
+    {
+      /* TODO: surface more details about the error */
+      g_message ("GPG subprocess failed: %s", error->message);
+      g_task_return_new_error (task, GIS_IMAGE_ERROR,
+                               GIS_IMAGE_ERROR_VERIFICATION_FAILED,
+                               _("Image verification error."));
+    }
+}
+
+static void
+gis_image_verifier_gpg_read_line_cb (GObject      *source,
+                                     GAsyncResult *result,
+                                     gpointer      user_data)
+{
+  g_autoptr(GTask) task = G_TASK (user_data);
+  GisImageVerifier *self = g_task_get_source_object (task);
+  GisImageVerifierTaskData *data = g_task_get_task_data (task);
+  GCancellable *cancellable = g_task_get_cancellable (task);
+  g_autofree gchar *line = NULL;
+  g_autoptr(GError) error = NULL;
+  gdouble progress;
+
+  line = g_data_input_stream_read_line_finish_utf8 (data->stdout_, result,
+                                                    NULL, &error);
+  if (line != NULL)
+    {
+      g_debug ("%s: %s", G_STRFUNC, line);
+
+      if (gis_image_verifier_parse_gpg_progress (line, &progress))
+        gis_image_verifier_set_progress (self, progress);
+
+      g_data_input_stream_read_line_async (data->stdout_, G_PRIORITY_DEFAULT,
+                                           cancellable,
+                                           gis_image_verifier_gpg_read_line_cb,
+                                           g_steal_pointer (&task));
+      return;
+    }
+
+  /* GPG has closed its stdout, or we were cancelled */
+  if (error != NULL &&
+      g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+    g_subprocess_force_exit (data->subprocess);
+
+  g_subprocess_wait_check_async (data->subprocess, cancellable,
+                                 gis_image_verifier_gpg_wait_check_cb,
+                                 g_steal_pointer (&task));
+}
+
+static void
+gis_image_verifier_begin_gpg (GisImageVerifier *self,
+                              GTask            *task)
+{
+  GisImageVerifierTaskData *data = g_task_get_task_data (task);
+  g_autofree gchar *signature_path = g_file_get_path (self->signature);
+  g_autofree gchar *image_path = g_file_get_path (self->image);
+  /* GPG reads the image itself, so (unlike in GisScribe) it knows the size
+   * and needs no hint.
+   */
+  const gchar * const args[] = {
+      self->gpg_path,
+      "--enable-progress-filter", "--status-fd", "1",
+      /* Trust the one key in this keyring, and no others */
+      "--keyring", self->keyring_path,
+      "--no-default-keyring",
+      "--trust-model", "always",
+      "--verify", signature_path, image_path, NULL
+  };
+  g_autofree gchar *args_flat = g_strjoinv (" ", (gchar **) args);
+  g_autoptr(GSubprocessLauncher) launcher = NULL;
+  GError *error = NULL;
+
+  g_message ("Spawning %s", args_flat);
+  launcher = g_subprocess_launcher_new (G_SUBPROCESS_FLAGS_STDOUT_PIPE);
+  data->subprocess = g_subprocess_launcher_spawnv (launcher, args, &error);
+  if (data->subprocess == NULL)
+    {
+      g_task_return_error (task, error);
+      return;
+    }
+
+  data->stdout_ =
+    g_data_input_stream_new (g_subprocess_get_stdout_pipe (data->subprocess));
+  g_data_input_stream_read_line_async (data->stdout_, G_PRIORITY_DEFAULT,
+                                       g_task_get_cancellable (task),
+                                       gis_image_verifier_gpg_read_line_cb,
+                                       g_object_ref (task));
+}
+
+/**
+ * gis_image_verifier_verify_async:
+ *
+ * Verifies the image against its manifest if it and the manifest's signature
+ * exist, its signature if it exists, or its checksum otherwise. This does not
+ * consult the record of past verifications; call
+ * gis_image_verifier_is_verified() first if appropriate.
+ */
+void
+gis_image_verifier_verify_async (GisImageVerifier   *self,
+                                 GCancellable       *cancellable,
+                                 GAsyncReadyCallback callback,
+                                 gpointer            user_data)
+{
+  g_autoptr(GTask) task = g_task_new (self, cancellable, callback, user_data);
+  GisImageVerifierTaskData *data = g_slice_new0 (GisImageVerifierTaskData);
+  GError *error = NULL;
+
+  g_task_set_source_tag (task, gis_image_verifier_verify_async);
+  g_task_set_task_data (task, data,
+                        (GDestroyNotify) gis_image_verifier_task_data_free);
+
+  gis_image_verifier_set_progress (self, 0);
+
+  if (!gis_image_verifier_has_manifest (self) &&
+      !g_file_query_exists (self->signature, cancellable) &&
+      !g_file_query_exists (self->checksum, cancellable))
+    {
+      g_autofree gchar *signature_path = g_file_get_path (self->signature);
+      g_autofree gchar *checksum_path = g_file_get_path (self->checksum);
+      g_task_return_new_error (
+          task, GIS_IMAGE_ERROR, GIS_IMAGE_ERROR_VERIFICATION_FAILED,
+          _("Neither the signature file ‘%s’ nor the checksum file ‘%s’ exist."),
+          signature_path, checksum_path);
+      return;
+    }
+
+  data->key = gis_image_verifier_get_key (self, &error);
+  if (data->key == NULL)
+    {
+      g_task_return_error (task, error);
+      return;
+    }
+
+  if (gis_image_verifier_has_manifest (self))
+    {
+      g_task_run_in_thread (task, gis_image_verifier_manifest_thread);
+      return;
+    }
+
+  if (g_file_query_exists (self->signature, cancellable))
+    {
+      gis_image_verifier_begin_gpg (self, task);
+      return;
+    }
+
+  data->expected_checksum =
+    gis_image_verifier_read_checksum_file (self->checksum, cancellable, &error);
+  if (data->expected_checksum == NULL)
+    {
+      g_task_return_error (task, error);
+      return;
+    }
+
+  g_task_run_in_thread (task, gis_image_verifier_checksum_thread);
+}
+
+/**
+ * gis_image_verifier_verify_finish:
+ *
+ * Returns: %TRUE if the image was successfully verified
+ */
+gboolean
+gis_image_verifier_verify_finish (GisImageVerifier *self,
+                                  GAsyncResult     *result,
+                                  GError          **error)
+{
+  g_return_val_if_fail (g_task_is_valid (result, self), FALSE);
+  g_return_val_if_fail (g_task_get_source_tag (G_TASK (result)) ==
+                        gis_image_verifier_verify_async, FALSE);
+
+  return g_task_propagate_boolean (G_TASK (result), error);
+}
+
+/**
+ * gis_image_verifier_get_progress:
+ *
+ * Returns: the fraction of the image verified so far, between 0 and 1, or -1
+ *  if this can't be determined.
+ */
+gdouble
+gis_image_verifier_get_progress (GisImageVerifier *self)
+{
+  gdouble progress;
+
+  g_return_val_if_fail (GIS_IS_IMAGE_VERIFIER (self), -1);
+
+  g_mutex_lock (&self->mutex);
+  progress = self->progress;
+  g_mutex_unlock (&self->mutex);
+
+  return progress;
+}
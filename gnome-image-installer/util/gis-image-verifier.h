@@ -0,0 +1,57 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*- */
+/*
+ * Copyright © 2018 Endless Mobile, Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <gio/gio.h>
+
+G_BEGIN_DECLS
+
+#define GIS_IMAGE_VERIFIER_DEFAULT_KEYRING "/usr/share/keyrings/eos-image-keyring.gpg"
+
+/* String length of a sha256 checksum hex digest */
+#define GIS_IMAGE_VERIFIER_CHECKSUM_STRLEN 64
+
+#define GIS_TYPE_IMAGE_VERIFIER (gis_image_verifier_get_type ())
+G_DECLARE_FINAL_TYPE (GisImageVerifier, gis_image_verifier, GIS, IMAGE_VERIFIER, GObject)
+
+GisImageVerifier *gis_image_verifier_new (GFile *image,
+                                          GFile *signature,
+                                          GFile *checksum);
+
+gboolean gis_image_verifier_is_verified (GisImageVerifier *self);
+
+void gis_image_verifier_verify_async (GisImageVerifier   *self,
+                                      GCancellable       *cancellable,
+                                      GAsyncReadyCallback callback,
+                                      gpointer            user_data);
+
+gboolean gis_image_verifier_verify_finish (GisImageVerifier *self,
+                                           GAsyncResult     *result,
+                                           GError          **error);
+
+gdouble gis_image_verifier_get_progress (GisImageVerifier *self);
+
+gchar *gis_image_verifier_read_checksum_file (GFile        *checksum,
+                                              GCancellable *cancellable,
+                                              GError      **error);
+
+gboolean gis_image_verifier_parse_gpg_progress (const gchar *line,
+                                                gdouble     *progress);
+
+G_END_DECLS
@@ -0,0 +1,320 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*- */
+/*
+ * Copyright © 2018 Endless Mobile, Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+#include "config.h"
+#include "gis-perf-report.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+
+#define SYSFS_DEV_BLOCK "/sys/dev/block"
+
+/* The queue parameters which most affect how quickly a drive is written */
+static const gchar * const queue_attrs[] = {
+  "rotational",
+  "scheduler",
+  "nr_requests",
+  "max_sectors_kb",
+  "logical_block_size",
+  "physical_block_size",
+  "write_cache",
+  "discard_max_bytes",
+};
+
+static gchar *
+read_sysfs_attr (const gchar *dir,
+                 const gchar *name)
+{
+  g_autofree gchar *path = g_build_filename (dir, name, NULL);
+  gchar *contents = NULL;
+
+  if (!g_file_get_contents (path, &contents, NULL, NULL))
+    return NULL;
+
+  return g_strstrip (contents);
+}
+
+/* Returns the sysfs directory of the whole disk holding @devnum, or %NULL if
+ * it isn't a block device (such as a FUSE filesystem's).
+ */
+static gchar *
+get_disk_sysfs_dir (dev_t devnum)
+{
+  g_autofree gchar *link = g_strdup_printf (SYSFS_DEV_BLOCK "/%u:%u",
+                                            major (devnum), minor (devnum));
+  g_autofree gchar *partition = NULL;
+  char *resolved = realpath (link, NULL);
+  g_autofree gchar *dir = g_strdup (resolved);
+
+  free (resolved);
+  if (dir == NULL)
+    return NULL;
+
+  partition = g_build_filename (dir, "partition", NULL);
+  if (g_file_test (partition, G_FILE_TEST_EXISTS))
+    return g_path_get_dirname (dir);
+
+  return g_steal_pointer (&dir);
+}
+
+/* USB devices have a 'speed' attribute, in Mbit/s, some way above the disk */
+static gchar *
+get_usb_speed (const gchar *disk_dir)
+{
+  g_autofree gchar *dir = g_strdup (disk_dir);
+
+  while (g_strcmp0 (dir, "/") != 0 && g_strcmp0 (dir, ".") != 0)
+    {
+      g_autofree gchar *id_vendor = read_sysfs_attr (dir, "idVendor");
+      gchar *parent;
+
+      if (id_vendor != NULL)
+        return read_sysfs_attr (dir, "speed");
+
+      parent = g_path_get_dirname (dir);
+      g_free (dir);
+      dir = parent;
+    }
+
+  return NULL;
+}
+
+static void
+append_medium (GString     *out,
+               const gchar *disk_dir)
+{
+  g_autofree gchar *name = g_path_get_basename (disk_dir);
+  g_autofree gchar *rotational = NULL;
+
+  g_string_append_printf (out, "%s, ", name);
+
+  if (strstr (disk_dir, "/usb") != NULL)
+    {
+      g_autofree gchar *speed = get_usb_speed (disk_dir);
+
+      if (speed != NULL)
+        g_string_append_printf (out, "USB at %s Mbit/s", speed);
+      else
+        g_string_append (out, "USB");
+    }
+  else if (g_str_has_prefix (name, "sr"))
+    {
+      g_string_append (out, "optical");
+    }
+  else if (g_str_has_prefix (name, "mmcblk"))
+    {
+      g_string_append (out, "SD/MMC");
+    }
+  else if (g_str_has_prefix (name, "nvme"))
+    {
+      g_string_append (out, "NVMe");
+    }
+  else if (g_str_has_prefix (name, "loop"))
+    {
+      g_autofree gchar *loop_dir = g_build_filename (disk_dir, "loop", NULL);
+      g_autofree gchar *backing_file = read_sysfs_attr (loop_dir,
+                                                        "backing_file");
+
+      g_string_append_printf (out, "loop device backed by %s",
+                              backing_file != NULL ? backing_file : "?");
+    }
+  else
+    {
+      g_autofree gchar *queue_dir = g_build_filename (disk_dir, "queue", NULL);
+
+      rotational = read_sysfs_attr (queue_dir, "rotational");
+      if (g_strcmp0 (rotational, "1") == 0)
+        g_string_append (out, "rotational disk");
+      else
+        g_string_append (out, "disk");
+    }
+}
+
+static void
+append_queue (GString     *out,
+              const gchar *disk_dir)
+{
+  g_autofree gchar *queue_dir = g_build_filename (disk_dir, "queue", NULL);
+  gsize i;
+
+  g_string_append (out, "; queue:");
+
+  for (i = 0; i < G_N_ELEMENTS (queue_attrs); i++)
+    {
+      g_autofree gchar *value = read_sysfs_attr (queue_dir, queue_attrs[i]);
+      gchar *active;
+      gchar *end;
+
+      if (value == NULL)
+        continue;
+
+      /* The scheduler in use is listed in brackets among the others */
+      active = strchr (value, '[');
+      end = active != NULL ? strchr (active, ']') : NULL;
+      if (end != NULL)
+        {
+          *end = '\0';
+          g_string_append_printf (out, " %s=%s", queue_attrs[i], active + 1);
+        }
+      else
+        {
+          g_string_append_printf (out, " %s=%s", queue_attrs[i], value);
+        }
+    }
+}
+
+static gchar *
+describe_devnum (const gchar *label,
+                 dev_t        devnum)
+{
+  g_autofree gchar *disk_dir = get_disk_sysfs_dir (devnum);
+  GString *out = g_string_new (label);
+
+  g_string_append (out, ": ");
+
+  if (disk_dir == NULL)
+    {
+      g_string_append_printf (out, "device %u:%u, unknown medium",
+                              major (devnum), minor (devnum));
+      return g_string_free (out, FALSE);
+    }
+
+  append_medium (out, disk_dir);
+  append_queue (out, disk_dir);
+
+  return g_string_free (out, FALSE);
+}
+
+/**
+ * gis_perf_report_describe_device:
+ * @device_path: path to a block device, such as the drive being written to
+ *
+ * Returns: (transfer full): a line describing the medium behind
+ *  @device_path, such as whether it is attached by USB, and its queue
+ *  parameters
+ */
+gchar *
+gis_perf_report_describe_device (const gchar *device_path)
+{
+  struct stat st;
+
+  g_return_val_if_fail (device_path != NULL, NULL);
+
+  if (stat (device_path, &st) < 0)
+    return g_strdup_printf ("%s: %s", device_path, g_strerror (errno));
+
+  if (!S_ISBLK (st.st_mode))
+    return g_strdup_printf ("%s: not a block device", device_path);
+
+  return describe_devnum (device_path, st.st_rdev);
+}
+
+/**
+ * gis_perf_report_describe_file:
+ * @file: a file, such as the image being written
+ *
+ * Returns: (transfer full): a line describing the medium @file is read from,
+ *  as for gis_perf_report_describe_device()
+ */
+gchar *
+gis_perf_report_describe_file (GFile *file)
+{
+  g_autofree gchar *path = NULL;
+  g_autofree gchar *uri = NULL;
+  g_autofree gchar *scheme = NULL;
+  struct stat st;
+
+  g_return_val_if_fail (G_IS_FILE (file), NULL);
+
+  path = g_file_get_path (file);
+  if (path == NULL)
+    {
+      uri = g_file_get_uri (file);
+      scheme = g_file_get_uri_scheme (file);
+      return g_strdup_printf ("%s: read over %s", uri, scheme);
+    }
+
+  if (stat (path, &st) < 0)
+    return g_strdup_printf ("%s: %s", path, g_strerror (errno));
+
+  if (S_ISBLK (st.st_mode))
+    return describe_devnum (path, st.st_rdev);
+
+  return describe_devnum (path, st.st_dev);
+}
+
+static gchar *
+format_usec (gint64 usec)
+{
+  if (usec < 0)
+    return g_strdup ("-");
+
+  return g_strdup_printf ("%.1f s", (gdouble) usec / G_USEC_PER_SEC);
+}
+
+/**
+ * gis_perf_report_append_stages:
+ * @report: a report being built
+ * @stages: (array length=n_stages): what each stage of writing did
+ * @n_stages: length of @stages
+ *
+ * Appends a table of @stages to @report. A stage which spent much of its time
+ * stalled was held up by its neighbours; the one which spent least is the
+ * bottleneck.
+ */
+void
+gis_perf_report_append_stages (GString            *report,
+                               const GisPerfStage *stages,
+                               gsize               n_stages)
+{
+  gsize i;
+
+  g_string_append_printf (report, "%-12s %12s %10s %10s %10s %14s\n",
+                          "stage", "bytes", "elapsed", "busy", "stalled",
+                          "throughput");
+
+  for (i = 0; i < n_stages; i++)
+    {
+      const GisPerfStage *stage = &stages[i];
+      g_autofree gchar *bytes =
+        g_format_size_full (stage->bytes, G_FORMAT_SIZE_IEC_UNITS);
+      g_autofree gchar *elapsed = format_usec (stage->elapsed_usec);
+      g_autofree gchar *busy = format_usec (stage->busy_usec);
+      g_autofree gchar *stalled = format_usec (stage->stalled_usec);
+      g_autofree gchar *throughput = NULL;
+
+      if (stage->elapsed_usec > 0)
+        {
+          g_autofree gchar *rate =
+            g_format_size_full (stage->bytes * G_USEC_PER_SEC
+                                / stage->elapsed_usec,
+                                G_FORMAT_SIZE_IEC_UNITS);
+          throughput = g_strdup_printf ("%s/s", rate);
+        }
+      else
+        {
+          throughput = g_strdup ("-");
+        }
+
+      g_string_append_printf (report, "%-12s %12s %10s %10s %10s %14s\n",
+                              stage->name, bytes, elapsed, busy, stalled,
+                              throughput);
+    }
+}
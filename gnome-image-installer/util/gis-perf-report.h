@@ -0,0 +1,50 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*- */
+/*
+ * Copyright © 2018 Endless Mobile, Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+#pragma once
+
+#include <gio/gio.h>
+
+G_BEGIN_DECLS
+
+/**
+ * GisPerfStage:
+ * @name: the stage's name, as shown in the report
+ * @bytes: how much data passed through the stage
+ * @elapsed_usec: from the stage starting to it finishing
+ * @busy_usec: time spent on the stage's own work, or -1 if not known
+ * @stalled_usec: time spent waiting for the stages on either side, or -1 if
+ *  not known
+ *
+ * What one stage of writing an image did, for gis_perf_report_append_stages().
+ */
+typedef struct {
+  const gchar *name;
+  guint64 bytes;
+  gint64 elapsed_usec;
+  gint64 busy_usec;
+  gint64 stalled_usec;
+} GisPerfStage;
+
+gchar *gis_perf_report_describe_device (const gchar *device_path);
+gchar *gis_perf_report_describe_file (GFile *file);
+
+void gis_perf_report_append_stages (GString            *report,
+                                    const GisPerfStage *stages,
+                                    gsize               n_stages);
+
+G_END_DECLS
@@ -0,0 +1,269 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*- */
+/*
+ * Copyright © 2018 Endless Mobile, Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+#include "gis-reread-partitions.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <unistd.h>
+/* for BLKRRPART */
+#include <linux/fs.h>
+#include <linux/netlink.h>
+
+#include <glib/gstdio.h>
+
+#include "glnx-errors.h"
+
+/* The netlink multicast group on which udev re-broadcasts each uevent once
+ * it has finished processing it: creating device nodes and symlinks, and
+ * updating its database. This is what libudev calls a "udev" monitor, as
+ * opposed to a "kernel" monitor on group 1, whose events may arrive before
+ * the device is usable.
+ */
+#define UDEV_MONITOR_GROUP 2
+
+/* Messages on UDEV_MONITOR_GROUP start with this header, in host byte order
+ * apart from the magic number. Only the fields up to properties_len are used
+ * here.
+ */
+#define UDEV_MONITOR_PREFIX "libudev"
+#define UDEV_MONITOR_PROPERTIES_OFF_OFFSET 16
+#define UDEV_MONITOR_PROPERTIES_LEN_OFFSET 20
+#define UDEV_MONITOR_HEADER_MIN_SIZE 24
+
+#define UEVENT_BUFFER_SIZE (8 * 1024)
+
+static gint
+open_udev_monitor (GError **error)
+{
+  struct sockaddr_nl addr = {
+      .nl_family = AF_NETLINK,
+      .nl_groups = UDEV_MONITOR_GROUP,
+  };
+  gint sock;
+
+  sock = socket (AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC | SOCK_NONBLOCK,
+                 NETLINK_KOBJECT_UEVENT);
+  if (sock < 0)
+    {
+      glnx_throw_errno_prefix (error, "can't open uevent socket");
+      return -1;
+    }
+
+  if (bind (sock, (struct sockaddr *) &addr, sizeof addr) < 0)
+    {
+      glnx_throw_errno_prefix (error, "can't bind uevent socket");
+      g_close (sock, NULL);
+      return -1;
+    }
+
+  return sock;
+}
+
+/* Returns the set of "MAJOR:MINOR" strings of the partitions of the block
+ * device @dev, as the kernel currently sees them.
+ */
+static GHashTable *
+list_partitions (dev_t dev)
+{
+  g_autofree gchar *sys_path =
+    g_strdup_printf ("/sys/dev/block/%u:%u", major (dev), minor (dev));
+  g_autoptr(GHashTable) partitions =
+    g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+  g_autoptr(GDir) dir = NULL;
+  const gchar *name;
+
+  dir = g_dir_open (sys_path, 0, NULL);
+  if (dir == NULL)
+    return g_steal_pointer (&partitions);
+
+  while ((name = g_dir_read_name (dir)) != NULL)
+    {
+      g_autofree gchar *partition_path =
+        g_build_filename (sys_path, name, "partition", NULL);
+      g_autofree gchar *dev_path =
+        g_build_filename (sys_path, name, "dev", NULL);
+      gchar *contents = NULL;
+
+      if (!g_file_test (partition_path, G_FILE_TEST_EXISTS) ||
+          !g_file_get_contents (dev_path, &contents, NULL, NULL))
+        continue;
+
+      g_hash_table_add (partitions, g_strstrip (contents));
+    }
+
+  return g_steal_pointer (&partitions);
+}
+
+/* If @buf holds an "add" or "change" event from udev, returns its
+ * "MAJOR:MINOR"; or NULL otherwise.
+ */
+static gchar *
+parse_udev_event (const gchar *buf,
+                  gsize        len)
+{
+  guint32 properties_off, properties_len;
+  const gchar *p, *end;
+  const gchar *action = NULL, *maj = NULL, *min = NULL;
+
+  if (len < UDEV_MONITOR_HEADER_MIN_SIZE ||
+      memcmp (buf, UDEV_MONITOR_PREFIX, sizeof UDEV_MONITOR_PREFIX) != 0)
+    return NULL;
+
+  memcpy (&properties_off, buf + UDEV_MONITOR_PROPERTIES_OFF_OFFSET,
+          sizeof properties_off);
+  memcpy (&properties_len, buf + UDEV_MONITOR_PROPERTIES_LEN_OFFSET,
+          sizeof properties_len);
+  if (properties_off > len || properties_len > len - properties_off)
+    return NULL;
+
+  /* NUL-separated KEY=VALUE pairs */
+  end = buf + properties_off + properties_len;
+  for (p = buf + properties_off; p < end; p += strnlen (p, end - p) + 1)
+    {
+      if (g_str_has_prefix (p, "ACTION="))
+        action = p + strlen ("ACTION=");
+      else if (g_str_has_prefix (p, "MAJOR="))
+        maj = p + strlen ("MAJOR=");
+      else if (g_str_has_prefix (p, "MINOR="))
+        min = p + strlen ("MINOR=");
+    }
+
+  if (action == NULL || maj == NULL || min == NULL ||
+      (strcmp (action, "add") != 0 && strcmp (action, "change") != 0))
+    return NULL;
+
+  return g_strdup_printf ("%s:%s", maj, min);
+}
+
+/**
+ * gis_reread_partitions:
+ * @fd: a file descriptor open on a whole-disk block device. Ownership is not
+ *  transferred.
+ * @timeout_msec: how long to wait for udev
+ * @n_partitions: (out) (optional): location to store the number of partitions
+ *  the kernel found
+ * @latency_usec: (out) (optional): location to store the time taken until udev
+ *  had announced all of them
+ *
+ * Asks the kernel to reread the partition table on @fd with the BLKRRPART
+ * ioctl, then waits for udev to finish processing each of the partitions it
+ * finds, so that their device nodes and symlinks exist and UDisks knows
+ * about them by the time this returns. This is what partprobe followed by
+ * udevadm settle would do, without waiting for unrelated events.
+ *
+ * Fails with %G_IO_ERROR_NOT_SUPPORTED if @fd is not a block device;
+ * %G_IO_ERROR_PERMISSION_DENIED without CAP_SYS_ADMIN, in which case udev
+ * rereads the partition table itself once @fd is closed; and
+ * %G_IO_ERROR_TIMED_OUT if udev does not announce every partition within
+ * @timeout_msec, though the kernel has reread the table by then.
+ *
+ * Returns: %TRUE on success
+ */
+gboolean
+gis_reread_partitions (gint      fd,
+                       guint     timeout_msec,
+                       guint    *n_partitions,
+                       gint64   *latency_usec,
+                       GError  **error)
+{
+  struct stat buf;
+  gint sock;
+  g_autoptr(GHashTable) pending = NULL;
+  guint n;
+  gint64 start, deadline, now;
+  gchar event[UEVENT_BUFFER_SIZE];
+
+  if (fstat (fd, &buf) < 0)
+    return glnx_throw_errno_prefix (error, "can't stat drive");
+
+  if (!S_ISBLK (buf.st_mode))
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED,
+                   "not a block device");
+      return FALSE;
+    }
+
+  /* Listen before rereading, so that no events are missed */
+  sock = open_udev_monitor (error);
+  if (sock < 0)
+    return FALSE;
+
+  start = g_get_monotonic_time ();
+  if (ioctl (fd, BLKRRPART) < 0)
+    {
+      int errsv = errno;
+
+      g_close (sock, NULL);
+      g_set_error (error, G_IO_ERROR, g_io_error_from_errno (errsv),
+                   "can't reread partition table: %s", g_strerror (errsv));
+      return FALSE;
+    }
+
+  pending = list_partitions (buf.st_rdev);
+  n = g_hash_table_size (pending);
+  if (n_partitions != NULL)
+    *n_partitions = n;
+
+  deadline = start + (gint64) timeout_msec * 1000;
+  now = g_get_monotonic_time ();
+  while (g_hash_table_size (pending) > 0 && now < deadline)
+    {
+      struct pollfd pfd = { .fd = sock, .events = POLLIN };
+      ssize_t len;
+      int r;
+
+      r = poll (&pfd, 1, (deadline - now + 999) / 1000);
+      now = g_get_monotonic_time ();
+      if (r < 0 && errno != EINTR)
+        {
+          glnx_throw_errno_prefix (error, "can't wait for udev");
+          g_close (sock, NULL);
+          return FALSE;
+        }
+
+      while ((len = recv (sock, event, sizeof event, 0)) > 0)
+        {
+          g_autofree gchar *dev = parse_udev_event (event, len);
+
+          if (dev != NULL)
+            g_hash_table_remove (pending, dev);
+        }
+    }
+
+  g_close (sock, NULL);
+
+  if (latency_usec != NULL)
+    *latency_usec = now - start;
+
+  if (g_hash_table_size (pending) > 0)
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_TIMED_OUT,
+                   "udev did not announce %u of %u partitions within %u ms",
+                   g_hash_table_size (pending), n, timeout_msec);
+      return FALSE;
+    }
+
+  return TRUE;
+}
@@ -0,0 +1,461 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*- */
+/*
+ * Copyright © 2018 Endless Mobile, Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+#include "config.h"
+#include "gis-sched.h"
+
+#include <errno.h>
+#include <sched.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+/* From linux/ioprio.h, which older kernel headers lack */
+#define GIS_IOPRIO_WHO_PROCESS 1
+#define GIS_IOPRIO_CLASS_NONE 0
+#define GIS_IOPRIO_CLASS_BE 2
+#define GIS_IOPRIO_CLASS_SHIFT 13
+#define GIS_IOPRIO_VALUE(class, level) \
+  (((class) << GIS_IOPRIO_CLASS_SHIFT) | (level))
+#define GIS_IOPRIO_CLASS(value) ((value) >> GIS_IOPRIO_CLASS_SHIFT)
+
+#define MAX_NICE 19
+
+#define LATENCY_MONITOR_INTERVAL_MSEC 100
+
+typedef struct {
+  const gchar *name;
+  /* Added to the nice value of the thread or process entering the stage */
+  gint nice_increment;
+  /* Best-effort I/O priority, from 0 (highest) to 7, or -1 to leave it alone */
+  gint io_level;
+  /* Whether to keep the stage off the CPU left for the main loop, if
+   * EI_PIN_WORKERS is set
+   */
+  gboolean pin;
+} GisSchedPolicy;
+
+/* Decompressing and verifying keep a CPU busy for the whole write, so yield to
+ * the user interface; but they only read and write pipes, so have no I/O
+ * priority to lower. Reading the image competes for the USB stick with the
+ * live session which the user interface is loaded from; writing has the
+ * target drive to itself. Both are bound by I/O, and everything else waits on
+ * them, so their CPU priority is left alone.
+ */
+static const GisSchedPolicy policies[] = {
+  [GIS_SCHED_STAGE_READ] = { "read", 0, 6, FALSE },
+  [GIS_SCHED_STAGE_DECODE] = { "decode", 10, -1, TRUE },
+  [GIS_SCHED_STAGE_VERIFY] = { "verify", 10, -1, TRUE },
+  [GIS_SCHED_STAGE_WRITE] = { "write", 0, 4, FALSE },
+};
+
+struct _GisSchedScope {
+  GisSchedStage stage;
+
+  gboolean reniced;
+  gint old_nice;
+
+  gboolean reprioritized;
+  gint old_ioprio;
+
+  gboolean repinned;
+  cpu_set_t old_cpus;
+};
+
+static pid_t
+gis_sched_gettid (void)
+{
+  return (pid_t) syscall (SYS_gettid);
+}
+
+/*
+ * gis_sched_get_worker_cpus:
+ *
+ * Returns: (nullable): the CPUs which pinned stages may run on, which is all
+ *  those the process may run on except the first, or %NULL if the
+ *  EI_PIN_WORKERS environment variable is unset or there is only one CPU
+ */
+static const cpu_set_t *
+gis_sched_get_worker_cpus (void)
+{
+  static gsize initialized = 0;
+  static cpu_set_t worker_cpus;
+  static gboolean pin = FALSE;
+
+  if (g_once_init_enter (&initialized))
+    {
+      const gchar *env = g_getenv ("EI_PIN_WORKERS");
+      cpu_set_t process_cpus;
+      gint reserved = -1;
+      gint i;
+
+      CPU_ZERO (&worker_cpus);
+
+      if (env != NULL && *env != '\0' && g_strcmp0 (env, "0") != 0 &&
+          sched_getaffinity (getpid (), sizeof process_cpus,
+                             &process_cpus) == 0 &&
+          CPU_COUNT (&process_cpus) >= 2)
+        {
+          for (i = 0; i < CPU_SETSIZE; i++)
+            {
+              if (!CPU_ISSET (i, &process_cpus))
+                continue;
+
+              if (reserved < 0)
+                reserved = i;
+              else
+                CPU_SET (i, &worker_cpus);
+            }
+
+          pin = TRUE;
+          g_message ("keeping decompression and verification off CPU %d",
+                     reserved);
+        }
+
+      g_once_init_leave (&initialized, 1);
+    }
+
+  return pin ? &worker_cpus : NULL;
+}
+
+/* Lowering a thread's priority is only worthwhile if it can be raised again
+ * once the thread moves on to other work: unprivileged processes may only do
+ * so within RLIMIT_NICE.
+ */
+static gboolean
+gis_sched_can_restore_nice (gint nice_value)
+{
+  struct rlimit rlim;
+
+  if (geteuid () == 0)
+    return TRUE;
+
+  if (getrlimit (RLIMIT_NICE, &rlim) < 0)
+    return FALSE;
+
+  if (rlim.rlim_cur == RLIM_INFINITY)
+    return TRUE;
+
+  /* RLIMIT_NICE allows nice values down to 20 - rlim_cur */
+  return 20 - (gint64) rlim.rlim_cur <= nice_value;
+}
+
+/**
+ * gis_sched_enter:
+ * @stage: the stage the calling thread is about to run
+ *
+ * Applies the scheduling policy for @stage to the calling thread: its nice
+ * value, its I/O priority, and, if the EI_PIN_WORKERS environment variable is
+ * set, the CPUs it may run on. Anything which cannot be changed is left as it
+ * is.
+ *
+ * Returns: (transfer full): the thread's previous scheduling parameters, to
+ *  be restored with gis_sched_leave()
+ */
+GisSchedScope *
+gis_sched_enter (GisSchedStage stage)
+{
+  const GisSchedPolicy *policy;
+  GisSchedScope *scope;
+  const cpu_set_t *worker_cpus;
+  pid_t tid = gis_sched_gettid ();
+
+  g_return_val_if_fail (stage < G_N_ELEMENTS (policies), NULL);
+
+  policy = &policies[stage];
+  scope = g_new0 (GisSchedScope, 1);
+  scope->stage = stage;
+
+  if (policy->nice_increment > 0)
+    {
+      gint old_nice;
+
+      /* getpriority() may legitimately return -1 */
+      errno = 0;
+      old_nice = getpriority (PRIO_PROCESS, tid);
+      if (errno == 0 &&
+          old_nice < MAX_NICE &&
+          gis_sched_can_restore_nice (old_nice) &&
+          setpriority (PRIO_PROCESS, tid,
+                       MIN (old_nice + policy->nice_increment, MAX_NICE)) == 0)
+        {
+          scope->reniced = TRUE;
+          scope->old_nice = old_nice;
+        }
+    }
+
+  if (policy->io_level >= 0)
+    {
+      gint old_ioprio = syscall (SYS_ioprio_get, GIS_IOPRIO_WHO_PROCESS, tid);
+
+      if (old_ioprio >= 0 &&
+          syscall (SYS_ioprio_set, GIS_IOPRIO_WHO_PROCESS, tid,
+                   GIS_IOPRIO_VALUE (GIS_IOPRIO_CLASS_BE,
+                                     policy->io_level)) == 0)
+        {
+          scope->reprioritized = TRUE;
+          scope->old_ioprio = old_ioprio;
+        }
+    }
+
+  worker_cpus = policy->pin ? gis_sched_get_worker_cpus () : NULL;
+  if (worker_cpus != NULL &&
+      sched_getaffinity (0, sizeof scope->old_cpus, &scope->old_cpus) == 0 &&
+      sched_setaffinity (0, sizeof *worker_cpus, worker_cpus) == 0)
+    scope->repinned = TRUE;
+
+  return scope;
+}
+
+/**
+ * gis_sched_leave:
+ * @scope: (transfer full): returned by gis_sched_enter() on the calling
+ *  thread
+ *
+ * Restores the scheduling parameters the calling thread had before
+ * gis_sched_enter(), and frees @scope.
+ */
+void
+gis_sched_leave (GisSchedScope *scope)
+{
+  pid_t tid;
+
+  if (scope == NULL)
+    return;
+
+  tid = gis_sched_gettid ();
+
+  if (scope->repinned &&
+      sched_setaffinity (0, sizeof scope->old_cpus, &scope->old_cpus) < 0)
+    g_debug ("couldn't restore CPU affinity after %s: %s",
+             policies[scope->stage].name, g_strerror (errno));
+
+  if (scope->reprioritized)
+    {
+      /* A thread which never had an I/O priority set may report class
+       * "none", meaning one derived from its nice value; some kernels only
+       * accept that class back with level 0.
+       */
+      gint ioprio = scope->old_ioprio;
+
+      if (GIS_IOPRIO_CLASS (ioprio) == GIS_IOPRIO_CLASS_NONE)
+        ioprio = GIS_IOPRIO_VALUE (GIS_IOPRIO_CLASS_NONE, 0);
+
+      if (syscall (SYS_ioprio_set, GIS_IOPRIO_WHO_PROCESS, tid, ioprio) < 0)
+        g_debug ("couldn't restore I/O priority after %s: %s",
+                 policies[scope->stage].name, g_strerror (errno));
+    }
+
+  if (scope->reniced &&
+      setpriority (PRIO_PROCESS, tid, scope->old_nice) < 0)
+    g_debug ("couldn't restore nice value after %s: %s",
+             policies[scope->stage].name, g_strerror (errno));
+
+  g_free (scope);
+}
+
+typedef struct {
+  gboolean renice;
+  gint nice_value;
+  /* -1 to leave it alone */
+  gint ioprio;
+  gboolean pin;
+  cpu_set_t cpus;
+} GisSchedChildSetup;
+
+/* Runs in the child between fork() and exec(), so only makes system calls.
+ * Failures are ignored: the child runs just as it would have otherwise.
+ */
+static void
+gis_sched_child_setup (gpointer data)
+{
+  GisSchedChildSetup *setup = data;
+
+  if (setup->renice)
+    setpriority (PRIO_PROCESS, 0, setup->nice_value);
+
+  if (setup->ioprio >= 0)
+    syscall (SYS_ioprio_set, GIS_IOPRIO_WHO_PROCESS, 0, setup->ioprio);
+
+  if (setup->pin)
+    sched_setaffinity (0, sizeof setup->cpus, &setup->cpus);
+}
+
+/**
+ * gis_sched_setup_launcher:
+ * @launcher: a #GSubprocessLauncher
+ * @stage: the stage subprocesses spawned by @launcher run
+ *
+ * Arranges for subprocesses spawned by @launcher to follow the scheduling
+ * policy for @stage. Unlike threads, they need never be restored, so their
+ * priority is lowered even if this process could not raise it again.
+ */
+void
+gis_sched_setup_launcher (GSubprocessLauncher *launcher,
+                          GisSchedStage        stage)
+{
+  const GisSchedPolicy *policy;
+  GisSchedChildSetup *setup;
+  const cpu_set_t *worker_cpus;
+
+  g_return_if_fail (G_IS_SUBPROCESS_LAUNCHER (launcher));
+  g_return_if_fail (stage < G_N_ELEMENTS (policies));
+
+  policy = &policies[stage];
+  setup = g_new0 (GisSchedChildSetup, 1);
+
+  if (policy->nice_increment > 0)
+    {
+      gint nice_value;
+
+      errno = 0;
+      nice_value = getpriority (PRIO_PROCESS, gis_sched_gettid ());
+      if (errno == 0)
+        {
+          setup->renice = TRUE;
+          setup->nice_value = MIN (nice_value + policy->nice_increment,
+                                   MAX_NICE);
+        }
+    }
+
+  setup->ioprio = policy->io_level < 0
+    ? -1
+    : GIS_IOPRIO_VALUE (GIS_IOPRIO_CLASS_BE, policy->io_level);
+
+  worker_cpus = policy->pin ? gis_sched_get_worker_cpus () : NULL;
+  if (worker_cpus != NULL)
+    {
+      setup->pin = TRUE;
+      setup->cpus = *worker_cpus;
+    }
+
+  g_subprocess_launcher_set_child_setup (launcher, gis_sched_child_setup,
+                                         setup, g_free);
+}
+
+/**
+ * gis_sched_describe:
+ *
+ * Returns: (transfer full): a line describing how each stage is scheduled,
+ *  for the performance report
+ */
+gchar *
+gis_sched_describe (void)
+{
+  GString *out = g_string_new (NULL);
+  gboolean pinning = gis_sched_get_worker_cpus () != NULL;
+  gsize i;
+
+  for (i = 0; i < G_N_ELEMENTS (policies); i++)
+    {
+      const GisSchedPolicy *policy = &policies[i];
+
+      if (i > 0)
+        g_string_append (out, "; ");
+
+      g_string_append_printf (out, "%s: nice +%d", policy->name,
+                              policy->nice_increment);
+
+      if (policy->io_level >= 0)
+        g_string_append_printf (out, ", I/O priority %d", policy->io_level);
+
+      if (policy->pin && pinning)
+        g_string_append (out, ", pinned");
+    }
+
+  return g_string_free (out, FALSE);
+}
+
+struct _GisLatencyMonitor {
+  GSource *source;
+  /* When the timeout should next be dispatched */
+  gint64 expected_usec;
+  gint64 total_usec;
+  GisLatencyStats stats;
+};
+
+static gboolean
+gis_latency_monitor_tick (gpointer data)
+{
+  GisLatencyMonitor *self = data;
+  gint64 now_usec = g_get_monotonic_time ();
+  gint64 lateness_usec = MAX (now_usec - self->expected_usec, 0);
+
+  self->stats.n_samples++;
+  self->total_usec += lateness_usec;
+  self->stats.max_usec = MAX (self->stats.max_usec, lateness_usec);
+  if (lateness_usec >= GIS_LATENCY_MONITOR_LATE_USEC)
+    self->stats.n_late++;
+
+  /* The next expiry is measured from this dispatch, not the last expiry */
+  self->expected_usec = now_usec + LATENCY_MONITOR_INTERVAL_MSEC * 1000;
+
+  return G_SOURCE_CONTINUE;
+}
+
+/**
+ * gis_latency_monitor_new:
+ *
+ * Starts sampling how late the thread-default main context is, until the
+ * returned monitor is freed.
+ *
+ * Returns: (transfer full): a new #GisLatencyMonitor
+ */
+GisLatencyMonitor *
+gis_latency_monitor_new (void)
+{
+  GisLatencyMonitor *self = g_new0 (GisLatencyMonitor, 1);
+
+  /* The default priority, like input events */
+  self->source = g_timeout_source_new (LATENCY_MONITOR_INTERVAL_MSEC);
+  g_source_set_name (self->source, "GisLatencyMonitor");
+  g_source_set_callback (self->source, gis_latency_monitor_tick, self, NULL);
+  self->expected_usec = g_get_monotonic_time ()
+                      + LATENCY_MONITOR_INTERVAL_MSEC * 1000;
+  g_source_attach (self->source, g_main_context_get_thread_default ());
+
+  return self;
+}
+
+void
+gis_latency_monitor_free (GisLatencyMonitor *self)
+{
+  g_return_if_fail (self != NULL);
+
+  g_source_destroy (self->source);
+  g_source_unref (self->source);
+  g_free (self);
+}
+
+/**
+ * gis_latency_monitor_get_stats:
+ * @self: a #GisLatencyMonitor
+ * @stats: (out caller-allocates): filled in with the lateness of the main
+ *  context so far
+ */
+void
+gis_latency_monitor_get_stats (GisLatencyMonitor *self,
+                               GisLatencyStats   *stats)
+{
+  g_return_if_fail (self != NULL);
+  g_return_if_fail (stats != NULL);
+
+  *stats = self->stats;
+  stats->mean_usec = self->stats.n_samples == 0
+    ? 0
+    : self->total_usec / self->stats.n_samples;
+}
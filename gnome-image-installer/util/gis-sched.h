@@ -0,0 +1,90 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*- */
+/*
+ * Copyright © 2018 Endless Mobile, Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+#pragma once
+
+#include <gio/gio.h>
+
+G_BEGIN_DECLS
+
+/**
+ * GisSchedStage:
+ * @GIS_SCHED_STAGE_READ: reading the image from its source
+ * @GIS_SCHED_STAGE_DECODE: decompressing the image
+ * @GIS_SCHED_STAGE_VERIFY: checking the image's signature, checksum or
+ *  manifest
+ * @GIS_SCHED_STAGE_WRITE: writing the image to the drive
+ *
+ * The stages of writing an image, each of which is scheduled differently so
+ * that together they leave room for the user interface.
+ */
+typedef enum {
+  GIS_SCHED_STAGE_READ,
+  GIS_SCHED_STAGE_DECODE,
+  GIS_SCHED_STAGE_VERIFY,
+  GIS_SCHED_STAGE_WRITE,
+} GisSchedStage;
+
+/**
+ * GisSchedScope:
+ *
+ * The scheduling parameters a thread had before gis_sched_enter() changed
+ * them. Threads from GLib's shared pools run other work afterwards, so must
+ * pass this to gis_sched_leave() before returning.
+ */
+typedef struct _GisSchedScope GisSchedScope;
+
+GisSchedScope *gis_sched_enter (GisSchedStage stage);
+void gis_sched_leave (GisSchedScope *scope);
+
+void gis_sched_setup_launcher (GSubprocessLauncher *launcher,
+                               GisSchedStage        stage);
+
+gchar *gis_sched_describe (void);
+
+/* A main loop iteration which is at least this late is one the user could
+ * notice.
+ */
+#define GIS_LATENCY_MONITOR_LATE_USEC (50 * 1000)
+
+typedef struct {
+  guint n_samples;
+  /* Samples at least GIS_LATENCY_MONITOR_LATE_USEC late */
+  guint n_late;
+  gint64 mean_usec;
+  gint64 max_usec;
+} GisLatencyStats;
+
+/**
+ * GisLatencyMonitor:
+ *
+ * Measures how late the thread-default main context dispatches a regular
+ * timeout, which is how long the user interface would have been unable to
+ * respond to input.
+ */
+typedef struct _GisLatencyMonitor GisLatencyMonitor;
+
+GisLatencyMonitor *gis_latency_monitor_new (void);
+void gis_latency_monitor_free (GisLatencyMonitor *self);
+
+void gis_latency_monitor_get_stats (GisLatencyMonitor *self,
+                                    GisLatencyStats   *stats);
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (GisSchedScope, gis_sched_leave)
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (GisLatencyMonitor, gis_latency_monitor_free)
+
+G_END_DECLS
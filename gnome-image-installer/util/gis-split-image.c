@@ -0,0 +1,155 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*- */
+/*
+ * Copyright © 2018 Endless Mobile, Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+#include "config.h"
+#include "gis-split-image.h"
+
+#include "gis-errors.h"
+
+/* Captures the path up to the disk number, the number, and the rest. Disk
+ * numbers have a single digit, as in get_display_name() on the image page.
+ */
+#define SPLIT_IMAGE_REGEX "^(.*\\.disk)([1-9])(\\.img(?:\\.[gx]z)?)$"
+#define SPLIT_IMAGE_MAX_DISKS 9
+
+static gboolean
+split_image_parse (const gchar *path,
+                   gchar      **prefix,
+                   guint       *disk,
+                   gchar      **suffix)
+{
+  g_autoptr(GRegex) reg = g_regex_new (SPLIT_IMAGE_REGEX, 0, 0, NULL);
+  g_autoptr(GMatchInfo) info = NULL;
+  g_autofree gchar *number = NULL;
+
+  if (!g_regex_match (reg, path, 0, &info))
+    return FALSE;
+
+  number = g_match_info_fetch (info, 2);
+  *disk = number[0] - '0';
+
+  if (prefix != NULL)
+    *prefix = g_match_info_fetch (info, 1);
+
+  if (suffix != NULL)
+    *suffix = g_match_info_fetch (info, 3);
+
+  return TRUE;
+}
+
+void
+gis_split_disk_free (GisSplitDisk *disk)
+{
+  g_free (disk->image);
+  g_free (disk->signature);
+  g_free (disk->checksum);
+  g_clear_object (&disk->target);
+  g_free (disk);
+}
+
+/**
+ * gis_split_image_get_disk:
+ * @path: path to an image
+ *
+ * Returns: which disk of a split image @path is, counting from 1; or 0 if it
+ *  is an ordinary image
+ */
+guint
+gis_split_image_get_disk (const gchar *path)
+{
+  guint disk = 0;
+
+  split_image_parse (path, NULL, &disk, NULL);
+  return disk;
+}
+
+/**
+ * gis_split_image_find_disks:
+ * @path: path to the first disk of a split image
+ *
+ * Finds every disk of the split image which @path begins, checking that the
+ * set is complete and that each has a signature or checksum alongside it.
+ * Their sizes are left for the caller to fill in.
+ *
+ * Returns: (transfer container) (element-type GisSplitDisk): the disks in
+ *  order, starting with @path; or %NULL with @error set
+ */
+GPtrArray *
+gis_split_image_find_disks (const gchar *path,
+                            GError     **error)
+{
+  g_autoptr(GPtrArray) disks =
+    g_ptr_array_new_with_free_func ((GDestroyNotify) gis_split_disk_free);
+  g_autofree gchar *prefix = NULL;
+  g_autofree gchar *suffix = NULL;
+  guint disk = 0;
+  guint i;
+
+  if (!split_image_parse (path, &prefix, &disk, &suffix) || disk != 1)
+    {
+      g_set_error (error, GIS_IMAGE_ERROR, GIS_IMAGE_ERROR_NOT_SUPPORTED,
+                   "%s is not the first disk of a split image", path);
+      return NULL;
+    }
+
+  for (i = 1; i <= SPLIT_IMAGE_MAX_DISKS; i++)
+    {
+      g_autofree gchar *image = g_strdup_printf ("%s%u%s", prefix, i, suffix);
+      GisSplitDisk *split_disk;
+
+      if (!g_file_test (image, G_FILE_TEST_EXISTS))
+        break;
+
+      split_disk = g_new0 (GisSplitDisk, 1);
+      split_disk->image = g_steal_pointer (&image);
+      split_disk->signature = g_strconcat (split_disk->image, ".asc", NULL);
+      split_disk->checksum = g_strconcat (split_disk->image, ".sha256", NULL);
+      g_ptr_array_add (disks, split_disk);
+
+      if (!g_file_test (split_disk->signature, G_FILE_TEST_EXISTS) &&
+          !g_file_test (split_disk->checksum, G_FILE_TEST_EXISTS))
+        {
+          g_set_error (error, GIS_IMAGE_ERROR, GIS_IMAGE_ERROR_NOT_FOUND,
+                       "neither %s nor %s exist",
+                       split_disk->signature, split_disk->checksum);
+          return NULL;
+        }
+    }
+
+  /* A set with a disk missing from the middle can't be written either */
+  for (disk = i + 1; disk <= SPLIT_IMAGE_MAX_DISKS; disk++)
+    {
+      g_autofree gchar *image =
+        g_strdup_printf ("%s%u%s", prefix, disk, suffix);
+
+      if (g_file_test (image, G_FILE_TEST_EXISTS))
+        {
+          g_set_error (error, GIS_IMAGE_ERROR, GIS_IMAGE_ERROR_NOT_FOUND,
+                       "disk %u of %s is missing", i, path);
+          return NULL;
+        }
+    }
+
+  if (disks->len < 2)
+    {
+      g_set_error (error, GIS_IMAGE_ERROR, GIS_IMAGE_ERROR_NOT_FOUND,
+                   "%s is the only disk of its split image", path);
+      return NULL;
+    }
+
+  return g_steal_pointer (&disks);
+}
@@ -0,0 +1,55 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*- */
+/*
+ * Copyright © 2018 Endless Mobile, Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+#pragma once
+
+#include <gio/gio.h>
+
+G_BEGIN_DECLS
+
+/**
+ * GisSplitDisk:
+ * @image: path to this disk's image
+ * @signature: path to its detached signature
+ * @checksum: path to its SHA-256 checksum file
+ * @image_size: size of @image, in bytes
+ * @required_size: size of the disk @image holds, in bytes
+ * @target: (nullable): the UDisksBlock to write it to, once chosen
+ *
+ * One disk of a split image. Split images are for computers with more than
+ * one internal drive, and are made up of a set of images named like
+ * `eos-eos3.4-amd64-amd64.180801-123456.base.disk1.img.xz`,
+ * `….disk2.img.xz` and so on, each written to a drive of its own.
+ */
+typedef struct {
+  gchar *image;
+  gchar *signature;
+  gchar *checksum;
+  guint64 image_size;
+  guint64 required_size;
+  GObject *target;
+} GisSplitDisk;
+
+void gis_split_disk_free (GisSplitDisk *disk);
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (GisSplitDisk, gis_split_disk_free)
+
+guint gis_split_image_get_disk (const gchar *path);
+GPtrArray *gis_split_image_find_disks (const gchar *path,
+                                       GError     **error);
+
+G_END_DECLS
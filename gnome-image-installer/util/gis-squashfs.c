@@ -0,0 +1,1084 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*- */
+/*
+ * Copyright © 2018 Endless Mobile, Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+#include "gis-squashfs.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <glib/gstdio.h>
+#include <lzma.h>
+#include <zlib.h>
+
+#include "glnx-errors.h"
+#include "gis-buffer-pool.h"
+#include "gis-sched.h"
+#include "gis-trace.h"
+
+/* See https://dr-emann.github.io/squashfs/ for a description of the format.
+ * Like gpt.c, this assumes a little-endian host.
+ */
+#define SQUASHFS_MAGIC 0x73717368
+#define SQUASHFS_METADATA_SIZE 8192
+#define SQUASHFS_METADATA_UNCOMPRESSED 0x8000
+#define SQUASHFS_DATA_UNCOMPRESSED (1 << 24)
+#define SQUASHFS_DATA_SIZE_MASK (SQUASHFS_DATA_UNCOMPRESSED - 1)
+#define SQUASHFS_NO_FRAGMENT 0xFFFFFFFF
+#define SQUASHFS_MIN_BLOCK_SIZE (4 * 1024)
+#define SQUASHFS_MAX_BLOCK_SIZE (1024 * 1024)
+/* Each directory header describes at most this many entries */
+#define SQUASHFS_MAX_DIR_ENTRIES 256
+
+typedef enum {
+  SQUASHFS_COMPRESSION_GZIP = 1,
+  SQUASHFS_COMPRESSION_LZMA = 2,
+  SQUASHFS_COMPRESSION_LZO = 3,
+  SQUASHFS_COMPRESSION_XZ = 4,
+  SQUASHFS_COMPRESSION_LZ4 = 5,
+  SQUASHFS_COMPRESSION_ZSTD = 6,
+} SquashfsCompression;
+
+typedef enum {
+  SQUASHFS_INODE_BASIC_DIR = 1,
+  SQUASHFS_INODE_BASIC_FILE = 2,
+  SQUASHFS_INODE_EXTENDED_DIR = 8,
+  SQUASHFS_INODE_EXTENDED_FILE = 9,
+} SquashfsInodeType;
+
+typedef struct {
+  guint32 magic;
+  guint32 inode_count;
+  guint32 modification_time;
+  guint32 block_size;
+  guint32 fragment_entry_count;
+  guint16 compression_id;
+  guint16 block_log;
+  guint16 flags;
+  guint16 id_count;
+  guint16 version_major;
+  guint16 version_minor;
+  guint64 root_inode_ref;
+  guint64 bytes_used;
+  guint64 id_table_start;
+  guint64 xattr_id_table_start;
+  guint64 inode_table_start;
+  guint64 directory_table_start;
+  guint64 fragment_table_start;
+  guint64 export_table_start;
+} __attribute__((packed)) SquashfsSuperblock;
+
+G_STATIC_ASSERT (sizeof (SquashfsSuperblock) == 96);
+
+typedef struct {
+  guint16 type;
+  guint16 permissions;
+  guint16 uid_idx;
+  guint16 gid_idx;
+  guint32 mtime;
+  guint32 inode_number;
+} __attribute__((packed)) SquashfsInodeHeader;
+
+typedef struct {
+  guint32 count;
+  guint32 start;
+  guint32 inode_number;
+} __attribute__((packed)) SquashfsDirHeader;
+
+typedef struct {
+  guint16 offset;
+  gint16 inode_offset;
+  guint16 type;
+  guint16 name_size;
+} __attribute__((packed)) SquashfsDirEntry;
+
+typedef struct {
+  guint64 start;
+  guint32 size;
+  guint32 unused;
+} __attribute__((packed)) SquashfsFragmentEntry;
+
+/* The parts of a directory or regular file inode which we need */
+typedef struct {
+  guint16 type;
+
+  /* Directories: where the listing starts in the directory table, and its
+   * length in bytes
+   */
+  guint32 dir_block;
+  guint16 dir_offset;
+  guint32 dir_size;
+
+  /* Regular files */
+  guint64 blocks_start;
+  guint64 file_size;
+  guint32 fragment;
+  guint32 fragment_offset;
+} SquashfsInode;
+
+/* A position within a metadata table: the metadata block, relative to the
+ * start of the table, and an offset into its uncompressed contents.
+ */
+typedef struct {
+  guint64 block;
+  gsize offset;
+} SquashfsMetadataPos;
+
+typedef struct {
+  gint fd;
+  guint64 size;
+  SquashfsSuperblock super;
+} Squashfs;
+
+static gboolean
+throw_invalid (GError     **error,
+               const gchar *message)
+{
+  g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+               "invalid squashfs image: %s", message);
+  return FALSE;
+}
+
+static gboolean
+read_exact (gint      fd,
+            void     *buf,
+            gsize     len,
+            guint64   offset,
+            GError  **error)
+{
+  gsize done = 0;
+
+  while (done < len)
+    {
+      ssize_t r = pread (fd, (guint8 *) buf + done, len - done, offset + done);
+
+      if (r < 0)
+        {
+          if (errno == EINTR)
+            continue;
+
+          return glnx_throw_errno_prefix (error, "can't read squashfs image");
+        }
+
+      if (r == 0)
+        return throw_invalid (error, "truncated");
+
+      done += r;
+    }
+
+  return TRUE;
+}
+
+static gboolean
+decompress (guint16        compression,
+            const guint8  *in,
+            gsize          in_len,
+            guint8        *out,
+            gsize          out_max,
+            gsize         *out_len,
+            GError       **error)
+{
+  switch (compression)
+    {
+    case SQUASHFS_COMPRESSION_GZIP:
+      {
+        uLongf len = out_max;
+
+        if (uncompress (out, &len, in, in_len) != Z_OK)
+          return throw_invalid (error, "corrupt gzip block");
+
+        *out_len = len;
+        return TRUE;
+      }
+
+    case SQUASHFS_COMPRESSION_XZ:
+      {
+        guint64 memlimit = G_MAXUINT64;
+        gsize in_pos = 0;
+        gsize out_pos = 0;
+
+        if (lzma_stream_buffer_decode (&memlimit, 0, NULL,
+                                       in, &in_pos, in_len,
+                                       out, &out_pos, out_max) != LZMA_OK)
+          return throw_invalid (error, "corrupt xz block");
+
+        *out_len = out_pos;
+        return TRUE;
+      }
+
+    default:
+      g_assert_not_reached ();
+    }
+}
+
+/* Reads the data or fragment block at @offset, described by @size_field as
+ * in a file inode's block list or a fragment table entry, into @out, which
+ * has room for a whole block.
+ */
+static gboolean
+read_data_block (gint          fd,
+                 guint16       compression,
+                 guint32       block_size,
+                 guint64       offset,
+                 guint32       size_field,
+                 guint8       *out,
+                 gsize        *out_len,
+                 GError      **error)
+{
+  gsize size = size_field & SQUASHFS_DATA_SIZE_MASK;
+  g_autofree guint8 *compressed = NULL;
+
+  if (size > block_size)
+    return throw_invalid (error, "data block too large");
+
+  /* Sparse blocks are not stored at all */
+  if (size == 0)
+    {
+      memset (out, 0, block_size);
+      *out_len = block_size;
+      return TRUE;
+    }
+
+  if (size_field & SQUASHFS_DATA_UNCOMPRESSED)
+    {
+      *out_len = size;
+      return read_exact (fd, out, size, offset, error);
+    }
+
+  compressed = g_malloc (size);
+  return read_exact (fd, compressed, size, offset, error) &&
+         decompress (compression, compressed, size, out, block_size, out_len,
+                     error);
+}
+
+/* Reads the metadata block at @offset into @out, which must have room for
+ * SQUASHFS_METADATA_SIZE bytes, and returns the offset of the next.
+ */
+static gboolean
+read_metadata_block (Squashfs  *fs,
+                     guint64    offset,
+                     guint8    *out,
+                     gsize     *out_len,
+                     guint64   *next,
+                     GError   **error)
+{
+  guint16 header;
+  gsize size;
+  guint8 compressed[SQUASHFS_METADATA_SIZE];
+
+  if (!read_exact (fs->fd, &header, sizeof header, offset, error))
+    return FALSE;
+
+  size = header & ~SQUASHFS_METADATA_UNCOMPRESSED;
+  if (size == 0 || size > SQUASHFS_METADATA_SIZE)
+    return throw_invalid (error, "bad metadata block size");
+
+  *next = offset + sizeof header + size;
+
+  if (header & SQUASHFS_METADATA_UNCOMPRESSED)
+    {
+      *out_len = size;
+      return read_exact (fs->fd, out, size, offset + sizeof header, error);
+    }
+
+  return read_exact (fs->fd, compressed, size, offset + sizeof header, error) &&
+         decompress (fs->super.compression_id, compressed, size,
+                     out, SQUASHFS_METADATA_SIZE, out_len, error);
+}
+
+/* Reads @len bytes from the metadata table starting at @table_start, from
+ * @pos onwards, which may span several metadata blocks. @pos is advanced past
+ * them.
+ */
+static gboolean
+read_metadata (Squashfs            *fs,
+               guint64              table_start,
+               SquashfsMetadataPos *pos,
+               void                *buf,
+               gsize                len,
+               GError             **error)
+{
+  guint8 block[SQUASHFS_METADATA_SIZE];
+  gsize done = 0;
+
+  while (done < len)
+    {
+      gsize block_len;
+      guint64 next;
+      gsize n;
+
+      if (!read_metadata_block (fs, table_start + pos->block, block,
+                                &block_len, &next, error))
+        return FALSE;
+
+      if (pos->offset > block_len)
+        return throw_invalid (error, "metadata offset out of range");
+
+      n = MIN (len - done, block_len - pos->offset);
+      memcpy ((guint8 *) buf + done, block + pos->offset, n);
+      done += n;
+      pos->offset += n;
+
+      if (pos->offset == block_len)
+        {
+          pos->block = next - table_start;
+          pos->offset = 0;
+        }
+    }
+
+  return TRUE;
+}
+
+/* Reads the inode referred to by @ref. @pos is left pointing just after it;
+ * for regular files, that's where the list of block sizes starts.
+ */
+static gboolean
+read_inode (Squashfs            *fs,
+            guint64              ref,
+            SquashfsInode       *inode,
+            SquashfsMetadataPos *pos,
+            GError             **error)
+{
+  SquashfsInodeHeader header;
+  guint64 table = fs->super.inode_table_start;
+
+  pos->block = ref >> 16;
+  pos->offset = ref & 0xFFFF;
+  memset (inode, 0, sizeof *inode);
+
+  if (!read_metadata (fs, table, pos, &header, sizeof header, error))
+    return FALSE;
+
+  inode->type = header.type;
+
+  switch (header.type)
+    {
+    case SQUASHFS_INODE_BASIC_DIR:
+      {
+        struct {
+          guint32 block_index;
+          guint32 link_count;
+          guint16 file_size;
+          guint16 block_offset;
+          guint32 parent_inode;
+        } __attribute__((packed)) dir;
+
+        if (!read_metadata (fs, table, pos, &dir, sizeof dir, error))
+          return FALSE;
+
+        inode->dir_block = dir.block_index;
+        inode->dir_offset = dir.block_offset;
+        inode->dir_size = dir.file_size;
+        break;
+      }
+
+    case SQUASHFS_INODE_EXTENDED_DIR:
+      {
+        struct {
+          guint32 link_count;
+          guint32 file_size;
+          guint32 block_index;
+          guint32 parent_inode;
+          guint16 index_count;
+          guint16 block_offset;
+          guint32 xattr_idx;
+        } __attribute__((packed)) dir;
+
+        if (!read_metadata (fs, table, pos, &dir, sizeof dir, error))
+          return FALSE;
+
+        inode->dir_block = dir.block_index;
+        inode->dir_offset = dir.block_offset;
+        inode->dir_size = dir.file_size;
+        break;
+      }
+
+    case SQUASHFS_INODE_BASIC_FILE:
+      {
+        struct {
+          guint32 blocks_start;
+          guint32 fragment;
+          guint32 block_offset;
+          guint32 file_size;
+        } __attribute__((packed)) file;
+
+        if (!read_metadata (fs, table, pos, &file, sizeof file, error))
+          return FALSE;
+
+        inode->blocks_start = file.blocks_start;
+        inode->file_size = file.file_size;
+        inode->fragment = file.fragment;
+        inode->fragment_offset = file.block_offset;
+        break;
+      }
+
+    case SQUASHFS_INODE_EXTENDED_FILE:
+      {
+        struct {
+          guint64 blocks_start;
+          guint64 file_size;
+          guint64 sparse;
+          guint32 link_count;
+          guint32 fragment;
+          guint32 block_offset;
+          guint32 xattr_idx;
+        } __attribute__((packed)) file;
+
+        if (!read_metadata (fs, table, pos, &file, sizeof file, error))
+          return FALSE;
+
+        inode->blocks_start = file.blocks_start;
+        inode->file_size = file.file_size;
+        inode->fragment = file.fragment;
+        inode->fragment_offset = file.block_offset;
+        break;
+      }
+
+    default:
+      /* Symlinks, devices and so on: we only need to know that they're not
+       * what we're looking for.
+       */
+      break;
+    }
+
+  /* The stored size of a directory counts 3 bytes for the implicit "." and
+   * ".." entries, which are not in the listing.
+   */
+  if (header.type == SQUASHFS_INODE_BASIC_DIR ||
+      header.type == SQUASHFS_INODE_EXTENDED_DIR)
+    {
+      if (inode->dir_size < 3)
+        return throw_invalid (error, "bad directory size");
+
+      inode->dir_size -= 3;
+    }
+
+  return TRUE;
+}
+
+static gboolean
+is_dir (const SquashfsInode *inode)
+{
+  return inode->type == SQUASHFS_INODE_BASIC_DIR ||
+         inode->type == SQUASHFS_INODE_EXTENDED_DIR;
+}
+
+static gboolean
+is_file (const SquashfsInode *inode)
+{
+  return inode->type == SQUASHFS_INODE_BASIC_FILE ||
+         inode->type == SQUASHFS_INODE_EXTENDED_FILE;
+}
+
+/* Looks up @name in the directory @dir, returning its inode reference in
+ * @ref and %TRUE if it is found, or %FALSE with @error unset if not.
+ */
+static gboolean
+lookup_entry (Squashfs             *fs,
+              const SquashfsInode  *dir,
+              const gchar          *name,
+              guint64              *ref,
+              GError              **error)
+{
+  guint64 table = fs->super.directory_table_start;
+  SquashfsMetadataPos pos = { dir->dir_block, dir->dir_offset };
+  gsize remaining = dir->dir_size;
+  gsize name_len = strlen (name);
+
+  while (remaining > 0)
+    {
+      SquashfsDirHeader header;
+      guint32 i;
+
+      if (remaining < sizeof header)
+        return throw_invalid (error, "truncated directory");
+
+      if (!read_metadata (fs, table, &pos, &header, sizeof header, error))
+        return FALSE;
+
+      remaining -= sizeof header;
+
+      if (header.count >= SQUASHFS_MAX_DIR_ENTRIES)
+        return throw_invalid (error, "too many directory entries");
+
+      for (i = 0; i <= header.count; i++)
+        {
+          SquashfsDirEntry entry;
+          gchar entry_name[SQUASHFS_MAX_DIR_ENTRIES + 1];
+          gsize entry_name_len;
+
+          if (remaining < sizeof entry)
+            return throw_invalid (error, "truncated directory");
+
+          if (!read_metadata (fs, table, &pos, &entry, sizeof entry, error))
+            return FALSE;
+
+          remaining -= sizeof entry;
+
+          /* Names are at most 256 bytes, and stored without a terminator */
+          entry_name_len = entry.name_size + 1;
+          if (entry_name_len > SQUASHFS_MAX_DIR_ENTRIES ||
+              remaining < entry_name_len)
+            return throw_invalid (error, "bad directory entry");
+
+          if (!read_metadata (fs, table, &pos, entry_name, entry_name_len,
+                              error))
+            return FALSE;
+
+          remaining -= entry_name_len;
+
+          if (entry_name_len == name_len &&
+              memcmp (entry_name, name, name_len) == 0)
+            {
+              *ref = ((guint64) header.start << 16) | entry.offset;
+              return TRUE;
+            }
+        }
+    }
+
+  return FALSE;
+}
+
+static gboolean
+read_fragment_entry (Squashfs               *fs,
+                     guint32                 index,
+                     SquashfsFragmentEntry  *entry,
+                     GError                **error)
+{
+  const gsize per_block = SQUASHFS_METADATA_SIZE / sizeof *entry;
+  guint64 block_start;
+  SquashfsMetadataPos pos = { 0, (index % per_block) * sizeof *entry };
+
+  if (index >= fs->super.fragment_entry_count)
+    return throw_invalid (error, "fragment index out of range");
+
+  /* The fragment table is preceded by a list of the locations of the
+   * metadata blocks which hold it.
+   */
+  if (!read_exact (fs->fd, &block_start, sizeof block_start,
+                   fs->super.fragment_table_start +
+                   (index / per_block) * sizeof block_start,
+                   error))
+    return FALSE;
+
+  return read_metadata (fs, block_start, &pos, entry, sizeof *entry, error);
+}
+
+static gboolean
+squashfs_open (Squashfs     *fs,
+               GFile        *file,
+               GError      **error)
+{
+  g_autofree gchar *path = g_file_get_path (file);
+  SquashfsSuperblock *super = &fs->super;
+  struct stat buf;
+
+  fs->fd = open (path, O_RDONLY | O_CLOEXEC);
+  if (fs->fd < 0)
+    return glnx_throw_errno_prefix (error, "can't open %s", path);
+
+  if (fstat (fs->fd, &buf) < 0)
+    return glnx_throw_errno_prefix (error, "can't stat %s", path);
+
+  fs->size = buf.st_size;
+
+  if (!read_exact (fs->fd, super, sizeof *super, 0, error))
+    return FALSE;
+
+  if (super->magic != SQUASHFS_MAGIC)
+    return throw_invalid (error, "bad magic number");
+
+  if (super->version_major != 4 || super->version_minor != 0)
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED,
+                   "squashfs version %u.%u is not supported",
+                   super->version_major, super->version_minor);
+      return FALSE;
+    }
+
+  if (super->block_size < SQUASHFS_MIN_BLOCK_SIZE ||
+      super->block_size > SQUASHFS_MAX_BLOCK_SIZE ||
+      super->block_size != (1u << super->block_log))
+    return throw_invalid (error, "bad block size");
+
+  if (super->compression_id != SQUASHFS_COMPRESSION_GZIP &&
+      super->compression_id != SQUASHFS_COMPRESSION_XZ)
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED,
+                   "squashfs compression type %u is not supported",
+                   super->compression_id);
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
+static void
+squashfs_close (Squashfs *fs)
+{
+  if (fs->fd >= 0)
+    g_close (fs->fd, NULL);
+  fs->fd = -1;
+}
+
+/* GisSquashfsFileStream: reads a regular file from a squashfs image,
+ * decompressing blocks ahead of the reader on a pool of threads.
+ */
+
+#define GIS_TYPE_SQUASHFS_FILE_STREAM (gis_squashfs_file_stream_get_type ())
+G_DECLARE_FINAL_TYPE (GisSquashfsFileStream, gis_squashfs_file_stream,
+                      GIS, SQUASHFS_FILE_STREAM, GInputStream);
+
+typedef struct {
+  GisSquashfsFileStream *stream;
+  guint index;
+  gboolean done;
+  guint8 *data;
+  gsize len;
+  GError *error;
+} SquashfsSlot;
+
+struct _GisSquashfsFileStream {
+  GInputStream parent;
+
+  gint fd;
+  guint16 compression;
+  guint32 block_size;
+  guint64 file_size;
+
+  /* Whole blocks stored in the data area, followed by the tail in a
+   * fragment block if fragment != SQUASHFS_NO_FRAGMENT
+   */
+  guint n_blocks;
+  guint64 *block_offsets;
+  guint32 *block_sizes;
+  guint32 fragment;
+  SquashfsFragmentEntry fragment_entry;
+  guint32 fragment_offset;
+
+  /* Block i is decoded into slots[i % n_slots]. The reader waits on cond for
+   * each slot to be done, then hands it back for block i + n_slots. Each
+   * slot's data is taken from buffers when the block is queued, and released
+   * once it has been read.
+   */
+  GisBufferPool *buffers;
+  GThreadPool *pool;
+  GMutex mutex;
+  GCond cond;
+  SquashfsSlot *slots;
+  guint n_slots;
+  guint next_read;
+  guint next_submit;
+  gsize read_pos;
+};
+
+G_DEFINE_TYPE (GisSquashfsFileStream, gis_squashfs_file_stream,
+               G_TYPE_INPUT_STREAM);
+
+static guint
+gis_squashfs_file_stream_n_chunks (GisSquashfsFileStream *self)
+{
+  return self->n_blocks + (self->fragment != SQUASHFS_NO_FRAGMENT ? 1 : 0);
+}
+
+/* Length of the file's data in chunk @index */
+static gsize
+gis_squashfs_file_stream_chunk_len (GisSquashfsFileStream *self,
+                                    guint                  index)
+{
+  guint64 start = (guint64) index * self->block_size;
+
+  return MIN (self->block_size, self->file_size - start);
+}
+
+static gboolean
+gis_squashfs_file_stream_decode (GisSquashfsFileStream  *self,
+                                 guint                   index,
+                                 guint8                 *out,
+                                 gsize                  *out_len,
+                                 GError                **error)
+{
+  gsize expected = gis_squashfs_file_stream_chunk_len (self, index);
+  gsize len;
+
+  if (index < self->n_blocks)
+    {
+      if (!read_data_block (self->fd, self->compression, self->block_size,
+                            self->block_offsets[index],
+                            self->block_sizes[index],
+                            out, &len, error))
+        return FALSE;
+
+      /* Only the last block may hold less than block_size bytes of the
+       * file; any padding after that is ignored
+       */
+      if (len < expected)
+        return throw_invalid (error, "data block too short");
+    }
+  else
+    {
+      /* The tail of the file, within a fragment block shared with other
+       * files' tails
+       */
+      if (!read_data_block (self->fd, self->compression, self->block_size,
+                            self->fragment_entry.start,
+                            self->fragment_entry.size,
+                            out, &len, error))
+        return FALSE;
+
+      if (len < self->fragment_offset ||
+          len - self->fragment_offset < expected)
+        return throw_invalid (error, "fragment too short");
+
+      memmove (out, out + self->fragment_offset, expected);
+    }
+
+  *out_len = expected;
+  return TRUE;
+}
+
+static void
+gis_squashfs_file_stream_decode_cb (gpointer data,
+                                    gpointer user_data)
+{
+  SquashfsSlot *slot = data;
+  GisSquashfsFileStream *self = slot->stream;
+  gsize len = 0;
+  GError *error = NULL;
+  g_autoptr(GisSchedScope) sched = gis_sched_enter (GIS_SCHED_STAGE_DECODE);
+  GisTraceSpan *span = gis_trace_begin ("decompress", "squashfs block");
+
+  gis_squashfs_file_stream_decode (self, slot->index, slot->data, &len,
+                                   &error);
+  gis_trace_span_set_arg (span, "index", slot->index);
+  gis_trace_span_set_arg (span, "bytes", len);
+  gis_trace_end (span);
+
+  g_mutex_lock (&self->mutex);
+  slot->len = len;
+  slot->error = error;
+  slot->done = TRUE;
+  g_cond_broadcast (&self->cond);
+  g_mutex_unlock (&self->mutex);
+}
+
+/* Queues as many of the following blocks as there are free slots. The block
+ * being read is decoded whatever the budget, but those after it only while
+ * the buffer pool has room for them, so that decoding ahead never holds up
+ * the other users of the pool.
+ */
+static void
+gis_squashfs_file_stream_submit (GisSquashfsFileStream *self)
+{
+  guint n_chunks = gis_squashfs_file_stream_n_chunks (self);
+
+  while (self->next_submit < n_chunks &&
+         self->next_submit < self->next_read + self->n_slots)
+    {
+      SquashfsSlot *slot = &self->slots[self->next_submit % self->n_slots];
+      guint8 *data;
+
+      if (self->next_submit == self->next_read)
+        data = gis_buffer_pool_acquire (self->buffers, self->block_size);
+      else
+        data = gis_buffer_pool_try_acquire (self->buffers, self->block_size);
+
+      if (data == NULL)
+        break;
+
+      g_mutex_lock (&self->mutex);
+      slot->data = data;
+      slot->index = self->next_submit;
+      slot->done = FALSE;
+      slot->len = 0;
+      g_clear_error (&slot->error);
+      g_mutex_unlock (&self->mutex);
+
+      g_thread_pool_push (self->pool, slot, NULL);
+      self->next_submit++;
+    }
+}
+
+static gssize
+gis_squashfs_file_stream_read (GInputStream  *stream,
+                               void          *buffer,
+                               gsize          count,
+                               GCancellable  *cancellable,
+                               GError       **error)
+{
+  GisSquashfsFileStream *self = GIS_SQUASHFS_FILE_STREAM (stream);
+  SquashfsSlot *slot;
+  gsize n;
+
+  if (g_cancellable_set_error_if_cancelled (cancellable, error))
+    return -1;
+
+  if (self->next_read >= gis_squashfs_file_stream_n_chunks (self))
+    return 0;
+
+  gis_squashfs_file_stream_submit (self);
+
+  slot = &self->slots[self->next_read % self->n_slots];
+  g_mutex_lock (&self->mutex);
+  while (!slot->done)
+    g_cond_wait (&self->cond, &self->mutex);
+  g_mutex_unlock (&self->mutex);
+
+  if (slot->error != NULL)
+    {
+      g_propagate_error (error, g_error_copy (slot->error));
+      return -1;
+    }
+
+  n = MIN (count, slot->len - self->read_pos);
+  memcpy (buffer, slot->data + self->read_pos, n);
+  self->read_pos += n;
+
+  if (self->read_pos == slot->len)
+    {
+      gis_buffer_pool_release (self->buffers, g_steal_pointer (&slot->data));
+      self->next_read++;
+      self->read_pos = 0;
+    }
+
+  return n;
+}
+
+static void
+gis_squashfs_file_stream_stop (GisSquashfsFileStream *self)
+{
+  /* Drop blocks which haven't been started, and wait for the rest */
+  if (self->pool != NULL)
+    g_thread_pool_free (self->pool, TRUE, TRUE);
+  self->pool = NULL;
+
+  if (self->fd >= 0)
+    g_close (self->fd, NULL);
+  self->fd = -1;
+}
+
+static gboolean
+gis_squashfs_file_stream_close (GInputStream  *stream,
+                                GCancellable  *cancellable,
+                                GError       **error)
+{
+  gis_squashfs_file_stream_stop (GIS_SQUASHFS_FILE_STREAM (stream));
+  return TRUE;
+}
+
+static void
+gis_squashfs_file_stream_finalize (GObject *object)
+{
+  GisSquashfsFileStream *self = GIS_SQUASHFS_FILE_STREAM (object);
+  guint i;
+
+  gis_squashfs_file_stream_stop (self);
+
+  for (i = 0; i < self->n_slots; i++)
+    {
+      gis_buffer_pool_release (self->buffers, self->slots[i].data);
+      g_clear_error (&self->slots[i].error);
+    }
+
+  g_free (self->slots);
+  g_clear_pointer (&self->buffers, gis_buffer_pool_unref);
+  g_free (self->block_offsets);
+  g_free (self->block_sizes);
+  g_mutex_clear (&self->mutex);
+  g_cond_clear (&self->cond);
+
+  G_OBJECT_CLASS (gis_squashfs_file_stream_parent_class)->finalize (object);
+}
+
+static void
+gis_squashfs_file_stream_class_init (GisSquashfsFileStreamClass *klass)
+{
+  GObjectClass *object_class = G_OBJECT_CLASS (klass);
+  GInputStreamClass *stream_class = G_INPUT_STREAM_CLASS (klass);
+
+  object_class->finalize = gis_squashfs_file_stream_finalize;
+
+  stream_class->read_fn = gis_squashfs_file_stream_read;
+  stream_class->close_fn = gis_squashfs_file_stream_close;
+}
+
+static void
+gis_squashfs_file_stream_init (GisSquashfsFileStream *self)
+{
+  self->fd = -1;
+  g_mutex_init (&self->mutex);
+  g_cond_init (&self->cond);
+}
+
+/**
+ * gis_squashfs_open_file:
+ * @squashfs: a squashfs image, compressed with gzip or xz
+ * @path: path to a regular file within @squashfs, such as "endless.img"
+ * @n_threads: number of threads to decompress blocks on, or 0 for one per
+ *  CPU
+ * @buffers: (nullable): pool to decompress blocks into, or %NULL to use one
+ *  of the minimum size
+ * @size: (out) (optional): location to store the size of the file, in bytes
+ *
+ * Opens a file within a squashfs image for reading, without mounting it. Data
+ * blocks are decompressed ahead of the reader, several at a time, so reading
+ * the file sequentially can use every CPU; the kernel's squashfs driver
+ * decompresses one block at a time per reader. Blocks are only decompressed
+ * ahead while @buffers has room for them.
+ *
+ * Returns: (transfer full): a stream of the file's contents, or %NULL with
+ *  @error set
+ */
+GInputStream *
+gis_squashfs_open_file (GFile          *squashfs,
+                        const gchar    *path,
+                        guint           n_threads,
+                        GisBufferPool  *buffers,
+                        guint64        *size,
+                        GError        **error)
+{
+  Squashfs fs = { -1 };
+  SquashfsInode inode;
+  SquashfsMetadataPos pos;
+  g_auto(GStrv) components = NULL;
+  g_autoptr(GisSquashfsFileStream) self = NULL;
+  guint64 ref;
+  guint64 offset;
+  guint i;
+  gboolean ret = FALSE;
+  GError *local_error = NULL;
+
+  g_return_val_if_fail (G_IS_FILE (squashfs), NULL);
+  g_return_val_if_fail (path != NULL, NULL);
+
+  if (!squashfs_open (&fs, squashfs, error))
+    goto out;
+
+  if (!read_inode (&fs, fs.super.root_inode_ref, &inode, &pos, error))
+    goto out;
+
+  components = g_strsplit (path, "/", -1);
+  for (i = 0; components[i] != NULL; i++)
+    {
+      if (*components[i] == '\0')
+        continue;
+
+      if (!is_dir (&inode))
+        {
+          g_set_error (error, G_IO_ERROR, G_IO_ERROR_NOT_DIRECTORY,
+                       "‘%s’ is not in a directory in the squashfs image",
+                       path);
+          goto out;
+        }
+
+      if (!lookup_entry (&fs, &inode, components[i], &ref, &local_error))
+        {
+          if (local_error != NULL)
+            g_propagate_error (error, g_steal_pointer (&local_error));
+          else
+            g_set_error (error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND,
+                         "‘%s’ not found in the squashfs image", path);
+          goto out;
+        }
+
+      if (!read_inode (&fs, ref, &inode, &pos, error))
+        goto out;
+    }
+
+  if (!is_file (&inode))
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_NOT_REGULAR_FILE,
+                   "‘%s’ is not a regular file in the squashfs image", path);
+      goto out;
+    }
+
+  self = g_object_new (GIS_TYPE_SQUASHFS_FILE_STREAM, NULL);
+  self->compression = fs.super.compression_id;
+  self->block_size = fs.super.block_size;
+  self->file_size = inode.file_size;
+  self->fragment = inode.fragment;
+  self->fragment_offset = inode.fragment_offset;
+
+  /* Each block's size is stored in the image, so a file with more blocks
+   * than would fit is corrupt
+   */
+  if (inode.file_size / self->block_size > fs.size / sizeof (guint32))
+    {
+      throw_invalid (error, "file too large");
+      goto out;
+    }
+
+  /* A file's tail only goes in a fragment if it's less than a block */
+  if (inode.fragment == SQUASHFS_NO_FRAGMENT)
+    self->n_blocks = (inode.file_size + self->block_size - 1) / self->block_size;
+  else
+    self->n_blocks = inode.file_size / self->block_size;
+
+  if (inode.fragment != SQUASHFS_NO_FRAGMENT &&
+      !read_fragment_entry (&fs, inode.fragment, &self->fragment_entry, error))
+    goto out;
+
+  self->block_sizes = g_new (guint32, self->n_blocks);
+  if (!read_metadata (&fs, fs.super.inode_table_start, &pos,
+                      self->block_sizes,
+                      (gsize) self->n_blocks * sizeof (guint32), error))
+    goto out;
+
+  self->block_offsets = g_new (guint64, self->n_blocks);
+  offset = inode.blocks_start;
+  for (i = 0; i < self->n_blocks; i++)
+    {
+      self->block_offsets[i] = offset;
+      offset += self->block_sizes[i] & SQUASHFS_DATA_SIZE_MASK;
+    }
+
+  if (n_threads == 0)
+    n_threads = g_get_num_processors ();
+
+  /* Keep every thread busy while the reader catches up */
+  self->buffers = buffers != NULL ? gis_buffer_pool_ref (buffers)
+                                  : gis_buffer_pool_new (0);
+  self->n_slots = 2 * n_threads;
+  self->slots = g_new0 (SquashfsSlot, self->n_slots);
+  for (i = 0; i < self->n_slots; i++)
+    self->slots[i].stream = self;
+
+  self->pool = g_thread_pool_new (gis_squashfs_file_stream_decode_cb, NULL,
+                                  n_threads, FALSE, error);
+  if (self->pool == NULL)
+    goto out;
+
+  self->fd = fs.fd;
+  fs.fd = -1;
+
+  if (size != NULL)
+    *size = inode.file_size;
+
+  ret = TRUE;
+
+out:
+  squashfs_close (&fs);
+
+  if (!ret)
+    return NULL;
+
+  return G_INPUT_STREAM (g_steal_pointer (&self));
+}
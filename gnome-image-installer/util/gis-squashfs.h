@@ -0,0 +1,37 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*- */
+/*
+ * Copyright © 2018 Endless Mobile, Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <gio/gio.h>
+
+#include "gis-buffer-pool.h"
+
+G_BEGIN_DECLS
+
+/* Path of the disk image within the endless.squash found on ISOs */
+#define GIS_SQUASHFS_IMAGE_PATH "endless.img"
+
+GInputStream *gis_squashfs_open_file (GFile          *squashfs,
+                                      const gchar    *path,
+                                      guint           n_threads,
+                                      GisBufferPool  *buffers,
+                                      guint64        *size,
+                                      GError        **error);
+
+G_END_DECLS
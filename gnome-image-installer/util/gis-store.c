@@ -34,6 +34,8 @@ static GError *_error = NULL;
 static GisUnattendedConfig *_config = NULL;
 static gboolean _live_install = FALSE;
 static gchar *_uuid = NULL;
+static GPtrArray *_split_disks = NULL;
+static GString *_perf_report = NULL;
 
 GObject *gis_store_get_object(gint key)
 {
@@ -130,6 +132,42 @@ void gis_store_set_image_uuid (const gchar *uuid)
   _uuid = g_strdup (uuid);
 }
 
+/* Every disk of the selected split image, starting with the one described by
+ * GIS_STORE_IMAGE and friends; or NULL if the image is not split.
+ */
+GPtrArray *gis_store_get_split_disks (void)
+{
+  return _split_disks;
+}
+
+void gis_store_set_split_disks (GPtrArray *disks)
+{
+  g_clear_pointer (&_split_disks, g_ptr_array_unref);
+  if (disks != NULL)
+    _split_disks = g_ptr_array_ref (disks);
+}
+
+/* Performance reports from each write (one per disk of a split image), or
+ * NULL if nothing has been written
+ */
+const gchar *gis_store_get_perf_report (void)
+{
+  return _perf_report != NULL ? _perf_report->str : NULL;
+}
+
+void gis_store_append_perf_report (const gchar *report)
+{
+  if (report == NULL)
+    return;
+
+  if (_perf_report == NULL)
+    _perf_report = g_string_new (NULL);
+  else
+    g_string_append_c (_perf_report, '\n');
+
+  g_string_append (_perf_report, report);
+}
+
 GError *gis_store_get_error(void)
 {
   return _error;
@@ -167,6 +205,71 @@ gis_store_is_unattended (void)
   return _config != NULL;
 }
 
+/**
+ * gis_store_is_station:
+ *
+ * Returns: %TRUE if we are in unattended mode, and the configuration asks for
+ *  the image to be written to each matching drive as it is plugged in.
+ */
+gboolean
+gis_store_is_station (void)
+{
+  return _config != NULL && gis_unattended_config_is_station (_config);
+}
+
+/**
+ * gis_store_is_verify_first:
+ *
+ * Returns: %TRUE if we are in unattended mode, and the configuration asks for
+ *  the image to be verified before anything is written to the target disk.
+ */
+gboolean
+gis_store_is_verify_first (void)
+{
+  return _config != NULL &&
+    gis_unattended_config_get_verify_policy (_config) ==
+      GIS_UNATTENDED_VERIFY_POLICY_FIRST;
+}
+
+/**
+ * gis_store_is_skip_unused:
+ *
+ * Returns: %TRUE if we are in unattended mode, and the configuration asks for
+ *  only the parts of the image which are in use to be written.
+ */
+gboolean
+gis_store_is_skip_unused (void)
+{
+  return _config != NULL &&
+    gis_unattended_config_get_write_policy (_config) ==
+      GIS_UNATTENDED_WRITE_POLICY_USED;
+}
+
+/**
+ * gis_store_is_compare_before_write:
+ *
+ * Returns: %TRUE if we are in unattended mode, and the configuration asks for
+ *  the image to be compared with the target disk, so that only the parts which
+ *  differ are written.
+ */
+gboolean
+gis_store_is_compare_before_write (void)
+{
+  return _config != NULL && gis_unattended_config_is_compare (_config);
+}
+
+/**
+ * gis_store_is_tracing:
+ *
+ * Returns: %TRUE if we are in unattended mode, and the configuration asks for
+ *  a timeline of writing the image to be recorded.
+ */
+gboolean
+gis_store_is_tracing (void)
+{
+  return _config != NULL && gis_unattended_config_is_trace (_config);
+}
+
 /**
  * gis_store_get_unattended_config:
  *
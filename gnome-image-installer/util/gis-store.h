@@ -77,12 +77,23 @@ void gis_store_set_image_signature(const gchar *signature);
 const gchar *gis_store_get_image_checksum(void);
 void gis_store_set_image_checksum(const gchar *signature);
 
+GPtrArray *gis_store_get_split_disks (void);
+void gis_store_set_split_disks (GPtrArray *disks);
+
+const gchar *gis_store_get_perf_report (void);
+void gis_store_append_perf_report (const gchar *report);
+
 GError *gis_store_get_error(void);
 void gis_store_set_error(GError *error);
 void gis_store_clear_error(void);
 
 void gis_store_enter_unattended (GisUnattendedConfig *config);
 gboolean gis_store_is_unattended (void);
+gboolean gis_store_is_station (void);
+gboolean gis_store_is_verify_first (void);
+gboolean gis_store_is_skip_unused (void);
+gboolean gis_store_is_compare_before_write (void);
+gboolean gis_store_is_tracing (void);
 GisUnattendedConfig *gis_store_get_unattended_config (void);
 
 void gis_store_enter_live_install(void);
@@ -0,0 +1,425 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*- */
+/*
+ * Copyright © 2018 Endless Mobile, Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+#include "config.h"
+#include "gis-trace.h"
+
+#include <pthread.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+typedef struct {
+  /* Interned */
+  const gchar *category;
+  const gchar *name;
+  /* Relative to trace_start_usec */
+  gint64 start_usec;
+  gint64 duration_usec;
+  gint tid;
+  guint n_args;
+  const gchar *arg_keys[GIS_TRACE_MAX_ARGS];
+  gint64 arg_values[GIS_TRACE_MAX_ARGS];
+} GisTraceEvent;
+
+struct _GisTraceSpan {
+  GisTraceEvent event;
+};
+
+/* Read without the lock, so that spans cost nothing unless tracing */
+static gint trace_enabled = 0;
+
+static GMutex trace_mutex;
+/* The fields below are guarded by trace_mutex */
+static gint64 trace_start_usec;
+static GArray *trace_events;
+/* Thread ID → (owned) thread name */
+static GHashTable *trace_threads;
+static guint64 trace_dropped;
+
+static gint
+gis_trace_gettid (void)
+{
+  return (gint) syscall (SYS_gettid);
+}
+
+/**
+ * gis_trace_enable:
+ *
+ * Starts recording spans, if not already. Recording is also started on first
+ * use if the EI_TRACE environment variable is set.
+ */
+void
+gis_trace_enable (void)
+{
+  g_mutex_lock (&trace_mutex);
+  if (trace_events == NULL)
+    {
+      trace_start_usec = g_get_monotonic_time ();
+      trace_events = g_array_new (FALSE, FALSE, sizeof (GisTraceEvent));
+      trace_threads = g_hash_table_new_full (NULL, NULL, NULL, g_free);
+      g_atomic_int_set (&trace_enabled, TRUE);
+      g_message ("recording a trace of this run");
+    }
+  g_mutex_unlock (&trace_mutex);
+}
+
+/**
+ * gis_trace_is_enabled:
+ *
+ * Returns: %TRUE if spans are being recorded
+ */
+gboolean
+gis_trace_is_enabled (void)
+{
+  static gsize initialized = 0;
+
+  if (g_once_init_enter (&initialized))
+    {
+      const gchar *env = g_getenv ("EI_TRACE");
+
+      if (env != NULL && *env != '\0' && g_strcmp0 (env, "0") != 0)
+        gis_trace_enable ();
+
+      g_once_init_leave (&initialized, 1);
+    }
+
+  return g_atomic_int_get (&trace_enabled);
+}
+
+/**
+ * gis_trace_begin:
+ * @category: what the span is part of, such as a stage of writing the image
+ * @name: what the span is
+ *
+ * Starts a span on the calling thread, which should usually be ended on the
+ * same thread.
+ *
+ * Returns: (transfer full) (nullable): a span to pass to gis_trace_end(), or
+ *  %NULL if tracing is not enabled
+ */
+GisTraceSpan *
+gis_trace_begin (const gchar *category,
+                 const gchar *name)
+{
+  GisTraceSpan *span;
+
+  if (!gis_trace_is_enabled ())
+    return NULL;
+
+  span = g_new0 (GisTraceSpan, 1);
+  span->event.category = g_intern_string (category);
+  span->event.name = g_intern_string (name);
+  span->event.tid = gis_trace_gettid ();
+  span->event.start_usec = g_get_monotonic_time ();
+
+  return span;
+}
+
+/**
+ * gis_trace_span_set_arg:
+ * @span: (nullable): a span from gis_trace_begin()
+ * @key: (not nullable): a static string, such as "bytes"
+ * @value: the value to record for @key
+ *
+ * Records a number alongside @span, such as how much data it handled. Up to
+ * %GIS_TRACE_MAX_ARGS may be set; others are ignored.
+ */
+void
+gis_trace_span_set_arg (GisTraceSpan *span,
+                        const gchar  *key,
+                        gint64        value)
+{
+  GisTraceEvent *event;
+
+  if (span == NULL)
+    return;
+
+  event = &span->event;
+  if (event->n_args < GIS_TRACE_MAX_ARGS)
+    {
+      event->arg_keys[event->n_args] = key;
+      event->arg_values[event->n_args] = value;
+      event->n_args++;
+    }
+}
+
+/**
+ * gis_trace_end:
+ * @span: (transfer full) (nullable): a span from gis_trace_begin()
+ *
+ * Ends and records @span.
+ */
+void
+gis_trace_end (GisTraceSpan *span)
+{
+  gint64 now_usec;
+
+  if (span == NULL)
+    return;
+
+  now_usec = g_get_monotonic_time ();
+
+  g_mutex_lock (&trace_mutex);
+
+  span->event.duration_usec = now_usec - span->event.start_usec;
+  span->event.start_usec -= trace_start_usec;
+
+  if (trace_events->len < GIS_TRACE_MAX_EVENTS)
+    g_array_append_val (trace_events, span->event);
+  else
+    trace_dropped++;
+
+  if (!g_hash_table_contains (trace_threads,
+                              GINT_TO_POINTER (span->event.tid)))
+    {
+      gchar name[16] = { 0 };
+
+      if (span->event.tid != gis_trace_gettid () ||
+          pthread_getname_np (pthread_self (), name, sizeof name) != 0)
+        g_snprintf (name, sizeof name, "%d", span->event.tid);
+
+      g_hash_table_insert (trace_threads, GINT_TO_POINTER (span->event.tid),
+                           g_strdup (name));
+    }
+
+  g_mutex_unlock (&trace_mutex);
+
+  g_free (span);
+}
+
+static void
+append_json_string (GString     *json,
+                    const gchar *s)
+{
+  g_string_append_c (json, '"');
+
+  for (; *s != '\0'; s++)
+    {
+      if (*s == '"' || *s == '\\')
+        g_string_append_printf (json, "\\%c", *s);
+      else if ((guchar) *s < 0x20)
+        g_string_append_printf (json, "\\u%04x", (guchar) *s);
+      else
+        g_string_append_c (json, *s);
+    }
+
+  g_string_append_c (json, '"');
+}
+
+static void
+append_metadata (GString     *json,
+                 const gchar *what,
+                 gint         pid,
+                 gint         tid,
+                 const gchar *name)
+{
+  g_string_append (json, "{\"ph\":\"M\",\"name\":");
+  append_json_string (json, what);
+  g_string_append_printf (json, ",\"pid\":%d,\"tid\":%d,\"args\":{\"name\":",
+                          pid, tid);
+  append_json_string (json, name);
+  g_string_append (json, "}},\n");
+}
+
+/**
+ * gis_trace_to_json:
+ *
+ * Returns: (transfer full): the spans recorded so far, in the Trace Event
+ *  Format; or %NULL if tracing is not enabled
+ */
+GBytes *
+gis_trace_to_json (void)
+{
+  g_autoptr(GString) json = NULL;
+  GHashTableIter iter;
+  gpointer tid, name;
+  gint pid = getpid ();
+  guint i;
+
+  if (!gis_trace_is_enabled ())
+    return NULL;
+
+  json = g_string_new ("{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+
+  g_mutex_lock (&trace_mutex);
+
+  append_metadata (json, "process_name", pid, pid, g_get_prgname () ?: "");
+
+  g_hash_table_iter_init (&iter, trace_threads);
+  while (g_hash_table_iter_next (&iter, &tid, &name))
+    append_metadata (json, "thread_name", pid, GPOINTER_TO_INT (tid), name);
+
+  for (i = 0; i < trace_events->len; i++)
+    {
+      const GisTraceEvent *event =
+        &g_array_index (trace_events, GisTraceEvent, i);
+      guint j;
+
+      g_string_append (json, "{\"ph\":\"X\",\"cat\":");
+      append_json_string (json, event->category);
+      g_string_append (json, ",\"name\":");
+      append_json_string (json, event->name);
+      g_string_append_printf (json,
+                              ",\"pid\":%d,\"tid\":%d"
+                              ",\"ts\":%" G_GINT64_FORMAT
+                              ",\"dur\":%" G_GINT64_FORMAT ",\"args\":{",
+                              pid, event->tid, event->start_usec,
+                              event->duration_usec);
+
+      for (j = 0; j < event->n_args; j++)
+        {
+          if (j > 0)
+            g_string_append_c (json, ',');
+          append_json_string (json, event->arg_keys[j]);
+          g_string_append_printf (json, ":%" G_GINT64_FORMAT,
+                                  event->arg_values[j]);
+        }
+
+      g_string_append (json, "}},\n");
+    }
+
+  /* Also ends the list without a trailing comma */
+  g_string_append_printf (json,
+                          "{\"ph\":\"M\",\"name\":\"dropped_spans\","
+                          "\"pid\":%d,\"tid\":%d,"
+                          "\"args\":{\"count\":%" G_GUINT64_FORMAT "}}\n"
+                          "]}\n",
+                          pid, pid, trace_dropped);
+
+  g_mutex_unlock (&trace_mutex);
+
+  return g_string_free_to_bytes (g_steal_pointer (&json));
+}
+
+typedef struct {
+  GFile *image_dir;
+  gchar *home_dir;
+} SaveTraceData;
+
+static void
+save_trace_data_free (SaveTraceData *d)
+{
+  g_clear_object (&d->image_dir);
+  g_free (d->home_dir);
+  g_free (d);
+}
+
+static GFile *
+save_trace_in_dir (GFile         *dir,
+                   const gchar   *basename,
+                   GBytes        *json,
+                   GCancellable  *cancellable,
+                   GError       **error)
+{
+  g_autoptr(GFile) target = g_file_get_child (dir, basename);
+  gsize size = 0;
+  gconstpointer data = g_bytes_get_data (json, &size);
+
+  if (!g_file_replace_contents (target, data, size, NULL, FALSE,
+                                G_FILE_CREATE_NONE, NULL, cancellable, error))
+    return NULL;
+
+  return g_steal_pointer (&target);
+}
+
+static void
+save_trace_thread_func (GTask        *task,
+                        gpointer      source_object,
+                        gpointer      task_data,
+                        GCancellable *cancellable)
+{
+  SaveTraceData *d = task_data;
+  g_autoptr(GBytes) json = gis_trace_to_json ();
+  g_autoptr(GDateTime) now = g_date_time_new_now_local ();
+  g_autofree gchar *now_str = g_date_time_format (now, "%y%m%d_%H%M%S_UTC%z");
+  g_autofree gchar *basename = g_strdup_printf ("eos-installer-trace-%s.json",
+                                                now_str);
+  g_autoptr(GFile) target = NULL;
+  g_autoptr(GError) error = NULL;
+
+  if (json == NULL)
+    {
+      g_task_return_pointer (task, NULL, NULL);
+      return;
+    }
+
+  /* Alongside the diagnostics; see write_diagnostics_thread_func() */
+  if (d->image_dir != NULL)
+    target = save_trace_in_dir (d->image_dir, basename, json, cancellable,
+                                &error);
+
+  if (target == NULL && d->home_dir != NULL)
+    {
+      g_autoptr(GFile) home_dir = g_file_new_for_path (d->home_dir);
+
+      g_clear_error (&error);
+      target = save_trace_in_dir (home_dir, basename, json, cancellable,
+                                  &error);
+    }
+
+  if (target != NULL)
+    g_task_return_pointer (task, g_steal_pointer (&target), g_object_unref);
+  else if (error != NULL)
+    g_task_return_error (task, g_steal_pointer (&error));
+  else
+    g_task_return_pointer (task, NULL, NULL);
+}
+
+/**
+ * gis_trace_save_async:
+ * @image_dir: (nullable): root directory of image partition, or %NULL if not
+ *  known
+ * @home_dir: (nullable): path to home directory, or %NULL if the trace
+ *  should not be saved to the home directory
+ *
+ * Saves the spans recorded so far, as by gis_trace_to_json(), to the first of
+ * @image_dir and @home_dir which is not %NULL and writable.
+ */
+void
+gis_trace_save_async (GFile              *image_dir,
+                      const gchar        *home_dir,
+                      GCancellable       *cancellable,
+                      GAsyncReadyCallback callback,
+                      gpointer            user_data)
+{
+  g_autoptr(GTask) task = g_task_new (NULL, cancellable, callback, user_data);
+  SaveTraceData *d = g_new0 (SaveTraceData, 1);
+
+  d->image_dir = image_dir != NULL ? g_object_ref (image_dir) : NULL;
+  d->home_dir = g_strdup (home_dir);
+
+  g_task_set_source_tag (task, gis_trace_save_async);
+  g_task_set_task_data (task, d, (GDestroyNotify) save_trace_data_free);
+  g_task_run_in_thread (task, save_trace_thread_func);
+}
+
+/**
+ * gis_trace_save_finish:
+ *
+ * Returns: (transfer full) (nullable): the saved trace; or %NULL if tracing
+ *  is not enabled, or both directories were %NULL
+ */
+GFile *
+gis_trace_save_finish (GAsyncResult *result,
+                       GError      **error)
+{
+  g_return_val_if_fail (g_task_is_valid (result, NULL), NULL);
+  g_return_val_if_fail (g_task_get_source_tag (G_TASK (result)) ==
+                        gis_trace_save_async, NULL);
+
+  return g_task_propagate_pointer (G_TASK (result), error);
+}
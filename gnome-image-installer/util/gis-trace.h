@@ -0,0 +1,62 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*- */
+/*
+ * Copyright © 2018 Endless Mobile, Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+#pragma once
+
+#include <gio/gio.h>
+
+G_BEGIN_DECLS
+
+/* Spans beyond this many are counted but not kept: enough for every chunk
+ * of a large image, in a few tens of MiB.
+ */
+#define GIS_TRACE_MAX_EVENTS (256 * 1024)
+#define GIS_TRACE_MAX_ARGS 2
+
+/**
+ * GisTraceSpan:
+ *
+ * A period of time spent on one thing, such as one chunk of the image passing
+ * through one stage of writing it, which is recorded once it ends. The spans
+ * recorded during a run can be saved in the Trace Event Format understood by
+ * chrome://tracing and Perfetto, with one track per thread.
+ */
+typedef struct _GisTraceSpan GisTraceSpan;
+
+void gis_trace_enable (void);
+gboolean gis_trace_is_enabled (void);
+
+GisTraceSpan *gis_trace_begin (const gchar *category,
+                               const gchar *name);
+void gis_trace_span_set_arg (GisTraceSpan *span,
+                             const gchar  *key,
+                             gint64        value);
+void gis_trace_end (GisTraceSpan *span);
+
+GBytes *gis_trace_to_json (void);
+
+void gis_trace_save_async (GFile              *image_dir,
+                           const gchar        *home_dir,
+                           GCancellable       *cancellable,
+                           GAsyncReadyCallback callback,
+                           gpointer            user_data);
+GFile *gis_trace_save_finish (GAsyncResult *result,
+                              GError      **error);
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (GisTraceSpan, gis_trace_end)
+
+G_END_DECLS
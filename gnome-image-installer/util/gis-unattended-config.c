@@ -24,6 +24,8 @@
 #include "glnx-errors.h"
 #include "glnx-fdio.h"
 
+#include "gis-http-source.h"
+
 #define EOS_GROUP "EndlessOS"
 #define LOCALE_KEY "locale"
 
@@ -34,6 +36,13 @@
 #define IMAGE_GROUP_PREFIX "Image"
 #define FILENAME_KEY "filename"
 #define BLOCK_DEVICE_KEY "block-device"
+#define SELECT_BLOCK_DEVICE_KEY "select-block-device"
+#define STATION_KEY "station"
+#define VERIFY_KEY "verify"
+#define WRITE_KEY "write"
+#define URL_KEY "url"
+#define COMPARE_KEY "compare"
+#define TRACE_KEY "trace"
 
 typedef struct _GisUnattendedConfig {
   GObject parent;
@@ -52,7 +61,15 @@ typedef struct _GisUnattendedConfig {
 
   /** Basename of image file */
   gchar *filename;
+  /** http:// or https:// URI of image file, to be read from a server */
+  gchar *url;
   gchar *block_device;
+  GisUnattendedDeviceSelection device_selection;
+  gboolean station;
+  GisUnattendedVerifyPolicy verify_policy;
+  GisUnattendedWritePolicy write_policy;
+  gboolean compare;
+  gboolean trace;
 } GisUnattendedConfig;
 
 G_DEFINE_QUARK (gis-unattended-error, gis_unattended_error);
@@ -123,6 +140,7 @@ gis_unattended_config_finalize (GObject *object)
   g_clear_pointer (&self->vendors, g_ptr_array_unref);
   g_clear_pointer (&self->products, g_ptr_array_unref);
   g_clear_pointer (&self->filename, g_free);
+  g_clear_pointer (&self->url, g_free);
   g_clear_pointer (&self->block_device, g_free);
 
   G_OBJECT_CLASS (gis_unattended_config_parent_class)->finalize (object);
@@ -206,6 +224,169 @@ key_file_get_optional_nonempty_string (GKeyFile    *key_file,
   return TRUE;
 }
 
+static gboolean
+key_file_get_optional_boolean (GKeyFile    *key_file,
+                               const gchar *group_name,
+                               const gchar *key,
+                               gboolean    *value_out,
+                               GError     **error)
+{
+  g_autoptr(GError) local_error = NULL;
+  gboolean value;
+
+  value = g_key_file_get_boolean (key_file, group_name, key, &local_error);
+  if (local_error != NULL)
+    {
+      if (!g_error_matches (local_error, G_KEY_FILE_ERROR,
+                            G_KEY_FILE_ERROR_KEY_NOT_FOUND))
+        {
+          g_set_error_literal (error, GIS_UNATTENDED_ERROR,
+                               GIS_UNATTENDED_ERROR_INVALID_IMAGE,
+                               local_error->message);
+          return FALSE;
+        }
+
+      value = FALSE;
+    }
+
+  *value_out = value;
+  return TRUE;
+}
+
+static gboolean
+key_file_get_device_selection (GKeyFile                     *key_file,
+                               const gchar                  *group_name,
+                               GisUnattendedDeviceSelection *value_out,
+                               GError                      **error)
+{
+  g_autofree gchar *value = NULL;
+
+  if (!key_file_get_optional_nonempty_string (key_file, group_name,
+                                              SELECT_BLOCK_DEVICE_KEY,
+                                              &value, error))
+    return FALSE;
+
+  if (value == NULL || g_str_equal (value, "unique"))
+    {
+      *value_out = GIS_UNATTENDED_DEVICE_SELECTION_UNIQUE;
+    }
+  else if (g_str_equal (value, "fastest"))
+    {
+      *value_out = GIS_UNATTENDED_DEVICE_SELECTION_FASTEST;
+    }
+  else
+    {
+      g_set_error (error, GIS_UNATTENDED_ERROR,
+                   GIS_UNATTENDED_ERROR_INVALID_IMAGE,
+                   /* Translators: this error refers to a configuration
+                    * file. The first placeholder is the name of a field in
+                    * the file; the second is the value it was set to.
+                    */
+                   _("Unknown value for %s key: ‘%s’"),
+                   SELECT_BLOCK_DEVICE_KEY, value);
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
+static gboolean
+key_file_get_verify_policy (GKeyFile                  *key_file,
+                            const gchar               *group_name,
+                            GisUnattendedVerifyPolicy *value_out,
+                            GError                   **error)
+{
+  g_autofree gchar *value = NULL;
+
+  if (!key_file_get_optional_nonempty_string (key_file, group_name,
+                                              VERIFY_KEY, &value, error))
+    return FALSE;
+
+  if (value == NULL || g_str_equal (value, "concurrent"))
+    {
+      *value_out = GIS_UNATTENDED_VERIFY_POLICY_CONCURRENT;
+    }
+  else if (g_str_equal (value, "first"))
+    {
+      *value_out = GIS_UNATTENDED_VERIFY_POLICY_FIRST;
+    }
+  else
+    {
+      g_set_error (error, GIS_UNATTENDED_ERROR,
+                   GIS_UNATTENDED_ERROR_INVALID_IMAGE,
+                   /* Translators: this error refers to a configuration
+                    * file. The first placeholder is the name of a field in
+                    * the file; the second is the value it was set to.
+                    */
+                   _("Unknown value for %s key: ‘%s’"),
+                   VERIFY_KEY, value);
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
+static gboolean
+key_file_get_url (GKeyFile    *key_file,
+                  const gchar *group_name,
+                  gchar      **value_out,
+                  GError     **error)
+{
+  g_autofree gchar *value = NULL;
+
+  if (!key_file_get_optional_nonempty_string (key_file, group_name,
+                                              URL_KEY, &value, error))
+    return FALSE;
+
+  if (value != NULL && !gis_http_source_is_uri (value))
+    {
+      g_set_error (error, GIS_UNATTENDED_ERROR,
+                   GIS_UNATTENDED_ERROR_INVALID_IMAGE,
+                   /* Translators: this error refers to a configuration
+                    * file. The first placeholder is the name of a field in
+                    * the file; the second is the value it was set to.
+                    */
+                   _("%s key must be an http:// or https:// URL: ‘%s’"),
+                   URL_KEY, value);
+      return FALSE;
+    }
+
+  *value_out = g_steal_pointer (&value);
+  return TRUE;
+}
+
+static gboolean
+key_file_get_write_policy (GKeyFile                 *key_file,
+                           const gchar              *group_name,
+                           GisUnattendedWritePolicy *value_out,
+                           GError                  **error)
+{
+  g_autofree gchar *value = NULL;
+
+  if (!key_file_get_optional_nonempty_string (key_file, group_name,
+                                              WRITE_KEY, &value, error))
+    return FALSE;
+
+  if (value == NULL || g_str_equal (value, "full"))
+    {
+      *value_out = GIS_UNATTENDED_WRITE_POLICY_FULL;
+    }
+  else if (g_str_equal (value, "used"))
+    {
+      *value_out = GIS_UNATTENDED_WRITE_POLICY_USED;
+    }
+  else
+    {
+      g_set_error (error, GIS_UNATTENDED_ERROR,
+                   GIS_UNATTENDED_ERROR_INVALID_IMAGE,
+                   _("Unknown value for %s key: ‘%s’"),
+                   WRITE_KEY, value);
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
 static gboolean
 gis_unattended_config_populate_fields (GisUnattendedConfig *self,
                                        GError **error)
@@ -268,8 +449,43 @@ gis_unattended_config_populate_fields (GisUnattendedConfig *self,
               !key_file_get_optional_nonempty_string (self->key_file,
                                                       *group, BLOCK_DEVICE_KEY,
                                                       &self->block_device,
-                                                      error))
+                                                      error) ||
+              !key_file_get_device_selection (self->key_file, *group,
+                                              &self->device_selection,
+                                              error) ||
+              !key_file_get_optional_boolean (self->key_file, *group,
+                                              STATION_KEY, &self->station,
+                                              error) ||
+              !key_file_get_verify_policy (self->key_file, *group,
+                                           &self->verify_policy,
+                                           error) ||
+              !key_file_get_write_policy (self->key_file, *group,
+                                          &self->write_policy,
+                                          error) ||
+              !key_file_get_url (self->key_file, *group, &self->url, error) ||
+              !key_file_get_optional_boolean (self->key_file, *group,
+                                              COMPARE_KEY, &self->compare,
+                                              error) ||
+              !key_file_get_optional_boolean (self->key_file, *group,
+                                              TRACE_KEY, &self->trace,
+                                              error))
             return FALSE;
+
+          /* Station mode decompresses the image to a local cache, which is
+           * only worthwhile for an image which is already local.
+           */
+          if (self->station && self->url != NULL)
+            {
+              g_set_error (error, GIS_UNATTENDED_ERROR,
+                           GIS_UNATTENDED_ERROR_INVALID_IMAGE,
+                           /* Translators: this error refers to a
+                            * configuration file. The placeholders are the
+                            * names of fields in the file.
+                            */
+                           _("%s and %s keys cannot be used together"),
+                           STATION_KEY, URL_KEY);
+              return FALSE;
+            }
         }
     }
 
@@ -353,6 +569,19 @@ gis_unattended_config_get_image (GisUnattendedConfig *self)
   return self->filename;
 }
 
+/**
+ * gis_unattended_config_get_url:
+ *
+ * Returns: the http:// or https:// URL of the configured image, if it is to be
+ *  read from a server rather than from the installer's own partition, or
+ *  %NULL otherwise.
+ */
+const gchar *
+gis_unattended_config_get_url (GisUnattendedConfig *self)
+{
+  return self->url;
+}
+
 /**
  * gis_unattended_config_matches_device:
  * @device: full path to a block device
@@ -376,6 +605,80 @@ gis_unattended_config_matches_device (GisUnattendedConfig *self,
   return g_str_has_prefix (basename, self->block_device);
 }
 
+/**
+ * gis_unattended_config_is_station:
+ *
+ * Returns: %TRUE if the installer should run as an imaging station, writing
+ *  the image to each matching drive as it is plugged in, rather than to a
+ *  single drive.
+ */
+gboolean
+gis_unattended_config_is_station (GisUnattendedConfig *self)
+{
+  return self->station;
+}
+
+/**
+ * gis_unattended_config_get_verify_policy:
+ *
+ * Returns: whether the image should be verified while it is written, or
+ *  beforehand
+ */
+GisUnattendedVerifyPolicy
+gis_unattended_config_get_verify_policy (GisUnattendedConfig *self)
+{
+  return self->verify_policy;
+}
+
+/**
+ * gis_unattended_config_get_write_policy:
+ *
+ * Returns: whether the whole image should be written, or only the parts of it
+ *  which are in use
+ */
+GisUnattendedWritePolicy
+gis_unattended_config_get_write_policy (GisUnattendedConfig *self)
+{
+  return self->write_policy;
+}
+
+/**
+ * gis_unattended_config_is_compare:
+ *
+ * Returns: %TRUE if the image should be compared with what is already on the
+ *  target disk, writing only the parts which differ, rather than written over
+ *  it regardless.
+ */
+gboolean
+gis_unattended_config_is_compare (GisUnattendedConfig *self)
+{
+  return self->compare;
+}
+
+/**
+ * gis_unattended_config_is_trace:
+ *
+ * Returns: %TRUE if a timeline of writing the image should be recorded and
+ *  saved alongside the image.
+ */
+gboolean
+gis_unattended_config_is_trace (GisUnattendedConfig *self)
+{
+  return self->trace;
+}
+
+/**
+ * gis_unattended_config_get_device_selection:
+ *
+ * Returns: how to choose between several block devices which all match the
+ *  configured target device
+ */
+GisUnattendedDeviceSelection
+gis_unattended_config_get_device_selection (GisUnattendedConfig *self)
+{
+  return self->device_selection;
+}
+
 /**
  * gis_unattended_config_match_computer:
  * @vendor: (nullable): the current computer's vendor, or %NULL if it could not
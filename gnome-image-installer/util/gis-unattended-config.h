@@ -72,6 +72,44 @@ typedef enum {
     GIS_UNATTENDED_COMPUTER_DOES_NOT_MATCH
 } GisUnattendedComputerMatch;
 
+/**
+ * GisUnattendedDeviceSelection:
+ * @GIS_UNATTENDED_DEVICE_SELECTION_UNIQUE: exactly one block device must match
+ *  the [Image...] definition; if more than one does, the process fails.
+ * @GIS_UNATTENDED_DEVICE_SELECTION_FASTEST: if more than one block device
+ *  matches, each is benchmarked and the one which is expected to be quickest
+ *  to write to is used.
+ */
+typedef enum {
+    GIS_UNATTENDED_DEVICE_SELECTION_UNIQUE,
+    GIS_UNATTENDED_DEVICE_SELECTION_FASTEST,
+} GisUnattendedDeviceSelection;
+
+/**
+ * GisUnattendedVerifyPolicy:
+ * @GIS_UNATTENDED_VERIFY_POLICY_CONCURRENT: the image is verified as it is
+ *  written, which is quickest; if verification fails, the target disk has
+ *  already been overwritten.
+ * @GIS_UNATTENDED_VERIFY_POLICY_FIRST: the image is verified in full before
+ *  the target disk is touched.
+ */
+typedef enum {
+    GIS_UNATTENDED_VERIFY_POLICY_CONCURRENT,
+    GIS_UNATTENDED_VERIFY_POLICY_FIRST,
+} GisUnattendedVerifyPolicy;
+
+/**
+ * GisUnattendedWritePolicy:
+ * @GIS_UNATTENDED_WRITE_POLICY_FULL: the whole image is written.
+ * @GIS_UNATTENDED_WRITE_POLICY_USED: only the partition tables and the parts
+ *  of each partition which are in use are written; the rest of the target
+ *  disk is left as it was.
+ */
+typedef enum {
+    GIS_UNATTENDED_WRITE_POLICY_FULL,
+    GIS_UNATTENDED_WRITE_POLICY_USED,
+} GisUnattendedWritePolicy;
+
 GisUnattendedConfig *gis_unattended_config_new (const gchar *file_path,
                                                 GError **error);
 
@@ -79,9 +117,23 @@ const gchar *gis_unattended_config_get_locale (GisUnattendedConfig *self);
 
 const gchar *gis_unattended_config_get_image (GisUnattendedConfig *self);
 
+const gchar *gis_unattended_config_get_url (GisUnattendedConfig *self);
+
 gboolean gis_unattended_config_matches_device (GisUnattendedConfig *self,
                                                const gchar *device);
 
+GisUnattendedDeviceSelection gis_unattended_config_get_device_selection (GisUnattendedConfig *self);
+
+gboolean gis_unattended_config_is_station (GisUnattendedConfig *self);
+
+GisUnattendedVerifyPolicy gis_unattended_config_get_verify_policy (GisUnattendedConfig *self);
+
+GisUnattendedWritePolicy gis_unattended_config_get_write_policy (GisUnattendedConfig *self);
+
+gboolean gis_unattended_config_is_compare (GisUnattendedConfig *self);
+
+gboolean gis_unattended_config_is_trace (GisUnattendedConfig *self);
+
 GisUnattendedComputerMatch gis_unattended_config_match_computer (GisUnattendedConfig *self,
                                                                  const gchar *vendor,
                                                                  const gchar *product);
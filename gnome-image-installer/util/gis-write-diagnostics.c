@@ -22,17 +22,20 @@ typedef struct {
     gchar *eos_diagnostics_exe;
     GFile *image_dir;
     gchar *home_dir;
+    gchar *report;
 } WriteDiagnosticsData;
 
 static WriteDiagnosticsData *
 write_diagnostics_data_new (const gchar *eos_diagnostics_exe,
                             GFile       *image_dir,
-                            const gchar *home_dir)
+                            const gchar *home_dir,
+                            const gchar *report)
 {
   WriteDiagnosticsData *d = g_new (WriteDiagnosticsData, 1);
   d->eos_diagnostics_exe = g_strdup (eos_diagnostics_exe ?: "eos-diagnostics");
   d->image_dir = image_dir != NULL ? g_object_ref (image_dir) : NULL;
   d->home_dir = g_strdup (home_dir);
+  d->report = g_strdup (report);
   return d;
 }
 
@@ -42,52 +45,121 @@ write_diagnostics_data_free (WriteDiagnosticsData *d)
   g_free (d->eos_diagnostics_exe);
   g_clear_object (&d->image_dir);
   g_free (d->home_dir);
+  g_free (d->report);
   g_free (d);
 }
 
-static GBytes *
-get_diagnostics (WriteDiagnosticsData *d,
-                 GCancellable *cancellable,
-                 GError **error)
+/* Creates @basename in @dir, returning a stream which compresses whatever is
+ * written to it into that file.
+ */
+static GOutputStream *
+open_in_dir (GFile *dir,
+             const gchar *basename,
+             GFile **target_out,
+             GCancellable *cancellable,
+             GError **error)
+{
+  g_autoptr(GFile) target = g_file_get_child (dir, basename);
+  g_autoptr(GFileOutputStream) file_stream = NULL;
+  g_autoptr(GZlibCompressor) compressor = NULL;
+
+  file_stream = g_file_replace (target, NULL, FALSE, G_FILE_CREATE_NONE,
+                                cancellable, error);
+  if (file_stream == NULL)
+    return NULL;
+
+  compressor = g_zlib_compressor_new (G_ZLIB_COMPRESSOR_FORMAT_GZIP, -1);
+  *target_out = g_steal_pointer (&target);
+  return g_converter_output_stream_new (G_OUTPUT_STREAM (file_stream),
+                                        G_CONVERTER (compressor));
+}
+
+/* Streams the diagnostics, followed by the report if any, into @output; so
+ * they are never held in memory all at once.
+ */
+static gboolean
+write_diagnostics (WriteDiagnosticsData *d,
+                   GSubprocess *subprocess,
+                   GOutputStream *output,
+                   GCancellable *cancellable,
+                   GError **error)
 {
-  g_autoptr(GSubprocess) subprocess =
-    g_subprocess_new (G_SUBPROCESS_FLAGS_STDOUT_PIPE, error,
-                      d->eos_diagnostics_exe, "stdout", NULL);
-  g_autoptr(GBytes) stdout_buf = NULL;
-
-  if (subprocess != NULL &&
-      g_subprocess_communicate (subprocess,
-                                NULL /* stdin_buf */,
-                                cancellable,
-                                &stdout_buf,
-                                NULL /* stderr_buf */,
-                                error) &&
-      g_subprocess_wait_check (subprocess, cancellable, error))
-    return g_steal_pointer (&stdout_buf);
-
-  return NULL;
+  GInputStream *diagnostics = g_subprocess_get_stdout_pipe (subprocess);
+
+  if (g_output_stream_splice (output, diagnostics,
+                              G_OUTPUT_STREAM_SPLICE_CLOSE_SOURCE,
+                              cancellable, error) < 0 ||
+      !g_subprocess_wait_check (subprocess, cancellable, error))
+    return FALSE;
+
+  if (d->report != NULL &&
+      !g_output_stream_printf (output, NULL, cancellable, error,
+                               "\n%s", d->report))
+    return FALSE;
+
+  return g_output_stream_close (output, cancellable, error);
 }
 
+/* Errors from which writing the diagnostics elsewhere won't recover */
 static gboolean
-write_diagnostics_in_dir (GTask *task,
+is_diagnostics_error (const GError *error)
+{
+  return error->domain == G_SPAWN_ERROR ||
+         error->domain == G_SPAWN_EXIT_ERROR ||
+         g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED);
+}
+
+/* Runs eos-diagnostics, writing what it prints, and the report, to a new file
+ * @basename in @dir, or (if @dir is %NULL) nowhere.
+ *
+ * Returns: (transfer full): the file written, or %NULL with @error set; or, if
+ *  @dir is %NULL, with @error unset unless eos-diagnostics failed
+ */
+static GFile *
+write_diagnostics_to_dir (WriteDiagnosticsData *d,
                           GFile *dir,
                           const gchar *basename,
-                          GBytes *diagnostics,
                           GCancellable *cancellable,
                           GError **error)
 {
-  g_autoptr(GFile) target = g_file_get_child (dir, basename);
-  gsize size = 0;
-  gconstpointer data = g_bytes_get_data (diagnostics, &size);
+  g_autoptr(GSubprocess) subprocess = NULL;
+  g_autoptr(GOutputStream) output = NULL;
+  g_autoptr(GFile) target = NULL;
+  g_autoptr(GError) local_error = NULL;
 
-  if (g_file_replace_contents (target, data, size, NULL, FALSE,
-                               G_FILE_CREATE_NONE, NULL, cancellable, error))
+  subprocess = g_subprocess_new (G_SUBPROCESS_FLAGS_STDOUT_PIPE, error,
+                                 d->eos_diagnostics_exe, "stdout", NULL);
+  if (subprocess == NULL)
+    return NULL;
+
+  if (dir != NULL)
+    output = open_in_dir (dir, basename, &target, cancellable, &local_error);
+
+  if (output == NULL)
     {
-      g_task_return_pointer (task, g_steal_pointer (&target), g_object_unref);
-      return TRUE;
+      /* There's nowhere to write the diagnostics, but eos-diagnostics failing
+       * is the more interesting error.
+       */
+      if (!g_subprocess_communicate (subprocess, NULL, cancellable, NULL, NULL,
+                                     error) ||
+          !g_subprocess_wait_check (subprocess, cancellable, error))
+        return NULL;
+
+      if (local_error != NULL)
+        g_propagate_error (error, g_steal_pointer (&local_error));
+
+      return NULL;
     }
 
-  return FALSE;
+  if (!write_diagnostics (d, subprocess, output, cancellable, error))
+    {
+      /* Don't leave a truncated file behind */
+      g_output_stream_close (output, NULL, NULL);
+      g_file_delete (target, NULL, NULL);
+      return NULL;
+    }
+
+  return g_steal_pointer (&target);
 }
 
 static void
@@ -98,50 +170,50 @@ write_diagnostics_thread_func (GTask *task,
 {
   WriteDiagnosticsData *d = task_data;
   g_autoptr(GError) error = NULL;
-
-  /* Grab diagnostics */
-  g_autoptr(GBytes) diagnostics = get_diagnostics (d, cancellable, &error);
-  if (diagnostics == NULL)
-    {
-      g_task_return_error (task, g_steal_pointer (&error));
-      return;
-    }
+  g_autoptr(GFile) home_dir = NULL;
+  GFile *target = NULL;
 
   /* Generate a filename matching those generated by eos-diagnostics. We build
    * the filename ourselves rather than letting eos-diagnostics do it because:
    * 1. we need to try two different target directories
    * 2. eos-diagnostics prints other text beside the output path
+   * 3. we add the installer's own report, and compress the whole lot
    */
   g_autoptr(GDateTime) now = g_date_time_new_now_local ();
   g_autofree gchar *now_str = g_date_time_format (now, "%y%m%d_%H%M%S_UTC%z");
-  g_autofree gchar *output_basename = g_strdup_printf ("eos-diagnostics-%s.txt",
-                                                       now_str);
-  g_autofree gchar *output = NULL;
+  g_autofree gchar *output_basename =
+    g_strdup_printf ("eos-diagnostics-%s.txt.gz", now_str);
 
   /* Ideally, we want to store the diagnostics to the live medium, in a
    * location which is easily found on both Windows and Linux. The ideal place
    * is the partition where the image is. This will fail if the image is on an
-   * ISO, since the ISO filesystem is read-only. It's also possible that the
-   * problem we hit is that we couldn't find the image partition!
+   * ISO, since the ISO filesystem is read-only, or if the partition is full.
+   * It's also possible that the problem we hit is that we couldn't find the
+   * image partition!
    */
   if (d->image_dir != NULL)
     {
-      if (write_diagnostics_in_dir (task, d->image_dir, output_basename,
-                                    diagnostics, cancellable, &error))
-        return;
+      target = write_diagnostics_to_dir (d, d->image_dir, output_basename,
+                                         cancellable, &error);
+
+      if (target != NULL || d->home_dir == NULL ||
+          is_diagnostics_error (error))
+        goto out;
 
-      if (d->home_dir != NULL &&
-          !g_error_matches (error, G_FILE_ERROR, G_FILE_ERROR_ROFS))
+      if (!g_error_matches (error, G_IO_ERROR, G_IO_ERROR_READ_ONLY))
         {
           g_autofree gchar *image_dirname = g_file_get_path (d->image_dir);
           g_message ("failed to write diagnostics to %s: %s",
                      image_dirname, error->message);
         }
+
+      g_clear_error (&error);
     }
 
-  /* Otherwise, save to the user's home directory. Unfortunately, this is a
-   * tmpfs (when running from the FBE, it's in /run; in a live user session,
-   * /home is a tmpfs).
+  /* Otherwise, save to the user's home directory, running eos-diagnostics
+   * again since its output was not kept. Unfortunately, this is a tmpfs (when
+   * running from the FBE, it's in /run; in a live user session, /home is a
+   * tmpfs).
    *
    * The additional complication is that, when running from the FBE, the user
    * can't get to a file manager or web browser. So there's only any point in
@@ -151,18 +223,16 @@ write_diagnostics_thread_func (GTask *task,
    * should just give up.)
    */
   if (d->home_dir != NULL)
-    {
-      g_autoptr(GFile) home_dir = g_file_new_for_path (d->home_dir);
-      g_clear_error (&error);
-      if (write_diagnostics_in_dir (task, home_dir, output_basename,
-                                    diagnostics, cancellable, &error))
-        return;
-    }
+    home_dir = g_file_new_for_path (d->home_dir);
+
+  target = write_diagnostics_to_dir (d, home_dir, output_basename,
+                                     cancellable, &error);
 
+out:
   if (error != NULL)
     g_task_return_error (task, g_steal_pointer (&error));
   else
-    g_task_return_pointer (task, NULL, NULL);
+    g_task_return_pointer (task, target, g_object_unref);
 }
 
 /**
@@ -173,21 +243,26 @@ write_diagnostics_thread_func (GTask *task,
  *  known
  * @home_dir: (nullable): path to home directory, or %NULL if diagnostics
  *  should not be written to the home directory
+ * @report: (nullable): the installer's own report, such as that from
+ *  gis_scribe_get_report(), to follow the diagnostics
  *
- * Writes diagnostics produced by @eos_diagnostics_exe to the first of
- * @image_dir and @home_dir which is not %NULL and writable.
+ * Writes diagnostics produced by @eos_diagnostics_exe, followed by @report,
+ * to the first of @image_dir and @home_dir which is not %NULL and can hold
+ * them. They are compressed with gzip as they are written.
  */
 void
 gis_write_diagnostics_async (const gchar        *eos_diagnostics_exe,
                              GFile              *image_dir,
                              const gchar        *home_dir,
+                             const gchar        *report,
                              GCancellable       *cancellable,
                              GAsyncReadyCallback callback,
                              gpointer            user_data)
 {
   g_autoptr(GTask) task = NULL;
   WriteDiagnosticsData *d =
-    write_diagnostics_data_new (eos_diagnostics_exe, image_dir, home_dir);
+    write_diagnostics_data_new (eos_diagnostics_exe, image_dir, home_dir,
+                                report);
 
   task = g_task_new (NULL, cancellable, callback, user_data);
   g_task_set_task_data (task, d, (GDestroyNotify) write_diagnostics_data_free);
@@ -21,6 +21,7 @@
 void gis_write_diagnostics_async (const gchar        *eos_diagnostics_exe,
                                   GFile              *image_dir,
                                   const gchar        *home_dir,
+                                  const gchar        *report,
                                   GCancellable       *cancellable,
                                   GAsyncReadyCallback callback,
                                   gpointer            user_data);
@@ -0,0 +1,628 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*- */
+/*
+ * Copyright © 2018 Endless Mobile, Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+#include "config.h"
+#include "gis-write-map.h"
+
+#include <string.h>
+
+#include <gio/gio.h>
+
+#include "gpt_probe.h"
+
+/* The subset of the ext2/3/4 on-disk format needed to find free blocks. Every
+ * field is little-endian.
+ */
+#define EXT4_SUPERBLOCK_OFFSET 1024
+#define EXT4_SUPERBLOCK_SIZE 1024
+#define EXT4_SB_BLOCKS_COUNT_LO 0x04
+#define EXT4_SB_FIRST_DATA_BLOCK 0x14
+#define EXT4_SB_LOG_BLOCK_SIZE 0x18
+#define EXT4_SB_BLOCKS_PER_GROUP 0x20
+#define EXT4_SB_MAGIC 0x38
+#define EXT4_SB_FEATURE_INCOMPAT 0x60
+#define EXT4_SB_DESC_SIZE 0xFE
+#define EXT4_SB_BLOCKS_COUNT_HI 0x150
+
+#define EXT4_MAGIC 0xEF53
+#define EXT4_FEATURE_INCOMPAT_META_BG 0x10
+#define EXT4_FEATURE_INCOMPAT_64BIT 0x80
+#define EXT4_MIN_DESC_SIZE 32
+#define EXT4_MIN_DESC_SIZE_64BIT 64
+
+#define EXT4_BG_BLOCK_BITMAP_LO 0x00
+#define EXT4_BG_FLAGS 0x12
+#define EXT4_BG_BLOCK_BITMAP_HI 0x20
+#define EXT4_BG_BLOCK_UNINIT 0x2
+
+/* The block bitmaps of each filesystem are kept until the whole image has been
+ * written. With 4 KiB blocks, this is enough for a 512 GiB filesystem; larger
+ * ones are written in full.
+ */
+#define MAX_BITMAP_BYTES (16 * 1024 * 1024)
+
+typedef enum {
+  EXT4_STATE_SUPERBLOCK,
+  EXT4_STATE_DESCRIPTORS,
+  EXT4_STATE_BITMAPS,
+  /* Not ext2/3/4, or not laid out in a way we understand */
+  EXT4_STATE_NONE,
+} Ext4State;
+
+typedef struct {
+  Ext4State state;
+
+  guint8 superblock[EXT4_SUPERBLOCK_SIZE];
+  guint32 block_size;
+  guint32 blocks_per_group;
+  guint32 first_data_block;
+  guint64 blocks_count;
+  guint32 n_groups;
+  guint32 desc_size;
+
+  /* The group descriptor table, while it is being read. Offsets here and
+   * below are from the start of the image.
+   */
+  guint64 descriptors_offset;
+  gsize descriptors_len;
+  guint8 *descriptors;
+
+  /* n_groups bitmaps of bitmap_len bytes each */
+  gsize bitmap_len;
+  guint8 *bitmaps;
+  /* For each group, the offset of its bitmap, or 0 if it can't be learned */
+  guint64 *bitmap_offsets;
+  /* For each group, whether its bitmap has been read in full */
+  gboolean *complete;
+  /* Group numbers in order of bitmap_offsets; and the index in this array of
+   * the next bitmap to read
+   */
+  guint32 *order;
+  guint32 next;
+} Ext4Tracker;
+
+typedef struct {
+  /* Offsets within the image; end is exclusive */
+  guint64 start;
+  guint64 end;
+  /* NULL for the partition tables */
+  Ext4Tracker *ext4;
+} Extent;
+
+struct _GisWriteMap {
+  /* Sorted and non-overlapping Extents: every byte outside them is skipped */
+  GArray *extents;
+  /* Index of the first extent which ends after the last offset looked up */
+  guint cursor;
+};
+
+static guint16
+read_le16 (const guint8 *p)
+{
+  guint16 v;
+
+  memcpy (&v, p, sizeof v);
+  return GUINT16_FROM_LE (v);
+}
+
+static guint32
+read_le32 (const guint8 *p)
+{
+  guint32 v;
+
+  memcpy (&v, p, sizeof v);
+  return GUINT32_FROM_LE (v);
+}
+
+static gboolean
+is_zero (const guint8 *p,
+         gsize         len)
+{
+  gsize i;
+
+  for (i = 0; i < len; i++)
+    if (p[i] != 0)
+      return FALSE;
+
+  return TRUE;
+}
+
+/* Copies whatever part of [want, want + want_len) lies within the image data
+ * [offset, offset + len) to the corresponding part of @dest. Since data is
+ * seen in order, returns %TRUE once the wanted region has been copied in full.
+ */
+static gboolean
+capture (guint64       want,
+         gsize         want_len,
+         guint8       *dest,
+         guint64       offset,
+         const guint8 *data,
+         gsize         len)
+{
+  guint64 from = MAX (want, offset);
+  guint64 to = MIN (want + want_len, offset + len);
+
+  if (from < to)
+    memcpy (dest + (from - want), data + (from - offset), to - from);
+
+  return offset + len >= want + want_len;
+}
+
+static void
+ext4_tracker_free (Ext4Tracker *ext4)
+{
+  g_free (ext4->descriptors);
+  g_free (ext4->bitmaps);
+  g_free (ext4->bitmap_offsets);
+  g_free (ext4->complete);
+  g_free (ext4->order);
+  g_free (ext4);
+}
+
+static void
+ext4_give_up (Ext4Tracker  *ext4,
+              const Extent *extent,
+              const gchar  *reason)
+{
+  g_message ("ext4 filesystem at sector %" G_GUINT64_FORMAT " %s; "
+             "writing all of it",
+             extent->start / SECTOR_SIZE, reason);
+  g_clear_pointer (&ext4->descriptors, g_free);
+  ext4->state = EXT4_STATE_NONE;
+}
+
+static gboolean
+ext4_parse_superblock (Ext4Tracker  *ext4,
+                       const Extent *extent)
+{
+  const guint8 *sb = ext4->superblock;
+  guint32 log_block_size = read_le32 (sb + EXT4_SB_LOG_BLOCK_SIZE);
+  guint32 incompat = read_le32 (sb + EXT4_SB_FEATURE_INCOMPAT);
+  guint64 n_groups;
+
+  if (read_le16 (sb + EXT4_SB_MAGIC) != EXT4_MAGIC)
+    {
+      ext4->state = EXT4_STATE_NONE;
+      return FALSE;
+    }
+
+  if (log_block_size > 6)
+    {
+      ext4_give_up (ext4, extent, "has an unsupported block size");
+      return FALSE;
+    }
+
+  /* With meta_bg, group descriptors are scattered across the disk */
+  if (incompat & EXT4_FEATURE_INCOMPAT_META_BG)
+    {
+      ext4_give_up (ext4, extent, "uses meta_bg");
+      return FALSE;
+    }
+
+  ext4->block_size = 1024 << log_block_size;
+  ext4->blocks_per_group = read_le32 (sb + EXT4_SB_BLOCKS_PER_GROUP);
+  ext4->first_data_block = read_le32 (sb + EXT4_SB_FIRST_DATA_BLOCK);
+  ext4->blocks_count = read_le32 (sb + EXT4_SB_BLOCKS_COUNT_LO);
+  ext4->desc_size = EXT4_MIN_DESC_SIZE;
+
+  if (incompat & EXT4_FEATURE_INCOMPAT_64BIT)
+    {
+      ext4->blocks_count |= (guint64) read_le32 (sb + EXT4_SB_BLOCKS_COUNT_HI) << 32;
+      ext4->desc_size = read_le16 (sb + EXT4_SB_DESC_SIZE);
+    }
+
+  if (ext4->desc_size < EXT4_MIN_DESC_SIZE ||
+      ext4->desc_size > ext4->block_size ||
+      (ext4->desc_size & (ext4->desc_size - 1)) != 0 ||
+      ext4->blocks_per_group == 0 ||
+      ext4->blocks_per_group % 8 != 0 ||
+      ext4->blocks_per_group > 8 * ext4->block_size ||
+      ext4->first_data_block >= ext4->blocks_count ||
+      ext4->blocks_count > (extent->end - extent->start) / ext4->block_size)
+    {
+      ext4_give_up (ext4, extent, "has an invalid superblock");
+      return FALSE;
+    }
+
+  n_groups = (ext4->blocks_count - ext4->first_data_block +
+              ext4->blocks_per_group - 1) / ext4->blocks_per_group;
+  ext4->bitmap_len = ext4->blocks_per_group / 8;
+  if (n_groups * ext4->bitmap_len > MAX_BITMAP_BYTES ||
+      n_groups * ext4->desc_size > MAX_BITMAP_BYTES)
+    {
+      ext4_give_up (ext4, extent, "is too large");
+      return FALSE;
+    }
+
+  ext4->n_groups = n_groups;
+  ext4->descriptors_offset = extent->start +
+    (guint64) (ext4->first_data_block + 1) * ext4->block_size;
+  ext4->descriptors_len = n_groups * ext4->desc_size;
+  if (ext4->descriptors_offset + ext4->descriptors_len > extent->end)
+    {
+      ext4_give_up (ext4, extent, "has an invalid superblock");
+      return FALSE;
+    }
+
+  ext4->descriptors = g_malloc (ext4->descriptors_len);
+  ext4->state = EXT4_STATE_DESCRIPTORS;
+  return TRUE;
+}
+
+static gint
+compare_bitmap_offsets (gconstpointer a,
+                        gconstpointer b,
+                        gpointer      data)
+{
+  const guint64 *bitmap_offsets = data;
+  guint64 offset_a = bitmap_offsets[*(const guint32 *) a];
+  guint64 offset_b = bitmap_offsets[*(const guint32 *) b];
+
+  return offset_a < offset_b ? -1 : offset_a > offset_b ? 1 : 0;
+}
+
+static void
+ext4_parse_descriptors (Ext4Tracker  *ext4,
+                        const Extent *extent)
+{
+  /* Bitmaps which start before this point have already gone past */
+  guint64 seen = ext4->descriptors_offset + ext4->descriptors_len;
+  guint32 n_unknown = 0;
+  guint32 g;
+
+  ext4->bitmaps = g_malloc (ext4->n_groups * ext4->bitmap_len);
+  ext4->bitmap_offsets = g_new0 (guint64, ext4->n_groups);
+  ext4->complete = g_new0 (gboolean, ext4->n_groups);
+  ext4->order = g_new (guint32, ext4->n_groups);
+
+  for (g = 0; g < ext4->n_groups; g++)
+    {
+      const guint8 *desc = ext4->descriptors + (gsize) g * ext4->desc_size;
+      guint64 block = read_le32 (desc + EXT4_BG_BLOCK_BITMAP_LO);
+      guint64 offset;
+
+      if (ext4->desc_size >= EXT4_MIN_DESC_SIZE_64BIT)
+        block |= (guint64) read_le32 (desc + EXT4_BG_BLOCK_BITMAP_HI) << 32;
+
+      offset = extent->start + block * ext4->block_size;
+      ext4->order[g] = g;
+
+      /* An uninitialized bitmap is computed by the kernel rather than read,
+       * so its contents on disk mean nothing.
+       */
+      if ((read_le16 (desc + EXT4_BG_FLAGS) & EXT4_BG_BLOCK_UNINIT) != 0 ||
+          block >= ext4->blocks_count ||
+          offset < seen)
+        n_unknown++;
+      else
+        ext4->bitmap_offsets[g] = offset;
+    }
+
+  g_qsort_with_data (ext4->order, ext4->n_groups, sizeof *ext4->order,
+                     compare_bitmap_offsets, ext4->bitmap_offsets);
+  /* Groups whose bitmaps can't be learned sort first */
+  ext4->next = n_unknown;
+
+  g_clear_pointer (&ext4->descriptors, g_free);
+  ext4->state = EXT4_STATE_BITMAPS;
+
+  g_message ("ext4 filesystem at sector %" G_GUINT64_FORMAT ": "
+             "%" G_GUINT32_FORMAT " block groups; skipping free blocks in "
+             "%" G_GUINT32_FORMAT " of them",
+             extent->start / SECTOR_SIZE, ext4->n_groups,
+             ext4->n_groups - n_unknown);
+}
+
+static void
+ext4_observe (Ext4Tracker  *ext4,
+              const Extent *extent,
+              guint64       offset,
+              const guint8 *data,
+              gsize         len)
+{
+  switch (ext4->state)
+    {
+    case EXT4_STATE_SUPERBLOCK:
+      if (!capture (extent->start + EXT4_SUPERBLOCK_OFFSET,
+                    EXT4_SUPERBLOCK_SIZE, ext4->superblock,
+                    offset, data, len) ||
+          !ext4_parse_superblock (ext4, extent))
+        return;
+      /* fall through */
+
+    case EXT4_STATE_DESCRIPTORS:
+      if (!capture (ext4->descriptors_offset, ext4->descriptors_len,
+                    ext4->descriptors, offset, data, len))
+        return;
+
+      ext4_parse_descriptors (ext4, extent);
+      /* fall through */
+
+    case EXT4_STATE_BITMAPS:
+      while (ext4->next < ext4->n_groups)
+        {
+          guint32 g = ext4->order[ext4->next];
+
+          if (ext4->bitmap_offsets[g] >= offset + len ||
+              !capture (ext4->bitmap_offsets[g], ext4->bitmap_len,
+                        ext4->bitmaps + (gsize) g * ext4->bitmap_len,
+                        offset, data, len))
+            break;
+
+          ext4->complete[g] = TRUE;
+          ext4->next++;
+        }
+      break;
+
+    case EXT4_STATE_NONE:
+    default:
+      break;
+    }
+}
+
+/* Blocks are assumed to be in use unless their group's bitmap says otherwise.
+ * This includes any space after the filesystem, to the end of the partition,
+ * which may hold something else, such as a dm-verity hash tree.
+ */
+static gboolean
+ext4_block_is_used (Ext4Tracker *ext4,
+                    guint64      block)
+{
+  guint64 g;
+  guint64 i;
+
+  if (block < ext4->first_data_block || block >= ext4->blocks_count)
+    return TRUE;
+
+  g = (block - ext4->first_data_block) / ext4->blocks_per_group;
+  i = (block - ext4->first_data_block) % ext4->blocks_per_group;
+
+  if (!ext4->complete[g])
+    return TRUE;
+
+  return (ext4->bitmaps[g * ext4->bitmap_len + i / 8] & (1 << (i % 8))) != 0;
+}
+
+static gsize
+ext4_lookup (Ext4Tracker  *ext4,
+             const Extent *extent,
+             guint64       offset,
+             gsize         len,
+             gboolean     *needed)
+{
+  guint64 rel = offset - extent->start;
+  guint64 block = rel / ext4->block_size;
+  guint64 n = (block + 1) * ext4->block_size - rel;
+
+  *needed = ext4_block_is_used (ext4, block);
+
+  while (n < len && ext4_block_is_used (ext4, ++block) == *needed)
+    n += ext4->block_size;
+
+  return MIN (n, len);
+}
+
+static void
+extent_clear (Extent *extent)
+{
+  g_clear_pointer (&extent->ext4, ext4_tracker_free);
+}
+
+static gint
+compare_extents (gconstpointer a,
+                 gconstpointer b)
+{
+  const Extent *extent_a = a;
+  const Extent *extent_b = b;
+
+  return extent_a->start < extent_b->start ? -1 :
+    extent_a->start > extent_b->start ? 1 : 0;
+}
+
+/**
+ * gis_write_map_new:
+ * @head: the start of the (uncompressed) image, holding at least the
+ *  protective MBR and the primary GPT
+ * @head_len: length of @head
+ * @image_size: the size of the whole image, in bytes
+ * @error:
+ *
+ * Returns: a write map for the image, or %NULL if its partition table could
+ *  not be read, or does not describe the whole image
+ */
+GisWriteMap *
+gis_write_map_new (const guint8 *head,
+                   gsize         head_len,
+                   guint64       image_size,
+                   GError      **error)
+{
+  g_autoptr(GInputStream) input =
+    g_memory_input_stream_new_from_data (head, head_len, NULL);
+  g_auto(GptTable) table = { 0 };
+  const struct gpt_header *header = &table.pt.header;
+  g_autoptr(GisWriteMap) self = NULL;
+  guint64 n_sectors = image_size / SECTOR_SIZE;
+  guint64 ptable_sectors;
+  Extent extent = { 0 };
+  guint i;
+
+  g_return_val_if_fail (head != NULL, NULL);
+  g_return_val_if_fail (error == NULL || *error == NULL, NULL);
+
+  if (!gpt_probe_stream (input, GPT_PROBE_COMPRESSION_NONE, &table,
+                         NULL, error))
+    return NULL;
+
+  /* The backup GPT must be at the very end of the image, since that is the
+   * only part after the last partition which is written.
+   */
+  ptable_sectors = (gpt_table_get_ptable_size (&table) + SECTOR_SIZE - 1) /
+    SECTOR_SIZE;
+  if (image_size % SECTOR_SIZE != 0 ||
+      header->current_lba != 1 ||
+      header->backup_lba != n_sectors - 1 ||
+      header->first_usable_lba < 2 + ptable_sectors ||
+      header->last_usable_lba < header->first_usable_lba ||
+      header->last_usable_lba + 1 + ptable_sectors > header->backup_lba)
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+                   "GPT does not describe a %" G_GUINT64_FORMAT "-byte image",
+                   image_size);
+      return NULL;
+    }
+
+  self = g_new0 (GisWriteMap, 1);
+  self->extents = g_array_new (FALSE, FALSE, sizeof (Extent));
+  g_array_set_clear_func (self->extents, (GDestroyNotify) extent_clear);
+
+  for (i = 0; i < header->ptable_count; i++)
+    {
+      const struct gpt_partition *part = &table.partitions[i];
+
+      if (is_zero (part->type_guid, sizeof part->type_guid))
+        continue;
+
+      if (part->first_lba < header->first_usable_lba ||
+          part->last_lba > header->last_usable_lba ||
+          part->first_lba > part->last_lba)
+        {
+          g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+                       "GPT partition %u lies outside the usable space", i + 1);
+          return NULL;
+        }
+
+      extent.start = part->first_lba * SECTOR_SIZE;
+      extent.end = (part->last_lba + 1) * SECTOR_SIZE;
+      extent.ext4 = g_new0 (Ext4Tracker, 1);
+      g_array_append_val (self->extents, extent);
+    }
+
+  g_array_sort (self->extents, compare_extents);
+  for (i = 1; i < self->extents->len; i++)
+    {
+      if (g_array_index (self->extents, Extent, i).start <
+          g_array_index (self->extents, Extent, i - 1).end)
+        {
+          g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+                       "GPT partitions overlap");
+          return NULL;
+        }
+    }
+
+  /* The protective MBR and primary GPT, and the backup GPT */
+  extent.start = 0;
+  extent.end = header->first_usable_lba * SECTOR_SIZE;
+  extent.ext4 = NULL;
+  g_array_prepend_val (self->extents, extent);
+
+  extent.start = (header->last_usable_lba + 1) * SECTOR_SIZE;
+  extent.end = image_size;
+  g_array_append_val (self->extents, extent);
+
+  return g_steal_pointer (&self);
+}
+
+void
+gis_write_map_free (GisWriteMap *self)
+{
+  g_array_unref (self->extents);
+  g_free (self);
+}
+
+/**
+ * gis_write_map_observe:
+ * @offset: offset of @data within the image
+ * @data: image data
+ * @len: length of @data
+ *
+ * Passes a chunk of the (uncompressed) image to @self, which reads the ext4
+ * metadata it needs from it. Chunks must be passed in order, without gaps,
+ * starting at offset 0; and before the corresponding gis_write_map_lookup()
+ * calls.
+ */
+void
+gis_write_map_observe (GisWriteMap  *self,
+                       guint64       offset,
+                       const guint8 *data,
+                       gsize         len)
+{
+  guint i;
+
+  for (i = 0; i < self->extents->len; i++)
+    {
+      const Extent *extent = &g_array_index (self->extents, Extent, i);
+
+      if (extent->start >= offset + len)
+        break;
+
+      if (extent->ext4 != NULL && extent->end > offset)
+        ext4_observe (extent->ext4, extent, offset, data, len);
+    }
+}
+
+/**
+ * gis_write_map_lookup:
+ * @offset: offset within the image
+ * @len: length of the range starting at @offset, which must be non-zero
+ * @needed: (out): whether the start of the range must be written
+ *
+ * Returns: the length of the prefix of the range which, like its first byte,
+ *  must or need not be written, according to @needed
+ */
+gsize
+gis_write_map_lookup (GisWriteMap *self,
+                      guint64      offset,
+                      gsize        len,
+                      gboolean    *needed)
+{
+  const Extent *extent;
+
+  g_return_val_if_fail (len > 0, 0);
+
+  if (self->cursor > 0 &&
+      offset < g_array_index (self->extents, Extent, self->cursor - 1).end)
+    self->cursor = 0;
+
+  while (self->cursor < self->extents->len &&
+         g_array_index (self->extents, Extent, self->cursor).end <= offset)
+    self->cursor++;
+
+  /* Past the end of the image, as described by the GPT: this will be an error
+   * anyway, so leave it to the caller to find out.
+   */
+  if (self->cursor == self->extents->len)
+    {
+      *needed = TRUE;
+      return len;
+    }
+
+  extent = &g_array_index (self->extents, Extent, self->cursor);
+  if (offset < extent->start)
+    {
+      *needed = FALSE;
+      return MIN (len, extent->start - offset);
+    }
+
+  len = MIN (len, extent->end - offset);
+  if (extent->ext4 == NULL || extent->ext4->state != EXT4_STATE_BITMAPS)
+    {
+      *needed = TRUE;
+      return len;
+    }
+
+  return ext4_lookup (extent->ext4, extent, offset, len, needed);
+}
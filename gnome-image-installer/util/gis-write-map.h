@@ -0,0 +1,56 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*- */
+/*
+ * Copyright © 2018 Endless Mobile, Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+#pragma once
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+/**
+ * GisWriteMap:
+ *
+ * Describes which parts of a GPT-partitioned image need to be written to the
+ * target drive: the protective MBR and primary GPT, each partition, and the
+ * backup GPT at the end. The gaps between them are skipped.
+ *
+ * Within partitions holding an ext2/3/4 filesystem, blocks which are marked
+ * free in the filesystem's block bitmaps are skipped too. The bitmaps are
+ * learned from the image data as it streams past, so the image need not be
+ * seekable; since each block group's bitmap precedes the blocks it describes,
+ * this finds almost all the free space.
+ */
+typedef struct _GisWriteMap GisWriteMap;
+
+GisWriteMap *gis_write_map_new (const guint8 *head,
+                                gsize         head_len,
+                                guint64       image_size,
+                                GError      **error);
+void gis_write_map_free (GisWriteMap *self);
+
+void gis_write_map_observe (GisWriteMap  *self,
+                            guint64       offset,
+                            const guint8 *data,
+                            gsize         len);
+gsize gis_write_map_lookup (GisWriteMap *self,
+                            guint64      offset,
+                            gsize        len,
+                            gboolean    *needed);
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (GisWriteMap, gis_write_map_free)
+
+G_END_DECLS
@@ -18,6 +18,15 @@ static uint8_t GPT_GUID_LINUX_ROOTFS_ARM[] = {0x10, 0xd7, 0xda, 0x69, 0xe4, 0x2c
 static uint8_t GPT_GUID_LINUX_ROOTFS_AARCH64[] = {0x45, 0xb0, 0x21, 0xb9, 0xf0, 0x1d, 0xc3, 0x41, 0xaf, 0x44, 0x4c, 0x6f, 0x28, 0x0d, 0x3f, 0xae};
 static uint8_t GPT_GUID_LINUX_ROOTFS_RISCV_32[] = {0xfe, 0xa7, 0xd5, 0x60, 0x7d, 0x8e, 0x5c, 0x43, 0xb7, 0x14, 0x3d, 0xd8, 0x16, 0x21, 0x44, 0xe1};
 static uint8_t GPT_GUID_LINUX_ROOTFS_RISCV_64[] = {0xa6, 0x70, 0xec, 0x72, 0x74, 0xcf, 0xe6, 0x40, 0xbd, 0x49, 0x4b, 0xda, 0x08, 0xe8, 0xf2, 0x24};
+// 21686148-6449-6E6F-744E-656564454649
+static uint8_t GPT_GUID_BIOS_BOOT[] = {0x48, 0x61, 0x68, 0x21, 0x49, 0x64, 0x6f, 0x6e, 0x74, 0x4e, 0x65, 0x65, 0x64, 0x45, 0x46, 0x49};
+
+#define MBR_TYPE_LINUX 0x83
+// What eos-repartition-mbr looks for to find the root partition to grow
+#define MBR_TYPE_EOS_ROOT 0xdd
+#define MBR_TYPE_EFI 0xef
+#define MBR_TYPE_GPT_PROTECTIVE 0xee
+#define MBR_BOOTABLE 0x80
 
 
 
@@ -153,55 +162,55 @@ void print_gpt_data(struct ptable *pt)
 }
 #endif
 
-static uint64_t get_disk_size(struct ptable *pt)
+static int is_rootfs_type(const uint8_t *type_guid)
 {
-    if(NULL==pt) return 0;
+    return memcmp(type_guid, GPT_GUID_LINUX_DATA, 16)==0
+        || memcmp(type_guid, GPT_GUID_LINUX_ROOTFS_X86, 16)==0
+        || memcmp(type_guid, GPT_GUID_LINUX_ROOTFS_X86_64, 16)==0
+        || memcmp(type_guid, GPT_GUID_LINUX_ROOTFS_ARM, 16)==0
+        || memcmp(type_guid, GPT_GUID_LINUX_ROOTFS_AARCH64, 16)==0
+        || memcmp(type_guid, GPT_GUID_LINUX_ROOTFS_RISCV_32, 16)==0
+        || memcmp(type_guid, GPT_GUID_LINUX_ROOTFS_RISCV_64, 16)==0;
+}
+
+static uint64_t get_disk_size(const struct gpt_header *header)
+{
+    if(NULL==header) return 0;
     return SECTOR_SIZE +    // mbr
         SECTOR_SIZE +       // gpt header
-        pt->header.ptable_count * pt->header.ptable_partition_size + //size of partition table
-        pt->header.last_usable_lba * SECTOR_SIZE; // rest of the usable disk size
+        header->ptable_count * header->ptable_partition_size + //size of partition table
+        header->last_usable_lba * SECTOR_SIZE; // rest of the usable disk size
 }
 
-/**
- * is_eos_gpt_valid:
- * @size: (out) (optional): location to store the disk size, in bytes, if the
- *  GPT is valid
- *
- * Checks the GPT for validity.
- *
- * Returns: 1 if the GPT is valid, 0 otherwise
- */
-int is_eos_gpt_valid(struct ptable *pt, uint64_t *size)
+static int is_eos_gpt_header_valid(const struct gpt_header *header)
 {
     size_t i = 0;
 
-    if(NULL==pt) return 0;
-
-    if(memcmp(pt->header.signature, "EFI PART", 8)!=0) {
+    if(memcmp(header->signature, "EFI PART", 8)!=0) {
         g_warning("invalid signature");
         return 0;
     }
-    if(pt->header.revision != 0x00010000) {
+    if(header->revision != 0x00010000) {
         g_warning("invalid revision");
         return 0;
     }
-    if(pt->header.header_size != GPT_HEADER_SIZE) {
+    if(header->header_size != GPT_HEADER_SIZE) {
         g_warning("invalid header size");
         return 0;
     }
-    if(pt->header.reserved != 0) {
+    if(header->reserved != 0) {
         g_warning("reserved bytes must be 0");
         return 0;
     }
-    if(pt->header.ptable_starting_lba != 2) {
+    if(header->ptable_starting_lba != 2) {
         g_warning("starting LBA should always be 2");
         return 0;
     }
-    if(pt->header.ptable_partition_size != 128) {
+    if(header->ptable_partition_size != GPT_PART_SIZE) {
         g_warning("invalid partition table entry size");
         return 0;
     }
-    if(pt->header.ptable_count < 2 ) {
+    if(header->ptable_count < 2 ) {
         //  Disk images must have at least 2 partitions: the ESP and the OS
         //  partition. Endless OS images have an additional BIOS Boot partition
         //  in between, but GNOME OS images (for example) do not.
@@ -209,7 +218,7 @@ int is_eos_gpt_valid(struct ptable *pt, uint64_t *size)
         return 0;
     }
     for(i=0; i<512-GPT_HEADER_SIZE; i++) {
-        if(pt->header.padding[i] != 0) {
+        if(header->padding[i] != 0) {
             g_warning("GPT header padding must be zeroed");
             return 0;
         }
@@ -217,44 +226,33 @@ int is_eos_gpt_valid(struct ptable *pt, uint64_t *size)
     //  crc32 of header, with 'crc' field zero'ed
     struct gpt_header testcrc_header;
     memset(&testcrc_header, 0, GPT_HEADER_SIZE);
-    memcpy(&testcrc_header, &pt->header, GPT_HEADER_SIZE);
+    memcpy(&testcrc_header, header, GPT_HEADER_SIZE);
     testcrc_header.crc = 0;
-    if(calc_crc32((uint8_t*)(&testcrc_header), GPT_HEADER_SIZE)!=pt->header.crc) {
+    if(calc_crc32((uint8_t*)(&testcrc_header), GPT_HEADER_SIZE)!=header->crc) {
         g_warning("invalid header crc");
         return 0;
     }
-    //  crc32 of partition table
-    int n = pt->header.ptable_count * pt->header.ptable_partition_size;
-    uint8_t *buffer = (uint8_t*)malloc(n);
-    memset(buffer, 0, n);
-    for(i=0; i<3; i++) { // only first 3 partitions are populated, everything else is zero
-        memcpy(buffer+(i*pt->header.ptable_partition_size), (uint8_t*)(&pt->partitions[i]), pt->header.ptable_partition_size);
-    }
-    if(calc_crc32(buffer, n) != pt->header.ptable_crc) {
-        g_warning("invalid partition table crc");
-        free(buffer);
-        return 0;
-    }
-    free(buffer);
+
+    return 1;
+}
+
+static int is_eos_gpt_partitions_valid(const struct gpt_partition *partitions,
+                                       uint32_t n_partitions)
+{
+    uint32_t i = 0;
 
     // The first partition must be an EFI System Partition
-    if(memcmp(&pt->partitions[0].type_guid, GPT_GUID_EFI, 16)!=0) {
+    if(memcmp(&partitions[0].type_guid, GPT_GUID_EFI, 16)!=0) {
         g_warning("first partition must be ESP");
         return 0;
     }
 
     // A subsequent partition must be a Linux rootfs.
     int has_root = 0;
-    for (i = 1; i < pt->header.ptable_count; ++i) {
-      if (memcmp(&pt->partitions[i].type_guid, GPT_GUID_LINUX_DATA, 16)==0
-          || memcmp(&pt->partitions[i].type_guid, GPT_GUID_LINUX_ROOTFS_X86, 16)==0
-          || memcmp(&pt->partitions[i].type_guid, GPT_GUID_LINUX_ROOTFS_X86_64, 16)==0
-          || memcmp(&pt->partitions[i].type_guid, GPT_GUID_LINUX_ROOTFS_ARM, 16)==0
-          || memcmp(&pt->partitions[i].type_guid, GPT_GUID_LINUX_ROOTFS_AARCH64, 16)==0
-          || memcmp(&pt->partitions[i].type_guid, GPT_GUID_LINUX_ROOTFS_RISCV_32, 16)==0
-          || memcmp(&pt->partitions[i].type_guid, GPT_GUID_LINUX_ROOTFS_RISCV_64, 16)==0) {
+    for (i = 1; i < n_partitions; ++i) {
+      if (is_rootfs_type(partitions[i].type_guid)) {
         uint64_t flags = 0;
-        memcpy(&flags, pt->partitions[i].attributes, 8);
+        memcpy(&flags, partitions[i].attributes, 8);
         if(!is_nth_flag_set(flags, 55)) {
           //  55th flag must be 1 for EOS images
           continue ;
@@ -268,23 +266,342 @@ int is_eos_gpt_valid(struct ptable *pt, uint64_t *size)
       return 0;
     }
 
+    return 1;
+}
+
+/**
+ * is_eos_gpt_valid:
+ * @size: (out) (optional): location to store the disk size, in bytes, if the
+ *  GPT is valid
+ *
+ * Checks the GPT for validity, assuming that only the first 3 partition
+ * table entries are populated. Prefer is_eos_gpt_table_valid() when the
+ * whole partition table is available.
+ *
+ * Returns: 1 if the GPT is valid, 0 otherwise
+ */
+int is_eos_gpt_valid(struct ptable *pt, uint64_t *size)
+{
+    size_t i = 0;
+
+    if(NULL==pt) return 0;
+
+    if(!is_eos_gpt_header_valid(&pt->header)) {
+        return 0;
+    }
+
+    //  crc32 of partition table
+    int n = pt->header.ptable_count * pt->header.ptable_partition_size;
+    uint8_t *buffer = (uint8_t*)malloc(n);
+    memset(buffer, 0, n);
+    for(i=0; i<3; i++) { // only first 3 partitions are populated, everything else is zero
+        memcpy(buffer+(i*pt->header.ptable_partition_size), (uint8_t*)(&pt->partitions[i]), pt->header.ptable_partition_size);
+    }
+    if(calc_crc32(buffer, n) != pt->header.ptable_crc) {
+        g_warning("invalid partition table crc");
+        free(buffer);
+        return 0;
+    }
+    free(buffer);
+
+    if(!is_eos_gpt_partitions_valid(pt->partitions, MIN(pt->header.ptable_count, 4))) {
+        return 0;
+    }
+
     if (size != NULL) {
-        *size = get_disk_size(pt);
+        *size = get_disk_size(&pt->header);
     }
     return 1; // success, GPT is valid
 }
 
-int get_is_valid_eos_gpt(const char *filepath, uint64_t *size)
+/**
+ * is_gpt_table_valid:
+ * @table: a partition table read by gpt_probe_stream()
+ * @size: (out) (optional): location to store the disk size, in bytes, if the
+ *  GPT is valid
+ *
+ * Checks the GPT header and the CRC over every entry of the partition table,
+ * without requiring any particular partitions. This suits the later disks of
+ * split images, which hold only data partitions.
+ *
+ * Returns: 1 if the GPT is valid, 0 otherwise
+ */
+int is_gpt_table_valid(const struct gpt_table *table, uint64_t *size)
 {
-    if(NULL == filepath) return 0;
-    FILE *in_file = fopen(filepath, "r");
-    if(NULL == in_file) return 0;
-    struct ptable pt;
-    if(fread(&pt, sizeof(pt), 1, in_file) == 1) {
-        fclose(in_file);
-        return is_eos_gpt_valid(&pt, size);
+    if(NULL==table || NULL==table->partitions) return 0;
+
+    if(!is_eos_gpt_header_valid(&table->pt.header)) {
+        return 0;
     }
-    // error reading from disk
-    fclose(in_file);
-    return 0;
+
+    if(calc_crc32(table->partitions, gpt_table_get_ptable_size(table)) != table->pt.header.ptable_crc) {
+        g_warning("invalid partition table crc");
+        return 0;
+    }
+
+    if (size != NULL) {
+        *size = get_disk_size(&table->pt.header);
+    }
+    return 1; // success, GPT is valid
+}
+
+/**
+ * is_eos_gpt_table_valid:
+ * @table: a partition table read by gpt_probe_stream()
+ * @size: (out) (optional): location to store the disk size, in bytes, if the
+ *  GPT is valid
+ *
+ * Checks the GPT for validity, verifying the CRC over every entry of the
+ * partition table rather than assuming that only the first few are in use.
+ *
+ * Returns: 1 if the GPT is valid, 0 otherwise
+ */
+int is_eos_gpt_table_valid(const struct gpt_table *table, uint64_t *size)
+{
+    if(!is_gpt_table_valid(table, NULL)) {
+        return 0;
+    }
+
+    if(!is_eos_gpt_partitions_valid(table->partitions, table->pt.header.ptable_count)) {
+        return 0;
+    }
+
+    if (size != NULL) {
+        *size = get_disk_size(&table->pt.header);
+    }
+    return 1; // success, GPT is valid
+}
+
+/**
+ * gpt_table_get_ptable_size:
+ *
+ * Returns: the size in bytes of the partition table entries array described
+ *  by @table's header
+ */
+uint32_t gpt_table_get_ptable_size(const struct gpt_table *table)
+{
+    return table->pt.header.ptable_count * GPT_PART_SIZE;
+}
+
+void gpt_table_clear(struct gpt_table *table)
+{
+    g_clear_pointer(&table->partitions, g_free);
+    memset(&table->pt, 0, sizeof(table->pt));
+}
+
+static uint32_t gpt_header_crc(const struct gpt_header *header)
+{
+    struct gpt_header copy;
+
+    memcpy(&copy, header, sizeof(copy));
+    copy.crc = 0;
+    return calc_crc32((uint8_t*)(&copy), GPT_HEADER_SIZE);
+}
+
+/* Returns the primary GPT header in @head, if it and the partition table
+ * which follows it are present and intact; or NULL otherwise.
+ */
+static struct gpt_header *gpt_head_get_header(uint8_t *head, size_t head_len)
+{
+    struct gpt_header *header = (struct gpt_header *)(head + SECTOR_SIZE);
+    uint32_t ptable_size;
+
+    if(head_len < 2 * SECTOR_SIZE) return NULL;
+
+    if(memcmp(header->signature, "EFI PART", 8)!=0
+       || header->header_size != GPT_HEADER_SIZE
+       || header->current_lba != 1
+       || header->ptable_starting_lba != 2
+       || header->ptable_partition_size != GPT_PART_SIZE
+       || header->ptable_count == 0
+       || header->ptable_count > GPT_MAX_PARTITIONS
+       || gpt_header_crc(header) != header->crc) {
+        return NULL;
+    }
+
+    ptable_size = header->ptable_count * GPT_PART_SIZE;
+    if(head_len < 2 * SECTOR_SIZE + ptable_size
+       || calc_crc32(head + 2 * SECTOR_SIZE, ptable_size) != header->ptable_crc) {
+        return NULL;
+    }
+
+    return header;
+}
+
+/**
+ * gpt_relocate:
+ * @head: the start of a disk image, holding its protective MBR, primary GPT
+ *  header and partition table
+ * @head_len: length of @head, in bytes
+ * @disk_sectors: size of the disk the image is written to, in sectors
+ * @old_backup_lba: (out): location to store the sector of the image's backup
+ *  GPT header, which the caller must erase
+ * @backup: (out) (transfer full): location to store the backup partition
+ *  table and GPT header for the disk, to be written to its last
+ *  *@backup_len bytes; free with g_free()
+ * @backup_len: (out): location to store the length of *@backup
+ *
+ * Rewrites the primary GPT header in @head so that the usable space extends
+ * to the end of the disk, with the backup GPT after it rather than at the end
+ * of the image; and builds that backup GPT. The partition table itself is
+ * left as it is. The protective MBR partition is enlarged to match.
+ *
+ * Returns: 1 on success, 0 if @head does not hold a valid GPT, or if the
+ *  disk is smaller than the GPT requires
+ */
+int gpt_relocate(uint8_t *head, size_t head_len, uint64_t disk_sectors,
+                 uint64_t *old_backup_lba, uint8_t **backup,
+                 size_t *backup_len)
+{
+    struct gpt_header *header = gpt_head_get_header(head, head_len);
+    struct gpt_header *backup_header;
+    uint32_t ptable_size;
+    uint64_t ptable_sectors;
+    uint64_t backup_lba;
+    int i;
+
+    if(header == NULL) return 0;
+
+    ptable_size = header->ptable_count * GPT_PART_SIZE;
+    ptable_sectors = (ptable_size + SECTOR_SIZE - 1) / SECTOR_SIZE;
+
+    // The partitions must still fit before the backup partition table
+    backup_lba = disk_sectors - 1;
+    if(disk_sectors < 3 + 2 * ptable_sectors
+       || backup_lba - ptable_sectors - 1 < header->last_usable_lba) {
+        return 0;
+    }
+
+    *old_backup_lba = header->backup_lba;
+    header->backup_lba = backup_lba;
+    header->last_usable_lba = backup_lba - ptable_sectors - 1;
+    header->crc = gpt_header_crc(header);
+
+    *backup_len = (ptable_sectors + 1) * SECTOR_SIZE;
+    *backup = g_malloc0(*backup_len);
+    memcpy(*backup, head + 2 * SECTOR_SIZE, ptable_size);
+
+    backup_header = (struct gpt_header *)(*backup + ptable_sectors * SECTOR_SIZE);
+    memcpy(backup_header, header, sizeof(*backup_header));
+    backup_header->current_lba = backup_lba;
+    backup_header->backup_lba = 1;
+    backup_header->ptable_starting_lba = backup_lba - ptable_sectors;
+    backup_header->crc = gpt_header_crc(backup_header);
+
+    // Protective MBR partitions cover the whole disk, or as much of it as
+    // they can.
+    for(i = 0; i < 4; i++) {
+        uint8_t *entry = head + 446 + 16 * i;
+        uint32_t n_sectors = (uint32_t) MIN(disk_sectors - 1, 0xFFFFFFFF);
+        uint32_t first_lba;
+
+        memcpy(&first_lba, entry + 8, 4);
+        if(entry[4] == MBR_TYPE_GPT_PROTECTIVE && first_lba == 1) {
+            memcpy(entry + 12, &n_sectors, 4);
+        }
+    }
+
+    return 1;
+}
+
+static void mbr_entry_set(uint8_t *entry, uint8_t status, uint8_t type,
+                          uint32_t first_lba, uint32_t n_sectors)
+{
+    // CHS addresses are meaningless for disks this size; 0xFEFFFF tells the
+    // BIOS to use the LBA fields instead.
+    static const uint8_t chs_lba[3] = {0xfe, 0xff, 0xff};
+
+    entry[0] = status;
+    memcpy(entry + 1, chs_lba, 3);
+    entry[4] = type;
+    memcpy(entry + 5, chs_lba, 3);
+    memcpy(entry + 8, &first_lba, 4);
+    memcpy(entry + 12, &n_sectors, 4);
+}
+
+/**
+ * gpt_convert_to_mbr:
+ * @head: the start of a disk image, holding its protective MBR, primary GPT
+ *  header and partition table
+ * @head_len: length of @head, in bytes
+ * @backup_lba: (out): location to store the sector of the image's backup GPT
+ *  header, which the caller must erase
+ *
+ * Replaces the GPT in @head with an MBR partition table holding the same
+ * partitions, as eos-repartition-mbr would. The EFI System Partition gets
+ * type 0xEF; the root partition is marked bootable, and gets type 0xDD if it
+ * has GPT attribute 55 set (so that it is grown on first boot), or 0x83
+ * otherwise; other partitions get type 0x83; the BIOS Boot partition is dropped, though its contents stay where they are,
+ * so the boot code in the protective MBR (which is kept) still finds them.
+ * The primary GPT header and partition table are zeroed.
+ *
+ * Returns: 1 on success, 0 if @head does not hold a valid GPT, or if its
+ *  partitions cannot be described by an MBR
+ */
+int gpt_convert_to_mbr(uint8_t *head, size_t head_len, uint64_t *backup_lba)
+{
+    struct gpt_header *header = gpt_head_get_header(head, head_len);
+    const struct gpt_partition *partitions;
+    uint8_t entries[4][16];
+    uint32_t ptable_size;
+    uint32_t i;
+    int n_entries = 0;
+    int has_root = 0;
+
+    if(header == NULL) return 0;
+
+    partitions = (const struct gpt_partition *)(head + 2 * SECTOR_SIZE);
+    memset(entries, 0, sizeof(entries));
+
+    for(i = 0; i < header->ptable_count; i++) {
+        const struct gpt_partition *part = &partitions[i];
+        uint8_t status = 0;
+        uint8_t type;
+
+        if(part->first_lba == 0 && part->last_lba == 0) continue;
+        if(memcmp(part->type_guid, GPT_GUID_BIOS_BOOT, 16)==0) continue;
+
+        if(n_entries == 4
+           || part->last_lba < part->first_lba
+           || part->last_lba > UINT32_MAX) {
+            return 0;
+        }
+
+        if(i == 0 && memcmp(part->type_guid, GPT_GUID_EFI, 16)==0) {
+            type = MBR_TYPE_EFI;
+        } else {
+            type = MBR_TYPE_LINUX;
+            if(!has_root && is_rootfs_type(part->type_guid)) {
+                uint64_t flags = 0;
+
+                memcpy(&flags, part->attributes, 8);
+                if(is_nth_flag_set(flags, 55)) {
+                    type = MBR_TYPE_EOS_ROOT;
+                }
+                status = MBR_BOOTABLE;
+                has_root = 1;
+            }
+        }
+
+        mbr_entry_set(entries[n_entries++], status, type,
+                      (uint32_t) part->first_lba,
+                      (uint32_t) (part->last_lba - part->first_lba + 1));
+    }
+
+    if(!has_root) return 0;
+
+    *backup_lba = header->backup_lba;
+
+    // Keep the boot code, and derive the disk signature from the GPT's disk
+    // GUID, so that it is the same for every disk written from this image.
+    ptable_size = header->ptable_count * GPT_PART_SIZE;
+    memcpy(head + 440, header->disk_guid, 4);
+    memset(head + 444, 0, 2);
+    memcpy(head + 446, entries, sizeof(entries));
+    head[510] = 0x55;
+    head[511] = 0xaa;
+
+    memset(head + SECTOR_SIZE, 0, SECTOR_SIZE + ptable_size);
+
+    return 1;
 }
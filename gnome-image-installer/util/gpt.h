@@ -8,25 +8,17 @@
 #include <stdlib.h>
 #include <stdint.h>
 
-#include "gpt_errors.h"
-
 //#define DEBUG_PRINTS
 
-#define CHUNK_SIZE 2048
-
-// for windows
-#if defined(MSDOS) || defined(OS2) || defined(WIN32) || defined(__CYGWIN__)
-#  include <fcntl.h>
-#  include <io.h>
-#  define SET_BINARY_MODE(file) setmode(fileno(file), O_BINARY)
-#else
-#  define SET_BINARY_MODE(file)
-#endif
-
 #define SECTOR_SIZE 512
 #define GPT_HEADER_SIZE 92
 #define GPT_PART_SIZE 128
 
+// The primary GPT must fit inside the first MiB of the image, which the
+// installer writes last.
+#define GPT_HEAD_MAX_SIZE (1024 * 1024)
+#define GPT_MAX_PARTITIONS ((GPT_HEAD_MAX_SIZE - 2 * SECTOR_SIZE) / GPT_PART_SIZE)
+
 
 struct gpt_header
 {
@@ -60,14 +52,27 @@ struct gpt_partition
 struct ptable {
     uint8_t mbr[SECTOR_SIZE];
     struct gpt_header header;
-    struct gpt_partition partitions[4]; // we only care about the first 4 partitions   
+    struct gpt_partition partitions[4]; // we only care about the first 4 partitions
 } __attribute__((packed));
 
+struct gpt_table {
+    struct ptable pt;
+    // all header.ptable_count entries, starting at LBA 2
+    struct gpt_partition *partitions;
+};
+
 int is_eos_gpt_valid(struct ptable *pt, uint64_t *size);
+int is_gpt_table_valid(const struct gpt_table *table, uint64_t *size);
+int is_eos_gpt_table_valid(const struct gpt_table *table, uint64_t *size);
 uint8_t is_nth_flag_set(uint64_t flags, uint8_t n);
 
-// helper function
-int get_is_valid_eos_gpt(const char *filepath, uint64_t *size);
+uint32_t gpt_table_get_ptable_size(const struct gpt_table *table);
+void gpt_table_clear(struct gpt_table *table);
+
+int gpt_relocate(uint8_t *head, size_t head_len, uint64_t disk_sectors,
+                 uint64_t *old_backup_lba, uint8_t **backup,
+                 size_t *backup_len);
+int gpt_convert_to_mbr(uint8_t *head, size_t head_len, uint64_t *backup_lba);
 
 #ifdef DEBUG_PRINTS
 void attributes_to_ascii(const uint8_t *attr, char *s);
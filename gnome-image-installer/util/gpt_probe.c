@@ -0,0 +1,179 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*- */
+/*
+ * Copyright © 2018 Endless Mobile, Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+#include "gpt_probe.h"
+
+#include <gio/gunixinputstream.h>
+
+#include "gduxzdecompressor.h"
+
+static gboolean
+read_exactly (GInputStream *input,
+              void         *buffer,
+              gsize         count,
+              const gchar  *what,
+              GCancellable *cancellable,
+              GError      **error)
+{
+  gsize bytes_read = 0;
+
+  if (!g_input_stream_read_all (input, buffer, count, &bytes_read,
+                                cancellable, error))
+    {
+      g_prefix_error (error, "Error reading %s: ", what);
+      return FALSE;
+    }
+
+  if (bytes_read != count)
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_PARTIAL_INPUT,
+                   "Image ended after %" G_GSIZE_FORMAT " of %" G_GSIZE_FORMAT
+                   " bytes of %s", bytes_read, count, what);
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
+/**
+ * gpt_probe_stream:
+ * @input: stream positioned at the start of the (possibly compressed) image
+ * @compression: how @input is compressed
+ * @table: (out caller-allocates): location to store the partition table
+ * @cancellable:
+ * @error:
+ *
+ * Reads the protective MBR, the primary GPT header and every entry of the
+ * partition table from the start of @input. Compressed streams are decoded
+ * incrementally, reading only as much of @input as is needed to produce those
+ * bytes, so this works regardless of how the compressor split the image into
+ * blocks. @input is not closed.
+ *
+ * The contents of @table are not validated beyond what is needed to read
+ * them; use is_eos_gpt_table_valid() for that. On success, free the
+ * partition array with gpt_table_clear().
+ *
+ * Returns: %TRUE if the partition table was read
+ */
+gboolean
+gpt_probe_stream (GInputStream        *input,
+                  GptProbeCompression  compression,
+                  GptTable            *table,
+                  GCancellable        *cancellable,
+                  GError             **error)
+{
+  g_autoptr(GConverter) converter = NULL;
+  g_autoptr(GInputStream) decompressed = NULL;
+  g_autofree struct gpt_partition *partitions = NULL;
+  const struct gpt_header *header = &table->pt.header;
+  guint32 n_inline;
+
+  g_return_val_if_fail (G_IS_INPUT_STREAM (input), FALSE);
+  g_return_val_if_fail (table != NULL, FALSE);
+  g_return_val_if_fail (error == NULL || *error == NULL, FALSE);
+
+  memset (table, 0, sizeof *table);
+
+  switch (compression)
+    {
+    case GPT_PROBE_COMPRESSION_NONE:
+      decompressed = g_object_ref (input);
+      break;
+
+    case GPT_PROBE_COMPRESSION_GZIP:
+      converter = G_CONVERTER (g_zlib_decompressor_new (G_ZLIB_COMPRESSOR_FORMAT_GZIP));
+      break;
+
+    case GPT_PROBE_COMPRESSION_XZ:
+      converter = G_CONVERTER (gdu_xz_decompressor_new ());
+      break;
+
+    default:
+      g_return_val_if_reached (FALSE);
+    }
+
+  if (converter != NULL)
+    {
+      decompressed = g_converter_input_stream_new (input, converter);
+      g_filter_input_stream_set_close_base_stream (
+          G_FILTER_INPUT_STREAM (decompressed), FALSE);
+    }
+
+  if (!read_exactly (decompressed, &table->pt, sizeof table->pt,
+                     "GPT header", cancellable, error))
+    return FALSE;
+
+  if (memcmp (header->signature, "EFI PART", 8) != 0)
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+                   "No GPT signature found");
+      return FALSE;
+    }
+
+  /* These are checked again by is_eos_gpt_table_valid(), but we need them to
+   * be sane before trusting them to size the read below.
+   */
+  if (header->ptable_starting_lba != 2 ||
+      header->ptable_partition_size != GPT_PART_SIZE ||
+      header->ptable_count == 0 ||
+      header->ptable_count > GPT_MAX_PARTITIONS)
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+                   "Unsupported GPT layout: %" G_GUINT32_FORMAT " entries of "
+                   "%" G_GUINT32_FORMAT " bytes at LBA %" G_GUINT64_FORMAT,
+                   header->ptable_count, header->ptable_partition_size,
+                   (guint64) header->ptable_starting_lba);
+      return FALSE;
+    }
+
+  /* The first few entries immediately follow the header, and have already been
+   * read as part of struct ptable; the rest are read straight after them.
+   */
+  partitions = g_new0 (struct gpt_partition, header->ptable_count);
+  n_inline = MIN (header->ptable_count, G_N_ELEMENTS (table->pt.partitions));
+  memcpy (partitions, table->pt.partitions, n_inline * GPT_PART_SIZE);
+
+  if (header->ptable_count > n_inline &&
+      !read_exactly (decompressed, partitions + n_inline,
+                     (header->ptable_count - n_inline) * GPT_PART_SIZE,
+                     "GPT partition table", cancellable, error))
+    return FALSE;
+
+  table->partitions = g_steal_pointer (&partitions);
+  return TRUE;
+}
+
+/**
+ * gpt_probe_fd:
+ * @fd: file descriptor positioned at the start of the image
+ *
+ * Like gpt_probe_stream(), but reads from @fd, which is not closed. The file
+ * offset of @fd is advanced past (at least) the data which was read.
+ */
+gboolean
+gpt_probe_fd (int                  fd,
+              GptProbeCompression  compression,
+              GptTable            *table,
+              GCancellable        *cancellable,
+              GError             **error)
+{
+  g_autoptr(GInputStream) input = g_unix_input_stream_new (fd, FALSE);
+
+  return gpt_probe_stream (input, compression, table, cancellable, error);
+}
@@ -0,0 +1,48 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*- */
+/*
+ * Copyright © 2018 Endless Mobile, Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <gio/gio.h>
+
+#include "gpt.h"
+
+G_BEGIN_DECLS
+
+typedef enum {
+  GPT_PROBE_COMPRESSION_NONE,
+  GPT_PROBE_COMPRESSION_GZIP,
+  GPT_PROBE_COMPRESSION_XZ,
+} GptProbeCompression;
+
+typedef struct gpt_table GptTable;
+G_DEFINE_AUTO_CLEANUP_CLEAR_FUNC (GptTable, gpt_table_clear)
+
+gboolean gpt_probe_stream (GInputStream        *input,
+                           GptProbeCompression  compression,
+                           GptTable            *table,
+                           GCancellable        *cancellable,
+                           GError             **error);
+
+gboolean gpt_probe_fd (int                  fd,
+                       GptProbeCompression  compression,
+                       GptTable            *table,
+                       GCancellable        *cancellable,
+                       GError             **error);
+
+G_END_DECLS
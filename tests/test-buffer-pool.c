@@ -0,0 +1,176 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*- */
+/*
+ * Copyright © 2018 Endless Mobile, Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+#include "config.h"
+#include <locale.h>
+#include <unistd.h>
+
+#include <glib.h>
+
+#include "gis-buffer-pool.h"
+
+#define MIB (1024 * 1024)
+
+static void
+test_buffer_pool_reuse (void)
+{
+  g_autoptr(GisBufferPool) pool = gis_buffer_pool_new (0);
+  gsize page_size = sysconf (_SC_PAGESIZE);
+  gpointer a, b;
+
+  /* Small budgets are raised to the minimum */
+  g_assert_cmpuint (gis_buffer_pool_get_budget (pool), ==,
+                    GIS_BUFFER_POOL_MIN_BUDGET);
+
+  a = gis_buffer_pool_acquire (pool, MIB);
+  g_assert_nonnull (a);
+  g_assert_cmpuint (GPOINTER_TO_SIZE (a) % page_size, ==, 0);
+
+  b = gis_buffer_pool_acquire (pool, 2 * MIB);
+  g_assert_nonnull (b);
+  g_assert_true (a != b);
+  g_assert_cmpuint (gis_buffer_pool_get_high_water_mark (pool), ==, 3 * MIB);
+
+  /* A released buffer is handed out again for the same size */
+  gis_buffer_pool_release (pool, a);
+  g_assert_true (gis_buffer_pool_acquire (pool, MIB) == a);
+
+  gis_buffer_pool_release (pool, a);
+  gis_buffer_pool_release (pool, b);
+  g_assert_cmpuint (gis_buffer_pool_get_high_water_mark (pool), ==, 3 * MIB);
+}
+
+typedef struct {
+  GisBufferPool *pool;
+  gpointer buffer;
+} ReleaseData;
+
+static gpointer
+release_later (gpointer user_data)
+{
+  ReleaseData *data = user_data;
+
+  g_usleep (G_USEC_PER_SEC / 10);
+  gis_buffer_pool_release (data->pool, data->buffer);
+
+  return NULL;
+}
+
+static void
+test_buffer_pool_budget (void)
+{
+  g_autoptr(GisBufferPool) pool = gis_buffer_pool_new (GIS_BUFFER_POOL_MIN_BUDGET);
+  gsize half = GIS_BUFFER_POOL_MIN_BUDGET / 2;
+  ReleaseData data = { pool, NULL };
+  gpointer a, b, c;
+  GThread *thread;
+
+  a = gis_buffer_pool_acquire (pool, half);
+  b = gis_buffer_pool_acquire (pool, half);
+
+  /* The budget is exhausted, so this blocks until the other thread releases
+   * b; and since b is the wrong size to reuse, and can't be kept alongside
+   * a new buffer, it is freed to make room.
+   */
+  data.buffer = b;
+  thread = g_thread_new ("release-later", release_later, &data);
+  c = gis_buffer_pool_acquire (pool, MIB);
+  g_assert_nonnull (c);
+  g_thread_join (thread);
+
+  g_assert_cmpuint (gis_buffer_pool_get_high_water_mark (pool), ==,
+                    GIS_BUFFER_POOL_MIN_BUDGET);
+
+  gis_buffer_pool_release (pool, c);
+  gis_buffer_pool_release (pool, a);
+}
+
+static void
+test_buffer_pool_try_acquire (void)
+{
+  g_autoptr(GisBufferPool) pool = gis_buffer_pool_new (GIS_BUFFER_POOL_MIN_BUDGET);
+  g_autoptr(GisBufferPool) shared = gis_buffer_pool_ref (pool);
+  gsize half = GIS_BUFFER_POOL_MIN_BUDGET / 2;
+  gpointer a, b;
+
+  a = gis_buffer_pool_try_acquire (pool, half);
+  g_assert_nonnull (a);
+
+  /* Every reference sees the same budget */
+  b = gis_buffer_pool_try_acquire (shared, half);
+  g_assert_nonnull (b);
+  g_assert_null (gis_buffer_pool_try_acquire (shared, MIB));
+
+  gis_buffer_pool_release (shared, b);
+  g_assert_true (gis_buffer_pool_try_acquire (pool, half) == b);
+
+  gis_buffer_pool_release (pool, b);
+  gis_buffer_pool_release (pool, a);
+}
+
+static void
+test_buffer_pool_count_shares (void)
+{
+  g_assert_cmpuint (gis_buffer_pool_count_shares (0), ==, 1);
+  g_assert_cmpuint (gis_buffer_pool_count_shares (GIS_BUFFER_POOL_MIN_BUDGET),
+                    ==, 1);
+  g_assert_cmpuint (gis_buffer_pool_count_shares (3 * GIS_BUFFER_POOL_MIN_BUDGET - 1),
+                    ==, 2);
+}
+
+static void
+test_buffer_pool_default_budget (void)
+{
+  guint64 budget = gis_buffer_pool_get_default_budget ();
+
+  g_assert_cmpuint (budget, >=, GIS_BUFFER_POOL_MIN_BUDGET);
+
+  g_setenv ("EI_MEMORY_BUDGET_MIB", "100", TRUE);
+  g_assert_cmpuint (gis_buffer_pool_get_default_budget (), ==, 100 * MIB);
+
+  g_setenv ("EI_MEMORY_BUDGET_MIB", "1", TRUE);
+  g_assert_cmpuint (gis_buffer_pool_get_default_budget (), ==,
+                    GIS_BUFFER_POOL_MIN_BUDGET);
+
+  g_unsetenv ("EI_MEMORY_BUDGET_MIB");
+}
+
+static void
+test_peak_rss (void)
+{
+  /* Every process touches at least a page */
+  g_assert_cmpuint (gis_get_peak_rss (), >, 0);
+}
+
+int
+main (int argc, char *argv[])
+{
+  setlocale (LC_ALL, "");
+
+  g_test_init (&argc, &argv, NULL);
+
+  g_test_add_func ("/buffer-pool/reuse", test_buffer_pool_reuse);
+  g_test_add_func ("/buffer-pool/budget", test_buffer_pool_budget);
+  g_test_add_func ("/buffer-pool/try-acquire", test_buffer_pool_try_acquire);
+  g_test_add_func ("/buffer-pool/count-shares",
+                   test_buffer_pool_count_shares);
+  g_test_add_func ("/buffer-pool/default-budget",
+                   test_buffer_pool_default_budget);
+  g_test_add_func ("/buffer-pool/peak-rss", test_peak_rss);
+
+  return g_test_run ();
+}
@@ -0,0 +1,138 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*- */
+/*
+ * Copyright © 2018 Endless Mobile, Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+#include "config.h"
+#include <locale.h>
+
+#include <glib.h>
+#include <gio/gio.h>
+
+#include "gis-calibration.h"
+
+static void
+calibration_cb (GObject      *source,
+                GAsyncResult *result,
+                gpointer      user_data)
+{
+  GAsyncResult **result_out = user_data;
+
+  g_assert_null (*result_out);
+  *result_out = g_object_ref (result);
+}
+
+static GisCalibration *
+calibrate_and_wait (const gchar  *filename,
+                    GError      **error)
+{
+  g_autoptr(GFile) image = g_file_new_for_path (filename);
+  g_autoptr(GAsyncResult) result = NULL;
+
+  /* There is no target to benchmark */
+  gis_calibration_async (image, -1, NULL, NULL, NULL, calibration_cb, &result);
+
+  while (result == NULL)
+    g_main_context_iteration (NULL, TRUE);
+
+  return gis_calibration_finish (result, error);
+}
+
+static void
+test_calibration_uncompressed (void)
+{
+  g_autofree gchar *filename = g_test_build_filename (G_TEST_BUILT, "gpt.img", NULL);
+  g_autoptr(GError) error = NULL;
+  g_autoptr(GisCalibration) calibration = NULL;
+
+  calibration = calibrate_and_wait (filename, &error);
+  g_assert_no_error (error);
+  g_assert_nonnull (calibration);
+
+  g_assert_cmpfloat (calibration->read_rate, >, 0);
+  g_assert_cmpfloat (calibration->decode_rate, ==, 0);
+  g_assert_cmpfloat (calibration->write_rate, ==, 0);
+}
+
+static void
+test_calibration_compressed (gconstpointer data)
+{
+  const gchar *basename = data;
+  g_autofree gchar *filename = g_test_build_filename (G_TEST_BUILT, basename, NULL);
+  g_autoptr(GError) error = NULL;
+  g_autoptr(GisCalibration) calibration = NULL;
+
+  calibration = calibrate_and_wait (filename, &error);
+  g_assert_no_error (error);
+  g_assert_nonnull (calibration);
+
+  g_assert_cmpfloat (calibration->read_rate, >, 0);
+  g_assert_cmpfloat (calibration->decode_rate, >, 0);
+  g_assert_cmpfloat (calibration->write_rate, ==, 0);
+}
+
+static void
+test_calibration_missing (void)
+{
+  g_autofree gchar *filename = g_test_build_filename (G_TEST_BUILT, "does-not-exist.img", NULL);
+  g_autoptr(GError) error = NULL;
+  g_autoptr(GisCalibration) calibration = NULL;
+
+  calibration = calibrate_and_wait (filename, &error);
+  g_assert_error (error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND);
+  g_assert_null (calibration);
+}
+
+static void
+test_estimate (void)
+{
+  const gdouble mb = 1000 * 1000;
+  GisCalibration calibration = { 0 };
+
+  /* No estimate without a measurement */
+  g_assert_cmpuint (gis_calibration_estimate_seconds (NULL, 1, 1), ==, 0);
+  g_assert_cmpuint (gis_calibration_estimate_seconds (&calibration, 1, 1), ==, 0);
+
+  /* Reading 200 MB at 10 MB/s is the only known stage */
+  calibration.read_rate = 10 * mb;
+  g_assert_cmpuint (gis_calibration_estimate_seconds (&calibration, 200 * mb, 600 * mb),
+                    ==, 20);
+
+  /* Decompressing 600 MB at 20 MB/s is now the slowest stage */
+  calibration.decode_rate = 20 * mb;
+  g_assert_cmpuint (gis_calibration_estimate_seconds (&calibration, 200 * mb, 600 * mb),
+                    ==, 30);
+
+  /* Writing 600 MB at 5 MB/s is slower still */
+  calibration.write_rate = 5 * mb;
+  g_assert_cmpuint (gis_calibration_estimate_seconds (&calibration, 200 * mb, 600 * mb),
+                    ==, 120);
+}
+
+int
+main (int argc, char *argv[])
+{
+  setlocale (LC_ALL, "");
+
+  g_test_init (&argc, &argv, NULL);
+
+  g_test_add_func ("/calibration/uncompressed", test_calibration_uncompressed);
+  g_test_add_data_func ("/calibration/gz", "gpt.img.gz", test_calibration_compressed);
+  g_test_add_data_func ("/calibration/xz", "gpt.img.xz", test_calibration_compressed);
+  g_test_add_func ("/calibration/missing", test_calibration_missing);
+  g_test_add_func ("/calibration/estimate", test_estimate);
+
+  return g_test_run ();
+}
@@ -0,0 +1,364 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*- */
+/*
+ * Copyright © 2018 Endless Mobile, Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+#include "config.h"
+#include <fcntl.h>
+#include <locale.h>
+#include <string.h>
+
+#include <glib.h>
+#include <glib/gstdio.h>
+#include <gio/gio.h>
+
+#include "glnx-shutil.h"
+#include "gis-chunk-manifest.h"
+#include "gis-errors.h"
+
+/* As generated by make-chunk-manifest in Makefile.am */
+#define IMAGE "w-8193.img"
+#define IMAGE_SIZE (8193 * 512)
+#define CHUNK_SIZE 65536
+#define N_CHUNKS 65
+
+static gchar *keyring_path = NULL;
+
+static GFile *
+get_built_file (const gchar *basename)
+{
+  g_autofree gchar *path = g_test_build_filename (G_TEST_BUILT, basename, NULL);
+
+  return g_file_new_for_path (path);
+}
+
+static GisChunkManifest *
+load_manifest (void)
+{
+  g_autoptr(GFile) file = get_built_file (IMAGE GIS_CHUNK_MANIFEST_SUFFIX);
+  g_autoptr(GisChunkManifest) manifest = NULL;
+  g_autoptr(GError) error = NULL;
+
+  manifest = gis_chunk_manifest_load (file, NULL, &error);
+  g_assert_no_error (error);
+  g_assert_nonnull (manifest);
+
+  return g_steal_pointer (&manifest);
+}
+
+static gchar *
+load_image (void)
+{
+  g_autoptr(GFile) image = get_built_file (IMAGE);
+  gchar *contents = NULL;
+  gsize len;
+  g_autoptr(GError) error = NULL;
+
+  g_file_load_contents (image, NULL, &contents, &len, NULL, &error);
+  g_assert_no_error (error);
+  g_assert_cmpuint (len, ==, IMAGE_SIZE);
+
+  return contents;
+}
+
+/* Pushes the first @n_chunks chunks of @contents to a new verifier, and
+ * returns the result of finishing it.
+ */
+static gboolean
+push_chunks (GisChunkManifest *manifest,
+             const gchar      *contents,
+             guint             n_chunks,
+             GError          **error)
+{
+  g_autoptr(GisChunkVerifier) chunks = gis_chunk_verifier_new (manifest, NULL);
+  guint i;
+
+  for (i = 0; i < n_chunks; i++)
+    {
+      gsize offset = (gsize) i * CHUNK_SIZE;
+      gsize len = MIN (CHUNK_SIZE, IMAGE_SIZE - offset);
+
+      if (!gis_chunk_verifier_push (chunks, g_memdup (contents + offset, len),
+                                    len, error))
+        return FALSE;
+    }
+
+  if (!gis_chunk_verifier_finish (chunks, error))
+    return FALSE;
+
+  g_assert_cmpuint (gis_chunk_verifier_get_bytes_verified (chunks), ==,
+                    IMAGE_SIZE);
+  return TRUE;
+}
+
+static void
+test_chunk_manifest_load (void)
+{
+  g_autoptr(GisChunkManifest) manifest = load_manifest ();
+
+  g_assert_cmpuint (gis_chunk_manifest_get_chunk_size (manifest), ==, CHUNK_SIZE);
+  g_assert_cmpuint (gis_chunk_manifest_get_image_size (manifest), ==, IMAGE_SIZE);
+  g_assert_cmpuint (gis_chunk_manifest_get_n_chunks (manifest), ==, N_CHUNKS);
+  g_assert_cmpuint (strlen (gis_chunk_manifest_get_root (manifest)), ==, 64);
+}
+
+static void
+test_chunk_manifest_verify (void)
+{
+  g_autoptr(GisChunkManifest) manifest = load_manifest ();
+  g_autofree gchar *contents = load_image ();
+  g_autoptr(GError) error = NULL;
+
+  g_assert_true (push_chunks (manifest, contents, N_CHUNKS, &error));
+  g_assert_no_error (error);
+}
+
+/* Two verifiers share the same threads, as when writing a split image to
+ * several drives; a corrupt chunk pushed to one doesn't fail the other.
+ */
+static void
+test_chunk_manifest_verify_concurrent (void)
+{
+  g_autoptr(GisChunkManifest) manifest = load_manifest ();
+  g_autofree gchar *contents = load_image ();
+  g_autoptr(GisChunkVerifier) good = gis_chunk_verifier_new (manifest, NULL);
+  g_autoptr(GisChunkVerifier) bad = gis_chunk_verifier_new (manifest, NULL);
+  g_autoptr(GError) error = NULL;
+  gboolean bad_ok = TRUE;
+  guint i;
+
+  for (i = 0; i < N_CHUNKS; i++)
+    {
+      gsize offset = (gsize) i * CHUNK_SIZE;
+      gsize len = MIN (CHUNK_SIZE, IMAGE_SIZE - offset);
+      guint8 *chunk = g_memdup (contents + offset, len);
+
+      g_assert_true (gis_chunk_verifier_push (good,
+                                              g_memdup (chunk, len), len,
+                                              &error));
+      g_assert_no_error (error);
+
+      if (i == 3)
+        chunk[17] ^= 0xff;
+
+      /* Once the corrupt chunk has been checked, later pushes fail */
+      if (bad_ok)
+        bad_ok = gis_chunk_verifier_push (bad, chunk, len, NULL);
+      else
+        g_free (chunk);
+    }
+
+  g_assert_true (gis_chunk_verifier_finish (good, &error));
+  g_assert_no_error (error);
+  g_assert_cmpuint (gis_chunk_verifier_get_bytes_verified (good), ==,
+                    IMAGE_SIZE);
+
+  g_assert_false (gis_chunk_verifier_finish (bad, &error));
+  g_assert_error (error, GIS_IMAGE_ERROR, GIS_IMAGE_ERROR_VERIFICATION_FAILED);
+}
+
+static void
+test_chunk_manifest_corrupt (void)
+{
+  g_autoptr(GisChunkManifest) manifest = load_manifest ();
+  g_autofree gchar *contents = load_image ();
+  g_autoptr(GError) error = NULL;
+
+  contents[3 * CHUNK_SIZE + 17] ^= 0xff;
+
+  g_assert_true (gis_chunk_manifest_check_chunk (manifest, 2,
+                                                 (guint8 *) contents + 2 * CHUNK_SIZE,
+                                                 CHUNK_SIZE, &error));
+  g_assert_no_error (error);
+  g_assert_false (gis_chunk_manifest_check_chunk (manifest, 3,
+                                                  (guint8 *) contents + 3 * CHUNK_SIZE,
+                                                  CHUNK_SIZE, &error));
+  g_assert_error (error, GIS_IMAGE_ERROR, GIS_IMAGE_ERROR_VERIFICATION_FAILED);
+  g_clear_error (&error);
+
+  g_assert_false (push_chunks (manifest, contents, N_CHUNKS, &error));
+  g_assert_error (error, GIS_IMAGE_ERROR, GIS_IMAGE_ERROR_VERIFICATION_FAILED);
+}
+
+static void
+test_chunk_manifest_truncated (void)
+{
+  g_autoptr(GisChunkManifest) manifest = load_manifest ();
+  g_autofree gchar *contents = load_image ();
+  g_autoptr(GError) error = NULL;
+
+  g_assert_false (push_chunks (manifest, contents, N_CHUNKS - 1, &error));
+  g_assert_error (error, GIS_IMAGE_ERROR, GIS_IMAGE_ERROR_VERIFICATION_FAILED);
+}
+
+static void
+test_chunk_manifest_invalid (void)
+{
+  const gchar *manifests[] = {
+    "",
+    "eos-image-chunks 2\n",
+    /* chunk-size is too small */
+    "eos-image-chunks 1\nchunk-size 1\nsize 0\n"
+    "root e3b0c44298fc1c149afbf4c8996fb92427ae41e4649b934ca495991b7852b855\n",
+    /* root does not match (no) chunks */
+    "eos-image-chunks 1\nchunk-size 65536\nsize 0\n"
+    "root 0000000000000000000000000000000000000000000000000000000000000000\n",
+    /* one chunk too few */
+    "eos-image-chunks 1\nchunk-size 65536\nsize 1\n"
+    "root e3b0c44298fc1c149afbf4c8996fb92427ae41e4649b934ca495991b7852b855\n",
+  };
+  g_autoptr(GError) error = NULL;
+  g_autofree gchar *tmpdir = g_dir_make_tmp ("test-chunk-manifest-XXXXXX", &error);
+  g_autofree gchar *path = NULL;
+  g_autoptr(GFile) file = NULL;
+  gsize i;
+
+  g_assert_no_error (error);
+  path = g_build_filename (tmpdir, "invalid.chunks", NULL);
+  file = g_file_new_for_path (path);
+
+  for (i = 0; i < G_N_ELEMENTS (manifests); i++)
+    {
+      g_autoptr(GisChunkManifest) manifest = NULL;
+
+      g_file_set_contents (path, manifests[i], -1, &error);
+      g_assert_no_error (error);
+
+      manifest = gis_chunk_manifest_load (file, NULL, &error);
+      g_assert_error (error, GIS_IMAGE_ERROR, GIS_IMAGE_ERROR_VERIFICATION_FAILED);
+      g_assert_null (manifest);
+      g_clear_error (&error);
+    }
+
+  /* An empty image has no chunks, and the root is the digest of nothing */
+  {
+    g_autoptr(GisChunkManifest) manifest = NULL;
+
+    g_file_set_contents (path,
+                         "eos-image-chunks 1\nchunk-size 65536\nsize 0\n"
+                         "root e3b0c44298fc1c149afbf4c8996fb92427ae41e4649b934ca495991b7852b855\n",
+                         -1, &error);
+    g_assert_no_error (error);
+
+    manifest = gis_chunk_manifest_load (file, NULL, &error);
+    g_assert_no_error (error);
+    g_assert_cmpuint (gis_chunk_manifest_get_n_chunks (manifest), ==, 0);
+  }
+
+  glnx_shutil_rm_rf_at (AT_FDCWD, tmpdir, NULL, NULL);
+}
+
+static void
+test_chunk_manifest_signature (void)
+{
+  g_autoptr(GFile) manifest = get_built_file (IMAGE GIS_CHUNK_MANIFEST_SUFFIX);
+  g_autoptr(GFile) signature = gis_chunk_manifest_get_signature_file (manifest);
+  g_autoptr(GError) error = NULL;
+  g_autofree gchar *tmpdir = g_dir_make_tmp ("test-chunk-manifest-XXXXXX", &error);
+  g_autoptr(GFile) tmpdir_file = NULL;
+  g_autoptr(GFile) tampered = NULL;
+  g_autoptr(GFile) tampered_signature = NULL;
+  g_autofree gchar *contents = NULL;
+  gsize len;
+
+  g_assert_no_error (error);
+
+  g_assert_true (gis_chunk_manifest_verify_signature (manifest, keyring_path,
+                                                      GPG_PATH, NULL, &error));
+  g_assert_no_error (error);
+
+  /* The same signature alongside a modified manifest */
+  tmpdir_file = g_file_new_for_path (tmpdir);
+  tampered = g_file_get_child (tmpdir_file, IMAGE GIS_CHUNK_MANIFEST_SUFFIX);
+  tampered_signature = gis_chunk_manifest_get_signature_file (tampered);
+
+  g_file_load_contents (manifest, NULL, &contents, &len, NULL, &error);
+  g_assert_no_error (error);
+  contents[len - 2] = contents[len - 2] == '0' ? '1' : '0';
+  g_file_replace_contents (tampered, contents, len, NULL, FALSE,
+                           G_FILE_CREATE_NONE, NULL, NULL, &error);
+  g_assert_no_error (error);
+  g_file_copy (signature, tampered_signature, G_FILE_COPY_NONE, NULL, NULL,
+               NULL, &error);
+  g_assert_no_error (error);
+
+  g_assert_false (gis_chunk_manifest_verify_signature (tampered, keyring_path,
+                                                       GPG_PATH, NULL, &error));
+  g_assert_error (error, GIS_IMAGE_ERROR, GIS_IMAGE_ERROR_VERIFICATION_FAILED);
+
+  glnx_shutil_rm_rf_at (AT_FDCWD, tmpdir, NULL, NULL);
+}
+
+/* The builder must agree with make-chunk-manifest, however the image is
+ * divided up as it is fed in.
+ */
+static void
+test_chunk_manifest_builder (void)
+{
+  g_autoptr(GFile) file = get_built_file (IMAGE GIS_CHUNK_MANIFEST_SUFFIX);
+  g_autofree gchar *expected = NULL;
+  g_autofree gchar *contents = load_image ();
+  const gsize piece_sizes[] = { 1000, CHUNK_SIZE, 3 * CHUNK_SIZE + 1 };
+  g_autoptr(GError) error = NULL;
+  gsize i;
+
+  g_file_load_contents (file, NULL, &expected, NULL, NULL, &error);
+  g_assert_no_error (error);
+
+  for (i = 0; i < G_N_ELEMENTS (piece_sizes); i++)
+    {
+      g_autoptr(GisChunkManifestBuilder) builder =
+        gis_chunk_manifest_builder_new (CHUNK_SIZE);
+      g_autofree gchar *manifest = NULL;
+      gsize offset;
+
+      for (offset = 0; offset < IMAGE_SIZE; offset += piece_sizes[i])
+        gis_chunk_manifest_builder_update (builder,
+                                           (guint8 *) contents + offset,
+                                           MIN (piece_sizes[i],
+                                                IMAGE_SIZE - offset));
+
+      manifest = gis_chunk_manifest_builder_end (builder);
+      g_assert_cmpstr (manifest, ==, expected);
+    }
+}
+
+int
+main (int argc, char *argv[])
+{
+  int ret;
+
+  setlocale (LC_ALL, "");
+
+  g_test_init (&argc, &argv, NULL);
+
+  keyring_path = g_test_build_filename (G_TEST_DIST, "public.asc", NULL);
+
+  g_test_add_func ("/chunk-manifest/load", test_chunk_manifest_load);
+  g_test_add_func ("/chunk-manifest/verify", test_chunk_manifest_verify);
+  g_test_add_func ("/chunk-manifest/verify/concurrent",
+                   test_chunk_manifest_verify_concurrent);
+  g_test_add_func ("/chunk-manifest/corrupt", test_chunk_manifest_corrupt);
+  g_test_add_func ("/chunk-manifest/truncated", test_chunk_manifest_truncated);
+  g_test_add_func ("/chunk-manifest/invalid", test_chunk_manifest_invalid);
+  g_test_add_func ("/chunk-manifest/signature", test_chunk_manifest_signature);
+  g_test_add_func ("/chunk-manifest/builder", test_chunk_manifest_builder);
+
+  ret = g_test_run ();
+
+  g_free (keyring_path);
+
+  return ret;
+}
@@ -0,0 +1,138 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*- */
+/*
+ * Copyright © 2018 Endless Mobile, Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+#include "config.h"
+#include <locale.h>
+#include <unistd.h>
+
+#include <glib.h>
+#include <glib/gstdio.h>
+
+#include "gis-drive-benchmark.h"
+
+/* Not a real block device, so there is no queue information in sysfs */
+#define FAKE_DEVICE "/dev/eos-installer-test-not-a-device"
+
+static void
+benchmark_cb (GObject      *source,
+              GAsyncResult *result,
+              gpointer      user_data)
+{
+  GAsyncResult **result_out = user_data;
+
+  g_assert_null (*result_out);
+  *result_out = g_object_ref (result);
+}
+
+/* Returns a file descriptor for an unlinked temporary file of the given
+ * size.
+ */
+static gint
+make_temp_file (gsize size)
+{
+  g_autoptr(GError) error = NULL;
+  g_autofree gchar *path = NULL;
+  g_autofree gchar *contents = g_malloc0 (size);
+  gint fd = g_file_open_tmp ("eos-installer-benchmark.XXXXXX", &path, &error);
+
+  g_assert_no_error (error);
+  g_assert_cmpint (fd, >=, 0);
+  g_assert_cmpint (g_unlink (path), ==, 0);
+  g_assert_cmpint (write (fd, contents, size), ==, size);
+
+  return fd;
+}
+
+static GisDriveBenchmark *
+benchmark_and_wait (gint          fd,
+                    const gchar  *connection_bus,
+                    GError      **error)
+{
+  g_autoptr(GAsyncResult) result = NULL;
+
+  gis_drive_benchmark_async (fd, FAKE_DEVICE, connection_bus, NULL,
+                             benchmark_cb, &result);
+
+  while (result == NULL)
+    g_main_context_iteration (NULL, TRUE);
+
+  return gis_drive_benchmark_finish (result, error);
+}
+
+static void
+test_benchmark_file (void)
+{
+  g_autoptr(GError) error = NULL;
+  g_autoptr(GisDriveBenchmark) benchmark = NULL;
+
+  benchmark = benchmark_and_wait (make_temp_file (4 * 1024 * 1024), "usb",
+                                  &error);
+  g_assert_no_error (error);
+  g_assert_nonnull (benchmark);
+
+  g_assert_cmpfloat (benchmark->read_rate, >, 0);
+  g_assert_false (benchmark->rotational);
+  g_assert_true (benchmark->removable_bus);
+  g_assert_cmpfloat (benchmark->write_rate, >, 0);
+  g_assert_cmpfloat (benchmark->write_rate, <, benchmark->read_rate);
+  g_assert_cmpuint (gis_drive_benchmark_estimate_seconds (benchmark, 0), ==, 0);
+}
+
+static void
+test_benchmark_empty (void)
+{
+  g_autoptr(GError) error = NULL;
+  g_autoptr(GisDriveBenchmark) benchmark = NULL;
+
+  benchmark = benchmark_and_wait (make_temp_file (0), NULL, &error);
+  g_assert_error (error, G_IO_ERROR, G_IO_ERROR_FAILED);
+  g_assert_null (benchmark);
+}
+
+static void
+test_estimate (void)
+{
+  const gdouble mb = 1000 * 1000;
+  GisDriveBenchmark benchmark = { 0 };
+
+  /* USB sticks are assumed to write much more slowly than they read */
+  g_assert_cmpfloat (gis_drive_benchmark_estimate_write_rate (100 * mb, FALSE, TRUE),
+                     <,
+                     gis_drive_benchmark_estimate_write_rate (100 * mb, FALSE, FALSE));
+
+  /* No estimate without a measurement */
+  g_assert_cmpuint (gis_drive_benchmark_estimate_seconds (NULL, 1), ==, 0);
+  g_assert_cmpuint (gis_drive_benchmark_estimate_seconds (&benchmark, 1), ==, 0);
+
+  benchmark.write_rate = 10 * mb;
+  g_assert_cmpuint (gis_drive_benchmark_estimate_seconds (&benchmark, 600 * mb),
+                    ==, 60);
+}
+
+int
+main (int argc, char *argv[])
+{
+  setlocale (LC_ALL, "");
+
+  g_test_init (&argc, &argv, NULL);
+
+  g_test_add_func ("/drive-benchmark/file", test_benchmark_file);
+  g_test_add_func ("/drive-benchmark/empty", test_benchmark_empty);
+  g_test_add_func ("/drive-benchmark/estimate", test_estimate);
+
+  return g_test_run ();
+}
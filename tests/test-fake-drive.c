@@ -0,0 +1,347 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*- */
+/*
+ * Copyright © 2018 Endless Mobile, Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* A pipe to pass as GisScribe:drive-fd, so that the image is written to it
+ * just as to a real drive, by write() and splice(). A thread takes what is
+ * written from the other end as slowly as its TestMedium would, writes it to
+ * the real target, and counts it.
+ */
+
+#include "config.h"
+#include "test-fake-drive.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#define BUFFER_SIZE (1024 * 1024)
+
+typedef struct _TestFakeDrive {
+  GObject parent;
+
+  gint target_fd;
+  const TestMedium *medium;
+  TestShapedInputStream *source;
+  guint64 image_size;
+
+  /* Ends of the pipe. write_fd is -1 once stolen. */
+  gint read_fd;
+  gint write_fd;
+  GThread *thread;
+
+  /* Written by the drive's thread, read by the test */
+  GMutex mutex;
+  TestFakeDriveStats stats;
+} TestFakeDrive;
+
+typedef enum {
+  PROP_TARGET_FD = 1,
+  PROP_MEDIUM,
+  PROP_SOURCE,
+  PROP_IMAGE_SIZE,
+
+  N_PROPERTIES
+} TestFakeDrivePropertyId;
+
+static GParamSpec *props[N_PROPERTIES] = { 0 };
+
+G_DEFINE_TYPE (TestFakeDrive, test_fake_drive, G_TYPE_OBJECT);
+
+static void
+test_fake_drive_init (TestFakeDrive *self)
+{
+  g_mutex_init (&self->mutex);
+
+  self->target_fd = -1;
+  self->read_fd = -1;
+  self->write_fd = -1;
+}
+
+static void
+test_fake_drive_set_property (GObject      *object,
+                              guint         property_id,
+                              const GValue *value,
+                              GParamSpec   *pspec)
+{
+  TestFakeDrive *self = TEST_FAKE_DRIVE (object);
+
+  switch ((TestFakeDrivePropertyId) property_id)
+    {
+    case PROP_TARGET_FD:
+      self->target_fd = g_value_get_int (value);
+      break;
+
+    case PROP_MEDIUM:
+      self->medium = g_value_get_pointer (value);
+      break;
+
+    case PROP_SOURCE:
+      g_clear_object (&self->source);
+      self->source = g_value_dup_object (value);
+      break;
+
+    case PROP_IMAGE_SIZE:
+      self->image_size = g_value_get_uint64 (value);
+      break;
+
+    case N_PROPERTIES:
+    default:
+      G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
+      break;
+    }
+}
+
+/* Writes @count bytes of @buffer, which were taken from the pipe after @pos
+ * bytes, to the target. Once the whole image has been written, the scribe
+ * writes the first MiB again, which it would have seeked back to write over
+ * the zeroes it started with.
+ */
+static void
+test_fake_drive_write_target (TestFakeDrive *self,
+                              const gchar   *buffer,
+                              gsize          count,
+                              guint64        pos)
+{
+  while (count > 0)
+    {
+      guint64 offset = pos;
+      gsize len = count;
+      ssize_t w;
+
+      if (pos < self->image_size)
+        len = MIN (len, self->image_size - pos);
+      else
+        offset = pos - self->image_size;
+
+      w = pwrite (self->target_fd, buffer, len, offset);
+      if (w < 0 && errno == EINTR)
+        continue;
+
+      g_assert_cmpint (w, >, 0);
+      buffer += w;
+      count -= w;
+      pos += w;
+    }
+}
+
+static gpointer
+test_fake_drive_thread (gpointer data)
+{
+  TestFakeDrive *self = TEST_FAKE_DRIVE (data);
+  g_autofree gchar *buffer = g_malloc (BUFFER_SIZE);
+
+  for (;;)
+    {
+      guint64 bytes_read = 0;
+      guint64 offset;
+      gint64 delay_usec = 0;
+      ssize_t r;
+
+      r = read (self->read_fd, buffer, BUFFER_SIZE);
+      if (r < 0 && errno == EINTR)
+        continue;
+
+      g_assert_cmpint (r, >=, 0);
+      if (r == 0)
+        break;
+
+      if (self->source != NULL)
+        bytes_read = test_shaped_input_stream_get_bytes_read (self->source);
+
+      g_mutex_lock (&self->mutex);
+      offset = self->stats.bytes_written;
+      if (bytes_read > offset)
+        self->stats.max_in_flight = MAX (self->stats.max_in_flight,
+                                         bytes_read - offset);
+      g_mutex_unlock (&self->mutex);
+
+      /* The data only counts as written once the medium would have taken it */
+      if (self->medium != NULL)
+        delay_usec = test_medium_get_delay (self->medium, offset, r);
+      g_usleep (delay_usec);
+
+      test_fake_drive_write_target (self, buffer, r, offset);
+
+      if (self->source != NULL)
+        bytes_read = test_shaped_input_stream_get_bytes_read (self->source);
+
+      g_mutex_lock (&self->mutex);
+      self->stats.bytes_written += r;
+      if (self->source != NULL && bytes_read < self->image_size &&
+          bytes_read <= self->stats.bytes_written)
+        self->stats.n_starved_writes++;
+      g_mutex_unlock (&self->mutex);
+    }
+
+  return NULL;
+}
+
+static void
+test_fake_drive_constructed (GObject *object)
+{
+  TestFakeDrive *self = TEST_FAKE_DRIVE (object);
+  gint pipe_fds[2];
+
+  G_OBJECT_CLASS (test_fake_drive_parent_class)->constructed (object);
+
+  g_assert_cmpint (self->target_fd, >=, 0);
+  g_assert_cmpint (pipe2 (pipe_fds, O_CLOEXEC), ==, 0);
+  self->read_fd = pipe_fds[0];
+  self->write_fd = pipe_fds[1];
+
+  self->thread = g_thread_new ("fake drive", test_fake_drive_thread, self);
+}
+
+static void
+test_fake_drive_dispose (GObject *object)
+{
+  TestFakeDrive *self = TEST_FAKE_DRIVE (object);
+
+  /* The thread runs until whoever has the write end closes it */
+  if (self->write_fd != -1)
+    {
+      close (self->write_fd);
+      self->write_fd = -1;
+    }
+
+  test_fake_drive_wait (self);
+  g_clear_object (&self->source);
+
+  G_OBJECT_CLASS (test_fake_drive_parent_class)->dispose (object);
+}
+
+static void
+test_fake_drive_finalize (GObject *object)
+{
+  TestFakeDrive *self = TEST_FAKE_DRIVE (object);
+
+  if (self->read_fd != -1)
+    close (self->read_fd);
+
+  if (self->target_fd != -1)
+    close (self->target_fd);
+
+  g_mutex_clear (&self->mutex);
+
+  G_OBJECT_CLASS (test_fake_drive_parent_class)->finalize (object);
+}
+
+static void
+test_fake_drive_class_init (TestFakeDriveClass *klass)
+{
+  GObjectClass *object_class = G_OBJECT_CLASS (klass);
+
+  object_class->set_property = test_fake_drive_set_property;
+  object_class->constructed = test_fake_drive_constructed;
+  object_class->dispose = test_fake_drive_dispose;
+  object_class->finalize = test_fake_drive_finalize;
+
+  props[PROP_TARGET_FD] = g_param_spec_int (
+      "target-fd",
+      "Target FD",
+      "Writable fd for the file standing in for the drive, which is closed "
+      "with this object.",
+      -1, G_MAXINT, -1,
+      G_PARAM_WRITABLE | G_PARAM_CONSTRUCT_ONLY | G_PARAM_STATIC_STRINGS);
+
+  props[PROP_MEDIUM] = g_param_spec_pointer (
+      "medium",
+      "Medium",
+      "TestMedium to simulate, or NULL to write at full speed.",
+      G_PARAM_WRITABLE | G_PARAM_CONSTRUCT_ONLY | G_PARAM_STATIC_STRINGS);
+
+  props[PROP_SOURCE] = g_param_spec_object (
+      "source",
+      "Source",
+      "Stream the image being written is read from, or NULL.",
+      TEST_TYPE_SHAPED_INPUT_STREAM,
+      G_PARAM_WRITABLE | G_PARAM_CONSTRUCT_ONLY | G_PARAM_STATIC_STRINGS);
+
+  props[PROP_IMAGE_SIZE] = g_param_spec_uint64 (
+      "image-size",
+      "Image size",
+      "Size of the image being written, which is also how much will be "
+      "read from :source in all.",
+      0, G_MAXUINT64, 0,
+      G_PARAM_WRITABLE | G_PARAM_CONSTRUCT_ONLY | G_PARAM_STATIC_STRINGS);
+
+  g_object_class_install_properties (object_class, N_PROPERTIES, props);
+}
+
+/**
+ * test_fake_drive_new:
+ * @target_fd: writes to the file standing in for the drive; owned by the
+ *  returned object
+ * @medium: (nullable): the drive's speed, or %NULL to only count writes
+ * @source: (nullable): the stream the image being written is read from, to
+ *  measure how far ahead of the drive reading gets
+ * @image_size: size of the image being written, which is also how much will
+ *  be read from @source in all
+ */
+TestFakeDrive *
+test_fake_drive_new (gint                   target_fd,
+                     const TestMedium      *medium,
+                     TestShapedInputStream *source,
+                     guint64                image_size)
+{
+  return g_object_new (TEST_TYPE_FAKE_DRIVE,
+                       "target-fd", target_fd,
+                       "medium", medium,
+                       "source", source,
+                       "image-size", image_size,
+                       NULL);
+}
+
+/**
+ * test_fake_drive_steal_fd:
+ *
+ * Returns: the write end of the pipe, to pass as GisScribe:drive-fd. The
+ *  caller owns it.
+ */
+gint
+test_fake_drive_steal_fd (TestFakeDrive *self)
+{
+  gint fd = self->write_fd;
+
+  g_return_val_if_fail (fd != -1, -1);
+
+  self->write_fd = -1;
+  return fd;
+}
+
+/**
+ * test_fake_drive_wait:
+ *
+ * Waits until the write end of the pipe has been closed, and everything
+ * written to it has reached the target.
+ */
+void
+test_fake_drive_wait (TestFakeDrive *self)
+{
+  if (self->thread != NULL)
+    g_thread_join (g_steal_pointer (&self->thread));
+}
+
+void
+test_fake_drive_get_stats (TestFakeDrive      *self,
+                           TestFakeDriveStats *stats)
+{
+  g_mutex_lock (&self->mutex);
+  *stats = self->stats;
+  g_mutex_unlock (&self->mutex);
+}
@@ -0,0 +1,56 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*- */
+/*
+ * Copyright © 2018 Endless Mobile, Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <gio/gio.h>
+
+#include "test-shaped-input-stream.h"
+
+G_BEGIN_DECLS
+
+/**
+ * TestFakeDriveStats:
+ * @bytes_written: taken from the pipe and written to the target
+ * @max_in_flight: the most data which had been read from the source, but
+ *  not yet written, when a write started
+ * @n_starved_writes: writes after which no more of the source had been read,
+ *  though there was more to read: so the writer would next have had to wait
+ *  for it
+ */
+typedef struct {
+  guint64 bytes_written;
+  guint64 max_in_flight;
+  guint n_starved_writes;
+} TestFakeDriveStats;
+
+#define TEST_TYPE_FAKE_DRIVE (test_fake_drive_get_type ())
+G_DECLARE_FINAL_TYPE (TestFakeDrive, test_fake_drive,
+                      TEST, FAKE_DRIVE, GObject);
+
+TestFakeDrive *test_fake_drive_new (gint                   target_fd,
+                                    const TestMedium      *medium,
+                                    TestShapedInputStream *source,
+                                    guint64                image_size);
+
+gint test_fake_drive_steal_fd (TestFakeDrive *self);
+void test_fake_drive_wait (TestFakeDrive *self);
+void test_fake_drive_get_stats (TestFakeDrive      *self,
+                                TestFakeDriveStats *stats);
+
+G_END_DECLS
@@ -0,0 +1,363 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*- */
+/*
+ * Copyright © 2018 Endless Mobile, Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+#include "config.h"
+
+#include <locale.h>
+#include <string.h>
+
+#include <glib.h>
+#include <gio/gio.h>
+
+#include "crc32.h"
+#include "gpt_probe.h"
+
+/* Generated by make-gpt-image: 8192 sectors, with an ESP at 2048 and the
+ * root partition from 4096 to the last usable LBA.
+ */
+#define GPT_IMAGE "gpt.img"
+#define GPT_IMAGE_SIZE (8192 * 512)
+#define GPT_IMAGE_N_PARTITIONS 128
+
+typedef struct {
+  const gchar *basename;
+  GptProbeCompression compression;
+} TestData;
+
+static gchar *
+test_build_filename (GTestFileType file_type,
+                     const gchar  *basename)
+{
+  gchar *filename = g_test_build_filename (file_type, basename, NULL);
+
+  if (!g_file_test (filename, G_FILE_TEST_EXISTS))
+    g_error ("test data file %s doesn't exist", filename);
+
+  return filename;
+}
+
+static GInputStream *
+open_test_file (const gchar *basename)
+{
+  g_autofree gchar *path = test_build_filename (G_TEST_BUILT, basename);
+  g_autoptr(GFile) file = g_file_new_for_path (path);
+  g_autoptr(GError) error = NULL;
+  GFileInputStream *input = g_file_read (file, NULL, &error);
+
+  g_assert_no_error (error);
+  return G_INPUT_STREAM (input);
+}
+
+static void
+test_probe_valid (gconstpointer data)
+{
+  const TestData *test_data = data;
+  g_autoptr(GInputStream) input = open_test_file (test_data->basename);
+  g_autoptr(GError) error = NULL;
+  g_auto(GptTable) table = { 0 };
+  guint64 size = 0;
+
+  g_assert_true (gpt_probe_stream (input, test_data->compression, &table,
+                                   NULL, &error));
+  g_assert_no_error (error);
+
+  g_assert_cmpuint (table.pt.header.ptable_count, ==, GPT_IMAGE_N_PARTITIONS);
+  g_assert_nonnull (table.partitions);
+  g_assert_cmpuint (table.partitions[0].first_lba, ==, 2048);
+  g_assert_cmpuint (table.partitions[1].first_lba, ==, 4096);
+
+  g_assert_true (is_eos_gpt_table_valid (&table, &size));
+  g_assert_cmpuint (size, ==, GPT_IMAGE_SIZE);
+
+  /* The legacy check, on the first few entries only, must agree */
+  size = 0;
+  g_assert_true (is_eos_gpt_valid (&table.pt, &size));
+  g_assert_cmpuint (size, ==, GPT_IMAGE_SIZE);
+
+  /* The stream is left open, positioned after the partition table */
+  g_assert_false (g_input_stream_is_closed (input));
+}
+
+static GBytes *
+load_gpt_image (void)
+{
+  g_autofree gchar *path = test_build_filename (G_TEST_BUILT, GPT_IMAGE);
+  g_autoptr(GMappedFile) mapped = NULL;
+  g_autoptr(GError) error = NULL;
+
+  mapped = g_mapped_file_new (path, FALSE, &error);
+  g_assert_no_error (error);
+  return g_mapped_file_get_bytes (mapped);
+}
+
+/* An image which ends midway through the partition table */
+static void
+test_probe_truncated (void)
+{
+  g_autoptr(GBytes) image = load_gpt_image ();
+  g_autoptr(GBytes) head = g_bytes_new_from_bytes (image, 0, 2 * 512 + 4096);
+  g_autoptr(GInputStream) input = g_memory_input_stream_new_from_bytes (head);
+  g_autoptr(GError) error = NULL;
+  g_auto(GptTable) table = { 0 };
+
+  g_assert_false (gpt_probe_stream (input, GPT_PROBE_COMPRESSION_NONE, &table,
+                                    NULL, &error));
+  g_assert_error (error, G_IO_ERROR, G_IO_ERROR_PARTIAL_INPUT);
+  g_assert_null (table.partitions);
+}
+
+/* An image with no partition table at all */
+static void
+test_probe_not_gpt (void)
+{
+  g_autoptr(GInputStream) input = open_test_file ("w.img");
+  g_autoptr(GError) error = NULL;
+  g_auto(GptTable) table = { 0 };
+
+  g_assert_false (gpt_probe_stream (input, GPT_PROBE_COMPRESSION_NONE, &table,
+                                    NULL, &error));
+  g_assert_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA);
+  g_assert_null (table.partitions);
+}
+
+/* The legacy check assumed entries beyond the third were zero; corruption
+ * there must be detected now that the whole table is read.
+ */
+static void
+test_probe_corrupt_late_entry (void)
+{
+  g_autoptr(GBytes) image = load_gpt_image ();
+  gsize len;
+  const guint8 *image_data = g_bytes_get_data (image, &len);
+  g_autofree guint8 *data = g_memdup (image_data, len);
+  g_autoptr(GInputStream) input = NULL;
+  g_autoptr(GError) error = NULL;
+  g_auto(GptTable) table = { 0 };
+
+  /* Set a byte of the name of the 100th partition table entry */
+  data[2 * 512 + 100 * GPT_PART_SIZE + 56] = 'x';
+  input = g_memory_input_stream_new_from_data (data, len, NULL);
+
+  g_assert_true (gpt_probe_stream (input, GPT_PROBE_COMPRESSION_NONE, &table,
+                                   NULL, &error));
+  g_assert_no_error (error);
+
+  g_test_expect_message (G_LOG_DOMAIN, G_LOG_LEVEL_WARNING,
+                         "invalid partition table crc");
+  g_assert_false (is_eos_gpt_table_valid (&table, NULL));
+  g_test_assert_expected_messages ();
+}
+
+/* Relocating the GPT for a disk twice the size of the image */
+static void
+test_relocate (void)
+{
+  g_autoptr(GBytes) image = load_gpt_image ();
+  gsize len;
+  const guint8 *image_data = g_bytes_get_data (image, &len);
+  g_autofree guint8 *data = g_memdup (image_data, len);
+  guint64 disk_sectors = 2 * GPT_IMAGE_SIZE / 512;
+  guint64 old_backup_lba = 0;
+  g_autofree guint8 *backup = NULL;
+  size_t backup_len = 0;
+  struct gpt_header backup_header;
+  guint32 backup_crc;
+  guint32 mbr_sectors;
+  g_autoptr(GInputStream) input = NULL;
+  g_autoptr(GError) error = NULL;
+  g_auto(GptTable) table = { 0 };
+  const gsize ptable_size = GPT_IMAGE_N_PARTITIONS * GPT_PART_SIZE;
+
+  g_assert_true (gpt_relocate (data, len, disk_sectors, &old_backup_lba,
+                               &backup, &backup_len));
+
+  /* The image's own backup GPT header is at its end */
+  g_assert_cmpuint (old_backup_lba, ==, GPT_IMAGE_SIZE / 512 - 1);
+
+  /* The primary GPT is still valid, and now spans the disk */
+  input = g_memory_input_stream_new_from_data (data, len, NULL);
+  g_assert_true (gpt_probe_stream (input, GPT_PROBE_COMPRESSION_NONE, &table,
+                                   NULL, &error));
+  g_assert_no_error (error);
+  g_assert_true (is_eos_gpt_table_valid (&table, NULL));
+  g_assert_cmpuint (table.pt.header.backup_lba, ==, disk_sectors - 1);
+  g_assert_cmpuint (table.pt.header.last_usable_lba, ==,
+                    disk_sectors - 2 - ptable_size / 512);
+  g_assert_cmpmem (table.partitions, ptable_size,
+                   image_data + 2 * 512, ptable_size);
+
+  memcpy (&mbr_sectors, data + 446 + 12, sizeof mbr_sectors);
+  g_assert_cmpuint (mbr_sectors, ==, disk_sectors - 1);
+
+  /* The backup GPT is the partition table followed by the header */
+  g_assert_cmpuint (backup_len, ==, ptable_size + 512);
+  g_assert_cmpmem (backup, ptable_size, table.partitions, ptable_size);
+
+  memcpy (&backup_header, backup + ptable_size, sizeof backup_header);
+  g_assert_cmpmem (backup_header.signature, 8, "EFI PART", 8);
+  g_assert_cmpuint (backup_header.current_lba, ==, disk_sectors - 1);
+  g_assert_cmpuint (backup_header.backup_lba, ==, 1);
+  g_assert_cmpuint (backup_header.ptable_starting_lba, ==,
+                    disk_sectors - 1 - ptable_size / 512);
+  g_assert_cmpuint (backup_header.last_usable_lba, ==,
+                    table.pt.header.last_usable_lba);
+  g_assert_cmpuint (backup_header.ptable_crc, ==, table.pt.header.ptable_crc);
+
+  backup_crc = backup_header.crc;
+  backup_header.crc = 0;
+  g_assert_cmpuint (calc_crc32 (&backup_header, GPT_HEADER_SIZE), ==,
+                    backup_crc);
+}
+
+/* The partitions would not fit on the disk */
+static void
+test_relocate_too_small (void)
+{
+  g_autoptr(GBytes) image = load_gpt_image ();
+  gsize len;
+  const guint8 *image_data = g_bytes_get_data (image, &len);
+  g_autofree guint8 *data = g_memdup (image_data, len);
+  guint64 old_backup_lba = 0;
+  g_autofree guint8 *backup = NULL;
+  size_t backup_len = 0;
+
+  g_assert_false (gpt_relocate (data, len, GPT_IMAGE_SIZE / 512 / 2,
+                                &old_backup_lba, &backup, &backup_len));
+  g_assert_null (backup);
+  g_assert_cmpmem (data, len, image_data, len);
+}
+
+static void
+test_convert_to_mbr (void)
+{
+  g_autoptr(GBytes) image = load_gpt_image ();
+  gsize len;
+  const guint8 *image_data = g_bytes_get_data (image, &len);
+  g_autofree guint8 *data = g_memdup (image_data, len);
+  g_autofree guint8 *zeroes = NULL;
+  guint64 backup_lba = 0;
+  const gsize ptable_size = GPT_IMAGE_N_PARTITIONS * GPT_PART_SIZE;
+  guint32 first_lba[2], n_sectors[2];
+  gsize i;
+
+  g_assert_true (gpt_convert_to_mbr (data, len, &backup_lba));
+  g_assert_cmpuint (backup_lba, ==, GPT_IMAGE_SIZE / 512 - 1);
+
+  for (i = 0; i < 2; i++)
+    {
+      memcpy (&first_lba[i], data + 446 + 16 * i + 8, 4);
+      memcpy (&n_sectors[i], data + 446 + 16 * i + 12, 4);
+    }
+
+  /* The ESP, then the bootable root partition, which is to be grown */
+  g_assert_cmpuint (data[446], ==, 0);
+  g_assert_cmpuint (data[446 + 4], ==, 0xef);
+  g_assert_cmpuint (first_lba[0], ==, 2048);
+  g_assert_cmpuint (n_sectors[0], ==, 2048);
+  g_assert_cmpuint (data[446 + 16], ==, 0x80);
+  g_assert_cmpuint (data[446 + 16 + 4], ==, 0xdd);
+  g_assert_cmpuint (first_lba[1], ==, 4096);
+  g_assert_cmpuint (first_lba[1] + n_sectors[1], ==,
+                    GPT_IMAGE_SIZE / 512 - 1 - ptable_size / 512);
+
+  zeroes = g_malloc0 (512 + ptable_size);
+  g_assert_cmpmem (data + 446 + 32, 32, zeroes, 32);
+  g_assert_cmpuint (data[510], ==, 0x55);
+  g_assert_cmpuint (data[511], ==, 0xaa);
+
+  /* The GPT itself is erased */
+  g_assert_cmpmem (data + 512, 512 + ptable_size, zeroes, 512 + ptable_size);
+}
+
+/* A root partition without attribute 55 is not grown on first boot, so gets
+ * the ordinary Linux type
+ */
+static void
+test_convert_to_mbr_not_eos_root (void)
+{
+  g_autoptr(GBytes) image = load_gpt_image ();
+  gsize len;
+  const guint8 *image_data = g_bytes_get_data (image, &len);
+  g_autofree guint8 *data = g_memdup (image_data, len);
+  const gsize ptable_size = GPT_IMAGE_N_PARTITIONS * GPT_PART_SIZE;
+  struct gpt_header header;
+  struct gpt_partition root;
+  guint64 flags;
+  guint64 backup_lba = 0;
+
+  memcpy (&root, data + 1024 + GPT_PART_SIZE, sizeof root);
+  memcpy (&flags, root.attributes, 8);
+  g_assert_true (is_nth_flag_set (flags, 55));
+  flags &= ~(G_GUINT64_CONSTANT (1) << 55);
+  memcpy (root.attributes, &flags, 8);
+  memcpy (data + 1024 + GPT_PART_SIZE, &root, sizeof root);
+
+  memcpy (&header, data + 512, sizeof header);
+  header.ptable_crc = calc_crc32 (data + 1024, ptable_size);
+  header.crc = 0;
+  header.crc = calc_crc32 (&header, GPT_HEADER_SIZE);
+  memcpy (data + 512, &header, sizeof header);
+
+  g_assert_true (gpt_convert_to_mbr (data, len, &backup_lba));
+  g_assert_cmpuint (data[446 + 16], ==, 0x80);
+  g_assert_cmpuint (data[446 + 16 + 4], ==, 0x83);
+}
+
+static void
+test_convert_to_mbr_not_gpt (void)
+{
+  g_autofree guint8 *data = g_malloc0 (GPT_IMAGE_SIZE);
+  guint64 backup_lba = 0;
+
+  g_assert_false (gpt_convert_to_mbr (data, GPT_IMAGE_SIZE, &backup_lba));
+}
+
+int
+main (int argc, char *argv[])
+{
+  static const TestData valid_data[] = {
+      { GPT_IMAGE, GPT_PROBE_COMPRESSION_NONE },
+      { GPT_IMAGE ".gz", GPT_PROBE_COMPRESSION_GZIP },
+      { GPT_IMAGE ".xz", GPT_PROBE_COMPRESSION_XZ },
+  };
+  static const gchar * const valid_names[] = { "img", "gz", "xz" };
+  gsize i;
+
+  setlocale (LC_ALL, "");
+
+  g_test_init (&argc, &argv, NULL);
+
+  for (i = 0; i < G_N_ELEMENTS (valid_data); i++)
+    {
+      g_autofree gchar *testpath =
+        g_strdup_printf ("/gpt/probe/valid/%s", valid_names[i]);
+      g_test_add_data_func (testpath, &valid_data[i], test_probe_valid);
+    }
+
+  g_test_add_func ("/gpt/probe/truncated", test_probe_truncated);
+  g_test_add_func ("/gpt/probe/not-gpt", test_probe_not_gpt);
+  g_test_add_func ("/gpt/probe/corrupt-late-entry",
+                   test_probe_corrupt_late_entry);
+  g_test_add_func ("/gpt/relocate", test_relocate);
+  g_test_add_func ("/gpt/relocate/too-small", test_relocate_too_small);
+  g_test_add_func ("/gpt/convert-to-mbr", test_convert_to_mbr);
+  g_test_add_func ("/gpt/convert-to-mbr/not-eos-root",
+                   test_convert_to_mbr_not_eos_root);
+  g_test_add_func ("/gpt/convert-to-mbr/not-gpt", test_convert_to_mbr_not_gpt);
+
+  return g_test_run ();
+}
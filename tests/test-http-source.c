@@ -0,0 +1,357 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*- */
+/*
+ * Copyright © 2018 Endless Mobile, Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+#include "config.h"
+#include <locale.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <glib.h>
+#include <gio/gio.h>
+
+#include "gis-errors.h"
+#include "gis-http-source.h"
+
+#define IMAGE_PATH "/eos-eos3.4-amd64-amd64.180801-123456.base.img"
+#define IMAGE_SIZE (1024 * 1024 + 123)
+#define SEGMENT_SIZE (64 * 1024)
+
+typedef enum {
+  SERVER_NORMAL,
+  /* The first request for each range sends half the body, then hangs up */
+  SERVER_TRUNCATE_ONCE,
+  /* The first request for each range is refused with 503 */
+  SERVER_UNAVAILABLE_ONCE,
+  /* Every request is answered with the whole file */
+  SERVER_NO_RANGES,
+} ServerMode;
+
+/* A stand-in for an HTTP server, just capable enough to serve one file in
+ * pieces, running on a thread per connection.
+ */
+typedef struct {
+  GSocketService *service;
+  gchar *uri;
+  GBytes *contents;
+  ServerMode mode;
+
+  GMutex mutex;
+  guint n_requests;
+  GHashTable *seen_ranges;
+} Fixture;
+
+static gboolean
+write_string (GOutputStream *output,
+              const gchar   *s)
+{
+  return g_output_stream_write_all (output, s, strlen (s), NULL, NULL, NULL);
+}
+
+static gboolean
+server_run_cb (GThreadedSocketService *service,
+               GSocketConnection      *connection,
+               GObject                *source_object,
+               gpointer                user_data)
+{
+  Fixture *fixture = user_data;
+  GOutputStream *output =
+    g_io_stream_get_output_stream (G_IO_STREAM (connection));
+  g_autoptr(GDataInputStream) input = g_data_input_stream_new (
+      g_io_stream_get_input_stream (G_IO_STREAM (connection)));
+  g_autofree gchar *request_line = NULL;
+  g_autofree gchar *path = NULL;
+  g_autofree gchar *head = NULL;
+  g_autofree gchar *range = NULL;
+  const guint8 *data;
+  gsize size;
+  guint64 start = 0, end = 0;
+  gboolean has_range = FALSE;
+  gboolean first_time = FALSE;
+  gsize body_len;
+
+  g_data_input_stream_set_newline_type (input,
+                                        G_DATA_STREAM_NEWLINE_TYPE_CR_LF);
+  request_line = g_data_input_stream_read_line (input, NULL, NULL, NULL);
+  if (request_line == NULL)
+    return TRUE;
+
+  path = g_malloc0 (strlen (request_line) + 1);
+  g_assert_cmpint (sscanf (request_line, "GET %s HTTP/1.1", path), ==, 1);
+
+  while (TRUE)
+    {
+      g_autofree gchar *line =
+        g_data_input_stream_read_line (input, NULL, NULL, NULL);
+
+      if (line == NULL || *line == '\0')
+        break;
+
+      if (g_ascii_strncasecmp (line, "Range: ", strlen ("Range: ")) == 0)
+        has_range = sscanf (line + strlen ("Range: "),
+                            "bytes=%" G_GUINT64_FORMAT "-%" G_GUINT64_FORMAT,
+                            &start, &end) == 2;
+    }
+
+  data = g_bytes_get_data (fixture->contents, &size);
+
+  range = g_strdup_printf ("%" G_GUINT64_FORMAT "-%" G_GUINT64_FORMAT,
+                           start, end);
+
+  g_mutex_lock (&fixture->mutex);
+  fixture->n_requests++;
+  if (!g_hash_table_contains (fixture->seen_ranges, range))
+    {
+      g_hash_table_add (fixture->seen_ranges, g_steal_pointer (&range));
+      first_time = TRUE;
+    }
+  g_mutex_unlock (&fixture->mutex);
+
+  if (g_strcmp0 (path, IMAGE_PATH) != 0)
+    {
+      write_string (output, "HTTP/1.1 404 Not Found\r\n"
+                            "Content-Length: 0\r\n\r\n");
+      return TRUE;
+    }
+
+  if (fixture->mode == SERVER_UNAVAILABLE_ONCE && first_time)
+    {
+      write_string (output, "HTTP/1.1 503 Service Unavailable\r\n"
+                            "Content-Length: 0\r\n\r\n");
+      return TRUE;
+    }
+
+  if (fixture->mode == SERVER_NO_RANGES || !has_range)
+    {
+      head = g_strdup_printf ("HTTP/1.1 200 OK\r\n"
+                              "Content-Length: %" G_GSIZE_FORMAT "\r\n\r\n",
+                              size);
+      if (write_string (output, head))
+        g_output_stream_write_all (output, data, size, NULL, NULL, NULL);
+      return TRUE;
+    }
+
+  g_assert_cmpuint (start, <=, end);
+  g_assert_cmpuint (end, <, size);
+  body_len = end - start + 1;
+
+  head = g_strdup_printf ("HTTP/1.1 206 Partial Content\r\n"
+                          "Content-Range: bytes %" G_GUINT64_FORMAT
+                          "-%" G_GUINT64_FORMAT "/%" G_GSIZE_FORMAT "\r\n"
+                          "Content-Length: %" G_GSIZE_FORMAT "\r\n"
+                          "Connection: close\r\n\r\n",
+                          start, end, size, body_len);
+  if (!write_string (output, head))
+    return TRUE;
+
+  if (fixture->mode == SERVER_TRUNCATE_ONCE && first_time)
+    body_len /= 2;
+
+  g_output_stream_write_all (output, data + start, body_len, NULL, NULL,
+                             NULL);
+  return TRUE;
+}
+
+static void
+fixture_set_up (Fixture       *fixture,
+                gconstpointer  user_data)
+{
+  g_autoptr(GError) error = NULL;
+  guint8 *data = g_malloc (IMAGE_SIZE);
+  guint16 port;
+  gsize i;
+
+  for (i = 0; i < IMAGE_SIZE; i++)
+    data[i] = g_test_rand_int_range (0, 256);
+
+  fixture->contents = g_bytes_new_take (data, IMAGE_SIZE);
+  fixture->mode = GPOINTER_TO_INT (user_data);
+  fixture->seen_ranges = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                                g_free, NULL);
+  g_mutex_init (&fixture->mutex);
+
+  fixture->service = g_threaded_socket_service_new (16);
+  port = g_socket_listener_add_any_inet_port (
+      G_SOCKET_LISTENER (fixture->service), NULL, &error);
+  g_assert_no_error (error);
+  g_assert_cmpuint (port, !=, 0);
+
+  g_signal_connect (fixture->service, "run", (GCallback) server_run_cb,
+                    fixture);
+  g_socket_service_start (fixture->service);
+
+  fixture->uri = g_strdup_printf ("http://127.0.0.1:%u" IMAGE_PATH, port);
+}
+
+static void
+fixture_tear_down (Fixture       *fixture,
+                   gconstpointer  user_data)
+{
+  g_socket_service_stop (fixture->service);
+  g_socket_listener_close (G_SOCKET_LISTENER (fixture->service));
+  g_clear_object (&fixture->service);
+  g_clear_pointer (&fixture->contents, g_bytes_unref);
+  g_clear_pointer (&fixture->seen_ranges, g_hash_table_unref);
+  g_free (fixture->uri);
+  g_mutex_clear (&fixture->mutex);
+}
+
+/* Reads the whole of @stream, in pieces which don't line up with segments */
+static GBytes *
+read_all (GInputStream  *stream,
+          GError       **error)
+{
+  g_autoptr(GByteArray) array = g_byte_array_new ();
+  guint8 buf[10000];
+
+  while (TRUE)
+    {
+      gssize r = g_input_stream_read (stream, buf, sizeof buf, NULL, error);
+
+      if (r < 0)
+        return NULL;
+
+      if (r == 0)
+        break;
+
+      g_byte_array_append (array, buf, r);
+    }
+
+  return g_byte_array_free_to_bytes (g_steal_pointer (&array));
+}
+
+static void
+test_read (Fixture       *fixture,
+           gconstpointer  user_data)
+{
+  g_autoptr(GInputStream) stream = NULL;
+  g_autoptr(GBytes) bytes = NULL;
+  g_autoptr(GError) error = NULL;
+  guint64 size = 0;
+  guint n_segments = (IMAGE_SIZE + SEGMENT_SIZE - 1) / SEGMENT_SIZE;
+
+  gis_http_source_query_size (fixture->uri, &size, NULL, &error);
+  g_assert_no_error (error);
+  g_assert_cmpuint (size, ==, IMAGE_SIZE);
+
+  stream = gis_http_source_open (fixture->uri, size, 4, SEGMENT_SIZE, NULL);
+  bytes = read_all (stream, &error);
+  g_assert_no_error (error);
+  g_assert_true (g_bytes_equal (bytes, fixture->contents));
+
+  g_input_stream_close (stream, NULL, &error);
+  g_assert_no_error (error);
+
+  /* Each segment which failed the first time was fetched again */
+  if (fixture->mode == SERVER_NORMAL)
+    g_assert_cmpuint (fixture->n_requests, ==, 1 + n_segments);
+  else
+    g_assert_cmpuint (fixture->n_requests, ==, 2 + 2 * n_segments);
+}
+
+static void
+test_no_ranges (Fixture       *fixture,
+                gconstpointer  user_data)
+{
+  g_autoptr(GInputStream) stream = NULL;
+  g_autoptr(GBytes) bytes = NULL;
+  g_autoptr(GError) error = NULL;
+  guint64 size = 0;
+
+  g_assert_false (gis_http_source_query_size (fixture->uri, &size, NULL,
+                                              &error));
+  g_assert_error (error, GIS_IMAGE_ERROR, GIS_IMAGE_ERROR_NOT_SUPPORTED);
+  g_clear_error (&error);
+
+  stream = gis_http_source_open (fixture->uri, IMAGE_SIZE, 4, SEGMENT_SIZE,
+                                 NULL);
+  bytes = read_all (stream, &error);
+  g_assert_error (error, GIS_IMAGE_ERROR, GIS_IMAGE_ERROR_NOT_SUPPORTED);
+  g_assert_null (bytes);
+
+  /* Not worth retrying */
+  g_assert_cmpuint (fixture->n_requests, <=, 1 + 2 * 4);
+}
+
+static void
+test_not_found (Fixture       *fixture,
+                gconstpointer  user_data)
+{
+  g_autofree gchar *uri = g_strconcat (fixture->uri, ".asc", NULL);
+  g_autoptr(GBytes) bytes = NULL;
+  g_autoptr(GError) error = NULL;
+
+  bytes = gis_http_source_fetch (uri, 1024, NULL, &error);
+  g_assert_error (error, GIS_IMAGE_ERROR, GIS_IMAGE_ERROR_NOT_FOUND);
+  g_assert_null (bytes);
+  g_assert_cmpuint (fixture->n_requests, ==, 1);
+}
+
+static void
+test_fetch (Fixture       *fixture,
+            gconstpointer  user_data)
+{
+  g_autoptr(GBytes) bytes = NULL;
+  g_autoptr(GError) error = NULL;
+
+  bytes = gis_http_source_fetch (fixture->uri, IMAGE_SIZE, NULL, &error);
+  g_assert_no_error (error);
+  g_assert_true (g_bytes_equal (bytes, fixture->contents));
+  g_clear_pointer (&bytes, g_bytes_unref);
+
+  bytes = gis_http_source_fetch (fixture->uri, IMAGE_SIZE - 1, NULL, &error);
+  g_assert_error (error, GIS_IMAGE_ERROR, GIS_IMAGE_ERROR_WRONG_SIZE);
+  g_assert_null (bytes);
+}
+
+static void
+test_is_uri (void)
+{
+  g_assert_true (gis_http_source_is_uri ("http://example.com/a.img"));
+  g_assert_true (gis_http_source_is_uri ("HTTPS://example.com/a.img"));
+  g_assert_false (gis_http_source_is_uri ("ftp://example.com/a.img"));
+  g_assert_false (gis_http_source_is_uri ("/run/mount/eosimages/a.img"));
+}
+
+int
+main (int argc, char *argv[])
+{
+  setlocale (LC_ALL, "");
+
+  g_test_init (&argc, &argv, NULL);
+
+  g_test_add_func ("/http-source/is-uri", test_is_uri);
+  g_test_add ("/http-source/read", Fixture,
+              GINT_TO_POINTER (SERVER_NORMAL),
+              fixture_set_up, test_read, fixture_tear_down);
+  g_test_add ("/http-source/read/truncated", Fixture,
+              GINT_TO_POINTER (SERVER_TRUNCATE_ONCE),
+              fixture_set_up, test_read, fixture_tear_down);
+  g_test_add ("/http-source/read/unavailable", Fixture,
+              GINT_TO_POINTER (SERVER_UNAVAILABLE_ONCE),
+              fixture_set_up, test_read, fixture_tear_down);
+  g_test_add ("/http-source/no-ranges", Fixture,
+              GINT_TO_POINTER (SERVER_NO_RANGES),
+              fixture_set_up, test_no_ranges, fixture_tear_down);
+  g_test_add ("/http-source/not-found", Fixture,
+              GINT_TO_POINTER (SERVER_NORMAL),
+              fixture_set_up, test_not_found, fixture_tear_down);
+  g_test_add ("/http-source/fetch", Fixture,
+              GINT_TO_POINTER (SERVER_NORMAL),
+              fixture_set_up, test_fetch, fixture_tear_down);
+
+  return g_test_run ();
+}
@@ -0,0 +1,286 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*- */
+/*
+ * Copyright © 2018 Endless Mobile, Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+#include "config.h"
+#include <locale.h>
+#include <string.h>
+
+#include <glib.h>
+#include <glib/gstdio.h>
+#include <gio/gio.h>
+
+#include "gis-errors.h"
+#include "gis-image-cache.h"
+
+#define IMAGE "w.img"
+#define IMAGE_SIZE (4 * 1024 * 1024)
+
+typedef struct {
+  gchar *cache_dir_path;
+  GFile *cache_dir;
+  GFile *image;
+  guint64 compressed_size;
+  GFile *signature;
+  GFile *checksum;
+} Fixture;
+
+static void
+fixture_set_up (Fixture       *fixture,
+                gconstpointer  user_data)
+{
+  g_autofree gchar *image_path = g_test_build_filename (G_TEST_BUILT, IMAGE ".gz", NULL);
+  g_autofree gchar *checksum_path = g_test_build_filename (G_TEST_BUILT, IMAGE ".gz.sha256", NULL);
+  g_autoptr(GFileInfo) info = NULL;
+  g_autoptr(GError) error = NULL;
+
+  fixture->cache_dir_path = g_dir_make_tmp ("test-image-cache-XXXXXX", &error);
+  g_assert_no_error (error);
+  fixture->cache_dir = g_file_new_for_path (fixture->cache_dir_path);
+
+  fixture->image = g_file_new_for_path (image_path);
+  info = g_file_query_info (fixture->image, G_FILE_ATTRIBUTE_STANDARD_SIZE,
+                            G_FILE_QUERY_INFO_NONE, NULL, &error);
+  g_assert_no_error (error);
+  fixture->compressed_size = g_file_info_get_size (info);
+
+  /* Use the checksum, since the scribe would look for the signing key in the
+   * system keyring.
+   */
+  fixture->signature = g_file_get_child (fixture->cache_dir, "does-not-exist.asc");
+  fixture->checksum = g_file_new_for_path (checksum_path);
+}
+
+static void
+fixture_tear_down (Fixture       *fixture,
+                   gconstpointer  user_data)
+{
+  const gchar *basenames[] = {
+    IMAGE, IMAGE ".asc", IMAGE ".sha256", IMAGE ".source",
+  };
+  gsize i;
+
+  for (i = 0; i < G_N_ELEMENTS (basenames); i++)
+    {
+      g_autofree gchar *path = g_build_filename (fixture->cache_dir_path,
+                                                 basenames[i], NULL);
+      g_unlink (path);
+    }
+
+  g_assert_cmpint (g_rmdir (fixture->cache_dir_path), ==, 0);
+
+  g_clear_pointer (&fixture->cache_dir_path, g_free);
+  g_clear_object (&fixture->cache_dir);
+  g_clear_object (&fixture->image);
+  g_clear_object (&fixture->signature);
+  g_clear_object (&fixture->checksum);
+}
+
+static void
+prepare_cb (GObject      *source,
+            GAsyncResult *result,
+            gpointer      user_data)
+{
+  GAsyncResult **result_out = user_data;
+
+  g_assert_null (*result_out);
+  *result_out = g_object_ref (result);
+}
+
+static GisImageCache *
+prepare_and_wait (Fixture  *fixture,
+                  GError  **error)
+{
+  g_autoptr(GisImageCache) cache = NULL;
+  g_autoptr(GAsyncResult) result = NULL;
+
+  cache = gis_image_cache_new (fixture->cache_dir, fixture->image, IMAGE_SIZE,
+                               fixture->compressed_size, fixture->signature,
+                               fixture->checksum);
+  gis_image_cache_prepare_async (cache, NULL, prepare_cb, &result);
+
+  while (result == NULL)
+    g_main_context_iteration (NULL, TRUE);
+
+  if (!gis_image_cache_prepare_finish (cache, result, error))
+    return NULL;
+
+  return g_steal_pointer (&cache);
+}
+
+static guint64
+get_inode (GFile *file)
+{
+  g_autoptr(GFileInfo) info = NULL;
+  g_autoptr(GError) error = NULL;
+
+  info = g_file_query_info (file, G_FILE_ATTRIBUTE_UNIX_INODE,
+                            G_FILE_QUERY_INFO_NONE, NULL, &error);
+  g_assert_no_error (error);
+
+  return g_file_info_get_attribute_uint64 (info, G_FILE_ATTRIBUTE_UNIX_INODE);
+}
+
+static void
+assert_cache_matches_image (GisImageCache *cache)
+{
+  g_autofree gchar *image_path = g_test_build_filename (G_TEST_BUILT, IMAGE, NULL);
+  g_autofree gchar *expected = NULL;
+  g_autofree gchar *actual = NULL;
+  g_autofree gchar *expected_sha256 = NULL;
+  g_autofree gchar *expected_checksum = NULL;
+  g_autofree gchar *checksum = NULL;
+  gsize expected_len, actual_len;
+  g_autoptr(GError) error = NULL;
+
+  g_file_get_contents (image_path, &expected, &expected_len, &error);
+  g_assert_no_error (error);
+
+  g_file_load_contents (gis_image_cache_get_image (cache), NULL,
+                        &actual, &actual_len, NULL, &error);
+  g_assert_no_error (error);
+
+  g_assert_cmpmem (actual, actual_len, expected, expected_len);
+
+  /* Hashed as it was written, so it must match what was read back */
+  g_file_load_contents (gis_image_cache_get_checksum (cache), NULL,
+                        &checksum, NULL, NULL, &error);
+  g_assert_no_error (error);
+  expected_sha256 = g_compute_checksum_for_data (G_CHECKSUM_SHA256,
+                                                 (const guchar *) expected,
+                                                 expected_len);
+  expected_checksum = g_strdup_printf ("%s  %s\n", expected_sha256, IMAGE);
+  g_assert_cmpstr (checksum, ==, expected_checksum);
+  g_assert_false (g_file_query_exists (gis_image_cache_get_signature (cache), NULL));
+}
+
+static void
+test_image_cache_prepare (Fixture       *fixture,
+                          gconstpointer  user_data)
+{
+  g_autoptr(GisImageCache) cache = NULL;
+  g_autoptr(GError) error = NULL;
+
+  cache = prepare_and_wait (fixture, &error);
+  g_assert_no_error (error);
+  g_assert_nonnull (cache);
+
+  assert_cache_matches_image (cache);
+}
+
+static void
+test_image_cache_reuse (Fixture       *fixture,
+                        gconstpointer  user_data)
+{
+  g_autoptr(GisImageCache) first = NULL;
+  g_autoptr(GisImageCache) second = NULL;
+  g_autoptr(GError) error = NULL;
+
+  first = prepare_and_wait (fixture, &error);
+  g_assert_no_error (error);
+
+  second = prepare_and_wait (fixture, &error);
+  g_assert_no_error (error);
+
+  /* The existing copy is used, rather than decompressing the image again */
+  g_assert_cmpuint (get_inode (gis_image_cache_get_image (first)), ==,
+                    get_inode (gis_image_cache_get_image (second)));
+  assert_cache_matches_image (second);
+}
+
+static void
+test_image_cache_stale (Fixture       *fixture,
+                        gconstpointer  user_data)
+{
+  g_autoptr(GisImageCache) first = NULL;
+  g_autoptr(GisImageCache) second = NULL;
+  g_autoptr(GFile) source = g_file_get_child (fixture->cache_dir, IMAGE ".source");
+  g_autoptr(GError) error = NULL;
+  guint64 inode;
+
+  first = prepare_and_wait (fixture, &error);
+  g_assert_no_error (error);
+  inode = get_inode (gis_image_cache_get_image (first));
+
+  /* As if the copy had been made from a different image */
+  g_file_replace_contents (source, "stale", strlen ("stale"), NULL, FALSE,
+                           G_FILE_CREATE_NONE, NULL, NULL, &error);
+  g_assert_no_error (error);
+
+  second = prepare_and_wait (fixture, &error);
+  g_assert_no_error (error);
+
+  g_assert_cmpuint (get_inode (gis_image_cache_get_image (second)), !=, inode);
+  assert_cache_matches_image (second);
+}
+
+static void
+test_image_cache_bad_checksum (Fixture       *fixture,
+                               gconstpointer  user_data)
+{
+  g_autofree gchar *bad_checksum_path = g_test_build_filename (G_TEST_DIST, "bad.sha256", NULL);
+  g_autoptr(GisImageCache) cache = NULL;
+  g_autoptr(GFile) image = g_file_get_child (fixture->cache_dir, IMAGE);
+  g_autoptr(GError) error = NULL;
+
+  g_clear_object (&fixture->checksum);
+  fixture->checksum = g_file_new_for_path (bad_checksum_path);
+
+  cache = prepare_and_wait (fixture, &error);
+  g_assert_error (error, GIS_IMAGE_ERROR, GIS_IMAGE_ERROR_VERIFICATION_FAILED);
+  g_assert_null (cache);
+
+  /* Nothing unverified is left behind */
+  g_assert_false (g_file_query_exists (image, NULL));
+}
+
+/* Whether an image is compressed is told by its contents, not its name */
+static void
+test_image_cache_is_useful (void)
+{
+  g_autofree gchar *img_path = g_test_build_filename (G_TEST_BUILT, IMAGE, NULL);
+  g_autofree gchar *gz_path = g_test_build_filename (G_TEST_BUILT, IMAGE ".gz", NULL);
+  g_autofree gchar *xz_path = g_test_build_filename (G_TEST_BUILT, IMAGE ".xz", NULL);
+  g_autoptr(GFile) img = g_file_new_for_path (img_path);
+  g_autoptr(GFile) gz = g_file_new_for_path (gz_path);
+  g_autoptr(GFile) xz = g_file_new_for_path (xz_path);
+  g_autoptr(GFile) missing = g_file_new_for_path ("does-not-exist.img.gz");
+
+  g_assert_false (gis_image_cache_is_useful (img));
+  g_assert_true (gis_image_cache_is_useful (gz));
+  g_assert_true (gis_image_cache_is_useful (xz));
+  g_assert_false (gis_image_cache_is_useful (missing));
+}
+
+int
+main (int argc, char *argv[])
+{
+  setlocale (LC_ALL, "");
+
+  g_test_init (&argc, &argv, NULL);
+
+  g_test_add_func ("/image-cache/is-useful", test_image_cache_is_useful);
+  g_test_add ("/image-cache/prepare", Fixture, NULL,
+              fixture_set_up, test_image_cache_prepare, fixture_tear_down);
+  g_test_add ("/image-cache/reuse", Fixture, NULL,
+              fixture_set_up, test_image_cache_reuse, fixture_tear_down);
+  g_test_add ("/image-cache/stale", Fixture, NULL,
+              fixture_set_up, test_image_cache_stale, fixture_tear_down);
+  g_test_add ("/image-cache/bad-checksum", Fixture, NULL,
+              fixture_set_up, test_image_cache_bad_checksum, fixture_tear_down);
+
+  return g_test_run ();
+}
@@ -0,0 +1,178 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*- */
+/*
+ * Copyright © 2018 Endless Mobile, Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+#include "config.h"
+#include <fcntl.h>
+#include <locale.h>
+#include <string.h>
+
+#include <glib.h>
+#include <glib/gstdio.h>
+#include <gio/gio.h>
+
+#include "glnx-shutil.h"
+#include "gis-image-format.h"
+
+/* As generated by make-gpt-image in Makefile.am */
+#define GPT_IMAGE_SIZE (8192 * 512)
+/* endless.img within endless.squash is w-8193.img */
+#define SQUASHFS_IMAGE_SIZE (8193 * 512)
+
+typedef struct {
+  const gchar *path;
+  GisImageFormatId format;
+  /* Size of the disk image within, or 0 if there is no size oracle */
+  guint64 image_size;
+} TestData;
+
+static GFile *
+get_built_file (const gchar *basename)
+{
+  g_autofree gchar *path = g_test_build_filename (G_TEST_BUILT, basename, NULL);
+
+  return g_file_new_for_path (path);
+}
+
+static void
+test_image_format_detect (gconstpointer user_data)
+{
+  const TestData *data = user_data;
+  g_autoptr(GFile) file = get_built_file (data->path);
+  const GisImageFormat *format;
+  guint64 image_size = 0;
+  g_autoptr(GError) error = NULL;
+
+  format = gis_image_format_detect_file (file, NULL, &error);
+  g_assert_no_error (error);
+  g_assert_nonnull (format);
+  g_assert_cmpint (format->id, ==, data->format);
+  g_assert_true (format == gis_image_format_get (data->format));
+
+  if (data->image_size == 0)
+    {
+      g_assert_null (format->get_image_size);
+    }
+  else
+    {
+      g_assert_true (format->get_image_size (file, &image_size, &error));
+      g_assert_no_error (error);
+      g_assert_cmpuint (image_size, ==, data->image_size);
+    }
+}
+
+/* A compressed image with an unhelpful name is still recognised */
+static void
+test_image_format_renamed (void)
+{
+  g_autoptr(GFile) xz = get_built_file ("gpt.img.xz");
+  g_autoptr(GError) error = NULL;
+  g_autofree gchar *tmpdir = g_dir_make_tmp ("test-image-format-XXXXXX", &error);
+  g_autofree gchar *path = NULL;
+  g_autoptr(GFile) renamed = NULL;
+  const GisImageFormat *format;
+
+  g_assert_no_error (error);
+  path = g_build_filename (tmpdir, "eos-image.img", NULL);
+  renamed = g_file_new_for_path (path);
+  g_file_copy (xz, renamed, G_FILE_COPY_NONE, NULL, NULL, NULL, &error);
+  g_assert_no_error (error);
+
+  format = gis_image_format_detect_file (renamed, NULL, &error);
+  g_assert_no_error (error);
+  g_assert_cmpint (format->id, ==, GIS_IMAGE_FORMAT_XZ);
+
+  /* ...whereas going by its name alone gets it wrong */
+  g_assert_cmpint (gis_image_format_guess (path)->id, ==, GIS_IMAGE_FORMAT_RAW);
+
+  glnx_shutil_rm_rf_at (AT_FDCWD, tmpdir, NULL, NULL);
+}
+
+/* Peeking at a stream leaves it to be read from the start */
+static void
+test_image_format_peek (void)
+{
+  static const guint8 contents[] = "\x1f\x8b and the rest";
+  g_autoptr(GInputStream) base =
+    g_memory_input_stream_new_from_data (contents, sizeof contents, NULL);
+  g_autoptr(GInputStream) input = g_buffered_input_stream_new (base);
+  guint8 buffer[sizeof contents];
+  gsize len = 0;
+  const GisImageFormat *format;
+  g_autoptr(GError) error = NULL;
+
+  format = gis_image_format_peek (G_BUFFERED_INPUT_STREAM (input), NULL,
+                                  &error);
+  g_assert_no_error (error);
+  g_assert_cmpint (format->id, ==, GIS_IMAGE_FORMAT_GZIP);
+
+  g_input_stream_read_all (input, buffer, sizeof buffer, &len, NULL, &error);
+  g_assert_no_error (error);
+  g_assert_cmpmem (buffer, len, contents, sizeof contents);
+}
+
+static void
+test_image_format_short (void)
+{
+  /* Too short to hold any magic, and so assumed to be raw */
+  g_assert_cmpint (gis_image_format_detect ((const guint8 *) "\xfd" "7z", 3)->id,
+                   ==, GIS_IMAGE_FORMAT_RAW);
+  g_assert_cmpint (gis_image_format_detect (NULL, 0)->id,
+                   ==, GIS_IMAGE_FORMAT_RAW);
+}
+
+static void
+test_image_format_guess (void)
+{
+  g_assert_cmpint (gis_image_format_guess ("eos.img")->id, ==,
+                   GIS_IMAGE_FORMAT_RAW);
+  g_assert_cmpint (gis_image_format_guess ("eos.img.gz")->id, ==,
+                   GIS_IMAGE_FORMAT_GZIP);
+  g_assert_cmpint (gis_image_format_guess ("http://example.com/eos.img.xz")->id,
+                   ==, GIS_IMAGE_FORMAT_XZ);
+  g_assert_cmpint (gis_image_format_guess ("endless.squash")->id, ==,
+                   GIS_IMAGE_FORMAT_SQUASHFS);
+}
+
+int
+main (int argc, char *argv[])
+{
+  const TestData raw = { "gpt.img", GIS_IMAGE_FORMAT_RAW, GPT_IMAGE_SIZE };
+  const TestData gzip = { "gpt.img.gz", GIS_IMAGE_FORMAT_GZIP, 0 };
+  const TestData xz = { "gpt.img.xz", GIS_IMAGE_FORMAT_XZ, GPT_IMAGE_SIZE };
+  const TestData squashfs = {
+    "endless.squash", GIS_IMAGE_FORMAT_SQUASHFS, SQUASHFS_IMAGE_SIZE
+  };
+
+  setlocale (LC_ALL, "");
+
+  g_test_init (&argc, &argv, NULL);
+
+  g_test_add_data_func ("/image-format/detect/raw", &raw,
+                        test_image_format_detect);
+  g_test_add_data_func ("/image-format/detect/gzip", &gzip,
+                        test_image_format_detect);
+  g_test_add_data_func ("/image-format/detect/xz", &xz,
+                        test_image_format_detect);
+  g_test_add_data_func ("/image-format/detect/squashfs", &squashfs,
+                        test_image_format_detect);
+  g_test_add_func ("/image-format/renamed", test_image_format_renamed);
+  g_test_add_func ("/image-format/peek", test_image_format_peek);
+  g_test_add_func ("/image-format/short", test_image_format_short);
+  g_test_add_func ("/image-format/guess", test_image_format_guess);
+
+  return g_test_run ();
+}
@@ -0,0 +1,170 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*- */
+/*
+ * Copyright © 2018 Endless Mobile, Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+#include "config.h"
+#include <locale.h>
+
+#include <glib.h>
+#include <gio/gio.h>
+
+#include "gis-errors.h"
+#include "gis-image-verifier.h"
+
+static void
+verify_cb (GObject      *source,
+           GAsyncResult *result,
+           gpointer      user_data)
+{
+  GAsyncResult **result_out = user_data;
+
+  g_assert_null (*result_out);
+  *result_out = g_object_ref (result);
+}
+
+static gboolean
+verify_and_wait (GisImageVerifier  *verifier,
+                 GError           **error)
+{
+  g_autoptr(GAsyncResult) result = NULL;
+
+  gis_image_verifier_verify_async (verifier, NULL, verify_cb, &result);
+
+  while (result == NULL)
+    g_main_context_iteration (NULL, TRUE);
+
+  return gis_image_verifier_verify_finish (verifier, result, error);
+}
+
+/* Test data is either checked in, or generated at build time */
+static GFile *
+test_file (const gchar *basename)
+{
+  g_autofree gchar *path = g_test_build_filename (G_TEST_DIST, basename, NULL);
+
+  if (!g_file_test (path, G_FILE_TEST_EXISTS))
+    {
+      g_free (path);
+      path = g_test_build_filename (G_TEST_BUILT, basename, NULL);
+    }
+
+  return g_file_new_for_path (path);
+}
+
+static GisImageVerifier *
+verifier_new (const gchar *image,
+              const gchar *signature,
+              const gchar *checksum)
+{
+  g_autofree gchar *keyring_path = g_test_build_filename (G_TEST_DIST, "public.asc", NULL);
+  g_autoptr(GFile) image_file = test_file (image);
+  g_autoptr(GFile) signature_file = test_file (signature);
+  g_autoptr(GFile) checksum_file = test_file (checksum);
+
+  return g_object_new (GIS_TYPE_IMAGE_VERIFIER,
+                       "image", image_file,
+                       "signature", signature_file,
+                       "checksum", checksum_file,
+                       "keyring-path", keyring_path,
+                       NULL);
+}
+
+static void
+test_image_verifier_checksum (void)
+{
+  g_autoptr(GisImageVerifier) verifier = NULL;
+  g_autoptr(GisImageVerifier) again = NULL;
+  g_autoptr(GError) error = NULL;
+
+  verifier = verifier_new ("w.img", "does-not-exist.asc", "w.img.sha256");
+  g_assert_false (gis_image_verifier_is_verified (verifier));
+
+  g_assert_true (verify_and_wait (verifier, &error));
+  g_assert_no_error (error);
+  g_assert_cmpfloat (gis_image_verifier_get_progress (verifier), ==, 1.0);
+
+  /* The result is remembered for the same files, even by another verifier */
+  again = verifier_new ("w.img", "does-not-exist.asc", "w.img.sha256");
+  g_assert_true (gis_image_verifier_is_verified (again));
+}
+
+static void
+test_image_verifier_bad_checksum (void)
+{
+  g_autoptr(GisImageVerifier) verifier = NULL;
+  g_autoptr(GError) error = NULL;
+
+  verifier = verifier_new ("w.img", "does-not-exist.asc", "bad.sha256");
+
+  g_assert_false (verify_and_wait (verifier, &error));
+  g_assert_error (error, GIS_IMAGE_ERROR, GIS_IMAGE_ERROR_VERIFICATION_FAILED);
+  g_assert_false (gis_image_verifier_is_verified (verifier));
+}
+
+static void
+test_image_verifier_signature (void)
+{
+  g_autoptr(GisImageVerifier) verifier = NULL;
+  g_autoptr(GError) error = NULL;
+
+  verifier = verifier_new ("w-8193.img", "w-8193.img.asc", "does-not-exist.sha256");
+
+  g_assert_true (verify_and_wait (verifier, &error));
+  g_assert_no_error (error);
+  g_assert_true (gis_image_verifier_is_verified (verifier));
+}
+
+static void
+test_image_verifier_wrong_key (void)
+{
+  g_autoptr(GisImageVerifier) verifier = NULL;
+  g_autoptr(GError) error = NULL;
+
+  /* wjt.asc is a valid signature made by a key that's not in the keyring */
+  verifier = verifier_new ("w-8193.img", "wjt.asc", "does-not-exist.sha256");
+
+  g_assert_false (verify_and_wait (verifier, &error));
+  g_assert_error (error, GIS_IMAGE_ERROR, GIS_IMAGE_ERROR_VERIFICATION_FAILED);
+  g_assert_false (gis_image_verifier_is_verified (verifier));
+}
+
+static void
+test_image_verifier_parse_gpg_progress (void)
+{
+  gdouble progress = 0;
+
+  g_assert_false (gis_image_verifier_parse_gpg_progress ("[GNUPG:] GOODSIG 1234 Someone", &progress));
+  g_assert_false (gis_image_verifier_parse_gpg_progress ("[GNUPG:] PROGRESS w.img.asc ? 100 200 B", &progress));
+
+  g_assert_true (gis_image_verifier_parse_gpg_progress ("[GNUPG:] PROGRESS /dev/mapper/endless- ? 1111 4444 MiB\n", &progress));
+  g_assert_cmpfloat (progress, ==, 0.25);
+}
+
+int
+main (int argc, char *argv[])
+{
+  setlocale (LC_ALL, "");
+
+  g_test_init (&argc, &argv, NULL);
+
+  g_test_add_func ("/image-verifier/checksum", test_image_verifier_checksum);
+  g_test_add_func ("/image-verifier/bad-checksum", test_image_verifier_bad_checksum);
+  g_test_add_func ("/image-verifier/signature", test_image_verifier_signature);
+  g_test_add_func ("/image-verifier/wrong-key", test_image_verifier_wrong_key);
+  g_test_add_func ("/image-verifier/parse-gpg-progress", test_image_verifier_parse_gpg_progress);
+
+  return g_test_run ();
+}
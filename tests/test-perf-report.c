@@ -0,0 +1,130 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*- */
+/*
+ * Copyright © 2018 Endless Mobile, Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+#include "config.h"
+#include <string.h>
+#include <locale.h>
+
+#include <gio/gio.h>
+
+#include "gis-perf-report.h"
+
+static void
+test_describe_device_not_block (void)
+{
+  g_autofree gchar *line = gis_perf_report_describe_device ("/dev/null");
+
+  g_assert_cmpstr (line, ==, "/dev/null: not a block device");
+}
+
+static void
+test_describe_device_missing (void)
+{
+  g_autofree gchar *line =
+    gis_perf_report_describe_device ("/nonexistent/drive");
+
+  g_assert_true (g_str_has_prefix (line, "/nonexistent/drive: "));
+}
+
+/* Whatever filesystem the file is on, the line describes it somehow */
+static void
+test_describe_file (void)
+{
+  g_autoptr(GError) error = NULL;
+  g_autoptr(GFileIOStream) iostream = NULL;
+  g_autoptr(GFile) file = g_file_new_tmp ("perf-report-XXXXXX", &iostream,
+                                          &error);
+  g_autofree gchar *path = NULL;
+  g_autofree gchar *prefix = NULL;
+  g_autofree gchar *line = NULL;
+
+  g_assert_no_error (error);
+
+  path = g_file_get_path (file);
+  prefix = g_strdup_printf ("%s: ", path);
+  line = gis_perf_report_describe_file (file);
+  g_assert_true (g_str_has_prefix (line, prefix));
+  g_assert_cmpuint (strlen (line), >, strlen (prefix));
+
+  g_file_delete (file, NULL, NULL);
+}
+
+static void
+test_describe_file_remote (void)
+{
+  g_autoptr(GFile) file =
+    g_file_new_for_uri ("http://images.example.com/eos.img.gz");
+  g_autofree gchar *line = gis_perf_report_describe_file (file);
+
+  g_assert_cmpstr (line, ==,
+                   "http://images.example.com/eos.img.gz: read over http");
+}
+
+static void
+test_append_stages (void)
+{
+  const GisPerfStage stages[] = {
+    { "read", 4 * 1024 * 1024, 2 * G_USEC_PER_SEC,
+      G_USEC_PER_SEC, G_USEC_PER_SEC / 2 },
+    /* A subprocess, whose busy and stalled time is unknown */
+    { "decompress", 8 * 1024 * 1024, 2 * G_USEC_PER_SEC, -1, -1 },
+    /* Finished instantly, perhaps because it failed */
+    { "write", 0, 0, 0, 0 },
+  };
+  g_autoptr(GString) report = g_string_new (NULL);
+  g_auto(GStrv) lines = NULL;
+
+  gis_perf_report_append_stages (report, stages, G_N_ELEMENTS (stages));
+  lines = g_strsplit (report->str, "\n", -1);
+
+  /* A heading, a line per stage, and the empty string after the last newline */
+  g_assert_cmpuint (g_strv_length (lines), ==, 1 + G_N_ELEMENTS (stages) + 1);
+  g_assert_true (g_str_has_prefix (lines[0], "stage "));
+  g_assert_cmpstr (lines[4], ==, "");
+
+  g_assert_true (g_str_has_prefix (lines[1], "read "));
+  g_assert_nonnull (strstr (lines[1], " 4.0 MiB "));
+  g_assert_nonnull (strstr (lines[1], " 2.0 s "));
+  g_assert_nonnull (strstr (lines[1], " 0.5 s "));
+  g_assert_true (g_str_has_suffix (lines[1], " 2.0 MiB/s"));
+
+  g_assert_true (g_str_has_prefix (lines[2], "decompress "));
+  g_assert_nonnull (strstr (lines[2], " - "));
+  g_assert_true (g_str_has_suffix (lines[2], " 4.0 MiB/s"));
+
+  g_assert_true (g_str_has_prefix (lines[3], "write "));
+  g_assert_true (g_str_has_suffix (lines[3], " -"));
+}
+
+int
+main (int argc, char *argv[])
+{
+  setlocale (LC_ALL, "");
+
+  g_test_init (&argc, &argv, NULL);
+
+  g_test_add_func ("/perf-report/describe-device/not-block",
+                   test_describe_device_not_block);
+  g_test_add_func ("/perf-report/describe-device/missing",
+                   test_describe_device_missing);
+  g_test_add_func ("/perf-report/describe-file", test_describe_file);
+  g_test_add_func ("/perf-report/describe-file/remote",
+                   test_describe_file_remote);
+  g_test_add_func ("/perf-report/append-stages", test_append_stages);
+
+  return g_test_run ();
+}
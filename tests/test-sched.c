@@ -0,0 +1,210 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*- */
+/*
+ * Copyright © 2018 Endless Mobile, Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+#include "config.h"
+#include <errno.h>
+#include <locale.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <gio/gio.h>
+
+#include "gis-sched.h"
+
+typedef struct {
+  gint nice_value;
+  glong ioprio;
+  cpu_set_t cpus;
+} Params;
+
+static void
+get_params (Params *params)
+{
+  pid_t tid = (pid_t) syscall (SYS_gettid);
+
+  errno = 0;
+  params->nice_value = getpriority (PRIO_PROCESS, tid);
+  g_assert_cmpint (errno, ==, 0);
+
+  params->ioprio = syscall (SYS_ioprio_get, 1 /* IOPRIO_WHO_PROCESS */, tid);
+  g_assert_cmpint (params->ioprio, >=, 0);
+
+  g_assert_cmpint (sched_getaffinity (0, sizeof params->cpus, &params->cpus),
+                   ==, 0);
+}
+
+/* A thread with no I/O priority of its own reports class "none", or the
+ * best-effort level which its nice value implies
+ */
+static glong
+effective_ioprio (const Params *params)
+{
+  if ((params->ioprio >> 13) == 0 /* IOPRIO_CLASS_NONE */)
+    return (2 /* IOPRIO_CLASS_BE */ << 13) | ((params->nice_value + 20) / 5);
+
+  return params->ioprio;
+}
+
+static void
+test_sched_restore (void)
+{
+  GisSchedStage stages[] = {
+    GIS_SCHED_STAGE_READ,
+    GIS_SCHED_STAGE_DECODE,
+    GIS_SCHED_STAGE_VERIFY,
+    GIS_SCHED_STAGE_WRITE,
+  };
+  Params before, after;
+  gsize i;
+
+  get_params (&before);
+
+  for (i = 0; i < G_N_ELEMENTS (stages); i++)
+    {
+      g_autoptr(GisSchedScope) scope = gis_sched_enter (stages[i]);
+      g_assert_nonnull (scope);
+    }
+
+  get_params (&after);
+  g_assert_cmpint (after.nice_value, ==, before.nice_value);
+  g_assert_cmpint (effective_ioprio (&after), ==, effective_ioprio (&before));
+  g_assert_true (CPU_EQUAL (&after.cpus, &before.cpus));
+}
+
+static void
+test_sched_pin (void)
+{
+  g_autoptr(GisSchedScope) scope = NULL;
+  Params before, during, after;
+  gint first = -1;
+  gint i;
+
+  get_params (&before);
+  if (CPU_COUNT (&before.cpus) < 2)
+    {
+      g_test_skip ("needs at least 2 CPUs");
+      return;
+    }
+
+  for (i = 0; i < CPU_SETSIZE && first < 0; i++)
+    if (CPU_ISSET (i, &before.cpus))
+      first = i;
+
+  /* Reading is not pinned */
+  scope = gis_sched_enter (GIS_SCHED_STAGE_READ);
+  get_params (&during);
+  g_assert_true (CPU_EQUAL (&during.cpus, &before.cpus));
+  g_clear_pointer (&scope, gis_sched_leave);
+
+  scope = gis_sched_enter (GIS_SCHED_STAGE_DECODE);
+  get_params (&during);
+  g_assert_false (CPU_ISSET (first, &during.cpus));
+  g_assert_cmpint (CPU_COUNT (&during.cpus), ==,
+                   CPU_COUNT (&before.cpus) - 1);
+  g_clear_pointer (&scope, gis_sched_leave);
+
+  get_params (&after);
+  g_assert_true (CPU_EQUAL (&after.cpus, &before.cpus));
+}
+
+static void
+test_sched_launcher (void)
+{
+  g_autoptr(GSubprocessLauncher) launcher =
+    g_subprocess_launcher_new (G_SUBPROCESS_FLAGS_STDOUT_PIPE);
+  g_autoptr(GSubprocess) subprocess = NULL;
+  g_autofree gchar *output = NULL;
+  g_autoptr(GError) error = NULL;
+  Params before, after;
+
+  get_params (&before);
+
+  gis_sched_setup_launcher (launcher, GIS_SCHED_STAGE_DECODE);
+  /* With no arguments, nice(1) prints its own nice value */
+  subprocess = g_subprocess_launcher_spawn (launcher, &error, "nice", NULL);
+  g_assert_no_error (error);
+
+  g_subprocess_communicate_utf8 (subprocess, NULL, NULL, &output, NULL,
+                                 &error);
+  g_assert_no_error (error);
+  g_assert_cmpint (atoi (output), ==, MIN (before.nice_value + 10, 19));
+
+  /* The parent is untouched */
+  get_params (&after);
+  g_assert_cmpint (after.nice_value, ==, before.nice_value);
+}
+
+static gboolean
+block_cb (gpointer data)
+{
+  g_usleep (300 * 1000);
+  return G_SOURCE_REMOVE;
+}
+
+static gboolean
+quit_cb (gpointer data)
+{
+  g_main_loop_quit (data);
+  return G_SOURCE_REMOVE;
+}
+
+static void
+test_latency_monitor (void)
+{
+  g_autoptr(GMainLoop) loop = g_main_loop_new (NULL, FALSE);
+  g_autoptr(GisLatencyMonitor) monitor = gis_latency_monitor_new ();
+  GisLatencyStats stats;
+
+  gis_latency_monitor_get_stats (monitor, &stats);
+  g_assert_cmpuint (stats.n_samples, ==, 0);
+  g_assert_cmpint (stats.mean_usec, ==, 0);
+
+  g_idle_add (block_cb, NULL);
+  g_timeout_add (800, quit_cb, loop);
+  g_main_loop_run (loop);
+
+  gis_latency_monitor_get_stats (monitor, &stats);
+  g_assert_cmpuint (stats.n_samples, >, 0);
+  /* The main loop was blocked for 300 ms, from before the first sample was
+   * due 100 ms in; allow some slack for the timeout's own rounding
+   */
+  g_assert_cmpint (stats.max_usec, >=, 150 * 1000);
+  g_assert_cmpint (stats.mean_usec, <=, stats.max_usec);
+  g_assert_cmpuint (stats.n_late, >=, 1);
+  g_assert_cmpuint (stats.n_late, <=, stats.n_samples);
+}
+
+int
+main (int argc, char *argv[])
+{
+  setlocale (LC_ALL, "");
+
+  /* Read once, on first use */
+  g_setenv ("EI_PIN_WORKERS", "1", TRUE);
+
+  g_test_init (&argc, &argv, NULL);
+
+  g_test_add_func ("/sched/restore", test_sched_restore);
+  g_test_add_func ("/sched/pin", test_sched_pin);
+  g_test_add_func ("/sched/launcher", test_sched_launcher);
+  g_test_add_func ("/sched/latency-monitor", test_latency_monitor);
+
+  return g_test_run ();
+}
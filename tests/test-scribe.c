@@ -31,12 +31,16 @@
 #include <gio/gunixinputstream.h>
 #include <gio/gunixoutputstream.h>
 
+#include "crc32.h"
 #include "gis-errors.h"
 #include "gis-scribe.h"
 #include "glnx-missing.h"
 #include "glnx-shutil.h"
+#include "gpt_probe.h"
 
 #include "test-error-input-stream.h"
+#include "test-fake-drive.h"
+#include "test-shaped-input-stream.h"
 
 /* A 4 MiB file of "w"s (0x77) */
 #define IMAGE "w.img"
@@ -45,14 +49,62 @@
 #define ONE_MIB (1024 * 1024)
 #define IMAGE_SIZE_BYTES 4 * ONE_MIB
 
+/* As IMAGE, to 16 MiB, for tests with simulated slow media */
+#define BIG_IMAGE "w-16m.img"
+#define BIG_IMAGE_SIZE_BYTES (16 * ONE_MIB)
+
+/* The most of the image which may have been read but not yet written, with a
+ * slow drive: a buffer each in the tee and write threads, the pipe between
+ * them and the fake drive's pipe, plus some slack for the first MiB, which is
+ * written last.
+ */
+#define MAX_IN_FLIGHT_BYTES (4 * ONE_MIB)
+
+/* Generated by make-gpt-image: 8192 sectors, with the root partition ending
+ * at the last usable LBA.
+ */
+#define GPT_IMAGE "gpt.img"
+#define GPT_IMAGE_SIZE_BYTES (8192 * 512)
+#define GPT_IMAGE_N_PARTITIONS 128
+#define GPT_ESP_START 2048
+#define GPT_ROOT_START 4096
+#define GPT_ROOT_END 8158
+
+/* Generated by make-gpt-image: 8192 sectors, with a gap between the ESP,
+ * which ends at sector 4095, and the root partition, which starts at 6144.
+ */
+#define GPT_GAP_IMAGE "gpt-gap.img"
+#define GPT_GAP_IMAGE_SIZE_BYTES (8192 * 512)
+#define GPT_GAP_START (4096 * 512)
+#define GPT_GAP_END (6144 * 512)
+
 static gchar *keyring_path = NULL;
 
+/* Ranges of the target which differ from the image before it is written with
+ * compare_before_write set: within a block; across the boundary between the
+ * scribe's buffers; and at the very end.
+ */
+static const struct {
+  gsize offset;
+  gsize len;
+} compare_ranges[] = {
+  { ONE_MIB + 3 * 4096 + 17, 1 },
+  { 2 * ONE_MIB - 100, 5000 },
+  { GPT_IMAGE_SIZE_BYTES - 1, 1 },
+};
+
 typedef struct {
   const gchar *image_path;
   const gchar *signature_path;
   const gchar *checksum_path;
+  /* If set, a chunk manifest to verify against rather than the signature
+   * or checksum.
+   */
+  const gchar *manifest_path;
   /* Defaults to IMAGE_SIZE_BYTES */
   gsize uncompressed_size;
+  /* Size of the target file; defaults to uncompressed_size */
+  gsize target_size;
 
   /* Domain and code for the expected error, if any. */
   GQuark error_domain;
@@ -72,6 +124,30 @@ typedef struct {
   guint64 read_error_offset;
 
   const gchar *gpg_path;
+
+  gboolean verify_first;
+
+  /* Passed as GisScribe:memory-budget; 0 means the default */
+  guint64 memory_budget;
+
+  gboolean skip_unused;
+  gboolean convert_to_mbr;
+
+  /* If set, the target starts out holding the image, with a few ranges
+   * overwritten (see compare_ranges), rather than all "D"s
+   */
+  gboolean compare_before_write;
+
+  /* If non-0, give the scribe a pipe holding only the first stall_offset
+   * bytes of the image, which then never delivers any more, so that only
+   * cancelling the write can end it. Must fit in the pipe's buffer.
+   */
+  gsize stall_offset;
+
+  /* If set, the image is read as slowly as from this medium */
+  const TestMedium *source_medium;
+  /* If set, the target is written as slowly as to this medium */
+  const TestMedium *target_medium;
 } TestData;
 
 typedef struct {
@@ -90,12 +166,22 @@ typedef struct {
    */
   gsize uncompressed_size;
   gint memfd;
+  /* Write end of the stalled pipe, if data->stall_offset != 0 */
+  gint stall_fd;
+  /* Set if data->source_medium is */
+  TestShapedInputStream *source;
+  /* Its pipe is passed as GisScribe:drive-fd if data->source_medium or
+   * data->target_medium is set
+   */
+  TestFakeDrive *drive;
 
   GisScribe *scribe;
   GCancellable *cancellable;
 
   guint step;
   gdouble progress;
+  /* How many times progress changed while writing, rather than verifying */
+  guint n_progress_updates;
 
   gboolean finished;
   GError *error;
@@ -139,6 +225,7 @@ test_scribe_notify_progress_cb (GObject    *object,
       g_assert_cmpfloat (0, <=, progress);
       g_assert_cmpfloat (progress, <=, 1);
       g_assert_cmpfloat (fixture->progress, <=, progress);
+      fixture->n_progress_updates++;
     }
 
   fixture->progress = progress;
@@ -207,6 +294,7 @@ fixture_set_up (Fixture *fixture,
   g_autoptr(GInputStream) image_input = NULL;
   GError *error = NULL;
   int fd;
+  int compare_fd = -1;
 
   fixture->uncompressed_size = data->uncompressed_size ?: IMAGE_SIZE_BYTES;
   fixture->data = data;
@@ -236,6 +324,12 @@ fixture_set_up (Fixture *fixture,
   compressed_size = g_file_info_get_size (info);
   g_assert_cmpint (compressed_size, >, 0);
 
+  /* As in the app, what is read from a squashfs image is the uncompressed
+   * disk image within it.
+   */
+  if (g_str_has_suffix (data->image_path, ".squash"))
+    compressed_size = fixture->uncompressed_size;
+
   if (data->read_error.domain != 0)
     {
       g_autoptr(GInputStream) real_input =
@@ -249,6 +343,37 @@ fixture_set_up (Fixture *fixture,
                                                  &data->read_error);
     }
 
+  if (data->source_medium != NULL)
+    {
+      g_autoptr(GInputStream) real_input =
+        G_INPUT_STREAM (g_file_read (fixture->image, NULL, &error));
+
+      g_assert_no_error (error);
+      g_assert_nonnull (real_input);
+
+      image_input = test_shaped_input_stream_new (real_input,
+                                                  data->source_medium);
+      fixture->source = TEST_SHAPED_INPUT_STREAM (g_object_ref (image_input));
+    }
+
+  fixture->stall_fd = -1;
+  if (data->stall_offset != 0)
+    {
+      g_autofree gchar *contents = NULL;
+      gsize length = 0;
+      int pipe_fds[2];
+
+      g_file_get_contents (data->image_path, &contents, &length, &error);
+      g_assert_no_error (error);
+      g_assert_cmpuint (length, >=, data->stall_offset);
+
+      g_assert_cmpint (pipe2 (pipe_fds, O_CLOEXEC), ==, 0);
+      g_assert_cmpint (write (pipe_fds[1], contents, data->stall_offset), ==,
+                       data->stall_offset);
+      image_input = g_unix_input_stream_new (pipe_fds[0], /* close_fd */ TRUE);
+      fixture->stall_fd = pipe_fds[1];
+    }
+
 
   fixture->target_path = g_build_filename (fixture->tmpdir, "target.img", NULL);
   fixture->target = g_file_new_for_path (fixture->target_path);
@@ -259,15 +384,55 @@ fixture_set_up (Fixture *fixture,
     }
   else
     {
-      g_autofree gchar *target_contents = g_malloc (fixture->uncompressed_size);
+      gsize target_size = data->target_size ?: fixture->uncompressed_size;
+      g_autofree gchar *target_contents = NULL;
+
+      if (data->compare_before_write)
+        {
+          gsize length = 0;
+          gsize i;
+
+          g_file_get_contents (data->image_path, &target_contents, &length,
+                               &error);
+          g_assert_no_error (error);
+          g_assert_cmpuint (length, ==, target_size);
+
+          for (i = 0; i < G_N_ELEMENTS (compare_ranges); i++)
+            memset (target_contents + compare_ranges[i].offset, 'D',
+                    compare_ranges[i].len);
+        }
+      else
+        {
+          target_contents = g_malloc (target_size);
+          memset (target_contents, 'D', target_size);
+        }
 
-      memset (target_contents, 'D', fixture->uncompressed_size);
       g_file_set_contents (fixture->target_path, target_contents,
-                           fixture->uncompressed_size, &error);
+                           target_size, &error);
       g_assert_no_error (error);
 
-      fd = open (fixture->target_path, O_WRONLY | O_SYNC | O_CLOEXEC | O_EXCL);
+      fd = open (fixture->target_path, O_WRONLY | O_SYNC | O_CLOEXEC);
       fixture->memfd = -1;
+
+      /* As in the app, the drive is read through a separate fd to compare
+       * the image with it
+       */
+      if (data->compare_before_write)
+        {
+          compare_fd = open (fixture->target_path, O_RDONLY | O_CLOEXEC);
+          g_assert_cmpint (compare_fd, >=, 0);
+        }
+
+      /* The image is written to the drive's pipe, and from there to the
+       * target
+       */
+      if (data->target_medium != NULL || data->source_medium != NULL)
+        {
+          fixture->drive = test_fake_drive_new (fd, data->target_medium,
+                                                fixture->source,
+                                                fixture->uncompressed_size);
+          fd = test_fake_drive_steal_fd (fixture->drive);
+        }
     }
 
   g_assert (fd >= 0);
@@ -281,8 +446,22 @@ fixture_set_up (Fixture *fixture,
                                   "keyring-path", keyring_path,
                                   "drive-path", fixture->target_path,
                                   "drive-fd", fd,
+                                  "convert-to-mbr", data->convert_to_mbr,
                                   data->gpg_path ? "gpg-path" : NULL, data->gpg_path,
                                   NULL);
+  g_object_set (fixture->scribe,
+                "verify-first", data->verify_first,
+                "memory-budget", data->memory_budget,
+                "skip-unused", data->skip_unused,
+                "compare-before-write", data->compare_before_write,
+                "compare-fd", compare_fd,
+                NULL);
+  if (data->manifest_path != NULL)
+    {
+      g_autoptr(GFile) manifest = g_file_new_for_path (data->manifest_path);
+
+      g_object_set (fixture->scribe, "manifest", manifest, NULL);
+    }
   g_signal_connect (fixture->scribe, "notify::step",
                     (GCallback) test_scribe_notify_step_cb, fixture);
   g_signal_connect (fixture->scribe, "notify::progress",
@@ -301,6 +480,8 @@ fixture_tear_down (Fixture *fixture,
   g_cancellable_cancel (fixture->cancellable);
   g_clear_object (&fixture->cancellable);
   g_clear_object (&fixture->scribe);
+  g_clear_object (&fixture->drive);
+  g_clear_object (&fixture->source);
   g_clear_object (&fixture->image);
   g_clear_object (&fixture->signature);
   g_clear_object (&fixture->checksum);
@@ -311,6 +492,9 @@ fixture_tear_down (Fixture *fixture,
   if (fixture->memfd != -1 && 0 != close (fixture->memfd))
     perror ("close (fixture->memfd)");
 
+  if (fixture->stall_fd != -1 && 0 != close (fixture->stall_fd))
+    perror ("close (fixture->stall_fd)");
+
   if (!glnx_shutil_rm_rf_at (AT_FDCWD, fixture->tmpdir, NULL, &error))
     g_warning ("Failed to remove %s: %s", fixture->tmpdir, error->message);
 
@@ -418,12 +602,67 @@ test_error (Fixture       *fixture,
   else
     g_assert_nonnull (error);
 
+  /* Failing to verify the image first is reported like any other failure */
+  if (fixture->data->verify_first)
+    {
+      const gchar *report = gis_scribe_get_report (fixture->scribe);
+
+      g_assert_nonnull (report);
+      g_assert_nonnull (strstr (report, "\nresult: "));
+    }
+
   if (fixture->data->setup_error)
     assert_no_writes (fixture);
   else
     assert_first_mib_zeroed (fixture);
 }
 
+typedef struct {
+  GCancellable *cancellable;
+  gint64 cancelled_time_usec;
+} CancelData;
+
+static gboolean
+test_cancel_timeout_cb (gpointer user_data)
+{
+  CancelData *cancel_data = user_data;
+
+  cancel_data->cancelled_time_usec = g_get_monotonic_time ();
+  g_cancellable_cancel (cancel_data->cancellable);
+  return G_SOURCE_REMOVE;
+}
+
+/* The image never finishes arriving, so the write must be cancelled. This
+ * should stop every thread and subprocess promptly, report cancellation
+ * rather than whatever error that caused along the way, and leave the target
+ * unbootable.
+ */
+static void
+test_cancel (Fixture       *fixture,
+             gconstpointer  user_data)
+{
+  g_autoptr(GAsyncResult) result = NULL;
+  CancelData cancel_data = { fixture->cancellable, 0 };
+  gboolean ret;
+  g_autoptr(GError) error = NULL;
+
+  gis_scribe_write_async (fixture->scribe, fixture->cancellable,
+                          test_scribe_write_cb, &result);
+  g_timeout_add (250, test_cancel_timeout_cb, &cancel_data);
+  while (result == NULL)
+    g_main_context_iteration (NULL, TRUE);
+
+  g_assert_cmpint (cancel_data.cancelled_time_usec, !=, 0);
+  g_assert_cmpint (g_get_monotonic_time () - cancel_data.cancelled_time_usec,
+                   <, G_USEC_PER_SEC);
+
+  ret = gis_scribe_write_finish (fixture->scribe, result, &error);
+  g_assert_error (error, G_IO_ERROR, G_IO_ERROR_CANCELLED);
+  g_assert_false (ret);
+
+  assert_first_mib_zeroed (fixture);
+}
+
 static void
 test_write_success (Fixture       *fixture,
                     gconstpointer  user_data)
@@ -433,6 +672,7 @@ test_write_success (Fixture       *fixture,
   g_autofree gchar *target_contents = NULL;
   gsize target_length = 0;
   g_autofree gchar *expected_contents = g_malloc (fixture->uncompressed_size);
+  const gchar *report;
   GError *error = NULL;
 
   gis_scribe_write_async (fixture->scribe, fixture->cancellable,
@@ -444,6 +684,23 @@ test_write_success (Fixture       *fixture,
   g_assert_no_error (error);
   g_assert_true (ret);
 
+  /* The stages which always run are accounted for */
+  report = gis_scribe_get_report (fixture->scribe);
+  g_assert_nonnull (report);
+  g_assert_nonnull (strstr (report, "\nresult: succeeded after "));
+  g_assert_nonnull (strstr (report, "\nread "));
+  g_assert_nonnull (strstr (report, "\nwrite "));
+
+  /* Verifying first doesn't stop what is written being verified too */
+  if (fixture->data->verify_first)
+    g_assert_nonnull (strstr (report, ", while writing, and before writing\n"));
+
+  /* The scribe has closed the fake drive's pipe, but it may not yet have
+   * caught up
+   */
+  if (fixture->drive != NULL)
+    test_fake_drive_wait (fixture->drive);
+
   ret = g_file_get_contents (fixture->target_path,
                              &target_contents, &target_length,
                              &error);
@@ -455,6 +712,295 @@ test_write_success (Fixture       *fixture,
                    target_contents, target_length);
 }
 
+/* As test_write_success(), with a slow source, drive or both. Beyond the
+ * image being written correctly, the pipeline must keep a slow drive busy
+ * without buffering more and more of the image, and keep the UI told of its
+ * progress.
+ */
+static void
+test_write_shaped (Fixture       *fixture,
+                   gconstpointer  user_data)
+{
+  const TestMedium *target_medium = fixture->data->target_medium;
+  TestFakeDriveStats stats;
+
+  test_write_success (fixture, user_data);
+  test_fake_drive_get_stats (fixture->drive, &stats);
+
+  g_test_message ("at most %" G_GUINT64_FORMAT " bytes in flight; "
+                  "%u writes left the drive waiting for the source",
+                  stats.max_in_flight, stats.n_starved_writes);
+
+  /* The zeroed first MiB is written over at the end */
+  g_assert_cmpuint (stats.bytes_written, ==,
+                    fixture->uncompressed_size + ONE_MIB);
+
+  /* Reading stays only a few buffers ahead of writing */
+  if (fixture->source != NULL)
+    g_assert_cmpuint (stats.max_in_flight, <=, MAX_IN_FLIGHT_BYTES);
+
+  if (target_medium != NULL && target_medium->bytes_per_second != 0)
+    {
+      /* Reading and verifying never keep a slow drive waiting */
+      if (fixture->source != NULL)
+        g_assert_cmpuint (stats.n_starved_writes, ==, 0);
+
+      /* Writing takes long enough that the UI must be told how it's going */
+      g_assert_cmpuint (fixture->n_progress_updates, >=, 1);
+    }
+}
+
+/* The image is written, except for the gap between its partitions, which is
+ * left as it was.
+ */
+static void
+test_write_skip_unused (Fixture       *fixture,
+                        gconstpointer  user_data)
+{
+  g_autoptr(GAsyncResult) result = NULL;
+  gboolean ret;
+  g_autofree gchar *target_contents = NULL;
+  gsize target_length = 0;
+  g_autofree gchar *expected_contents = NULL;
+  gsize expected_length = 0;
+  GError *error = NULL;
+
+  gis_scribe_write_async (fixture->scribe, fixture->cancellable,
+                          test_scribe_write_cb, &result);
+  while (result == NULL)
+    g_main_context_iteration (NULL, TRUE);
+
+  ret = gis_scribe_write_finish (fixture->scribe, result, &error);
+  g_assert_no_error (error);
+  g_assert_true (ret);
+
+  ret = g_file_get_contents (fixture->target_path,
+                             &target_contents, &target_length,
+                             &error);
+  g_assert_no_error (error);
+  g_assert (ret);
+
+  ret = g_file_get_contents (fixture->data->image_path,
+                             &expected_contents, &expected_length,
+                             &error);
+  g_assert_no_error (error);
+  g_assert (ret);
+
+  memset (expected_contents + GPT_GAP_START, 'D',
+          GPT_GAP_END - GPT_GAP_START);
+  g_assert_cmpmem (expected_contents, expected_length,
+                   target_contents, target_length);
+}
+
+/* Only the ranges which differ need writing, but the result must be the same
+ * as writing the whole image.
+ */
+static void
+test_write_compare (Fixture       *fixture,
+                    gconstpointer  user_data)
+{
+  g_autoptr(GAsyncResult) result = NULL;
+  gboolean ret;
+  g_autofree gchar *target_contents = NULL;
+  gsize target_length = 0;
+  g_autofree gchar *expected_contents = NULL;
+  gsize expected_length = 0;
+  GError *error = NULL;
+
+  gis_scribe_write_async (fixture->scribe, fixture->cancellable,
+                          test_scribe_write_cb, &result);
+  while (result == NULL)
+    g_main_context_iteration (NULL, TRUE);
+
+  ret = gis_scribe_write_finish (fixture->scribe, result, &error);
+  g_assert_no_error (error);
+  g_assert_true (ret);
+
+  ret = g_file_get_contents (fixture->target_path,
+                             &target_contents, &target_length,
+                             &error);
+  g_assert_no_error (error);
+  g_assert (ret);
+
+  ret = g_file_get_contents (fixture->data->image_path,
+                             &expected_contents, &expected_length,
+                             &error);
+  g_assert_no_error (error);
+  g_assert (ret);
+
+  g_assert_cmpmem (expected_contents, expected_length,
+                   target_contents, target_length);
+}
+
+/* Writing a GPT image to a larger target should move its backup GPT to the
+ * end of the target, erase the image's own backup GPT header, and leave the
+ * rest of the image as it was.
+ */
+static void
+test_write_relocate (Fixture       *fixture,
+                     gconstpointer  user_data)
+{
+  const gsize target_size = fixture->data->target_size;
+  const guint64 backup_lba = target_size / 512 - 1;
+  const gsize old_backup_offset = GPT_IMAGE_SIZE_BYTES - 512;
+  g_autoptr(GAsyncResult) result = NULL;
+  gboolean ret;
+  g_autofree gchar *target_contents = NULL;
+  gsize target_length = 0;
+  g_autofree gchar *image_contents = NULL;
+  gsize image_length = 0;
+  g_autoptr(GInputStream) input = NULL;
+  g_auto(GptTable) table = { 0 };
+  gsize ptable_size;
+  gsize ptable_end;
+  struct gpt_header backup_header;
+  guint32 backup_crc;
+  g_autofree gchar *zeroes = g_malloc0 (512);
+  GError *error = NULL;
+
+  gis_scribe_write_async (fixture->scribe, fixture->cancellable,
+                          test_scribe_write_cb, &result);
+  while (result == NULL)
+    g_main_context_iteration (NULL, TRUE);
+
+  ret = gis_scribe_write_finish (fixture->scribe, result, &error);
+  g_assert_no_error (error);
+  g_assert_true (ret);
+
+  ret = g_file_get_contents (fixture->target_path,
+                             &target_contents, &target_length,
+                             &error);
+  g_assert_no_error (error);
+  g_assert (ret);
+  g_assert_cmpuint (target_length, ==, target_size);
+
+  ret = g_file_get_contents (fixture->data->image_path,
+                             &image_contents, &image_length,
+                             &error);
+  g_assert_no_error (error);
+  g_assert (ret);
+
+  /* The primary GPT is valid, and points at the end of the target */
+  input = g_memory_input_stream_new_from_data (target_contents, target_length,
+                                               NULL);
+  ret = gpt_probe_stream (input, GPT_PROBE_COMPRESSION_NONE, &table, NULL,
+                          &error);
+  g_assert_no_error (error);
+  g_assert_true (ret);
+  g_assert_true (is_eos_gpt_table_valid (&table, NULL));
+
+  ptable_size = gpt_table_get_ptable_size (&table);
+  g_assert_cmpuint (table.pt.header.backup_lba, ==, backup_lba);
+  g_assert_cmpuint (table.pt.header.last_usable_lba, ==,
+                    backup_lba - ptable_size / 512 - 1);
+
+  /* The backup GPT at the end of the target matches it */
+  memcpy (&backup_header, target_contents + backup_lba * 512,
+          sizeof backup_header);
+  g_assert_cmpmem (backup_header.signature, 8, "EFI PART", 8);
+  g_assert_cmpuint (backup_header.current_lba, ==, backup_lba);
+  g_assert_cmpuint (backup_header.backup_lba, ==, 1);
+  g_assert_cmpuint (backup_header.ptable_starting_lba, ==,
+                    backup_lba - ptable_size / 512);
+  g_assert_cmpmem (target_contents + backup_header.ptable_starting_lba * 512,
+                   ptable_size,
+                   table.partitions, ptable_size);
+
+  backup_crc = backup_header.crc;
+  backup_header.crc = 0;
+  g_assert_cmpuint (calc_crc32 (&backup_header, GPT_HEADER_SIZE), ==,
+                    backup_crc);
+
+  /* The image's backup GPT header is gone */
+  g_assert_cmpuint (image_length, ==, old_backup_offset + 512);
+  g_assert_cmpmem (target_contents + old_backup_offset, 512, zeroes, 512);
+
+  /* Everything else after the primary partition table is written verbatim */
+  ptable_end = 2 * 512 + ptable_size;
+  g_assert_cmpmem (target_contents + ptable_end, old_backup_offset - ptable_end,
+                   image_contents + ptable_end, old_backup_offset - ptable_end);
+}
+
+/* Converting to MBR should replace the GPT with an MBR describing the ESP and
+ * the root partition, and erase the backup GPT header.
+ */
+static void
+test_write_mbr (Fixture       *fixture,
+                gconstpointer  user_data)
+{
+  g_autoptr(GAsyncResult) result = NULL;
+  gboolean ret;
+  g_autofree gchar *target_contents = NULL;
+  gsize target_length = 0;
+  g_autofree gchar *image_contents = NULL;
+  gsize image_length = 0;
+  g_autofree gchar *zeroes = NULL;
+  const guint8 *entry;
+  guint32 first_lba;
+  guint32 n_sectors;
+  const gsize ptable_end = 2 * 512 + GPT_IMAGE_N_PARTITIONS * 128;
+  const gsize backup_offset = GPT_IMAGE_SIZE_BYTES - 512;
+  GError *error = NULL;
+
+  gis_scribe_write_async (fixture->scribe, fixture->cancellable,
+                          test_scribe_write_cb, &result);
+  while (result == NULL)
+    g_main_context_iteration (NULL, TRUE);
+
+  ret = gis_scribe_write_finish (fixture->scribe, result, &error);
+  g_assert_no_error (error);
+  g_assert_true (ret);
+
+  ret = g_file_get_contents (fixture->target_path,
+                             &target_contents, &target_length,
+                             &error);
+  g_assert_no_error (error);
+  g_assert (ret);
+
+  ret = g_file_get_contents (fixture->data->image_path,
+                             &image_contents, &image_length,
+                             &error);
+  g_assert_no_error (error);
+  g_assert (ret);
+  g_assert_cmpuint (target_length, ==, image_length);
+
+  /* Boot code and signature are kept */
+  g_assert_cmpmem (target_contents, 440, image_contents, 440);
+  g_assert_cmpuint ((guint8) target_contents[510], ==, 0x55);
+  g_assert_cmpuint ((guint8) target_contents[511], ==, 0xaa);
+
+  /* ESP */
+  entry = (const guint8 *) target_contents + 446;
+  memcpy (&first_lba, entry + 8, 4);
+  memcpy (&n_sectors, entry + 12, 4);
+  g_assert_cmpuint (entry[0], ==, 0);
+  g_assert_cmpuint (entry[4], ==, 0xef);
+  g_assert_cmpuint (first_lba, ==, GPT_ESP_START);
+  g_assert_cmpuint (n_sectors, ==, GPT_ROOT_START - GPT_ESP_START);
+
+  /* Root partition, which is bootable, and to be grown on first boot */
+  entry += 16;
+  memcpy (&first_lba, entry + 8, 4);
+  memcpy (&n_sectors, entry + 12, 4);
+  g_assert_cmpuint (entry[0], ==, 0x80);
+  g_assert_cmpuint (entry[4], ==, 0xdd);
+  g_assert_cmpuint (first_lba, ==, GPT_ROOT_START);
+  g_assert_cmpuint (n_sectors, ==, GPT_ROOT_END + 1 - GPT_ROOT_START);
+
+  /* No others */
+  zeroes = g_malloc0 (ptable_end);
+  g_assert_cmpmem (target_contents + 446 + 32, 32, zeroes, 32);
+
+  /* Both GPT headers, and the primary partition table, are gone */
+  g_assert_cmpmem (target_contents + 512, ptable_end - 512,
+                   zeroes, ptable_end - 512);
+  g_assert_cmpmem (target_contents + backup_offset, 512, zeroes, 512);
+
+  /* Everything else is as it was */
+  g_assert_cmpmem (target_contents + ptable_end, backup_offset - ptable_end,
+                   image_contents + ptable_end, backup_offset - ptable_end);
+}
+
 static gchar *
 test_build_filename (GTestFileType file_type,
                      const gchar  *basename)
@@ -495,6 +1041,16 @@ main (int argc, char *argv[])
   g_autofree gchar *s8193_gz_sig_path  = test_build_filename (G_TEST_BUILT, "w-8193.img.gz.asc");
   g_autofree gchar *s8193_xz_path      = test_build_filename (G_TEST_BUILT, "w-8193.img.xz");
   g_autofree gchar *s8193_xz_sig_path  = test_build_filename (G_TEST_BUILT, "w-8193.img.xz.asc");
+  g_autofree gchar *s8193_chunks_path  = test_build_filename (G_TEST_BUILT, "w-8193.img.chunks");
+  g_autofree gchar *squashfs_path      = test_build_filename (G_TEST_BUILT, "endless.squash");
+  g_autofree gchar *big_path           = test_build_filename (G_TEST_BUILT, BIG_IMAGE);
+  g_autofree gchar *big_csum_path      = test_build_filename (G_TEST_BUILT, BIG_IMAGE ".sha256");
+  g_autofree gchar *big_gz_path        = test_build_filename (G_TEST_BUILT, BIG_IMAGE ".gz");
+  g_autofree gchar *big_gz_sig_path    = test_build_filename (G_TEST_BUILT, BIG_IMAGE ".gz.asc");
+  g_autofree gchar *gpt_path           = test_build_filename (G_TEST_BUILT, GPT_IMAGE);
+  g_autofree gchar *gpt_sig_path       = test_build_filename (G_TEST_BUILT, GPT_IMAGE ".asc");
+  g_autofree gchar *gpt_gap_path       = test_build_filename (G_TEST_BUILT, GPT_GAP_IMAGE);
+  g_autofree gchar *gpt_gap_sig_path   = test_build_filename (G_TEST_BUILT, GPT_GAP_IMAGE ".asc");
   g_autofree gchar *wjt_sig_path       = test_build_filename (G_TEST_DIST, "wjt.asc");
   g_autofree gchar *bad_csum_path      = test_build_filename (G_TEST_DIST, "bad.sha256");
   g_autofree gchar *invalid1_csum_path = test_build_filename (G_TEST_DIST, "invalid-1.sha256");
@@ -775,6 +1331,37 @@ main (int argc, char *argv[])
               test_write_success,
               fixture_tear_down);
 
+  /* As above, but read out of a squashfs image, whose signature covers the
+   * disk image within it.
+   */
+  TestData s8193_squashfs = {
+      .image_path = squashfs_path,
+      .signature_path = s8193_sig_path,
+      .checksum_path = missing_path,
+      .uncompressed_size = 8193 * 512,
+  };
+  g_test_add ("/scribe/8193-sector-squashfs", Fixture,
+              &s8193_squashfs,
+              fixture_set_up,
+              test_write_success,
+              fixture_tear_down);
+
+  /* As above, but with the smallest memory budget, so the pipes are not
+   * enlarged and the stages compete for buffers.
+   */
+  TestData s8193_xz_low_memory = {
+      .image_path = s8193_xz_path,
+      .signature_path = s8193_xz_sig_path,
+      .checksum_path = missing_path,
+      .uncompressed_size = 8193 * 512,
+      .memory_budget = 1,
+  };
+  g_test_add ("/scribe/8193-sector-xz-low-memory", Fixture,
+              &s8193_xz_low_memory,
+              fixture_set_up,
+              test_write_success,
+              fixture_tear_down);
+
   /* IMAGE_SIZE_BYTES / 2 is a multiple of the 1 MiB block size used by
    * GisScribe so it is likely that it will not hit a short write, but two full
    * writes followed by an error.
@@ -904,6 +1491,97 @@ main (int argc, char *argv[])
               test_error,
               fixture_tear_down);
 
+  /* Only the parts of the image which are in use are written */
+  TestData skip_unused = {
+      .image_path = gpt_gap_path,
+      .signature_path = gpt_gap_sig_path,
+      .checksum_path = missing_path,
+      .uncompressed_size = GPT_GAP_IMAGE_SIZE_BYTES,
+      .skip_unused = TRUE,
+  };
+  g_test_add ("/scribe/skip-unused", Fixture, &skip_unused,
+              fixture_set_up,
+              test_write_skip_unused,
+              fixture_tear_down);
+
+  /* Written over an almost-identical copy of itself */
+  TestData compare_before_write = {
+      .image_path = gpt_path,
+      .signature_path = gpt_sig_path,
+      .checksum_path = missing_path,
+      .uncompressed_size = GPT_IMAGE_SIZE_BYTES,
+      .compare_before_write = TRUE,
+  };
+  g_test_add ("/scribe/compare-before-write", Fixture, &compare_before_write,
+              fixture_set_up,
+              test_write_compare,
+              fixture_tear_down);
+
+  /* Written to a target twice the size of the image */
+  TestData relocate_gpt = {
+      .image_path = gpt_path,
+      .signature_path = gpt_sig_path,
+      .checksum_path = missing_path,
+      .uncompressed_size = GPT_IMAGE_SIZE_BYTES,
+      .target_size = 2 * GPT_IMAGE_SIZE_BYTES,
+  };
+  g_test_add ("/scribe/relocate-gpt", Fixture, &relocate_gpt,
+              fixture_set_up,
+              test_write_relocate,
+              fixture_tear_down);
+
+  /* Converted to MBR as it is written */
+  TestData convert_to_mbr = {
+      .image_path = gpt_path,
+      .signature_path = gpt_sig_path,
+      .checksum_path = missing_path,
+      .uncompressed_size = GPT_IMAGE_SIZE_BYTES,
+      .convert_to_mbr = TRUE,
+  };
+  g_test_add ("/scribe/convert-to-mbr/gpt", Fixture, &convert_to_mbr,
+              fixture_set_up,
+              test_write_mbr,
+              fixture_tear_down);
+
+  /* An image without a GPT can't be converted */
+  TestData convert_to_mbr_not_gpt = {
+      .image_path = image_path,
+      .signature_path = image_sig_path,
+      .checksum_path = missing_path,
+      .convert_to_mbr = TRUE,
+      .error_domain = GIS_IMAGE_ERROR,
+      .error_code = GIS_IMAGE_ERROR_NOT_SUPPORTED,
+  };
+  g_test_add ("/scribe/convert-to-mbr/not-gpt", Fixture,
+              &convert_to_mbr_not_gpt,
+              fixture_set_up,
+              test_error,
+              fixture_tear_down);
+
+  /* Cancelled while gpg and the write thread wait for more of the image */
+  TestData cancel_img = {
+      .image_path = image_path,
+      .signature_path = image_sig_path,
+      .checksum_path = missing_path,
+      .stall_offset = 16 * 1024,
+  };
+  g_test_add ("/scribe/cancel/img", Fixture, &cancel_img,
+              fixture_set_up,
+              test_cancel,
+              fixture_tear_down);
+
+  /* As above, but the decompressor must be stopped too */
+  TestData cancel_xz = {
+      .image_path = image_xz_path,
+      .signature_path = image_xz_sig_path,
+      .checksum_path = missing_path,
+      .stall_offset = 256,
+  };
+  g_test_add ("/scribe/cancel/xz", Fixture, &cancel_xz,
+              fixture_set_up,
+              test_cancel,
+              fixture_tear_down);
+
   /* Missing verification files */
   TestData missing_verification = {
       .image_path = image_path,
@@ -935,6 +1613,149 @@ main (int argc, char *argv[])
               test_error,
               fixture_tear_down);
 
+  /* Valid signed manifest for an image which is not a multiple of the chunk
+   * size; neither the signature nor the checksum is needed.
+   */
+  TestData manifest_good = {
+      .image_path = s8193_path,
+      .signature_path = missing_path,
+      .checksum_path = missing_path,
+      .manifest_path = s8193_chunks_path,
+      .uncompressed_size = 8193 * 512,
+  };
+  g_test_add ("/scribe/manifest/good", Fixture, &manifest_good,
+              fixture_set_up,
+              test_write_success,
+              fixture_tear_down);
+
+  /* Valid signed manifest, but for a slightly larger image: every chunk but
+   * the last matches, so this checks the last chunk is not forgotten.
+   */
+  TestData manifest_mismatch = {
+      .image_path = image_path,
+      .signature_path = missing_path,
+      .checksum_path = missing_path,
+      .manifest_path = s8193_chunks_path,
+      .error_domain = GIS_IMAGE_ERROR,
+      .error_code = GIS_IMAGE_ERROR_VERIFICATION_FAILED,
+  };
+  g_test_add ("/scribe/manifest/mismatch", Fixture, &manifest_mismatch,
+              fixture_set_up,
+              test_error,
+              fixture_tear_down);
+
+  /* Read from a USB 2.0 stick, while verifying its checksum */
+  TestData shaped_usb2_source = {
+      .image_path = big_path,
+      .signature_path = missing_path,
+      .checksum_path = big_csum_path,
+      .uncompressed_size = BIG_IMAGE_SIZE_BYTES,
+      .source_medium = &test_medium_usb2,
+  };
+  g_test_add ("/scribe/shaped/usb2-source", Fixture, &shaped_usb2_source,
+              fixture_set_up,
+              test_write_shaped,
+              fixture_tear_down);
+
+  /* Read from a DVD, which seeks before every read */
+  TestData shaped_optical_source = {
+      .image_path = big_path,
+      .signature_path = missing_path,
+      .checksum_path = big_csum_path,
+      .uncompressed_size = BIG_IMAGE_SIZE_BYTES,
+      .source_medium = &test_medium_optical,
+  };
+  g_test_add ("/scribe/shaped/optical-source", Fixture, &shaped_optical_source,
+              fixture_set_up,
+              test_write_shaped,
+              fixture_tear_down);
+
+  /* Read from a local disk faster than it can be written to an SD card */
+  TestData shaped_sd_target = {
+      .image_path = big_path,
+      .signature_path = missing_path,
+      .checksum_path = big_csum_path,
+      .uncompressed_size = BIG_IMAGE_SIZE_BYTES,
+      .source_medium = &test_medium_local,
+      .target_medium = &test_medium_sd,
+  };
+  g_test_add ("/scribe/shaped/sd-target", Fixture, &shaped_sd_target,
+              fixture_set_up,
+              test_write_shaped,
+              fixture_tear_down);
+
+  /* As above, decompressing and checking the signature as it goes */
+  TestData shaped_sd_target_gz = {
+      .image_path = big_gz_path,
+      .signature_path = big_gz_sig_path,
+      .checksum_path = missing_path,
+      .uncompressed_size = BIG_IMAGE_SIZE_BYTES,
+      .target_medium = &test_medium_sd,
+  };
+  g_test_add ("/scribe/shaped/sd-target-gz", Fixture, &shaped_sd_target_gz,
+              fixture_set_up,
+              test_write_shaped,
+              fixture_tear_down);
+
+  /* Verifying before writing. A successful verification is remembered for
+   * the rest of the process, so these come last to avoid later tests skipping
+   * verification.
+   */
+  TestData verify_first_bad_checksum = {
+      .image_path = image_path,
+      .signature_path = missing_path,
+      .checksum_path = bad_csum_path,
+      .verify_first = TRUE,
+      .error_domain = GIS_IMAGE_ERROR,
+      .error_code = GIS_IMAGE_ERROR_VERIFICATION_FAILED,
+      /* The target must be left untouched */
+      .setup_error = TRUE,
+  };
+  g_test_add ("/scribe/verify-first/bad-checksum",
+              Fixture, &verify_first_bad_checksum,
+              fixture_set_up,
+              test_error,
+              fixture_tear_down);
+
+  TestData verify_first_bad_signature = {
+      .image_path = image_path,
+      .signature_path = image_gz_sig_path,
+      .checksum_path = missing_path,
+      .verify_first = TRUE,
+      .error_domain = GIS_IMAGE_ERROR,
+      .error_code = GIS_IMAGE_ERROR_VERIFICATION_FAILED,
+      .setup_error = TRUE,
+  };
+  g_test_add ("/scribe/verify-first/bad-signature",
+              Fixture, &verify_first_bad_signature,
+              fixture_set_up,
+              test_error,
+              fixture_tear_down);
+
+  TestData verify_first_good_signature = {
+      .image_path = image_xz_path,
+      .signature_path = image_xz_sig_path,
+      .checksum_path = missing_path,
+      .verify_first = TRUE,
+  };
+  g_test_add ("/scribe/verify-first/good-signature-xz",
+              Fixture, &verify_first_good_signature,
+              fixture_set_up,
+              test_write_success,
+              fixture_tear_down);
+
+  TestData verify_first_good_checksum = {
+      .image_path = image_gz_path,
+      .signature_path = missing_path,
+      .checksum_path = image_gz_csum_path,
+      .verify_first = TRUE,
+  };
+  g_test_add ("/scribe/verify-first/good-checksum-gz",
+              Fixture, &verify_first_good_checksum,
+              fixture_set_up,
+              test_write_success,
+              fixture_tear_down);
+
   int ret = g_test_run ();
 
   g_free (keyring_path);
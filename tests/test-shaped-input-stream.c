@@ -0,0 +1,269 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*- */
+/*
+ * Copyright © 2018 Endless Mobile, Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "test-shaped-input-stream.h"
+
+#define MIB (1024 * 1024)
+
+/* A local disk, much faster than any drive being written to */
+const TestMedium test_medium_local = {
+  .name = "local",
+};
+
+/* Most USB 2.0 sticks read at well under half of the bus's 480 Mbit/s */
+const TestMedium test_medium_usb2 = {
+  .name = "USB 2.0",
+  .bytes_per_second = 20 * MIB,
+};
+
+/* A DVD drive at 12x, seeking for every read because the tee thread and the
+ * rest of the live system take turns with it
+ */
+const TestMedium test_medium_optical = {
+  .name = "optical",
+  .bytes_per_second = 16 * MIB,
+  .latency_usec = 20 * G_TIME_SPAN_MILLISECOND,
+};
+
+/* A cheap SD card writes quickly until its cache fills */
+const TestMedium test_medium_sd = {
+  .name = "SD",
+  .bytes_per_second = 40 * MIB,
+  .cliff_offset = 4 * MIB,
+  .cliff_bytes_per_second = 6 * MIB,
+};
+
+static gint64
+transfer_usec (guint64 bytes,
+               guint64 bytes_per_second)
+{
+  if (bytes_per_second == 0)
+    return 0;
+
+  return bytes * G_USEC_PER_SEC / bytes_per_second;
+}
+
+/**
+ * test_medium_get_delay:
+ * @medium: a #TestMedium
+ * @offset: how much has been transferred so far
+ * @count: how much is being transferred now
+ *
+ * Returns: how long @medium takes to transfer @count bytes after @offset
+ */
+gint64
+test_medium_get_delay (const TestMedium *medium,
+                       guint64           offset,
+                       gsize             count)
+{
+  guint64 fast = count;
+  guint64 slow = 0;
+
+  if (medium->cliff_offset != 0)
+    {
+      fast = offset < medium->cliff_offset
+        ? MIN (count, medium->cliff_offset - offset)
+        : 0;
+      slow = count - fast;
+    }
+
+  return medium->latency_usec +
+    transfer_usec (fast, medium->bytes_per_second) +
+    transfer_usec (slow, medium->cliff_bytes_per_second);
+}
+
+typedef struct _TestShapedInputStream {
+  GInputStream parent;
+
+  GInputStream *child;
+  const TestMedium *medium;
+
+  /* Read by other threads, to see how far ahead of them the reader is */
+  GMutex mutex;
+  guint64 pos;
+} TestShapedInputStream;
+
+typedef enum {
+  PROP_CHILD = 1,
+  PROP_MEDIUM,
+
+  N_PROPERTIES
+} TestShapedInputStreamPropertyId;
+
+static GParamSpec *props[N_PROPERTIES] = { 0 };
+
+G_DEFINE_TYPE (TestShapedInputStream, test_shaped_input_stream, G_TYPE_INPUT_STREAM);
+
+static void
+test_shaped_input_stream_init (TestShapedInputStream *self)
+{
+  g_mutex_init (&self->mutex);
+}
+
+static void
+test_shaped_input_stream_constructed (GObject *object)
+{
+  TestShapedInputStream *self = TEST_SHAPED_INPUT_STREAM (object);
+
+  G_OBJECT_CLASS (test_shaped_input_stream_parent_class)->constructed (object);
+
+  g_assert (self->child != NULL);
+  g_assert (self->medium != NULL);
+}
+
+static void
+test_shaped_input_stream_set_property (GObject      *object,
+                                       guint         property_id,
+                                       const GValue *value,
+                                       GParamSpec   *pspec)
+{
+  TestShapedInputStream *self = TEST_SHAPED_INPUT_STREAM (object);
+
+  switch ((TestShapedInputStreamPropertyId) property_id)
+    {
+    case PROP_CHILD:
+      g_clear_object (&self->child);
+      self->child = G_INPUT_STREAM (g_value_dup_object (value));
+      break;
+
+    case PROP_MEDIUM:
+      self->medium = g_value_get_pointer (value);
+      break;
+
+    case N_PROPERTIES:
+    default:
+      G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
+      break;
+    }
+}
+
+static void
+test_shaped_input_stream_dispose (GObject *object)
+{
+  TestShapedInputStream *self = TEST_SHAPED_INPUT_STREAM (object);
+
+  g_clear_object (&self->child);
+
+  G_OBJECT_CLASS (test_shaped_input_stream_parent_class)->dispose (object);
+}
+
+static void
+test_shaped_input_stream_finalize (GObject *object)
+{
+  TestShapedInputStream *self = TEST_SHAPED_INPUT_STREAM (object);
+
+  g_mutex_clear (&self->mutex);
+
+  G_OBJECT_CLASS (test_shaped_input_stream_parent_class)->finalize (object);
+}
+
+static gssize
+test_shaped_input_stream_read (GInputStream        *stream,
+                               void                *buffer,
+                               gsize                count,
+                               GCancellable        *cancellable,
+                               GError             **error)
+{
+  TestShapedInputStream *self = TEST_SHAPED_INPUT_STREAM (stream);
+  gssize bytes_read;
+  gint64 delay_usec;
+
+  bytes_read = g_input_stream_read (self->child, buffer, count, cancellable,
+                                    error);
+  if (bytes_read <= 0)
+    return bytes_read;
+
+  /* The data only counts as read once the medium would have delivered it */
+  delay_usec = test_medium_get_delay (self->medium, self->pos, bytes_read);
+  g_usleep (delay_usec);
+
+  g_mutex_lock (&self->mutex);
+  self->pos += bytes_read;
+  g_mutex_unlock (&self->mutex);
+
+  return bytes_read;
+}
+
+static gboolean
+test_shaped_input_stream_close (GInputStream        *stream,
+                                GCancellable        *cancellable,
+                                GError             **error)
+{
+  TestShapedInputStream *self = TEST_SHAPED_INPUT_STREAM (stream);
+
+  return g_input_stream_close (self->child, cancellable, error);
+}
+
+static void
+test_shaped_input_stream_class_init (TestShapedInputStreamClass *klass)
+{
+  GObjectClass *object_class = G_OBJECT_CLASS (klass);
+  GInputStreamClass *istream_class = G_INPUT_STREAM_CLASS (klass);
+
+  object_class->set_property = test_shaped_input_stream_set_property;
+  object_class->constructed = test_shaped_input_stream_constructed;
+  object_class->dispose = test_shaped_input_stream_dispose;
+  object_class->finalize = test_shaped_input_stream_finalize;
+
+  istream_class->read_fn = test_shaped_input_stream_read;
+  /* Allow parent class to emulate skip. We don't use it anyway. */
+  istream_class->close_fn = test_shaped_input_stream_close;
+
+  props[PROP_CHILD] = g_param_spec_object (
+      "child",
+      "Child",
+      "Child stream to read from, as slowly as :medium would.",
+      G_TYPE_INPUT_STREAM,
+      G_PARAM_WRITABLE | G_PARAM_CONSTRUCT_ONLY | G_PARAM_STATIC_STRINGS);
+
+  props[PROP_MEDIUM] = g_param_spec_pointer (
+      "medium",
+      "Medium",
+      "TestMedium to simulate.",
+      G_PARAM_WRITABLE | G_PARAM_CONSTRUCT_ONLY | G_PARAM_STATIC_STRINGS);
+
+  g_object_class_install_properties (object_class, N_PROPERTIES, props);
+}
+
+GInputStream *
+test_shaped_input_stream_new (GInputStream     *child,
+                              const TestMedium *medium)
+{
+  return g_object_new (TEST_TYPE_SHAPED_INPUT_STREAM,
+                       "child", child,
+                       "medium", medium,
+                       NULL);
+}
+
+/**
+ * test_shaped_input_stream_get_bytes_read:
+ *
+ * Returns: how much has been read from @self so far. May be called from any
+ *  thread.
+ */
+guint64
+test_shaped_input_stream_get_bytes_read (TestShapedInputStream *self)
+{
+  guint64 pos;
+
+  g_mutex_lock (&self->mutex);
+  pos = self->pos;
+  g_mutex_unlock (&self->mutex);
+
+  return pos;
+}
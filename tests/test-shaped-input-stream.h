@@ -0,0 +1,64 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*- */
+/*
+ * Copyright © 2018 Endless Mobile, Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <gio/gio.h>
+
+G_BEGIN_DECLS
+
+/**
+ * TestMedium:
+ * @name: for messages
+ * @bytes_per_second: sustained transfer rate, or 0 for no limit
+ * @latency_usec: added to every transfer, such as an optical drive's seek
+ * @cliff_offset: once this many bytes have been transferred, the rate drops
+ *  to @cliff_bytes_per_second, as for an SD card whose fast cache has filled;
+ *  or 0 if it never does
+ * @cliff_bytes_per_second: the rate beyond @cliff_offset
+ *
+ * How quickly a simulated medium transfers data. The rates are those of real
+ * media, but no more of the medium is simulated than the test images need.
+ */
+typedef struct {
+  const gchar *name;
+  guint64 bytes_per_second;
+  gint64 latency_usec;
+  guint64 cliff_offset;
+  guint64 cliff_bytes_per_second;
+} TestMedium;
+
+extern const TestMedium test_medium_local;
+extern const TestMedium test_medium_usb2;
+extern const TestMedium test_medium_optical;
+extern const TestMedium test_medium_sd;
+
+gint64 test_medium_get_delay (const TestMedium *medium,
+                              guint64           offset,
+                              gsize             count);
+
+#define TEST_TYPE_SHAPED_INPUT_STREAM (test_shaped_input_stream_get_type ())
+G_DECLARE_FINAL_TYPE (TestShapedInputStream, test_shaped_input_stream,
+                      TEST, SHAPED_INPUT_STREAM, GInputStream);
+
+GInputStream *test_shaped_input_stream_new (GInputStream     *child,
+                                            const TestMedium *medium);
+
+guint64 test_shaped_input_stream_get_bytes_read (TestShapedInputStream *self);
+
+G_END_DECLS
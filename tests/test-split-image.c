@@ -0,0 +1,232 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*- */
+/*
+ * Copyright © 2018 Endless Mobile, Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+#include "config.h"
+#include <locale.h>
+
+#include <glib.h>
+#include <glib/gstdio.h>
+#include <gio/gio.h>
+
+#include "gis-errors.h"
+#include "gis-split-image.h"
+
+#define PREFIX "eos-eos3.4-amd64-amd64.180801-123456.base"
+
+typedef struct {
+  gchar *tmpdir;
+} Fixture;
+
+static void
+fixture_set_up (Fixture       *fixture,
+                gconstpointer  user_data)
+{
+  g_autoptr(GError) error = NULL;
+
+  fixture->tmpdir = g_dir_make_tmp ("eos-installer-split.XXXXXX", &error);
+  g_assert_no_error (error);
+}
+
+static void
+fixture_tear_down (Fixture       *fixture,
+                   gconstpointer  user_data)
+{
+  g_autoptr(GDir) dir = g_dir_open (fixture->tmpdir, 0, NULL);
+  const gchar *name;
+
+  while ((name = g_dir_read_name (dir)) != NULL)
+    {
+      g_autofree gchar *path = g_build_filename (fixture->tmpdir, name, NULL);
+
+      g_assert_cmpint (g_unlink (path), ==, 0);
+    }
+
+  g_assert_cmpint (g_rmdir (fixture->tmpdir), ==, 0);
+  g_free (fixture->tmpdir);
+}
+
+/* Creates each of the NULL-terminated basenames in the fixture's directory,
+ * and returns the path to the first.
+ */
+static gchar *
+fixture_touch (Fixture     *fixture,
+               const gchar *basename,
+               ...)
+{
+  gchar *first = g_build_filename (fixture->tmpdir, basename, NULL);
+  va_list ap;
+
+  va_start (ap, basename);
+  for (; basename != NULL; basename = va_arg (ap, const gchar *))
+    {
+      g_autofree gchar *path = g_build_filename (fixture->tmpdir, basename,
+                                                 NULL);
+      g_autoptr(GError) error = NULL;
+
+      g_file_set_contents (path, "", 0, &error);
+      g_assert_no_error (error);
+    }
+  va_end (ap);
+
+  return first;
+}
+
+static void
+test_get_disk (void)
+{
+  g_assert_cmpuint (gis_split_image_get_disk ("/a/" PREFIX ".img.xz"), ==, 0);
+  g_assert_cmpuint (gis_split_image_get_disk ("/a/" PREFIX ".img.asc"), ==, 0);
+  g_assert_cmpuint (gis_split_image_get_disk ("/a/" PREFIX ".disk1.img"), ==, 1);
+  g_assert_cmpuint (gis_split_image_get_disk ("/a/" PREFIX ".disk1.img.gz"), ==, 1);
+  g_assert_cmpuint (gis_split_image_get_disk ("/a/" PREFIX ".disk2.img.xz"), ==, 2);
+  /* Signatures and checksums of split images are not images themselves */
+  g_assert_cmpuint (gis_split_image_get_disk ("/a/" PREFIX ".disk1.img.xz.asc"), ==, 0);
+  g_assert_cmpuint (gis_split_image_get_disk ("/a/" PREFIX ".disk2.img.sha256"), ==, 0);
+}
+
+/* Each disk has a signature or a checksum */
+static void
+test_find_disks (Fixture       *fixture,
+                 gconstpointer  user_data)
+{
+  g_autofree gchar *path = fixture_touch (fixture,
+                                          PREFIX ".disk1.img.xz",
+                                          PREFIX ".disk1.img.xz.asc",
+                                          PREFIX ".disk2.img.xz",
+                                          PREFIX ".disk2.img.xz.sha256",
+                                          PREFIX ".disk3.img.xz",
+                                          PREFIX ".disk3.img.xz.asc",
+                                          /* Not part of the set */
+                                          PREFIX ".disk1.img.gz",
+                                          PREFIX ".img.xz",
+                                          NULL);
+  g_autoptr(GPtrArray) disks = NULL;
+  g_autoptr(GError) error = NULL;
+  guint i;
+
+  disks = gis_split_image_find_disks (path, &error);
+  g_assert_no_error (error);
+  g_assert_nonnull (disks);
+  g_assert_cmpuint (disks->len, ==, 3);
+
+  for (i = 0; i < disks->len; i++)
+    {
+      GisSplitDisk *disk = g_ptr_array_index (disks, i);
+      g_autofree gchar *basename = g_strdup_printf (PREFIX ".disk%u.img.xz",
+                                                    i + 1);
+      g_autofree gchar *expected = g_build_filename (fixture->tmpdir, basename,
+                                                     NULL);
+      g_autofree gchar *signature = g_strconcat (expected, ".asc", NULL);
+      g_autofree gchar *checksum = g_strconcat (expected, ".sha256", NULL);
+
+      g_assert_cmpstr (disk->image, ==, expected);
+      g_assert_cmpstr (disk->signature, ==, signature);
+      g_assert_cmpstr (disk->checksum, ==, checksum);
+      g_assert_null (disk->target);
+    }
+}
+
+static void
+test_find_disks_not_first (Fixture       *fixture,
+                           gconstpointer  user_data)
+{
+  g_autofree gchar *path = fixture_touch (fixture,
+                                          PREFIX ".disk2.img.xz",
+                                          PREFIX ".disk2.img.xz.asc",
+                                          NULL);
+  g_autoptr(GPtrArray) disks = NULL;
+  g_autoptr(GError) error = NULL;
+
+  disks = gis_split_image_find_disks (path, &error);
+  g_assert_error (error, GIS_IMAGE_ERROR, GIS_IMAGE_ERROR_NOT_SUPPORTED);
+  g_assert_null (disks);
+}
+
+static void
+test_find_disks_only_one (Fixture       *fixture,
+                          gconstpointer  user_data)
+{
+  g_autofree gchar *path = fixture_touch (fixture,
+                                          PREFIX ".disk1.img.xz",
+                                          PREFIX ".disk1.img.xz.asc",
+                                          NULL);
+  g_autoptr(GPtrArray) disks = NULL;
+  g_autoptr(GError) error = NULL;
+
+  disks = gis_split_image_find_disks (path, &error);
+  g_assert_error (error, GIS_IMAGE_ERROR, GIS_IMAGE_ERROR_NOT_FOUND);
+  g_assert_null (disks);
+}
+
+static void
+test_find_disks_gap (Fixture       *fixture,
+                     gconstpointer  user_data)
+{
+  g_autofree gchar *path = fixture_touch (fixture,
+                                          PREFIX ".disk1.img.xz",
+                                          PREFIX ".disk1.img.xz.asc",
+                                          PREFIX ".disk2.img.xz",
+                                          PREFIX ".disk2.img.xz.asc",
+                                          PREFIX ".disk4.img.xz",
+                                          PREFIX ".disk4.img.xz.asc",
+                                          NULL);
+  g_autoptr(GPtrArray) disks = NULL;
+  g_autoptr(GError) error = NULL;
+
+  disks = gis_split_image_find_disks (path, &error);
+  g_assert_error (error, GIS_IMAGE_ERROR, GIS_IMAGE_ERROR_NOT_FOUND);
+  g_assert_null (disks);
+}
+
+static void
+test_find_disks_unsigned (Fixture       *fixture,
+                          gconstpointer  user_data)
+{
+  g_autofree gchar *path = fixture_touch (fixture,
+                                          PREFIX ".disk1.img.xz",
+                                          PREFIX ".disk1.img.xz.asc",
+                                          PREFIX ".disk2.img.xz",
+                                          NULL);
+  g_autoptr(GPtrArray) disks = NULL;
+  g_autoptr(GError) error = NULL;
+
+  disks = gis_split_image_find_disks (path, &error);
+  g_assert_error (error, GIS_IMAGE_ERROR, GIS_IMAGE_ERROR_NOT_FOUND);
+  g_assert_null (disks);
+}
+
+int
+main (int argc, char *argv[])
+{
+  setlocale (LC_ALL, "");
+
+  g_test_init (&argc, &argv, NULL);
+
+  g_test_add_func ("/split-image/get-disk", test_get_disk);
+  g_test_add ("/split-image/find-disks", Fixture, NULL,
+              fixture_set_up, test_find_disks, fixture_tear_down);
+  g_test_add ("/split-image/find-disks/not-first", Fixture, NULL,
+              fixture_set_up, test_find_disks_not_first, fixture_tear_down);
+  g_test_add ("/split-image/find-disks/only-one", Fixture, NULL,
+              fixture_set_up, test_find_disks_only_one, fixture_tear_down);
+  g_test_add ("/split-image/find-disks/gap", Fixture, NULL,
+              fixture_set_up, test_find_disks_gap, fixture_tear_down);
+  g_test_add ("/split-image/find-disks/unsigned", Fixture, NULL,
+              fixture_set_up, test_find_disks_unsigned, fixture_tear_down);
+
+  return g_test_run ();
+}
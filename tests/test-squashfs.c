@@ -0,0 +1,229 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*- */
+/*
+ * Copyright © 2018 Endless Mobile, Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+#include "config.h"
+#include <locale.h>
+#include <string.h>
+
+#include <glib.h>
+#include <gio/gio.h>
+
+#include "gis-squashfs.h"
+
+typedef struct {
+  const gchar *squashfs;
+  const gchar *path;
+  /* Expected contents of @path */
+  const gchar *expected;
+  guint n_threads;
+  /* If TRUE, the buffer pool has room for about one block */
+  gboolean tight_pool;
+} TestData;
+
+static gchar *
+test_build_filename (GTestFileType file_type,
+                     const gchar  *basename)
+{
+  gchar *filename = g_test_build_filename (file_type, basename, NULL);
+
+  if (!g_file_test (filename, G_FILE_TEST_EXISTS))
+    g_error ("test data file %s doesn't exist", filename);
+
+  return filename;
+}
+
+/* Reads a file out of a squashfs image, in reads of an awkward size, and
+ * checks it matches the file it was made from.
+ */
+static void
+test_read (gconstpointer user_data)
+{
+  const TestData *data = user_data;
+  g_autofree gchar *squashfs_path =
+    test_build_filename (G_TEST_BUILT, data->squashfs);
+  g_autofree gchar *expected_path =
+    test_build_filename (G_TEST_BUILT, data->expected);
+  g_autoptr(GFile) squashfs = g_file_new_for_path (squashfs_path);
+  g_autoptr(GisBufferPool) pool = gis_buffer_pool_new (0);
+  g_autoptr(GInputStream) stream = NULL;
+  g_autoptr(GError) error = NULL;
+  g_autoptr(GByteArray) contents = g_byte_array_new ();
+  g_autofree gchar *expected = NULL;
+  gsize expected_len = 0;
+  guint64 size = 0;
+  guint8 buf[12345];
+  gpointer reserved = NULL;
+  gssize r;
+
+  g_file_get_contents (expected_path, &expected, &expected_len, &error);
+  g_assert_no_error (error);
+
+  /* The largest squashfs block is 1 MiB */
+  if (data->tight_pool)
+    reserved = gis_buffer_pool_acquire (
+        pool, gis_buffer_pool_get_budget (pool) - 1024 * 1024);
+
+  stream = gis_squashfs_open_file (squashfs, data->path, data->n_threads,
+                                   pool, &size, &error);
+  g_assert_no_error (error);
+  g_assert_nonnull (stream);
+  g_assert_cmpuint (size, ==, expected_len);
+
+  while ((r = g_input_stream_read (stream, buf, sizeof buf, NULL, &error)) > 0)
+    g_byte_array_append (contents, buf, r);
+
+  g_assert_no_error (error);
+  g_assert_cmpint (r, ==, 0);
+  g_assert_cmpmem (contents->data, contents->len, expected, expected_len);
+
+  g_input_stream_close (stream, NULL, &error);
+  g_assert_no_error (error);
+
+  g_clear_object (&stream);
+  gis_buffer_pool_release (pool, reserved);
+}
+
+/* Closing the stream part-way through stops the decompression threads */
+static void
+test_close_early (void)
+{
+  g_autofree gchar *squashfs_path =
+    test_build_filename (G_TEST_BUILT, "endless.squash");
+  g_autoptr(GFile) squashfs = g_file_new_for_path (squashfs_path);
+  g_autoptr(GInputStream) stream = NULL;
+  g_autoptr(GError) error = NULL;
+  guint8 buf[512];
+  gssize r;
+
+  stream = gis_squashfs_open_file (squashfs, GIS_SQUASHFS_IMAGE_PATH, 4, NULL,
+                                   NULL, &error);
+  g_assert_no_error (error);
+  g_assert_nonnull (stream);
+
+  r = g_input_stream_read (stream, buf, sizeof buf, NULL, &error);
+  g_assert_no_error (error);
+  g_assert_cmpint (r, ==, sizeof buf);
+
+  g_input_stream_close (stream, NULL, &error);
+  g_assert_no_error (error);
+}
+
+static void
+test_not_found (void)
+{
+  g_autofree gchar *squashfs_path =
+    test_build_filename (G_TEST_BUILT, "endless.squash");
+  g_autoptr(GFile) squashfs = g_file_new_for_path (squashfs_path);
+  g_autoptr(GInputStream) stream = NULL;
+  g_autoptr(GError) error = NULL;
+
+  stream = gis_squashfs_open_file (squashfs, "nonexistent.img", 0, NULL, NULL,
+                                   &error);
+  g_assert_error (error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND);
+  g_assert_null (stream);
+  g_clear_error (&error);
+
+  /* endless.img is not a directory */
+  stream = gis_squashfs_open_file (squashfs, "endless.img/gpt.img", 0, NULL,
+                                   NULL, &error);
+  g_assert_error (error, G_IO_ERROR, G_IO_ERROR_NOT_DIRECTORY);
+  g_assert_null (stream);
+  g_clear_error (&error);
+
+  /* nor is the root directory a regular file */
+  stream = gis_squashfs_open_file (squashfs, "/", 0, NULL, NULL, &error);
+  g_assert_error (error, G_IO_ERROR, G_IO_ERROR_NOT_REGULAR_FILE);
+  g_assert_null (stream);
+}
+
+static void
+test_not_squashfs (void)
+{
+  g_autofree gchar *image_path = test_build_filename (G_TEST_BUILT, "w.img");
+  g_autoptr(GFile) image = g_file_new_for_path (image_path);
+  g_autoptr(GInputStream) stream = NULL;
+  g_autoptr(GError) error = NULL;
+
+  stream = gis_squashfs_open_file (image, GIS_SQUASHFS_IMAGE_PATH, 0, NULL,
+                                   NULL, &error);
+  g_assert_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA);
+  g_assert_null (stream);
+}
+
+int
+main (int argc, char *argv[])
+{
+  setlocale (LC_ALL, "");
+
+  g_test_init (&argc, &argv, NULL);
+
+  TestData gzip_image = {
+      .squashfs = "endless.squash",
+      .path = GIS_SQUASHFS_IMAGE_PATH,
+      .expected = "w-8193.img",
+      .n_threads = 1,
+  };
+  g_test_add_data_func ("/squashfs/gzip", &gzip_image, test_read);
+
+  /* Several blocks are decompressed at once */
+  TestData gzip_threads = {
+      .squashfs = "endless.squash",
+      .path = GIS_SQUASHFS_IMAGE_PATH,
+      .expected = "w-8193.img",
+      .n_threads = 4,
+  };
+  g_test_add_data_func ("/squashfs/gzip/threads", &gzip_threads, test_read);
+
+  /* Blocks are only decompressed ahead while the pool has room, but the
+   * block being read always is
+   */
+  TestData gzip_tight_pool = {
+      .squashfs = "endless.squash",
+      .path = GIS_SQUASHFS_IMAGE_PATH,
+      .expected = "w-8193.img",
+      .n_threads = 4,
+      .tight_pool = TRUE,
+  };
+  g_test_add_data_func ("/squashfs/gzip/tight-pool", &gzip_tight_pool,
+                        test_read);
+
+  /* Unlike endless.img, gpt.img is a whole number of blocks, so has no tail
+   * in a fragment block
+   */
+  TestData gzip_no_fragment = {
+      .squashfs = "endless.squash",
+      .path = "gpt.img",
+      .expected = "gpt.img",
+      .n_threads = 0,
+  };
+  g_test_add_data_func ("/squashfs/gzip/no-fragment", &gzip_no_fragment,
+                        test_read);
+
+  TestData xz_image = {
+      .squashfs = "endless-xz.squash",
+      .path = GIS_SQUASHFS_IMAGE_PATH,
+      .expected = "w-8193.img",
+      .n_threads = 0,
+  };
+  g_test_add_data_func ("/squashfs/xz", &xz_image, test_read);
+
+  g_test_add_func ("/squashfs/close-early", test_close_early);
+  g_test_add_func ("/squashfs/not-found", test_not_found);
+  g_test_add_func ("/squashfs/not-squashfs", test_not_squashfs);
+
+  return g_test_run ();
+}
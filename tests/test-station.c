@@ -0,0 +1,59 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*- */
+/*
+ * Copyright © 2018 Endless Mobile, Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+#include "config.h"
+#include <locale.h>
+
+#include "gis-station.h"
+
+/* A drive skeleton has the same properties as the proxies UDisksClient hands
+ * out, without needing the daemon.
+ */
+static void
+test_drive_is_removable (void)
+{
+  UDisksDrive *drive = udisks_drive_skeleton_new ();
+
+  /* An internal disk */
+  udisks_drive_set_connection_bus (drive, "");
+  g_assert_false (gis_station_drive_is_removable (drive));
+
+  /* A USB stick */
+  udisks_drive_set_connection_bus (drive, "usb");
+  udisks_drive_set_removable (drive, TRUE);
+  g_assert_true (gis_station_drive_is_removable (drive));
+
+  /* An internal card reader */
+  udisks_drive_set_connection_bus (drive, "");
+  udisks_drive_set_removable (drive, FALSE);
+  udisks_drive_set_media_removable (drive, TRUE);
+  g_assert_true (gis_station_drive_is_removable (drive));
+
+  g_object_unref (drive);
+}
+
+int
+main (int argc, char *argv[])
+{
+  setlocale (LC_ALL, "");
+
+  g_test_init (&argc, &argv, NULL);
+
+  g_test_add_func ("/station/drive-is-removable", test_drive_is_removable);
+
+  return g_test_run ();
+}
@@ -0,0 +1,198 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*- */
+/*
+ * Copyright © 2018 Endless Mobile, Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+#include "config.h"
+#include <string.h>
+#include <locale.h>
+
+#include <gio/gio.h>
+
+#include "gis-trace.h"
+#include "glnx-shutil.h"
+
+static guint
+count_occurrences (GBytes      *json,
+                   const gchar *needle)
+{
+  g_autofree gchar *haystack =
+    g_strndup (g_bytes_get_data (json, NULL), g_bytes_get_size (json));
+  const gchar *p = haystack;
+  guint n = 0;
+
+  while ((p = strstr (p, needle)) != NULL)
+    {
+      n++;
+      p += strlen (needle);
+    }
+
+  return n;
+}
+
+/* Must run first, before anything enables tracing */
+static void
+test_trace_disabled (void)
+{
+  GisTraceSpan *span;
+
+  g_assert_false (gis_trace_is_enabled ());
+
+  span = gis_trace_begin ("test", "ignored");
+  g_assert_null (span);
+  /* All of these accept NULL */
+  gis_trace_span_set_arg (span, "bytes", 1);
+  gis_trace_end (span);
+
+  g_assert_null (gis_trace_to_json ());
+}
+
+static gpointer
+thread_func (gpointer data)
+{
+  GisTraceSpan *span = gis_trace_begin ("test", "in thread");
+
+  gis_trace_span_set_arg (span, "bytes", 42);
+  gis_trace_span_set_arg (span, "index", 7);
+  /* Beyond GIS_TRACE_MAX_ARGS */
+  gis_trace_span_set_arg (span, "ignored", 1);
+  gis_trace_end (span);
+
+  return NULL;
+}
+
+static void
+test_trace_spans (void)
+{
+  g_autoptr(GBytes) json = NULL;
+  g_autoptr(GisTraceSpan) outer = NULL;
+  GisTraceSpan *span;
+  GThread *thread;
+  g_autofree gchar *data = NULL;
+
+  gis_trace_enable ();
+  g_assert_true (gis_trace_is_enabled ());
+
+  outer = gis_trace_begin ("test", "outer");
+  g_assert_nonnull (outer);
+
+  span = gis_trace_begin ("test", "say \"hello\"");
+  g_assert_nonnull (span);
+  g_usleep (1000);
+  gis_trace_end (span);
+
+  thread = g_thread_new ("tracer", thread_func, NULL);
+  g_thread_join (thread);
+
+  g_clear_pointer (&outer, gis_trace_end);
+
+  json = gis_trace_to_json ();
+  g_assert_nonnull (json);
+  data = g_strndup (g_bytes_get_data (json, NULL), g_bytes_get_size (json));
+
+  g_assert_true (g_str_has_prefix (data, "{"));
+  g_assert_true (g_str_has_suffix (data, "]}\n"));
+  g_assert_cmpuint (count_occurrences (json, "\"traceEvents\":["), ==, 1);
+  g_assert_cmpuint (count_occurrences (json, "\"ph\":\"X\""), ==, 3);
+  g_assert_cmpuint (count_occurrences (json, "\"name\":\"say \\\"hello\\\"\""),
+                    ==, 1);
+  g_assert_cmpuint (count_occurrences (json, "\"cat\":\"test\""), ==, 3);
+  g_assert_cmpuint (count_occurrences (json,
+                                       "\"args\":{\"bytes\":42,\"index\":7}"),
+                    ==, 1);
+  g_assert_cmpuint (count_occurrences (json, "\"ignored\""), ==, 0);
+
+  /* The thread is named after GLib's name for it */
+  g_assert_cmpuint (count_occurrences (json, "\"thread_name\""), ==, 2);
+  g_assert_cmpuint (count_occurrences (json, "\"args\":{\"name\":\"tracer\"}"),
+                    ==, 1);
+
+  g_assert_cmpuint (count_occurrences (json, "\"count\":0"), ==, 1);
+}
+
+static void
+save_cb (GObject      *source,
+         GAsyncResult *result,
+         gpointer      user_data)
+{
+  GAsyncResult **result_out = user_data;
+
+  *result_out = g_object_ref (result);
+}
+
+static void
+test_trace_save (void)
+{
+  g_autofree gchar *tmpdir = NULL;
+  g_autofree gchar *image_path = NULL;
+  g_autoptr(GFile) image_dir = NULL;
+  g_autoptr(GAsyncResult) result = NULL;
+  g_autoptr(GFile) output = NULL;
+  g_autoptr(GFile) parent = NULL;
+  g_autofree gchar *parent_path = NULL;
+  g_autofree gchar *basename = NULL;
+  g_autofree gchar *contents = NULL;
+  g_autoptr(GError) error = NULL;
+
+  gis_trace_enable ();
+
+  tmpdir = g_dir_make_tmp ("eos-installer.XXXXXX", &error);
+  g_assert_no_error (error);
+
+  /* The image directory doesn't exist, so the trace is saved to the home
+   * directory instead
+   */
+  image_path = g_build_filename (tmpdir, "missing", NULL);
+  image_dir = g_file_new_for_path (image_path);
+  gis_trace_save_async (image_dir, tmpdir, NULL, save_cb, &result);
+
+  while (result == NULL)
+    g_main_context_iteration (NULL, TRUE);
+
+  output = gis_trace_save_finish (result, &error);
+  g_assert_no_error (error);
+  g_assert_nonnull (output);
+
+  parent = g_file_get_parent (output);
+  parent_path = g_file_get_path (parent);
+  g_assert_cmpstr (parent_path, ==, tmpdir);
+
+  basename = g_file_get_basename (output);
+  g_assert_true (g_str_has_prefix (basename, "eos-installer-trace-"));
+  g_assert_true (g_str_has_suffix (basename, ".json"));
+
+  g_file_load_contents (output, NULL, &contents, NULL, NULL, &error);
+  g_assert_no_error (error);
+  g_assert_true (g_str_has_prefix (contents, "{\"displayTimeUnit\""));
+
+  if (!glnx_shutil_rm_rf_at (AT_FDCWD, tmpdir, NULL, &error))
+    g_warning ("Failed to remove %s: %s", tmpdir, error->message);
+}
+
+int
+main (int argc, char *argv[])
+{
+  setlocale (LC_ALL, "");
+
+  g_unsetenv ("EI_TRACE");
+
+  g_test_init (&argc, &argv, NULL);
+
+  g_test_add_func ("/trace/disabled", test_trace_disabled);
+  g_test_add_func ("/trace/spans", test_trace_spans);
+  g_test_add_func ("/trace/save", test_trace_save);
+
+  return g_test_run ();
+}
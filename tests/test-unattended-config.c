@@ -310,6 +310,284 @@ test_two_images (void)
   g_assert_null (config);
 }
 
+static void
+test_select_fastest (void)
+{
+  g_autofree gchar *select_fastest_ini =
+    g_test_build_filename (G_TEST_DIST, "unattended/select-fastest.ini", NULL);
+  g_autoptr(GisUnattendedConfig) config = NULL;
+  g_autoptr(GError) error = NULL;
+
+  config = gis_unattended_config_new (select_fastest_ini, &error);
+  g_assert_no_error (error);
+  g_assert_nonnull (config);
+
+  g_assert_cmpuint (gis_unattended_config_get_device_selection (config), ==,
+                    GIS_UNATTENDED_DEVICE_SELECTION_FASTEST);
+  g_assert_true (gis_unattended_config_matches_device (config, "/dev/sda"));
+  g_assert_false (gis_unattended_config_matches_device (config, "/dev/mmcblk0"));
+}
+
+static void
+test_select_default (void)
+{
+  g_autofree gchar *full_ini =
+    g_test_build_filename (G_TEST_DIST, "unattended/full.ini", NULL);
+  g_autoptr(GisUnattendedConfig) config = NULL;
+  g_autoptr(GError) error = NULL;
+
+  config = gis_unattended_config_new (full_ini, &error);
+  g_assert_no_error (error);
+  g_assert_nonnull (config);
+
+  g_assert_cmpuint (gis_unattended_config_get_device_selection (config), ==,
+                    GIS_UNATTENDED_DEVICE_SELECTION_UNIQUE);
+}
+
+static void
+test_select_invalid (void)
+{
+  g_autofree gchar *select_invalid_ini =
+    g_test_build_filename (G_TEST_DIST, "unattended/select-invalid.ini", NULL);
+  g_autoptr(GisUnattendedConfig) config = NULL;
+  g_autoptr(GError) error = NULL;
+
+  config = gis_unattended_config_new (select_invalid_ini, &error);
+  g_assert_error (error,
+                  GIS_UNATTENDED_ERROR,
+                  GIS_UNATTENDED_ERROR_INVALID_IMAGE);
+  g_assert_nonnull (strstr (error->message, "slowest"));
+  g_assert_null (config);
+}
+
+static void
+test_station (void)
+{
+  g_autofree gchar *station_ini =
+    g_test_build_filename (G_TEST_DIST, "unattended/station.ini", NULL);
+  g_autofree gchar *full_ini =
+    g_test_build_filename (G_TEST_DIST, "unattended/full.ini", NULL);
+  g_autoptr(GisUnattendedConfig) config = NULL;
+  g_autoptr(GError) error = NULL;
+
+  config = gis_unattended_config_new (station_ini, &error);
+  g_assert_no_error (error);
+  g_assert_nonnull (config);
+
+  g_assert_true (gis_unattended_config_is_station (config));
+  g_assert_true (gis_unattended_config_matches_device (config, "/dev/sdb"));
+  g_clear_object (&config);
+
+  config = gis_unattended_config_new (full_ini, &error);
+  g_assert_no_error (error);
+  g_assert_nonnull (config);
+
+  g_assert_false (gis_unattended_config_is_station (config));
+}
+
+static void
+test_station_invalid (void)
+{
+  g_autofree gchar *station_invalid_ini =
+    g_test_build_filename (G_TEST_DIST, "unattended/station-invalid.ini", NULL);
+  g_autoptr(GisUnattendedConfig) config = NULL;
+  g_autoptr(GError) error = NULL;
+
+  config = gis_unattended_config_new (station_invalid_ini, &error);
+  g_assert_error (error,
+                  GIS_UNATTENDED_ERROR,
+                  GIS_UNATTENDED_ERROR_INVALID_IMAGE);
+  g_assert_null (config);
+}
+
+static void
+test_verify_first (void)
+{
+  g_autofree gchar *verify_first_ini =
+    g_test_build_filename (G_TEST_DIST, "unattended/verify-first.ini", NULL);
+  g_autofree gchar *full_ini =
+    g_test_build_filename (G_TEST_DIST, "unattended/full.ini", NULL);
+  g_autoptr(GisUnattendedConfig) config = NULL;
+  g_autoptr(GError) error = NULL;
+
+  config = gis_unattended_config_new (verify_first_ini, &error);
+  g_assert_no_error (error);
+  g_assert_nonnull (config);
+
+  g_assert_cmpuint (gis_unattended_config_get_verify_policy (config), ==,
+                    GIS_UNATTENDED_VERIFY_POLICY_FIRST);
+  g_clear_object (&config);
+
+  config = gis_unattended_config_new (full_ini, &error);
+  g_assert_no_error (error);
+  g_assert_nonnull (config);
+
+  g_assert_cmpuint (gis_unattended_config_get_verify_policy (config), ==,
+                    GIS_UNATTENDED_VERIFY_POLICY_CONCURRENT);
+}
+
+static void
+test_verify_invalid (void)
+{
+  g_autofree gchar *verify_invalid_ini =
+    g_test_build_filename (G_TEST_DIST, "unattended/verify-invalid.ini", NULL);
+  g_autoptr(GisUnattendedConfig) config = NULL;
+  g_autoptr(GError) error = NULL;
+
+  config = gis_unattended_config_new (verify_invalid_ini, &error);
+  g_assert_error (error,
+                  GIS_UNATTENDED_ERROR,
+                  GIS_UNATTENDED_ERROR_INVALID_IMAGE);
+  g_assert_nonnull (strstr (error->message, "never"));
+  g_assert_null (config);
+}
+
+static void
+test_write_used (void)
+{
+  g_autofree gchar *write_used_ini =
+    g_test_build_filename (G_TEST_DIST, "unattended/write-used.ini", NULL);
+  g_autofree gchar *full_ini =
+    g_test_build_filename (G_TEST_DIST, "unattended/full.ini", NULL);
+  g_autoptr(GisUnattendedConfig) config = NULL;
+  g_autoptr(GError) error = NULL;
+
+  config = gis_unattended_config_new (write_used_ini, &error);
+  g_assert_no_error (error);
+  g_assert_nonnull (config);
+
+  g_assert_cmpuint (gis_unattended_config_get_write_policy (config), ==,
+                    GIS_UNATTENDED_WRITE_POLICY_USED);
+  g_clear_object (&config);
+
+  config = gis_unattended_config_new (full_ini, &error);
+  g_assert_no_error (error);
+  g_assert_nonnull (config);
+
+  g_assert_cmpuint (gis_unattended_config_get_write_policy (config), ==,
+                    GIS_UNATTENDED_WRITE_POLICY_FULL);
+}
+
+static void
+test_write_invalid (void)
+{
+  g_autofree gchar *write_invalid_ini =
+    g_test_build_filename (G_TEST_DIST, "unattended/write-invalid.ini", NULL);
+  g_autoptr(GisUnattendedConfig) config = NULL;
+  g_autoptr(GError) error = NULL;
+
+  config = gis_unattended_config_new (write_invalid_ini, &error);
+  g_assert_error (error,
+                  GIS_UNATTENDED_ERROR,
+                  GIS_UNATTENDED_ERROR_INVALID_IMAGE);
+  g_assert_nonnull (strstr (error->message, "sparse"));
+  g_assert_null (config);
+}
+
+static void
+test_compare (void)
+{
+  g_autofree gchar *compare_ini =
+    g_test_build_filename (G_TEST_DIST, "unattended/compare.ini", NULL);
+  g_autofree gchar *full_ini =
+    g_test_build_filename (G_TEST_DIST, "unattended/full.ini", NULL);
+  g_autoptr(GisUnattendedConfig) config = NULL;
+  g_autoptr(GError) error = NULL;
+
+  config = gis_unattended_config_new (compare_ini, &error);
+  g_assert_no_error (error);
+  g_assert_nonnull (config);
+
+  g_assert_true (gis_unattended_config_is_compare (config));
+  g_clear_object (&config);
+
+  config = gis_unattended_config_new (full_ini, &error);
+  g_assert_no_error (error);
+  g_assert_nonnull (config);
+
+  g_assert_false (gis_unattended_config_is_compare (config));
+}
+
+static void
+test_trace (void)
+{
+  g_autofree gchar *trace_ini =
+    g_test_build_filename (G_TEST_DIST, "unattended/trace.ini", NULL);
+  g_autofree gchar *full_ini =
+    g_test_build_filename (G_TEST_DIST, "unattended/full.ini", NULL);
+  g_autoptr(GisUnattendedConfig) config = NULL;
+  g_autoptr(GError) error = NULL;
+
+  config = gis_unattended_config_new (trace_ini, &error);
+  g_assert_no_error (error);
+  g_assert_nonnull (config);
+
+  g_assert_true (gis_unattended_config_is_trace (config));
+  g_clear_object (&config);
+
+  config = gis_unattended_config_new (full_ini, &error);
+  g_assert_no_error (error);
+  g_assert_nonnull (config);
+
+  g_assert_false (gis_unattended_config_is_trace (config));
+}
+
+static void
+test_compare_invalid (void)
+{
+  g_autofree gchar *compare_invalid_ini =
+    g_test_build_filename (G_TEST_DIST, "unattended/compare-invalid.ini", NULL);
+  g_autoptr(GisUnattendedConfig) config = NULL;
+  g_autoptr(GError) error = NULL;
+
+  config = gis_unattended_config_new (compare_invalid_ini, &error);
+  g_assert_error (error,
+                  GIS_UNATTENDED_ERROR,
+                  GIS_UNATTENDED_ERROR_INVALID_IMAGE);
+  g_assert_null (config);
+}
+
+static void
+test_url (void)
+{
+  g_autofree gchar *url_ini =
+    g_test_build_filename (G_TEST_DIST, "unattended/url.ini", NULL);
+  g_autofree gchar *full_ini =
+    g_test_build_filename (G_TEST_DIST, "unattended/full.ini", NULL);
+  g_autoptr(GisUnattendedConfig) config = NULL;
+  g_autoptr(GError) error = NULL;
+
+  config = gis_unattended_config_new (url_ini, &error);
+  g_assert_no_error (error);
+  g_assert_nonnull (config);
+
+  g_assert_cmpstr (gis_unattended_config_get_url (config), ==,
+                   "http://images.example.com/eos-eos3.4-amd64-amd64.180801-123456.base.img.xz");
+  g_clear_object (&config);
+
+  config = gis_unattended_config_new (full_ini, &error);
+  g_assert_no_error (error);
+  g_assert_nonnull (config);
+
+  g_assert_null (gis_unattended_config_get_url (config));
+}
+
+static void
+test_url_invalid (gconstpointer data)
+{
+  const gchar *filename = data;
+  g_autofree gchar *path =
+    g_test_build_filename (G_TEST_DIST, "unattended", filename, NULL);
+  g_autoptr(GisUnattendedConfig) config = NULL;
+  g_autoptr(GError) error = NULL;
+
+  config = gis_unattended_config_new (path, &error);
+  g_assert_error (error,
+                  GIS_UNATTENDED_ERROR,
+                  GIS_UNATTENDED_ERROR_INVALID_IMAGE);
+  g_assert_null (config);
+}
+
 static void
 test_write_empty (Fixture *fixture,
                   gconstpointer data)
@@ -443,6 +721,23 @@ main (int argc, char *argv[])
   g_test_add_func ("/unattended-config/image/missing-block-device", test_missing_block_device);
   g_test_add_func ("/unattended-config/image/missing-filename", test_missing_filename);
   g_test_add_func ("/unattended-config/image/two-images", test_two_images);
+  g_test_add_func ("/unattended-config/image/select-fastest", test_select_fastest);
+  g_test_add_func ("/unattended-config/image/select-default", test_select_default);
+  g_test_add_func ("/unattended-config/image/select-invalid", test_select_invalid);
+  g_test_add_func ("/unattended-config/image/station", test_station);
+  g_test_add_func ("/unattended-config/image/station-invalid", test_station_invalid);
+  g_test_add_func ("/unattended-config/image/verify-first", test_verify_first);
+  g_test_add_func ("/unattended-config/image/verify-invalid", test_verify_invalid);
+  g_test_add_func ("/unattended-config/image/write-used", test_write_used);
+  g_test_add_func ("/unattended-config/image/write-invalid", test_write_invalid);
+  g_test_add_func ("/unattended-config/image/compare", test_compare);
+  g_test_add_func ("/unattended-config/image/compare-invalid", test_compare_invalid);
+  g_test_add_func ("/unattended-config/image/trace", test_trace);
+  g_test_add_func ("/unattended-config/image/url", test_url);
+  g_test_add_data_func ("/unattended-config/image/url-invalid",
+                        "url-invalid.ini", test_url_invalid);
+  g_test_add_data_func ("/unattended-config/image/url-station",
+                        "url-station.ini", test_url_invalid);
 
   g_test_add ("/unattended-config/write/empty", Fixture, NULL, fixture_set_up,
               test_write_empty, fixture_tear_down);
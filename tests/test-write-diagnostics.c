@@ -18,6 +18,8 @@
 #include "config.h"
 #include <string.h>
 #include <locale.h>
+#include <signal.h>
+#include <sys/resource.h>
 
 #include <glib.h>
 #include <glib/gstdio.h>
@@ -27,9 +29,11 @@
 #include "glnx-shutil.h"
 
 typedef struct {
+  gchar *eos_diagnostics_exe;
   gchar *tmpdir;
   gchar *image_dir;
   gchar *home_dir;
+  const gchar *report;
 
   GFile *output;
   GError *error;
@@ -56,6 +60,7 @@ fixture_tear_down (Fixture *fixture,
     g_warning ("Failed to remove %s: %s", fixture->tmpdir, error->message);
 
   g_clear_pointer (&fixture->tmpdir, g_free);
+  g_clear_pointer (&fixture->eos_diagnostics_exe, g_free);
   g_clear_pointer (&fixture->image_dir, g_free);
   g_clear_pointer (&fixture->home_dir, g_free);
 
@@ -74,6 +79,33 @@ write_unattended_config_cb (GObject      *source,
   *result_out = g_object_ref (result);
 }
 
+/* The diagnostics are compressed as they are written */
+static gchar *
+load_decompressed (GFile   *file,
+                   GError **error)
+{
+  g_autoptr(GInputStream) compressed = NULL;
+  g_autoptr(GZlibDecompressor) decompressor =
+    g_zlib_decompressor_new (G_ZLIB_COMPRESSOR_FORMAT_GZIP);
+  g_autoptr(GInputStream) decompressed = NULL;
+  g_autoptr(GOutputStream) contents = g_memory_output_stream_new_resizable ();
+
+  compressed = G_INPUT_STREAM (g_file_read (file, NULL, error));
+  if (compressed == NULL)
+    return NULL;
+
+  decompressed = g_converter_input_stream_new (compressed,
+                                               G_CONVERTER (decompressor));
+  if (g_output_stream_splice (contents, decompressed,
+                              G_OUTPUT_STREAM_SPLICE_CLOSE_SOURCE,
+                              NULL, error) < 0 ||
+      !g_output_stream_write_all (contents, "", 1, NULL, NULL, error) ||
+      !g_output_stream_close (contents, NULL, error))
+    return NULL;
+
+  return g_memory_output_stream_steal_data (G_MEMORY_OUTPUT_STREAM (contents));
+}
+
 static void
 call_and_wait (Fixture *fixture)
 {
@@ -87,7 +119,9 @@ call_and_wait (Fixture *fixture)
   /* We override the executable path with "echo" so we can check the arguments
    * passed to it below.
    */
-  gis_write_diagnostics_async ("echo", image_dir, fixture->home_dir,
+  gis_write_diagnostics_async (fixture->eos_diagnostics_exe ?: "echo",
+                               image_dir, fixture->home_dir,
+                               fixture->report,
                                NULL, write_unattended_config_cb, &result);
 
   while (result == NULL)
@@ -97,18 +131,26 @@ call_and_wait (Fixture *fixture)
 
   if (fixture->output != NULL)
     {
+      g_autofree gchar *basename = g_file_get_basename (fixture->output);
+      g_autofree gchar *expected = NULL;
+
       g_assert_no_error (fixture->error);
+      g_assert_true (g_str_has_suffix (basename, ".txt.gz"));
 
-      gboolean ret = g_file_load_contents (fixture->output, NULL, &contents,
-                                           NULL, NULL, &fixture->error);
+      contents = load_decompressed (fixture->output, &fixture->error);
       g_assert_no_error (fixture->error);
-      g_assert_true (ret);
+      g_assert_nonnull (contents);
       /* eos-diagnostics accepts an optional target filename. Rather than
        * following the normal UNIX convention of "-" meaning "write to stdout",
        * it treats the argument "stdout" that way. The trailing newline is
-       * added by /bin/echo.
+       * added by /bin/echo. Our own report follows.
        */
-      g_assert_cmpstr (contents, ==, "stdout\n");
+      if (fixture->report != NULL)
+        expected = g_strdup_printf ("stdout\n\n%s", fixture->report);
+      else
+        expected = g_strdup ("stdout\n");
+
+      g_assert_cmpstr (contents, ==, expected);
     }
 }
 
@@ -145,6 +187,57 @@ test_image_dir_ok (Fixture      *fixture,
   assert_file_in_dir (fixture->output, fixture->image_dir);
 }
 
+static void
+test_report (Fixture      *fixture,
+             gconstpointer user_data)
+{
+  fixture->image_dir = g_build_filename (fixture->tmpdir, "imagedir", NULL);
+  glnx_ensure_dir (AT_FDCWD, fixture->image_dir, 0755, &fixture->error);
+  g_assert_no_error (fixture->error);
+
+  fixture->report = "Write performance report\nresult: succeeded\n";
+
+  call_and_wait (fixture);
+  g_assert_nonnull (fixture->output);
+  g_assert_no_error (fixture->error);
+  assert_file_in_dir (fixture->output, fixture->image_dir);
+}
+
+/* A partial file is not left behind */
+static void
+test_command_fails_in_dir (Fixture      *fixture,
+                           gconstpointer user_data)
+{
+  g_autoptr(GFile) image_dir = NULL;
+  g_autoptr(GFileEnumerator) children = NULL;
+  g_autoptr(GFileInfo) child = NULL;
+  g_autoptr(GAsyncResult) result = NULL;
+
+  fixture->image_dir = g_build_filename (fixture->tmpdir, "imagedir", NULL);
+  glnx_ensure_dir (AT_FDCWD, fixture->image_dir, 0755, &fixture->error);
+  g_assert_no_error (fixture->error);
+  image_dir = g_file_new_for_path (fixture->image_dir);
+
+  gis_write_diagnostics_async ("false", image_dir, NULL, "report", NULL,
+                               write_unattended_config_cb, &result);
+
+  while (result == NULL)
+    g_main_context_iteration (NULL, TRUE);
+
+  fixture->output = gis_write_diagnostics_finish (result, &fixture->error);
+  g_assert_error (fixture->error, G_SPAWN_EXIT_ERROR, 1);
+  g_assert_null (fixture->output);
+
+  children = g_file_enumerate_children (image_dir,
+                                        G_FILE_ATTRIBUTE_STANDARD_NAME,
+                                        G_FILE_QUERY_INFO_NONE, NULL,
+                                        &fixture->error);
+  g_assert_no_error (fixture->error);
+  child = g_file_enumerator_next_file (children, NULL, &fixture->error);
+  g_assert_no_error (fixture->error);
+  g_assert_null (child);
+}
+
 static void
 test_image_dir_error (Fixture      *fixture,
                       gconstpointer user_data)
@@ -216,6 +309,74 @@ test_fall_back_to_image_dir (Fixture      *fixture,
   assert_file_in_dir (fixture->output, fixture->home_dir);
 }
 
+/* Prints far too much the first time it's run, and then behaves like "echo" */
+static const gchar too_much_then_echo[] =
+  "#!/bin/sh\n"
+  "if [ -e \"$0.ran\" ]; then\n"
+  "  echo \"$@\"\n"
+  "else\n"
+  "  touch \"$0.ran\"\n"
+  "  head -c 1048576 /dev/urandom\n"
+  "fi\n";
+
+/* Filling up the image partition part-way through writing the diagnostics
+ * to it falls back to the home directory, where they are written in full.
+ */
+static void
+test_fall_back_after_write_error (Fixture      *fixture,
+                                  gconstpointer user_data)
+{
+  /* Limiting the size of files we can write stands in for a full image
+   * partition, so do it in a subprocess lest it affect other tests.
+   */
+  const struct rlimit limit = { 64 * 1024, 64 * 1024 };
+  g_autoptr(GFile) image_dir = NULL;
+  g_autoptr(GFileEnumerator) children = NULL;
+  g_autoptr(GFileInfo) child = NULL;
+  g_autofree gchar *exe = NULL;
+
+  if (!g_test_subprocess ())
+    {
+      g_test_trap_subprocess (NULL, 0, 0);
+      g_test_trap_assert_passed ();
+      return;
+    }
+
+  exe = g_build_filename (fixture->tmpdir, "eos-diagnostics", NULL);
+  g_file_set_contents (exe, too_much_then_echo, -1, &fixture->error);
+  g_assert_no_error (fixture->error);
+  g_assert_cmpint (g_chmod (exe, 0755), ==, 0);
+  fixture->eos_diagnostics_exe = g_steal_pointer (&exe);
+
+  fixture->image_dir = g_build_filename (fixture->tmpdir, "imagedir", NULL);
+  glnx_ensure_dir (AT_FDCWD, fixture->image_dir, 0755, &fixture->error);
+  g_assert_no_error (fixture->error);
+
+  fixture->home_dir = g_build_filename (fixture->tmpdir, "homedir", NULL);
+  glnx_ensure_dir (AT_FDCWD, fixture->home_dir, 0755, &fixture->error);
+  g_assert_no_error (fixture->error);
+
+  /* Exceeding the limit fails with EFBIG rather than killing us */
+  signal (SIGXFSZ, SIG_IGN);
+  g_assert_cmpint (setrlimit (RLIMIT_FSIZE, &limit), ==, 0);
+
+  call_and_wait (fixture);
+  g_assert_nonnull (fixture->output);
+  g_assert_no_error (fixture->error);
+  assert_file_in_dir (fixture->output, fixture->home_dir);
+
+  /* The partial file is not left behind */
+  image_dir = g_file_new_for_path (fixture->image_dir);
+  children = g_file_enumerate_children (image_dir,
+                                        G_FILE_ATTRIBUTE_STANDARD_NAME,
+                                        G_FILE_QUERY_INFO_NONE, NULL,
+                                        &fixture->error);
+  g_assert_no_error (fixture->error);
+  child = g_file_enumerator_next_file (children, NULL, &fixture->error);
+  g_assert_no_error (fixture->error);
+  g_assert_null (child);
+}
+
 static void
 test_both_error (Fixture      *fixture,
                  gconstpointer user_data)
@@ -242,7 +403,7 @@ test_command_fails (Fixture      *fixture,
 {
   g_autoptr(GAsyncResult) result = NULL;
 
-  gis_write_diagnostics_async ("false", NULL, NULL, NULL,
+  gis_write_diagnostics_async ("false", NULL, NULL, NULL, NULL,
                                write_unattended_config_cb, &result);
 
   while (result == NULL)
@@ -267,13 +428,16 @@ main (int argc, char *argv[])
 
   TEST ("no-dirs", test_no_dirs);
   TEST ("image-dir-ok", test_image_dir_ok);
+  TEST ("report", test_report);
   TEST ("image-dir-error", test_image_dir_error);
   TEST ("home-dir-ok", test_home_dir_ok);
   TEST ("home-dir-error", test_home_dir_error);
   TEST ("image-dir-preferred", test_image_dir_preferred);
   TEST ("fall-back-to-image-dir", test_fall_back_to_image_dir);
+  TEST ("fall-back-after-write-error", test_fall_back_after_write_error);
   TEST ("both-error", test_both_error);
   TEST ("command-fails", test_command_fails);
+  TEST ("command-fails-in-dir", test_command_fails_in_dir);
 
 #undef TEST
 
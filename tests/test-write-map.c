@@ -0,0 +1,255 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*- */
+/*
+ * Copyright © 2018 Endless Mobile, Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+#include "config.h"
+
+#include <locale.h>
+#include <string.h>
+
+#include <glib.h>
+#include <gio/gio.h>
+
+#include "gis-write-map.h"
+
+/* Generated by make-gpt-image: 8192 sectors, with the primary GPT up to
+ * sector 34, an ESP from 2048 to 4095, the root partition from 4096 to 8158,
+ * and the backup GPT after it.
+ */
+#define GPT_IMAGE "gpt.img"
+#define SECTOR 512
+#define GPT_IMAGE_SIZE (8192 * SECTOR)
+#define FIRST_USABLE (34 * SECTOR)
+#define ESP_START (2048 * SECTOR)
+#define ROOT_START (4096 * SECTOR)
+#define ROOT_END (8159 * SECTOR)
+
+#define HEAD_SIZE (1024 * 1024)
+
+/* A 1 KiB-block ext2 filesystem filling the root partition, with a single
+ * block group whose bitmap marks its first 100 blocks as used.
+ */
+#define EXT4_BLOCK_SIZE 1024
+#define EXT4_BLOCKS_COUNT ((ROOT_END - ROOT_START) / EXT4_BLOCK_SIZE)
+#define EXT4_USED_BLOCKS 100
+
+static gchar *
+test_build_filename (GTestFileType file_type,
+                     const gchar  *basename)
+{
+  gchar *filename = g_test_build_filename (file_type, basename, NULL);
+
+  if (!g_file_test (filename, G_FILE_TEST_EXISTS))
+    g_error ("test data file %s doesn't exist", filename);
+
+  return filename;
+}
+
+static guint8 *
+load_test_file (const gchar *basename,
+                gsize       *len)
+{
+  g_autofree gchar *path = test_build_filename (G_TEST_BUILT, basename);
+  g_autoptr(GError) error = NULL;
+  gchar *contents = NULL;
+
+  g_file_get_contents (path, &contents, len, &error);
+  g_assert_no_error (error);
+  return (guint8 *) contents;
+}
+
+static void
+write_le16 (guint8  *p,
+            guint16  v)
+{
+  v = GUINT16_TO_LE (v);
+  memcpy (p, &v, sizeof v);
+}
+
+static void
+write_le32 (guint8  *p,
+            guint32  v)
+{
+  v = GUINT32_TO_LE (v);
+  memcpy (p, &v, sizeof v);
+}
+
+/* Writes the filesystem described above over the root partition of @data */
+static void
+make_ext4 (guint8  *data,
+           guint16  group_flags)
+{
+  guint8 *fs = data + ROOT_START;
+  guint8 *sb = fs + 1024;
+  guint8 *desc = fs + 2 * EXT4_BLOCK_SIZE;
+  guint8 *bitmap = fs + 3 * EXT4_BLOCK_SIZE;
+
+  memset (fs, 0, 4 * EXT4_BLOCK_SIZE);
+
+  write_le32 (sb + 0x04, EXT4_BLOCKS_COUNT);
+  write_le32 (sb + 0x14, 1);     /* first data block */
+  write_le32 (sb + 0x18, 0);     /* log2 (block size) - 10 */
+  write_le32 (sb + 0x20, 8192);  /* blocks per group */
+  write_le16 (sb + 0x38, 0xEF53);
+
+  write_le32 (desc + 0x00, 3);   /* block bitmap */
+  write_le16 (desc + 0x12, group_flags);
+
+  /* Bit i is block i + 1, since the first block precedes the first group */
+  memset (bitmap, 0xff, EXT4_USED_BLOCKS / 8);
+  bitmap[EXT4_USED_BLOCKS / 8] = (1 << (EXT4_USED_BLOCKS % 8)) - 1;
+}
+
+static GisWriteMap *
+map_image (const guint8 *data,
+           gsize         len,
+           gsize         chunk_size)
+{
+  g_autoptr(GisWriteMap) map = NULL;
+  g_autoptr(GError) error = NULL;
+  gsize offset;
+
+  map = gis_write_map_new (data, HEAD_SIZE, len, &error);
+  g_assert_no_error (error);
+  g_assert_nonnull (map);
+
+  for (offset = 0; offset < len; offset += chunk_size)
+    gis_write_map_observe (map, offset, data + offset,
+                           MIN (chunk_size, len - offset));
+
+  return g_steal_pointer (&map);
+}
+
+static void
+assert_range (GisWriteMap *map,
+              guint64      start,
+              guint64      end,
+              gboolean     expected)
+{
+  guint64 offset = start;
+
+  while (offset < end)
+    {
+      gboolean needed = !expected;
+      gsize n = gis_write_map_lookup (map, offset, end - offset, &needed);
+
+      g_assert_cmpuint (n, >, 0);
+      g_assert_cmpuint (n, <=, end - offset);
+      g_assert_cmpint (needed, ==, expected);
+      offset += n;
+    }
+}
+
+/* Without a filesystem, the partitions and partition tables are written, and
+ * only the gap before the ESP is skipped.
+ */
+static void
+test_gpt (void)
+{
+  gsize len;
+  g_autofree guint8 *data = load_test_file (GPT_IMAGE, &len);
+  g_autoptr(GisWriteMap) map = NULL;
+
+  g_assert_cmpuint (len, ==, GPT_IMAGE_SIZE);
+  map = map_image (data, len, HEAD_SIZE);
+
+  assert_range (map, 0, FIRST_USABLE, TRUE);
+  assert_range (map, FIRST_USABLE, ESP_START, FALSE);
+  assert_range (map, ESP_START, GPT_IMAGE_SIZE, TRUE);
+
+  /* Looking up an earlier offset again gives the same answer */
+  assert_range (map, 0, FIRST_USABLE, TRUE);
+}
+
+/* Free blocks in the root filesystem are skipped too. The image is seen in
+ * chunks which don't line up with the filesystem's metadata.
+ */
+static void
+test_ext4 (void)
+{
+  gsize len;
+  g_autofree guint8 *data = load_test_file (GPT_IMAGE, &len);
+  g_autoptr(GisWriteMap) map = NULL;
+  guint64 used_end = ROOT_START + (EXT4_USED_BLOCKS + 1) * EXT4_BLOCK_SIZE;
+  guint64 fs_end = ROOT_START + EXT4_BLOCKS_COUNT * EXT4_BLOCK_SIZE;
+
+  make_ext4 (data, 0);
+  map = map_image (data, len, 1000);
+
+  assert_range (map, FIRST_USABLE, ESP_START, FALSE);
+  assert_range (map, ESP_START, used_end, TRUE);
+  assert_range (map, used_end, fs_end, FALSE);
+  /* The tail of the partition, after the filesystem, is written */
+  g_assert_cmpuint (fs_end, <, ROOT_END);
+  assert_range (map, fs_end, GPT_IMAGE_SIZE, TRUE);
+}
+
+/* A group whose bitmap is uninitialized is written in full */
+static void
+test_ext4_uninit (void)
+{
+  gsize len;
+  g_autofree guint8 *data = load_test_file (GPT_IMAGE, &len);
+  g_autoptr(GisWriteMap) map = NULL;
+
+  make_ext4 (data, 0x2);
+  map = map_image (data, len, HEAD_SIZE);
+
+  assert_range (map, ESP_START, GPT_IMAGE_SIZE, TRUE);
+}
+
+static void
+test_not_gpt (void)
+{
+  gsize len;
+  g_autofree guint8 *data = load_test_file ("w.img", &len);
+  g_autoptr(GisWriteMap) map = NULL;
+  g_autoptr(GError) error = NULL;
+
+  map = gis_write_map_new (data, HEAD_SIZE, len, &error);
+  g_assert_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA);
+  g_assert_null (map);
+}
+
+/* The backup GPT must be at the end of the image */
+static void
+test_wrong_size (void)
+{
+  gsize len;
+  g_autofree guint8 *data = load_test_file (GPT_IMAGE, &len);
+  g_autoptr(GisWriteMap) map = NULL;
+  g_autoptr(GError) error = NULL;
+
+  map = gis_write_map_new (data, HEAD_SIZE, len * 2, &error);
+  g_assert_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA);
+  g_assert_null (map);
+}
+
+int
+main (int argc, char *argv[])
+{
+  setlocale (LC_ALL, "");
+
+  g_test_init (&argc, &argv, NULL);
+
+  g_test_add_func ("/write-map/gpt", test_gpt);
+  g_test_add_func ("/write-map/ext4", test_ext4);
+  g_test_add_func ("/write-map/ext4-uninit", test_ext4_uninit);
+  g_test_add_func ("/write-map/not-gpt", test_not_gpt);
+  g_test_add_func ("/write-map/wrong-size", test_wrong_size);
+
+  return g_test_run ();
+}